@@ -45,13 +45,13 @@
 #define PACKAGE_NAME "WhiteDB"
 
 /* Define to the full name and version of this package. */
-#define PACKAGE_STRING "WhiteDB 0.8-alpha"
+#define PACKAGE_STRING "WhiteDB 0.9-alpha"
 
 /* Define to the one symbol short name of this package. */
 #define PACKAGE_TARNAME "whitedb"
 
 /* Define to the version of this package. */
-#define PACKAGE_VERSION "0.8-alpha"
+#define PACKAGE_VERSION "0.9-alpha"
 
 /* Define to necessary symbol if this constant uses a non-standard name on
    your system. */
@@ -66,6 +66,9 @@
 /* Use single-compare T-tree mode */
 #define TTREE_SINGLE_COMPARE 1
 
+/* Store normalized key prefixes in T-tree nodes */
+#define TTREE_KEY_PREFIX 1
+
 /* Use record banklinks */
 #define USE_BACKLINKING 1
 
@@ -78,17 +81,20 @@
 /* Use match templates for indexes */
 #define USE_INDEX_TEMPLATE 1
 
+/* Collect full scan statistics for the index advisor */
+#define USE_INDEX_ADVISOR 1
+
 /* Enable reasoner */
 /* #undef USE_REASONER */
 
 /* Version number of package */
-#define VERSION "0.8-alpha"
+#define VERSION "0.9-alpha"
 
 /* Package major version */
 #define VERSION_MAJOR 0
 
 /* Package minor version */
-#define VERSION_MINOR 8
+#define VERSION_MINOR 9
 
 /* Package revision number */
 #define VERSION_REV 0
@@ -0,0 +1,451 @@
+/*
+* $Id:  $
+* $Version: $
+*
+* Copyright (c) WhiteDB contributors 2026
+*
+* This file is part of WhiteDB
+*
+* WhiteDB is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* WhiteDB is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with WhiteDB.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+
+ /** @file dbadvise.c
+ * Index advisor.
+ *
+ * Queries that fall back to a full scan report their conditions
+ * together with the number of rows examined and returned and the
+ * time spent in the scan. The counters are kept per column and
+ * condition type in a small hash table in shared memory, along with
+ * the totals of each candidate index: a single column with any
+ * index-friendly condition, and pairs of columns where the first
+ * one is compared for equality (the key of a composite T-tree).
+ *
+ * A sample of the scanned rows is also checked against the
+ * conditions of each column alone. This estimates how many rows an
+ * index on the column would have visited; for a pair of columns the
+ * conditions are assumed to be independent.
+ *
+ * Scans run under the read lock, so the counters are updated with
+ * atomic operations. The table has a fixed size; observations of
+ * new shapes are dropped once it is full.
+ *
+ * The candidates are ranked by the part of the scan time spent on
+ * the rows that the index would not have visited.
+ */
+
+/* ====== Includes =============== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* ====== Private headers and defs ======== */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef _WIN32
+#include "config-w32.h"
+#else
+#include "config-gcc.h"
+#endif
+
+#include "dballoc.h"
+#include "dbdata.h"
+#include "dblock.h"
+#include "dbindex.h"
+#include "dbadvise.h"
+
+/* Table keys. Condition 0 marks the totals of a candidate index,
+ * column2 is -1 unless the candidate is a composite. */
+#define ADVISOR_KEY(c, c2, cond) \
+  (((c) + 1) | (((c2) + 1) << 8) | ((gint) (cond) << 16))
+#define ADVISOR_COLUMN(k) (((k) & 0xff) - 1)
+#define ADVISOR_COLUMN2(k) ((((k) >> 8) & 0xff) - 1)
+#define ADVISOR_COND(k) ((k) >> 16)
+
+/** candidate while ranking */
+typedef struct {
+  wg_index_advice advice;
+  gint pair_scans;  /** scans that also restricted the second column */
+  gint gain;        /** rows the second column saves over the first */
+} advice_candidate;
+
+/* ====== Private protos ======== */
+
+#ifdef USE_INDEX_ADVISOR
+static void advisor_add(volatile gint *ptr, gint incr);
+static db_advisor_entry *advisor_entry(void *db, gint key);
+static void advisor_record(void *db, gint key, gint examined,
+  gint returned, gint visited, gint lead_visited, gint elapsed_us);
+static gint estimate_visited(gint examined, gint returned, double sel);
+static gint estimate_savings(gint examined, gint visited, gint elapsed_us);
+static gint leading_index(void *db, gint column);
+static int compare_candidates(const void *a, const void *b);
+#endif
+
+static gint show_advisor_error(void* db, char* errmsg);
+
+/* ====== Functions ============== */
+
+/* ------------------- helpers ------------------------------ */
+
+#ifdef USE_INDEX_ADVISOR
+
+/** Atomically add to a counter
+ */
+static void advisor_add(volatile gint *ptr, gint incr) {
+  gint old;
+  do {
+    old = *ptr;
+  } while(!wg_compare_and_swap(ptr, old, old + incr));
+}
+
+/** Find or claim the table entry of a key
+ *  returns NULL if the table is full
+ */
+static db_advisor_entry *advisor_entry(void *db, gint key) {
+  db_advisor_area_header *ah = &dbmemsegh(db)->advisor;
+  gint i, slot = (gint) (((wg_uint) key * 2654435761U) % ADVISOR_TABLE_SIZE);
+
+  for(i=0; i<ADVISOR_TABLE_SIZE; i++) {
+    db_advisor_entry *e = &ah->entry[slot];
+    if(e->key == key)
+      return e;
+    if(!e->key && (wg_compare_and_swap(&e->key, 0, key) || e->key == key))
+      return e;
+    slot = (slot + 1) % ADVISOR_TABLE_SIZE;
+  }
+  return NULL;
+}
+
+/** Add one scan to the counters of a key
+ */
+static void advisor_record(void *db, gint key, gint examined,
+  gint returned, gint visited, gint lead_visited, gint elapsed_us) {
+  db_advisor_entry *e = advisor_entry(db, key);
+
+  if(!e) {
+    advisor_add(&dbmemsegh(db)->advisor.dropped, 1);
+    return;
+  }
+  advisor_add(&e->scans, 1);
+  advisor_add(&e->examined, examined);
+  advisor_add(&e->returned, returned);
+  advisor_add(&e->visited, visited);
+  advisor_add(&e->lead_visited, lead_visited);
+  advisor_add(&e->elapsed_us, elapsed_us);
+}
+
+/** Rows that an index would have visited
+ *  sel is the estimated fraction of the rows that pass the
+ *  conditions on the key columns. The index visits at least
+ *  the rows that were returned.
+ */
+static gint estimate_visited(gint examined, gint returned, double sel) {
+  gint visited = (gint) (examined * sel + 0.5);
+  return (visited > returned ? visited : returned);
+}
+
+/** Scan time that an index would have saved
+ */
+static gint estimate_savings(gint examined, gint visited, gint elapsed_us) {
+  if(examined <= 0 || visited >= examined)
+    return 0;
+  return (gint) ((double) elapsed_us * (examined - visited) / examined);
+}
+
+/** Check if queries on a column can already use an index
+ *  That is a full T-tree or B+tree index with the column as
+ *  its leading key.
+ */
+static gint leading_index(void *db, gint column) {
+  gint *ilist = \
+    &dbmemsegh(db)->index_control_area_header.index_table[column];
+
+  while(*ilist) {
+    gcell *ilistelem = (gcell *) offsettoptr(db, *ilist);
+    if(ilistelem->car) {
+      wg_index_header *hdr = \
+        (wg_index_header *) offsettoptr(db, ilistelem->car);
+      if((hdr->type == WG_INDEX_TYPE_TTREE ||\
+        hdr->type == WG_INDEX_TYPE_BTREE) &&\
+        hdr->rec_field_index[0] == column &&\
+        !hdr->template_offset && !hdr->predicate_offset)
+        return ilistelem->car;
+    }
+    ilist = &ilistelem->cdr;
+  }
+  return 0;
+}
+
+/** Order candidates by savings, composites first on ties
+ */
+static int compare_candidates(const void *a, const void *b) {
+  const wg_index_advice *x = &((const advice_candidate *) a)->advice;
+  const wg_index_advice *y = &((const advice_candidate *) b)->advice;
+
+  if(x->savings_us != y->savings_us)
+    return (x->savings_us > y->savings_us ? -1 : 1);
+  if(x->col_count != y->col_count)
+    return (x->col_count > y->col_count ? -1 : 1);
+  return (x->columns[0] < y->columns[0] ? -1 :\
+    (x->columns[0] > y->columns[0]));
+}
+
+#endif /* USE_INDEX_ADVISOR */
+
+/* ------------------- statistics -------------------------- */
+
+/** Record a query that was answered by a full scan
+ *  sampled rows were checked against the conditions of each column
+ *  alone and pass[i] of them passed those on the i-th distinct column
+ *  of the argument list.
+ *
+ *  Each condition type of a column is counted once per query.
+ *  NOT_EQUAL and CONTAINS conditions do not make candidates,
+ *  as the T-tree does not help with them.
+ */
+void wg_advise_scan(void *db, wg_query_arg *arglist, gint argc,
+  gint examined, gint returned, gint elapsed_us,
+  gint sampled, wg_uint *pass) {
+#ifdef USE_INDEX_ADVISOR
+  gint cols[ADVISOR_MAX_COLUMNS], eq[ADVISOR_MAX_COLUMNS];
+  double sel[ADVISOR_MAX_COLUMNS];
+  gint i, j, k, n = 0;
+
+  /* Distinct columns, in the same order as the samples */
+  for(i=0; i<argc && n<ADVISOR_MAX_COLUMNS; i++) {
+    for(j=0; j<n; j++) {
+      if(cols[j] == arglist[i].column)
+        break;
+    }
+    if(j == n) {
+      cols[n] = arglist[i].column;
+      sel[n] = (sampled > 0 ? (double) pass[n] / sampled : 1.0);
+      eq[n++] = -1; /* no candidate yet */
+    }
+  }
+
+  for(i=0; i<argc; i++) {
+    gint col = arglist[i].column, cond = arglist[i].cond;
+
+    if(col < 0 || col > MAX_INDEXED_FIELDNR)
+      continue;
+    for(j=0; j<n; j++) {
+      if(cols[j] == col)
+        break;
+    }
+    if(j == n)
+      continue; /* too many columns */
+    for(k=0; k<i; k++) {
+      if(arglist[k].column == col && arglist[k].cond == cond)
+        break;
+    }
+    if(k == i)
+      advisor_record(db, ADVISOR_KEY(col, -1, cond), examined, returned,
+        estimate_visited(examined, returned, sel[j]), 0, elapsed_us);
+
+    if(cond == WG_COND_NOT_EQUAL || cond == WG_COND_CONTAINS)
+      continue;
+    if(cond == WG_COND_EQUAL)
+      eq[j] = 1;
+    else if(eq[j] < 0)
+      eq[j] = 0;
+  }
+
+  for(i=0; i<n; i++) {
+    gint visited;
+
+    if(eq[i] < 0)
+      continue;
+    visited = estimate_visited(examined, returned, sel[i]);
+    advisor_record(db, ADVISOR_KEY(cols[i], -1, 0), examined, returned,
+      visited, 0, elapsed_us);
+    if(!eq[i])
+      continue;
+    for(j=0; j<n; j++) {
+      if(j != i && eq[j] >= 0)
+        advisor_record(db, ADVISOR_KEY(cols[i], cols[j], 0),
+          examined, returned,
+          estimate_visited(examined, returned, sel[i] * sel[j]),
+          visited, elapsed_us);
+    }
+  }
+#endif
+}
+
+/* ------------------- advice ------------------------------ */
+
+/** Rank the indexes that would have replaced full scans
+ *  Writes at most max suggestions to the advice array, best first.
+ *  There is one suggestion per leading column: a composite index
+ *  if a second column compared along with it narrows the search,
+ *  a single column index otherwise. A composite also serves the
+ *  queries on its leading column alone. Columns that already have
+ *  an index, or that are mostly queried together with the leading
+ *  column of a better suggestion, are left out.
+ *
+ *  If create_us is positive, T-tree indexes are created for the
+ *  returned suggestions that would save at least that many
+ *  microseconds. This needs the write lock.
+ *
+ *  returns the number of suggestions
+ *  returns -1 on error
+ */
+gint wg_get_index_advice(void *db, wg_index_advice *advice, gint max,
+  gint create_us) {
+#ifdef USE_INDEX_ADVISOR
+  db_advisor_area_header *ah;
+  advice_candidate *cand;
+  gint i, j, n = 0, m = 0, count = 0;
+
+#ifdef CHECK
+  if (!dbcheck(db)) {
+    show_advisor_error(db, "wrong database pointer given to wg_get_index_advice");
+    return -1;
+  }
+#endif
+
+  cand = (advice_candidate *) malloc(ADVISOR_TABLE_SIZE *\
+    sizeof(advice_candidate));
+  if(!cand) {
+    show_advisor_error(db, "Failed to allocate memory");
+    return -1;
+  }
+  ah = &dbmemsegh(db)->advisor;
+
+  /* Single column totals */
+  for(i=0; i<ADVISOR_TABLE_SIZE; i++) {
+    db_advisor_entry *e = &ah->entry[i];
+    gint key = e->key;
+    wg_index_advice *a;
+
+    if(!key || ADVISOR_COND(key) || ADVISOR_COLUMN2(key) >= 0)
+      continue;
+    a = &cand[n].advice;
+    a->columns[0] = ADVISOR_COLUMN(key);
+    a->columns[1] = -1;
+    a->col_count = 1;
+    a->scans = e->scans;
+    a->examined = e->examined;
+    a->returned = e->returned;
+    a->visited = e->visited;
+    a->elapsed_us = e->elapsed_us;
+    a->index_id = 0;
+    cand[n].pair_scans = 0;
+    cand[n++].gain = 0;
+  }
+
+  /* Extend them with the second column that narrows the
+   * search the most */
+  for(i=0; i<ADVISOR_TABLE_SIZE; i++) {
+    db_advisor_entry *e = &ah->entry[i];
+    gint key = e->key;
+
+    if(!key || ADVISOR_COND(key) || ADVISOR_COLUMN2(key) < 0)
+      continue;
+    for(j=0; j<n; j++) {
+      wg_index_advice *a = &cand[j].advice;
+      if(a->columns[0] == ADVISOR_COLUMN(key) &&\
+        e->lead_visited - e->visited > cand[j].gain) {
+        a->columns[1] = ADVISOR_COLUMN2(key);
+        a->col_count = 2;
+        cand[j].pair_scans = e->scans;
+        cand[j].gain = e->lead_visited - e->visited;
+      }
+    }
+  }
+
+  /* Keep the ones that save something */
+  for(i=0; i<n; i++) {
+    wg_index_advice *a = &cand[i].advice;
+    a->visited -= cand[i].gain;
+    a->savings_us = estimate_savings(a->examined, a->visited,
+      a->elapsed_us);
+    if(a->savings_us > 0)
+      cand[m++] = cand[i];
+  }
+  n = m;
+
+  qsort(cand, n, sizeof(advice_candidate), compare_candidates);
+
+  for(i=0; i<n && count<max; i++) {
+    wg_index_advice *a = &cand[i].advice;
+
+    /* Queries on the leading column can use an existing index,
+     * this also serves the column paired with it */
+    if(leading_index(db, a->columns[0]))
+      continue;
+    /* A hidden candidate gets pair_scans -1, so it does not hide
+     * the column paired with it */
+    for(j=0; j<i; j++) {
+      if(cand[j].pair_scans > 0 &&\
+        cand[j].advice.columns[1] == a->columns[0] &&\
+        cand[j].pair_scans * 2 > a->scans)
+        break;
+    }
+    if(j < i) {
+      cand[i].pair_scans = -1;
+      continue;
+    }
+
+    if(create_us > 0 && a->savings_us >= create_us) {
+      if(wg_create_multi_index(db, a->columns, a->col_count,
+        WG_INDEX_TYPE_TTREE, NULL, 0) == 0) {
+        a->index_id = wg_multi_column_to_index_id(db, a->columns,
+          a->col_count, WG_INDEX_TYPE_TTREE, NULL, 0);
+        if(a->index_id < 0)
+          a->index_id = 0;
+      }
+    }
+    advice[count++] = *a;
+  }
+
+  free(cand);
+  return count;
+#else
+  show_advisor_error(db, "Index advisor is not enabled");
+  return -1;
+#endif
+}
+
+/** Forget the observed scans
+ *  Call with the write lock held.
+ */
+void wg_reset_index_advice(void *db) {
+#ifdef USE_INDEX_ADVISOR
+  db_advisor_area_header *ah = &dbmemsegh(db)->advisor;
+  ah->dropped = 0;
+  memset((void *) ah->entry, 0,
+    ADVISOR_TABLE_SIZE * sizeof(db_advisor_entry));
+#endif
+}
+
+/* ------------------- error handling ---------------------- */
+
+static gint show_advisor_error(void* db, char* errmsg) {
+#ifdef WG_NO_ERRPRINT
+#else
+  fprintf(stderr,"index advisor error: %s\n",errmsg);
+#endif
+  return -1;
+}
+
+#ifdef __cplusplus
+}
+#endif
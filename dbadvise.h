@@ -0,0 +1,77 @@
+/*
+* $Id:  $
+* $Version: $
+*
+* Copyright (c) WhiteDB contributors 2026
+*
+* This file is part of WhiteDB
+*
+* WhiteDB is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* WhiteDB is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with WhiteDB.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+
+ /** @file dbadvise.h
+ * Public headers for the index advisor.
+ */
+
+#ifndef DEFINED_DBADVISE_H
+#define DEFINED_DBADVISE_H
+
+#ifdef _WIN32
+#include "config-w32.h"
+#else
+#include "config-gcc.h"
+#endif
+
+/* For gint data type */
+#include "dbdata.h"
+/* For wg_query_arg */
+#include "dbquery.h"
+
+/* ====== data structures ======== */
+
+/** index suggested by the advisor
+*   The counters are those of the full scans the index could have
+*   replaced. The savings are proportional to the rows that the
+*   index would not have visited.
+*/
+typedef struct {
+  gint columns[2];  /** key columns of the index */
+  gint col_count;   /** 1, or 2 for a composite index */
+  gint scans;       /** full scans with conditions on the leading column */
+  gint examined;    /** rows examined by the scans */
+  gint returned;    /** rows returned by the scans */
+  gint visited;     /** rows the index would have visited (estimate) */
+  gint elapsed_us;  /** time spent in the scans */
+  gint savings_us;  /** estimated time saved by the index */
+  gint index_id;    /** index created by the advisor, 0 if none */
+} wg_index_advice;
+
+/* ==== Protos ==== */
+
+/* API functions (copied in dbapi.h) */
+
+gint wg_get_index_advice(void *db, wg_index_advice *advice, gint max,
+  gint create_us);
+void wg_reset_index_advice(void *db);
+
+/* WhiteDB internal functions */
+
+void wg_advise_scan(void *db, wg_query_arg *arglist, gint argc,
+  gint examined, gint returned, gint elapsed_us,
+  gint sampled, wg_uint *pass);
+
+
+#endif /* DEFINED_DBADVISE_H */
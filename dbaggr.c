@@ -0,0 +1,896 @@
+/*
+* $Id:  $
+* $Version: $
+*
+* Copyright (c) WhiteDB contributors 2026
+*
+* This file is part of WhiteDB
+*
+* WhiteDB is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* WhiteDB is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with WhiteDB.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+ /** @file dbaggr.c
+ * Materialized aggregate views.
+ *
+ * A view groups the rows that pass its filter by the value of one
+ * column and keeps the row count and the sums of the aggregate
+ * columns of each group. It lives in shared memory and is updated
+ * by hooks in the record and field setting functions, in the same
+ * way as indexes are, so reading it costs O(groups) instead of
+ * O(rows).
+ *
+ * Only plain data records are counted. Records created with
+ * wg_create_raw_record() enter the views when wg_aggr_add_rec()
+ * is called on them, just as they need wg_index_add_rec() for
+ * the indexes.
+ */
+
+/* ====== Includes =============== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* ====== Private headers and defs ======== */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef _WIN32
+#include "config-w32.h"
+#else
+#include "config-gcc.h"
+#endif
+
+#include "dballoc.h"
+#include "dbdata.h"
+#include "dbcompare.h"
+#include "dbhash.h"
+#include "dbaggr.h"
+
+/* ====== Private protos ======== */
+
+static gint insert_into_list(void *db, gint *head, gint value);
+static void delete_from_list(void *db, gint *head);
+static gint copy_value(void *db, gint enc);
+static void free_value(void *db, gint enc);
+static gint value_hash(void *db, gint enc, gint *hash);
+static wg_aggr_group *find_group(void *db, wg_aggr_header *hdr,
+  gint value, gint hash, gint **prev);
+static gint grow_buckets(void *db, wg_aggr_header *hdr);
+static void update_sums(void *db, wg_aggr_header *hdr, wg_aggr_group *grp,
+  void *rec, gint sign);
+static gint view_add_row(void *db, gint view_id, void *rec);
+static gint view_del_row(void *db, gint view_id, void *rec);
+static gint view_reads_column(wg_aggr_header *hdr, gint column);
+static void free_view(void *db, gint view_id);
+
+static gint show_aggr_error(void* db, char* errmsg);
+static gint show_aggr_error_nr(void* db, char* errmsg, gint nr);
+
+/* ====== Functions ============== */
+
+/* ------------------- list helpers ------------------------- */
+
+/** Insert into list
+ *
+ * Takes address of a variable containing an offset to the
+ * first element.
+ */
+static gint insert_into_list(void *db, gint *head, gint value) {
+  db_memsegment_header* dbh = dbmemsegh(db);
+  gint old = *head;
+
+  *head = wg_alloc_fixlen_object(db, &dbh->listcell_area_header);
+  if(*head) {
+    gcell *listelem = (gcell *) offsettoptr(db, *head);
+    listelem->car = value;
+    listelem->cdr = old;
+  }
+  return *head;
+}
+
+/** Delete from list
+ *
+ * Deletes the current element.
+ */
+static void delete_from_list(void *db, gint *head) {
+  db_memsegment_header* dbh = dbmemsegh(db);
+  gcell *listelem = (gcell *) offsettoptr(db, *head);
+
+  *head = listelem->cdr;
+  wg_free_fixlen_object(db, &dbh->listcell_area_header,
+    ptrtooffset(db, listelem));
+}
+
+/* ------------------- value helpers ------------------------ */
+
+/** Make a private copy of an encoded value
+ *  The copy is stored in the database and owned by a view, so it
+ *  survives the row it was taken from. Long strings are shared, the
+ *  view holds a reference to them instead.
+ *  returns the encoded copy
+ *  returns WG_ILLEGAL on error
+ */
+static gint copy_value(void *db, gint enc) {
+  gint copy;
+
+  switch(wg_get_encoded_type(db, enc)) {
+    case WG_INTTYPE:
+      return wg_encode_int(db, wg_decode_int(db, enc));
+    case WG_DOUBLETYPE:
+      return wg_encode_double(db, wg_decode_double(db, enc));
+    case WG_STRTYPE:
+      copy = wg_encode_str(db, wg_decode_str(db, enc),
+        wg_decode_str_lang(db, enc));
+      break;
+    case WG_XMLLITERALTYPE:
+      copy = wg_encode_xmlliteral(db, wg_decode_xmlliteral(db, enc),
+        wg_decode_xmlliteral_xsdtype(db, enc));
+      break;
+    case WG_URITYPE:
+      copy = wg_encode_uri(db, wg_decode_uri(db, enc),
+        wg_decode_uri_prefix(db, enc));
+      break;
+    case WG_BLOBTYPE:
+      copy = wg_encode_blob(db, wg_decode_blob(db, enc),
+        wg_decode_blob_type(db, enc), wg_decode_blob_len(db, enc));
+      break;
+    default:
+      return enc; /* immediate values and records */
+  }
+
+  if(copy != WG_ILLEGAL && islongstr(copy)) {
+    gint *strptr = (gint *) offsettoptr(db, decode_longstr_offset(copy));
+    ++(*(strptr+LONGSTR_REFCOUNT_POS));
+  }
+  return copy;
+}
+
+/** Release a value made by copy_value()
+ */
+static void free_value(void *db, gint enc) {
+  if(isptr(enc) && wg_get_encoded_type(db, enc) != WG_RECORDTYPE) {
+    if(islongstr(enc)) {
+      /* drop the view's reference, wg_free_encoded() frees the
+       * string if no rows use it either */
+      gint *strptr = (gint *) offsettoptr(db, decode_longstr_offset(enc));
+      --(*(strptr+LONGSTR_REFCOUNT_POS));
+    }
+    wg_free_encoded(db, enc);
+  }
+}
+
+/** Hash a group value
+ *  Immediate values and records are hashed by their encoding, the
+ *  rest by their decoded contents.
+ *  returns 0 on success
+ *  returns -1 on error
+ */
+static gint value_hash(void *db, gint enc, gint *hash) {
+  wg_uint h;
+
+  if(!isptr(enc) || wg_get_encoded_type(db, enc) == WG_RECORDTYPE) {
+    h = wg_hash_bytes((char *) &enc, sizeof(gint));
+  } else if(wg_hash_encoded(db, enc, &h)) {
+    return -1;
+  }
+  *hash = (gint) h;
+  return 0;
+}
+
+/* ------------------- stored filters ---------------------- */
+
+/** Copy a query argument list into a stored filter
+ *  The values are copied so the caller may free its own
+ *  encoded values afterwards.
+ *  returns 0 on success
+ *  returns -1 on error (the filter is left empty)
+ */
+gint wg_store_filter(void *db, wg_stored_filter *filter,
+  wg_query_arg *arglist, gint argc) {
+  gint i;
+
+  filter->count = 0;
+  if(argc < 0 || argc > MAX_FILTER_ARGS || (argc && !arglist))
+    return show_aggr_error_nr(db, "Invalid number of filter conditions", argc);
+  for(i=0; i<argc; i++) {
+    if(arglist[i].column < 0 || arglist[i].column > MAX_INDEXED_FIELDNR)
+      return show_aggr_error_nr(db, "Invalid filter column",
+        arglist[i].column);
+    switch(arglist[i].cond) {
+      case WG_COND_CONTAINS:
+        if(wg_get_encoded_type(db, arglist[i].value) != WG_STRTYPE)
+          return show_aggr_error(db,
+            "Substring condition needs a string value");
+        break;
+      case WG_COND_EQUAL:
+      case WG_COND_NOT_EQUAL:
+      case WG_COND_LESSTHAN:
+      case WG_COND_GREATER:
+      case WG_COND_LTEQUAL:
+      case WG_COND_GTEQUAL:
+        break;
+      default:
+        return show_aggr_error_nr(db, "Invalid filter condition",
+          arglist[i].cond);
+    }
+  }
+
+  for(i=0; i<argc; i++) {
+    filter->column[i] = arglist[i].column;
+    filter->cond[i] = arglist[i].cond;
+    filter->value[i] = copy_value(db, arglist[i].value);
+    if(filter->value[i] == WG_ILLEGAL) {
+      wg_free_stored_filter(db, filter);
+      return show_aggr_error(db, "Failed to store the filter value");
+    }
+    filter->count++;
+  }
+  return 0;
+}
+
+/** Check a record against a stored filter
+ *  Records too short to have a filter column do not pass.
+ *  returns 1 if the record passes, 0 if not
+ */
+gint wg_match_stored_filter(void *db, wg_stored_filter *filter, void *rec) {
+  gint i, reclen = wg_get_record_len(db, rec);
+
+  for(i=0; i<filter->count; i++) {
+    gint enc, value = filter->value[i];
+
+    if(filter->column[i] >= reclen)
+      return 0;
+    enc = wg_get_field(db, rec, filter->column[i]);
+
+    switch(filter->cond[i]) {
+      case WG_COND_EQUAL:
+        if(WG_COMPARE(db, enc, value) != WG_EQUAL)
+          return 0;
+        break;
+      case WG_COND_NOT_EQUAL:
+        if(WG_COMPARE(db, enc, value) == WG_EQUAL)
+          return 0;
+        break;
+      case WG_COND_LESSTHAN:
+        if(WG_COMPARE(db, enc, value) != WG_LESSTHAN)
+          return 0;
+        break;
+      case WG_COND_GREATER:
+        if(WG_COMPARE(db, enc, value) != WG_GREATER)
+          return 0;
+        break;
+      case WG_COND_LTEQUAL:
+        if(WG_COMPARE(db, enc, value) == WG_GREATER)
+          return 0;
+        break;
+      case WG_COND_GTEQUAL:
+        if(WG_COMPARE(db, enc, value) == WG_LESSTHAN)
+          return 0;
+        break;
+      case WG_COND_CONTAINS:
+        if(wg_get_encoded_type(db, enc) != WG_STRTYPE ||\
+          !strstr(wg_decode_str(db, enc), wg_decode_str(db, value)))
+          return 0;
+        break;
+      default:
+        break;
+    }
+  }
+  return 1;
+}
+
+/** Release the values of a stored filter
+ */
+void wg_free_stored_filter(void *db, wg_stored_filter *filter) {
+  gint i;
+
+  for(i=0; i<filter->count; i++)
+    free_value(db, filter->value[i]);
+  filter->count = 0;
+}
+
+/* ------------------- group table ------------------------- */
+
+/** Find the group of a value
+ *  If prev is given, it is set to point to the offset that links
+ *  to the group (or to the chain head if the group is not found).
+ *  returns the group, NULL if not found
+ */
+static wg_aggr_group *find_group(void *db, wg_aggr_header *hdr,
+  gint value, gint hash, gint **prev) {
+  gint *link = AGGR_BUCKETS(db, hdr) + (wg_uint) hash % hdr->bucket_count;
+
+  if(prev)
+    *prev = link;
+  while(*link) {
+    wg_aggr_group *grp = (wg_aggr_group *) offsettoptr(db, *link);
+    if(grp->hash == hash) {
+      if(grp->key == value)
+        return grp;
+      /* records are grouped by identity, not by contents */
+      if(isptr(value) && wg_get_encoded_type(db, value) != WG_RECORDTYPE &&\
+        WG_COMPARE(db, grp->key, value) == WG_EQUAL)
+        return grp;
+    }
+    link = &grp->next;
+    if(prev)
+      *prev = link;
+  }
+  return NULL;
+}
+
+/** Double the group hash array
+ *  returns 0 on success
+ *  returns -1 on error
+ */
+static gint grow_buckets(void *db, wg_aggr_header *hdr) {
+  db_memsegment_header* dbh = dbmemsegh(db);
+  gint size = hdr->bucket_count * 2;
+  gint offset, i;
+  gint *oldarr, *newarr;
+
+  offset = wg_alloc_gints(db, &dbh->indexhash_area_header, size + 1);
+  if(!offset)
+    return show_aggr_error(db, "Failed to allocate the group hash array");
+  newarr = (gint *) offsettoptr(db, offset) + 1;
+  memset(newarr, 0, size * sizeof(gint));
+
+  oldarr = AGGR_BUCKETS(db, hdr);
+  for(i=0; i<hdr->bucket_count; i++) {
+    while(oldarr[i]) {
+      wg_aggr_group *grp = (wg_aggr_group *) offsettoptr(db, oldarr[i]);
+      gint *head = &newarr[(wg_uint) grp->hash % size];
+      gint next = grp->next;
+      grp->next = *head;
+      *head = oldarr[i];
+      oldarr[i] = next;
+    }
+  }
+
+  wg_free_object(db, &dbh->indexhash_area_header, hdr->buckets);
+  hdr->buckets = offset;
+  hdr->bucket_count = size;
+  return 0;
+}
+
+/** Add (sign 1) or remove (sign -1) the row's values to the group sums
+ */
+static void update_sums(void *db, wg_aggr_header *hdr, wg_aggr_group *grp,
+  void *rec, gint sign) {
+  gint i;
+
+  for(i=0; i<hdr->columns; i++) {
+    gint enc = wg_get_field(db, rec, hdr->aggr_column[i]);
+    wg_aggr_sum *sum = &grp->sums[i];
+
+    switch(wg_get_encoded_type(db, enc)) {
+      case WG_INTTYPE:
+        sum->isum += sign * wg_decode_int(db, enc);
+        break;
+      case WG_DOUBLETYPE:
+        sum->dsum += sign * wg_decode_double(db, enc);
+        break;
+      case WG_FIXPOINTTYPE:
+        sum->dsum += sign * wg_decode_fixpoint(db, enc);
+        break;
+      default:
+        continue; /* not a number */
+    }
+    sum->values += sign;
+  }
+}
+
+/* ------------------- row maintenance --------------------- */
+
+/** Add a row to one view
+ *  returns 0 on success
+ *  returns -1 on error (the view is no longer consistent)
+ */
+static gint view_add_row(void *db, gint view_id, void *rec) {
+  db_memsegment_header* dbh = dbmemsegh(db);
+  wg_aggr_header *hdr = (wg_aggr_header *) offsettoptr(db, view_id);
+  wg_aggr_group *grp;
+  gint value, hash, *link;
+
+  if(wg_get_record_len(db, rec) <= hdr->max_column)
+    return 0;
+  if(!wg_match_stored_filter(db, &hdr->filter, rec))
+    return 0;
+
+  value = wg_get_field(db, rec, hdr->group_column);
+  if(value_hash(db, value, &hash))
+    return show_aggr_error(db, "Failed to hash the group value");
+
+  grp = find_group(db, hdr, value, hash, &link);
+  if(!grp) {
+    gint size, offset;
+
+    size = (sizeof(wg_aggr_group) + (hdr->columns ? hdr->columns - 1 : 0) *\
+      sizeof(wg_aggr_sum) + sizeof(gint) - 1) / sizeof(gint);
+    offset = wg_alloc_gints(db, &dbh->indexhash_area_header, size);
+    if(!offset)
+      return show_aggr_error(db, "Failed to allocate a group");
+    grp = (wg_aggr_group *) offsettoptr(db, offset);
+    memset(&grp->next, 0, size * sizeof(gint) - sizeof(gint));
+    grp->hash = hash;
+    grp->key = copy_value(db, value);
+    if(grp->key == WG_ILLEGAL) {
+      wg_free_object(db, &dbh->indexhash_area_header, offset);
+      return show_aggr_error(db, "Failed to store the group value");
+    }
+    /* link was left pointing at the end of the chain */
+    *link = offset;
+    hdr->groups++;
+  }
+
+  grp->count++;
+  update_sums(db, hdr, grp, rec, 1);
+
+  /* failing to grow only makes the chains longer */
+  if(hdr->groups > hdr->bucket_count * AGGR_MAX_LOAD)
+    grow_buckets(db, hdr);
+  return 0;
+}
+
+/** Remove a row from one view
+ *  returns 0 on success
+ *  returns -1 on error (the view is no longer consistent)
+ */
+static gint view_del_row(void *db, gint view_id, void *rec) {
+  db_memsegment_header* dbh = dbmemsegh(db);
+  wg_aggr_header *hdr = (wg_aggr_header *) offsettoptr(db, view_id);
+  wg_aggr_group *grp;
+  gint value, hash, *link;
+
+  if(wg_get_record_len(db, rec) <= hdr->max_column)
+    return 0;
+  if(!wg_match_stored_filter(db, &hdr->filter, rec))
+    return 0;
+
+  value = wg_get_field(db, rec, hdr->group_column);
+  if(value_hash(db, value, &hash))
+    return show_aggr_error(db, "Failed to hash the group value");
+
+  grp = find_group(db, hdr, value, hash, &link);
+  if(!grp)
+    return show_aggr_error(db, "Row is missing from its group");
+
+  update_sums(db, hdr, grp, rec, -1);
+  if(--grp->count == 0) {
+    *link = grp->next;
+    free_value(db, grp->key);
+    wg_free_object(db, &dbh->indexhash_area_header, ptrtooffset(db, grp));
+    hdr->groups--;
+  }
+  return 0;
+}
+
+/** Check if the view reads a column
+ */
+static gint view_reads_column(wg_aggr_header *hdr, gint column) {
+  gint i;
+
+  if(hdr->group_column == column)
+    return 1;
+  for(i=0; i<hdr->columns; i++) {
+    if(hdr->aggr_column[i] == column)
+      return 1;
+  }
+  for(i=0; i<hdr->filter.count; i++) {
+    if(hdr->filter.column[i] == column)
+      return 1;
+  }
+  return 0;
+}
+
+/** Add a field of a record to the views that read it
+ *  Called after the new value is written. The whole row is added
+ *  back, wg_aggr_del_field() removed it before the change.
+ *  returns 0 for success
+ *  returns -1 for invalid arguments
+ *  returns -2 for error (a view is no longer consistent)
+ */
+gint wg_aggr_add_field(void *db, void *rec, gint column) {
+  gint *vlist;
+  db_memsegment_header* dbh = dbmemsegh(db);
+
+  if(column > MAX_INDEXED_FIELDNR)
+    return -1;
+  if(!is_plain_record(rec))
+    return 0;
+
+  vlist = &dbh->aggr_control_area_header.view_table[column];
+  while(*vlist) {
+    gcell *vlistelem = (gcell *) offsettoptr(db, *vlist);
+    if(view_add_row(db, vlistelem->car, rec))
+      return -2;
+    vlist = &vlistelem->cdr;
+  }
+  return 0;
+}
+
+/** Add a record to all views
+ *  returns 0 for success
+ *  returns -2 for error (a view is no longer consistent)
+ */
+gint wg_aggr_add_rec(void *db, void *rec) {
+  gint *vlist;
+  db_memsegment_header* dbh = dbmemsegh(db);
+
+  if(!is_plain_record(rec))
+    return 0;
+
+  vlist = &dbh->aggr_control_area_header.view_list;
+  while(*vlist) {
+    gcell *vlistelem = (gcell *) offsettoptr(db, *vlist);
+    if(view_add_row(db, vlistelem->car, rec))
+      return -2;
+    vlist = &vlistelem->cdr;
+  }
+  return 0;
+}
+
+/** Remove a field of a record from the views that read it
+ *  Called before the old value is overwritten.
+ *  returns 0 for success
+ *  returns -1 for invalid arguments
+ *  returns -2 for error (a view is no longer consistent)
+ */
+gint wg_aggr_del_field(void *db, void *rec, gint column) {
+  gint *vlist;
+  db_memsegment_header* dbh = dbmemsegh(db);
+
+  if(column > MAX_INDEXED_FIELDNR)
+    return -1;
+  if(!is_plain_record(rec))
+    return 0;
+
+  vlist = &dbh->aggr_control_area_header.view_table[column];
+  while(*vlist) {
+    gcell *vlistelem = (gcell *) offsettoptr(db, *vlist);
+    if(view_del_row(db, vlistelem->car, rec))
+      return -2;
+    vlist = &vlistelem->cdr;
+  }
+  return 0;
+}
+
+/** Remove a record from all views
+ *  returns 0 for success
+ *  returns -2 for error (a view is no longer consistent)
+ */
+gint wg_aggr_del_rec(void *db, void *rec) {
+  gint *vlist;
+  db_memsegment_header* dbh = dbmemsegh(db);
+
+  if(!is_plain_record(rec))
+    return 0;
+
+  vlist = &dbh->aggr_control_area_header.view_list;
+  while(*vlist) {
+    gcell *vlistelem = (gcell *) offsettoptr(db, *vlist);
+    if(view_del_row(db, vlistelem->car, rec))
+      return -2;
+    vlist = &vlistelem->cdr;
+  }
+  return 0;
+}
+
+/* ------------------- view management --------------------- */
+
+/** Create a materialized aggregate view
+ *  Rows that pass the filter in arglist (may be NULL) are grouped
+ *  by group_column. Each group keeps its row count and the sums
+ *  of the columns listed in columns. Existing rows are added
+ *  to the view immediately.
+ *  returns the view id (a positive value) on success
+ *  returns -1 on error
+ */
+gint wg_create_aggr_view(void *db, gint group_column, gint *columns,
+  gint col_count, wg_query_arg *arglist, gint argc) {
+  db_memsegment_header* dbh = dbmemsegh(db);
+  wg_aggr_header *hdr;
+  gint view_id, i, size;
+  void *rec;
+
+#ifdef CHECK
+  if (!dbcheck(db)) {
+    show_aggr_error(db, "wrong database pointer given to wg_create_aggr_view");
+    return -1;
+  }
+#endif
+
+  if(group_column < 0 || group_column > MAX_INDEXED_FIELDNR)
+    return show_aggr_error_nr(db, "Invalid group column", group_column);
+  if(col_count < 0 || col_count > MAX_AGGR_FIELDS)
+    return show_aggr_error_nr(db, "Invalid number of aggregate columns",
+      col_count);
+  for(i=0; i<col_count; i++) {
+    if(columns[i] < 0 || columns[i] > MAX_INDEXED_FIELDNR)
+      return show_aggr_error_nr(db, "Invalid aggregate column", columns[i]);
+  }
+
+  /* Set up the header */
+  size = (sizeof(wg_aggr_header) + sizeof(gint) - 1) / sizeof(gint);
+  view_id = wg_alloc_gints(db, &dbh->indexhash_area_header, size);
+  if(!view_id)
+    return show_aggr_error(db, "Failed to allocate the view header");
+  hdr = (wg_aggr_header *) offsettoptr(db, view_id);
+  memset(&hdr->group_column, 0, size * sizeof(gint) - sizeof(gint));
+  hdr->group_column = hdr->max_column = group_column;
+  hdr->columns = col_count;
+  for(i=0; i<col_count; i++) {
+    hdr->aggr_column[i] = columns[i];
+    if(columns[i] > hdr->max_column)
+      hdr->max_column = columns[i];
+  }
+  if(wg_store_filter(db, &hdr->filter, arglist, argc)) {
+    free_view(db, view_id);
+    return -1;
+  }
+  for(i=0; i<argc; i++) {
+    if(arglist[i].column > hdr->max_column)
+      hdr->max_column = arglist[i].column;
+  }
+
+  hdr->buckets = wg_alloc_gints(db, &dbh->indexhash_area_header,
+    AGGR_INITIAL_BUCKETS + 1);
+  if(!hdr->buckets) {
+    free_view(db, view_id);
+    return show_aggr_error(db, "Failed to allocate the group hash array");
+  }
+  hdr->bucket_count = AGGR_INITIAL_BUCKETS;
+  memset(AGGR_BUCKETS(db, hdr), 0,
+    AGGR_INITIAL_BUCKETS * sizeof(gint));
+
+  /* Count the existing rows */
+  rec = wg_get_first_record(db);
+  while(rec) {
+    if(is_plain_record(rec)) {
+      if(view_add_row(db, view_id, rec)) {
+        free_view(db, view_id);
+        return -1;
+      }
+    }
+    rec = wg_get_next_record(db, rec);
+  }
+
+  /* Register the view. Each column that the view reads lists
+   * it once. */
+  for(i=0; i<=hdr->max_column; i++) {
+    if(view_reads_column(hdr, i)) {
+      if(!insert_into_list(db,
+        &dbh->aggr_control_area_header.view_table[i], view_id))
+        return show_aggr_error(db, "Failed to register the view");
+    }
+  }
+  if(!insert_into_list(db,
+    &dbh->aggr_control_area_header.view_list, view_id))
+    return show_aggr_error(db, "Failed to register the view");
+  dbh->aggr_control_area_header.number_of_views++;
+
+  return view_id;
+}
+
+/** Free the storage of a view
+ *  The view should not be registered anymore.
+ */
+static void free_view(void *db, gint view_id) {
+  db_memsegment_header* dbh = dbmemsegh(db);
+  wg_aggr_header *hdr = (wg_aggr_header *) offsettoptr(db, view_id);
+  gint i;
+
+  if(hdr->buckets) {
+    gint *arr = AGGR_BUCKETS(db, hdr);
+    for(i=0; i<hdr->bucket_count; i++) {
+      while(arr[i]) {
+        wg_aggr_group *grp = (wg_aggr_group *) offsettoptr(db, arr[i]);
+        arr[i] = grp->next;
+        free_value(db, grp->key);
+        wg_free_object(db, &dbh->indexhash_area_header,
+          ptrtooffset(db, grp));
+      }
+    }
+    wg_free_object(db, &dbh->indexhash_area_header, hdr->buckets);
+  }
+  wg_free_stored_filter(db, &hdr->filter);
+  wg_free_object(db, &dbh->indexhash_area_header, view_id);
+}
+
+/** Drop a view
+ *  returns 0 on success
+ *  returns -1 on error
+ */
+gint wg_drop_aggr_view(void *db, gint view_id) {
+  db_memsegment_header* dbh = dbmemsegh(db);
+  gint *vlist;
+  gint i, found = 0;
+
+#ifdef CHECK
+  if (!dbcheck(db)) {
+    show_aggr_error(db, "wrong database pointer given to wg_drop_aggr_view");
+    return -1;
+  }
+#endif
+
+  /* Check if the view exists */
+  vlist = &dbh->aggr_control_area_header.view_list;
+  while(*vlist) {
+    gcell *vlistelem = (gcell *) offsettoptr(db, *vlist);
+    if(vlistelem->car == view_id) {
+      delete_from_list(db, vlist);
+      found = 1;
+      break;
+    }
+    vlist = &vlistelem->cdr;
+  }
+  if(!found)
+    return show_aggr_error_nr(db, "Invalid view id", view_id);
+
+  for(i=0; i<=MAX_INDEXED_FIELDNR; i++) {
+    vlist = &dbh->aggr_control_area_header.view_table[i];
+    while(*vlist) {
+      gcell *vlistelem = (gcell *) offsettoptr(db, *vlist);
+      if(vlistelem->car == view_id) {
+        delete_from_list(db, vlist);
+        break;
+      }
+      vlist = &vlistelem->cdr;
+    }
+  }
+
+  free_view(db, view_id);
+  dbh->aggr_control_area_header.number_of_views--;
+  return 0;
+}
+
+/** Get the ids of all views
+ *  returns an array that should be freed by the caller, NULL if
+ *  there are no views or on error
+ */
+void *wg_get_all_aggr_views(void *db, gint *count) {
+  db_memsegment_header* dbh = dbmemsegh(db);
+  gint *vlist;
+  gint *res;
+
+  *count = 0;
+  if(!dbh->aggr_control_area_header.number_of_views) {
+    return NULL;
+  }
+
+  res = (gint *) malloc(dbh->aggr_control_area_header.number_of_views *\
+    sizeof(gint));
+  if(!res) {
+    show_aggr_error(db, "Memory allocation failed");
+    return NULL;
+  }
+
+  vlist = &dbh->aggr_control_area_header.view_list;
+  while(*vlist) {
+    gcell *vlistelem = (gcell *) offsettoptr(db, *vlist);
+    res[(*count)++] = vlistelem->car;
+    vlist = &vlistelem->cdr;
+  }
+  return res;
+}
+
+/* ------------------- reading views ----------------------- */
+
+/** Get the number of summed columns of a view
+ */
+gint wg_aggr_view_columns(void *db, gint view_id) {
+  return ((wg_aggr_header *) offsettoptr(db, view_id))->columns;
+}
+
+/** Get the first group of a view
+ *  Groups are returned in no particular order.
+ *  returns NULL if the view has no groups
+ */
+void *wg_aggr_first_group(void *db, gint view_id) {
+  wg_aggr_header *hdr = (wg_aggr_header *) offsettoptr(db, view_id);
+  gint *arr = AGGR_BUCKETS(db, hdr);
+  gint i;
+
+  for(i=0; i<hdr->bucket_count; i++) {
+    if(arr[i])
+      return offsettoptr(db, arr[i]);
+  }
+  return NULL;
+}
+
+/** Get the next group of a view
+ *  The view must not change while its groups are scanned.
+ *  returns NULL after the last group
+ */
+void *wg_aggr_next_group(void *db, gint view_id, void *group) {
+  wg_aggr_header *hdr = (wg_aggr_header *) offsettoptr(db, view_id);
+  wg_aggr_group *grp = (wg_aggr_group *) group;
+  gint *arr = AGGR_BUCKETS(db, hdr);
+  gint i;
+
+  if(grp->next)
+    return offsettoptr(db, grp->next);
+  for(i=(wg_uint) grp->hash % hdr->bucket_count + 1; i<hdr->bucket_count; i++) {
+    if(arr[i])
+      return offsettoptr(db, arr[i]);
+  }
+  return NULL;
+}
+
+/** Find the group of a value
+ *  returns NULL if no row in the view has the value
+ */
+void *wg_aggr_find_group(void *db, gint view_id, gint value) {
+  wg_aggr_header *hdr = (wg_aggr_header *) offsettoptr(db, view_id);
+  gint hash;
+
+  if(value_hash(db, value, &hash)) {
+    show_aggr_error(db, "Failed to hash the group value");
+    return NULL;
+  }
+  return find_group(db, hdr, value, hash, NULL);
+}
+
+/** Get the value of a group
+ *  The value is owned by the view and must not be freed.
+ */
+gint wg_aggr_group_value(void *db, void *group) {
+  return ((wg_aggr_group *) group)->key;
+}
+
+/** Get the number of rows in a group
+ */
+gint wg_aggr_group_count(void *db, void *group) {
+  return ((wg_aggr_group *) group)->count;
+}
+
+/** Get the sum of the idx-th aggregate column of a group
+ */
+double wg_aggr_group_sum(void *db, void *group, gint idx) {
+  wg_aggr_sum *sum = &((wg_aggr_group *) group)->sums[idx];
+  return (double) sum->isum + sum->dsum;
+}
+
+/** Get the number of numeric values summed in the idx-th
+ *  aggregate column of a group (for averages)
+ */
+gint wg_aggr_group_values(void *db, void *group, gint idx) {
+  return ((wg_aggr_group *) group)->sums[idx].values;
+}
+
+/* ------------------- error handling ---------------------- */
+
+static gint show_aggr_error(void* db, char* errmsg) {
+#ifdef WG_NO_ERRPRINT
+#else
+  fprintf(stderr,"aggregate view error: %s\n",errmsg);
+#endif
+  return -1;
+}
+
+static gint show_aggr_error_nr(void* db, char* errmsg, gint nr) {
+#ifdef WG_NO_ERRPRINT
+#else
+  fprintf(stderr,"aggregate view error: %s %d\n", errmsg, (int) nr);
+#endif
+  return -1;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,104 @@
+/*
+* $Id:  $
+* $Version: $
+*
+* Copyright (c) WhiteDB contributors 2026
+*
+* This file is part of WhiteDB
+*
+* WhiteDB is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* WhiteDB is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with WhiteDB.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+ /** @file dbaggr.h
+ * Public headers for materialized aggregate views.
+ */
+
+#ifndef DEFINED_DBAGGR_H
+#define DEFINED_DBAGGR_H
+
+#ifdef _WIN32
+#include "config-w32.h"
+#else
+#include "config-gcc.h"
+#endif
+
+/* For gint data type */
+#include "dbdata.h"
+/* For wg_query_arg */
+#include "dbquery.h"
+
+/* ==== Public macros ==== */
+
+#define AGGR_INITIAL_BUCKETS 64   /** hash array size of a new view */
+#define AGGR_MAX_LOAD 2           /** groups per bucket before growing */
+
+/* The group hash array follows the allocator header of its object */
+#define AGGR_BUCKETS(d, h) ((gint *) offsettoptr(d, h->buckets) + 1)
+
+/* ====== data structures ======== */
+
+/** running sum of one column in one group
+*   Integers are summed separately so that adding and removing
+*   the same rows gives back the exact original sum.
+*/
+typedef struct {
+  gint values;      /** numeric values summed */
+  gint isum;        /** sum of the integer values */
+  double dsum;      /** sum of the other numeric values */
+} wg_aggr_sum;
+
+/** one group of a view
+*   Allocated with a sum for each aggregate column of the view.
+*/
+typedef struct {
+  gint objhead;     /** allocator header of the object, do not use */
+  gint next;        /** next group in the hash chain */
+  gint hash;        /** hash of the group value */
+  gint key;         /** group value, private encoded copy */
+  gint count;       /** rows in the group */
+  wg_aggr_sum sums[1];
+} wg_aggr_group;
+
+/* ==== Protos ==== */
+
+/* API functions (copied in dbapi.h) */
+
+gint wg_create_aggr_view(void *db, gint group_column, gint *columns,
+  gint col_count, wg_query_arg *arglist, gint argc);
+gint wg_drop_aggr_view(void *db, gint view_id);
+void *wg_get_all_aggr_views(void *db, gint *count);
+gint wg_aggr_view_columns(void *db, gint view_id);
+void *wg_aggr_first_group(void *db, gint view_id);
+void *wg_aggr_next_group(void *db, gint view_id, void *group);
+void *wg_aggr_find_group(void *db, gint view_id, gint value);
+gint wg_aggr_group_value(void *db, void *group);
+gint wg_aggr_group_count(void *db, void *group);
+double wg_aggr_group_sum(void *db, void *group, gint idx);
+gint wg_aggr_group_values(void *db, void *group, gint idx);
+
+/* WhiteDB internal functions */
+
+gint wg_aggr_add_field(void *db, void *rec, gint column);
+gint wg_aggr_add_rec(void *db, void *rec);
+gint wg_aggr_del_field(void *db, void *rec, gint column);
+gint wg_aggr_del_rec(void *db, void *rec);
+
+gint wg_store_filter(void *db, wg_stored_filter *filter,
+  wg_query_arg *arglist, gint argc);
+gint wg_match_stored_filter(void *db, wg_stored_filter *filter, void *rec);
+void wg_free_stored_filter(void *db, wg_stored_filter *filter);
+
+
+#endif /* DEFINED_DBAGGR_H */
@@ -64,9 +64,15 @@ static gint alloc_db_segmentchunk(void* db, gint size); // allocates a next chun
 static gint init_syn_vars(void* db);
 static gint init_extdb(void* db);
 static gint init_db_index_area_header(void* db);
+static gint init_db_aggr_area_header(void* db);
+static gint init_db_feed_area_header(void* db);
+#ifdef USE_INDEX_ADVISOR
+static gint init_db_advisor_area_header(void* db);
+#endif
 static gint init_logging(void* db);
 static gint init_strhash_area(void* db, db_hash_area_header* areah);
-static gint init_hash_subarea(void* db, db_hash_area_header* areah, gint arraylength);
+static gint init_hash_array(void* db, void* area_header,
+  db_hash_area_header* areah, gint arraylength);
 static gint init_db_recptr_bitmap(void* db);
 #ifdef USE_REASONER
 static gint init_anonconst_table(void* db);
@@ -173,6 +179,7 @@ gint wg_init_db_memsegment(void* db, gint key, gint size) {
 
   /* index structures also user fixlen object storage:
    *   tnode area - contains index nodes
+   *   bnode area - contains B+tree index nodes
    *   index header area - contains index headers
    *   index template area - contains template headers
    *   index hash area - varlen storage for hash buckets
@@ -186,6 +193,13 @@ gint wg_init_db_memsegment(void* db, gint key, gint size) {
   tmp=make_subarea_freelist(db,&(dbh->tnode_area_header),0);
   if (tmp) {  show_dballoc_error(db," cannot initialize tnode area"); return -1; }
 
+  tmp=init_db_subarea(db,&(dbh->bnode_area_header),0,INITIAL_SUBAREA_SIZE);
+  if (tmp) {  show_dballoc_error(db," cannot create bnode area"); return -1; }
+  (dbh->bnode_area_header).fixedlength=1;
+  (dbh->bnode_area_header).objlength=sizeof(struct wg_bnode);
+  tmp=make_subarea_freelist(db,&(dbh->bnode_area_header),0);
+  if (tmp) {  show_dballoc_error(db," cannot initialize bnode area"); return -1; }
+
   tmp=init_db_subarea(db,&(dbh->indexhdr_area_header),0,MINIMAL_SUBAREA_SIZE);
   if (tmp) {  show_dballoc_error(db," cannot create index header area"); return -1; }
   (dbh->indexhdr_area_header).fixedlength=1;
@@ -229,6 +243,20 @@ gint wg_init_db_memsegment(void* db, gint key, gint size) {
   tmp=init_db_index_area_header(db);
   if (tmp) { show_dballoc_error(db," cannot initialize index header area"); return -1; }
 
+  /* initialize aggregate view structures */
+  tmp=init_db_aggr_area_header(db);
+  if (tmp) { show_dballoc_error(db," cannot initialize aggregate view area"); return -1; }
+
+  /* initialize change feed structures */
+  tmp=init_db_feed_area_header(db);
+  if (tmp) { show_dballoc_error(db," cannot initialize change feed area"); return -1; }
+
+#ifdef USE_INDEX_ADVISOR
+  /* initialize index advisor statistics */
+  tmp=init_db_advisor_area_header(db);
+  if (tmp) { show_dballoc_error(db," cannot initialize index advisor area"); return -1; }
+#endif
+
   /* initialize bitmap for record pointers: really allocated only if USE_RECPTR_BITMAP defined */
   tmp=init_db_recptr_bitmap(db);
   if (tmp) { show_dballoc_error(db," cannot initialize record pointer bitmap"); return -1; }
@@ -389,6 +417,7 @@ static gint init_db_index_area_header(void* db) {
   memset(dbh->index_control_area_header.index_table, 0,
     (MAX_INDEXED_FIELDNR+1)*sizeof(gint));
   dbh->index_control_area_header.index_list=0;
+  dbh->index_control_area_header.online_build=0;
 #ifdef USE_INDEX_TEMPLATE
   dbh->index_control_area_header.index_template_list=0;
   memset(dbh->index_control_area_header.index_template_table, 0,
@@ -397,6 +426,50 @@ static gint init_db_index_area_header(void* db) {
   return 0;
 }
 
+/** initializes aggregate view area
+* Sets up an empty view table. View headers and groups are stored
+* in the indexhash area.
+* returns 0 if ok
+*/
+static gint init_db_aggr_area_header(void* db) {
+  db_memsegment_header* dbh = dbmemsegh(db);
+  dbh->aggr_control_area_header.number_of_views=0;
+  dbh->aggr_control_area_header.view_list=0;
+  memset(dbh->aggr_control_area_header.view_table, 0,
+    (MAX_INDEXED_FIELDNR+1)*sizeof(gint));
+  return 0;
+}
+
+/** initializes change feed area
+* There are no subscriptions and no event ring.
+* returns 0 if ok
+*/
+static gint init_db_feed_area_header(void* db) {
+  db_memsegment_header* dbh = dbmemsegh(db);
+  dbh->feed_area_header.ring=0;
+  dbh->feed_area_header.size=0;
+  dbh->feed_area_header.seq=0;
+  dbh->feed_area_header.waiters=0;
+  dbh->feed_area_header.active=0;
+  memset(dbh->feed_area_header.subscription, 0,
+    MAX_FEED_SUBSCRIPTIONS*sizeof(gint));
+  return 0;
+}
+
+#ifdef USE_INDEX_ADVISOR
+/** initializes index advisor area
+* No predicates have been observed.
+* returns 0 if ok
+*/
+static gint init_db_advisor_area_header(void* db) {
+  db_memsegment_header* dbh = dbmemsegh(db);
+  dbh->advisor.dropped=0;
+  memset((void *) dbh->advisor.entry, 0,
+    ADVISOR_TABLE_SIZE*sizeof(db_advisor_entry));
+  return 0;
+}
+#endif
+
 /** initializes logging area
 *
 */
@@ -421,35 +494,32 @@ static gint init_strhash_area(void* db, db_hash_area_header* areah) {
   } else {
     arraylength = DEFAULT_STRHASH_LENGTH;
   }
-  return init_hash_subarea(db, areah, arraylength);
+  /* the strhash grows with the strings, see dbhash.c */
+  return init_hash_array(db, &(dbh->longstr_area_header), areah, arraylength);
 }
 
-/** initializes hash area
+/** initializes a hash array
 *
+*  The array is a varlen object in the given area, so that it can be
+*  freed when the hash grows or is dropped. Gint 0 of the object is
+*  the allocator header, the array starts after it.
 */
-static gint init_hash_subarea(void* db, db_hash_area_header* areah, gint arraylength) {
-  gint segmentchunk;
-  gint i;
-  gint asize;
-  gint j;
-
-  //printf("init_hash_subarea called with arraylength %d \n",arraylength);
-  asize=((arraylength+1)*sizeof(gint))+(2*SUBAREA_ALIGNMENT_BYTES); // 2* just to be safe
-  //printf("asize: %d \n",asize);
-  //if (asize<100) return -1; // errcase to filter out stupid requests
-  segmentchunk=alloc_db_segmentchunk(db,asize);
-  //printf("segmentchunk: %d \n",segmentchunk);
-  if (!segmentchunk) return -2; // errcase
-  areah->offset=segmentchunk;
-  areah->size=asize;
+static gint init_hash_array(void* db, void* area_header,
+  db_hash_area_header* areah, gint arraylength) {
+  gint arr;
+
+  arr=wg_alloc_gints(db,area_header,arraylength+1);
+  if (!arr) return -2; // errcase
+  memset(offsettoptr(db,arr+sizeof(gint)),0,arraylength*sizeof(gint));
+  areah->offset=arr;
+  areah->size=(arraylength+1)*sizeof(gint);
+  areah->arraysize=arraylength*sizeof(gint);
+  areah->arraystart=arr+sizeof(gint);
   areah->arraylength=arraylength;
-  // set correct alignment for arraystart
-  i=SUBAREA_ALIGNMENT_BYTES-(segmentchunk%SUBAREA_ALIGNMENT_BYTES);
-  if (i==SUBAREA_ALIGNMENT_BYTES) i=0;
-  areah->arraystart=segmentchunk+i;
-  i=areah->arraystart;
-  for(j=0;j<arraylength;j++) dbstore(db,i+(j*sizeof(gint)),0);
-  //show_strhash(db);
+  areah->entries=0;
+  areah->oldstart=0;
+  areah->oldlength=0;
+  areah->rehashpos=0;
   return 0;
 }
 
@@ -1388,8 +1458,9 @@ gint wg_register_external_db(void *db, void *extdb) {
 gint wg_create_hash(void *db, db_hash_area_header* areah, gint size) {
   if(size <= 0)
     size = DEFAULT_IDXHASH_LENGTH;
-  if(init_hash_subarea(db, areah, size)) {
-    return show_dballoc_error(db," cannot create strhash array area");
+  if(init_hash_array(db, &(dbmemsegh(db)->indexhash_area_header),
+    areah, size)) {
+    return show_dballoc_error(db," cannot create index hash array");
   }
   return 0;
 }
@@ -167,6 +167,10 @@ Varlen allocation follows the main ideas of the Doug Lea allocator:
 /* defaults, used when there is no user-supplied or computed value */
 #define DEFAULT_STRHASH_LENGTH 10000  /** length of the strhash array (nr of array elements) */
 #define DEFAULT_IDXHASH_LENGTH 10000  /** hash index hash size */
+#define IDXHASH_MAX_LOAD 2            /** keys per hash index array element before growing */
+#define IDXHASH_REHASH_STEP 4         /** array elements rehashed per hash index update */
+#define STRHASH_MAX_LOAD 2            /** strings per strhash array element before growing */
+#define STRHASH_REHASH_STEP 4         /** array elements rehashed per strhash update */
 
 #define ANONCONST_TABLE_SIZE 200 /** length of the table containing predefined anonconst uri ptrs */
 
@@ -255,13 +259,29 @@ gcell;
 
 /* index related stuff */
 #define MAX_INDEX_FIELDS 10       /** maximum number of fields in one index */
+#define MAX_INDEX_INCLUDE 4       /** maximum included columns of an index */
 #define MAX_INDEXED_FIELDNR 127   /** limits the size of field/index table */
 
+/* aggregate view related stuff */
+#define MAX_AGGR_FIELDS 10        /** maximum summed columns of a view */
+#define MAX_FILTER_ARGS 10        /** maximum conditions of a stored filter */
+
+/* change feed related stuff */
+#define MAX_FEED_SUBSCRIPTIONS 31 /** one bit per subscription in event masks */
+#define FEED_RING_SIZE 4096       /** events kept in the change ring */
+
+/* index advisor related stuff */
+#define ADVISOR_TABLE_SIZE 256    /** predicate shapes tracked by the advisor */
+#define ADVISOR_MAX_COLUMNS 8     /** columns of a query considered by the advisor */
+#define ADVISOR_SAMPLE_RATE 64    /** one in so many scanned rows is sampled */
+
 #ifndef TTREE_CHAINED_NODES
 #define WG_TNODE_ARRAY_SIZE 10
 #else
 #define WG_TNODE_ARRAY_SIZE 8
 #endif
+#define WG_BNODE_SIZE 16          /** entries in a B+tree node */
+#define WG_ZONE_BLOCK_SIZE 8192   /** bytes of a datarec subarea per zone map block */
 
 /* logging related */
 #define maxnumberoflogrows 10
@@ -353,6 +373,11 @@ typedef struct _db_hash_area_header {
   gint arraysize;      /** subarea object alloc usable size: not necessarily to end of area */
   gint arraystart;     /** subarea start as to be used for object allocation */
   gint arraylength;    /** nr of elements in the hash array */
+  /* growable hashes only */
+  gint entries;        /** nr of keys in the hash */
+  gint oldstart;       /** array being rehashed from, 0 if none */
+  gint oldlength;      /** nr of elements in the old array */
+  gint rehashpos;      /** old array elements already rehashed */
 } db_hash_area_header;
 
 /**
@@ -364,6 +389,18 @@ struct __wg_ttree_header {
   gint offset_max_node;     /** last node in chain */
   gint offset_min_node;     /** first node in chain */
 #endif
+  gint key_columns[MAX_INDEX_FIELDS]; /** key order of a composite index */
+  gint include_count;       /** columns copied into the nodes */
+  gint include_columns[MAX_INDEX_INCLUDE]; /** included (covered) columns */
+};
+
+/**
+ * B+tree specific index header fields
+ */
+struct __wg_btree_header {
+  gint offset_root_node;
+  gint offset_first_leaf;   /** start of the leaf chain */
+  gint offset_last_leaf;    /** end of the leaf chain */
 };
 
 /**
@@ -371,6 +408,14 @@ struct __wg_ttree_header {
  */
 struct __wg_hashidx_header {
   db_hash_area_header hasharea;
+  gint unique;              /** no two rows share a key without NULLs */
+};
+
+/**
+ * Zone map specific index header fields
+ */
+struct __wg_zonemap_header {
+  gint offset_tables;       /** block tables of the datarec subareas */
 };
 
 
@@ -383,9 +428,12 @@ typedef struct {
   gint rec_field_index[MAX_INDEX_FIELDS]; /** field numbers for this index */
   union {
     struct __wg_ttree_header t;
+    struct __wg_btree_header b;
     struct __wg_hashidx_header h;
+    struct __wg_zonemap_header z;
   } ctl;                    /** shared fields for different index types */
   gint template_offset;     /** matchrec template, 0 if full index */
+  gint predicate_offset;    /** row filter of a partial index, 0 if none */
 } wg_index_header;
 
 
@@ -408,6 +456,7 @@ typedef struct {
   gint number_of_indexes;       /** unused, reserved */
   gint index_list;              /** master index list */
   gint index_table[MAX_INDEXED_FIELDNR+1];    /** index lookup by column */
+  gint online_build;            /** state of an online index build, 0 if none */
 #ifdef USE_INDEX_TEMPLATE
   gint index_template_list;     /** sorted list of index masks */
   gint index_template_table[MAX_INDEXED_FIELDNR+1]; /** masks indexed by column */
@@ -415,6 +464,104 @@ typedef struct {
 } db_index_area_header;
 
 
+/** query argument list kept in shared memory
+*   The values are private encoded copies owned by the filter.
+*/
+typedef struct {
+  gint count;                       /** number of conditions */
+  gint column[MAX_FILTER_ARGS];
+  gint cond[MAX_FILTER_ARGS];
+  gint value[MAX_FILTER_ARGS];
+} wg_stored_filter;
+
+
+/** control data for one materialized aggregate view
+*   Groups are kept in a hash array in the indexhash area.
+*/
+typedef struct {
+  gint objhead;             /** allocator header of the object, do not use */
+  gint group_column;        /** rows are grouped by this column */
+  gint columns;             /** number of summed columns */
+  gint aggr_column[MAX_AGGR_FIELDS];   /** summed columns */
+  wg_stored_filter filter;  /** rows that fail it are not counted */
+  gint max_column;          /** highest column the view reads */
+  gint buckets;             /** group hash array object, see AGGR_BUCKETS */
+  gint bucket_count;        /** size of the group hash array */
+  gint groups;              /** number of groups */
+} wg_aggr_header;
+
+
+/** aggregate view management data
+*  contains lookup table by field number
+*/
+typedef struct {
+  gint number_of_views;         /** views in view_list */
+  gint view_list;               /** master view list */
+  gint view_table[MAX_INDEXED_FIELDNR+1];  /** views by column they read */
+} db_aggr_area_header;
+
+
+/** one change event in the feed ring
+*   seq is written last so that readers can tell a complete
+*   event from one that is being overwritten.
+*/
+typedef struct {
+  volatile gint seq;        /** sequence number, 0 while being written */
+  gint offset;              /** changed record */
+  gint column;              /** changed column, -1 for the whole record */
+  gint op;                  /** WG_CHANGE_CREATE, _SET or _DELETE */
+  gint mask;                /** subscriptions that the event matched */
+} db_feed_event;
+
+
+/** one change feed subscription
+*   The slot is reclaimed when the owner process is gone.
+*/
+typedef struct {
+  gint objhead;             /** allocator header of the object, do not use */
+  gint pid;                 /** process that owns the subscription */
+  wg_stored_filter filter;  /** events of records failing it are skipped */
+} db_feed_subscription;
+
+
+/** change feed management data
+*  The ring is allocated in the indexhash area while there are
+*  subscriptions and freed with the last one.
+*/
+typedef struct {
+  gint ring;                /** event ring object, 0 if not allocated */
+  gint size;                /** events in the ring */
+  volatile gint seq;        /** sequence number of the last event */
+  volatile gint waiters;    /** readers blocked on seq */
+  gint active;              /** bitmask of used subscription slots */
+  gint subscription[MAX_FEED_SUBSCRIPTIONS]; /** filters by slot */
+} db_feed_area_header;
+
+
+/** scan statistics of one predicate shape
+*  The key packs the columns and the condition, see dbadvise.c.
+*  All counters are updated atomically by concurrent readers.
+*/
+typedef struct {
+  volatile gint key;        /** 0 if the slot is free */
+  volatile gint scans;      /** queries that fell back to a full scan */
+  volatile gint examined;   /** rows examined by the scans */
+  volatile gint returned;   /** rows returned by the scans */
+  volatile gint visited;    /** rows an index would have visited (estimate) */
+  volatile gint lead_visited; /** same with the first column only (pairs) */
+  volatile gint elapsed_us; /** time spent in the scans */
+} db_advisor_entry;
+
+
+/** index advisor statistics
+*  A fixed hash table, shapes that do not fit are only counted.
+*/
+typedef struct {
+  volatile gint dropped;    /** observations lost to a full table */
+  db_advisor_entry entry[ADVISOR_TABLE_SIZE];
+} db_advisor_area_header;
+
+
 /** Registered external databases
 *   Offsets of data in these databases are recognized properly
 *   by the data store/retrieve/compare functions.
@@ -487,9 +634,14 @@ typedef struct _db_memsegment_header {
   // index structures
   db_index_area_header index_control_area_header;
   db_area_header tnode_area_header;
+  db_area_header bnode_area_header;
   db_area_header indexhdr_area_header;
   db_area_header indextmpl_area_header;
   db_area_header indexhash_area_header;
+  // aggregate view structures
+  db_aggr_area_header aggr_control_area_header;
+  // change feed structures
+  db_feed_area_header feed_area_header;
   // logging structures
   db_logging_area_header logging;
   // recptr bitmap
@@ -499,6 +651,9 @@ typedef struct _db_memsegment_header {
   db_anonconst_area_header anonconst;
 #endif
   // statistics
+#ifdef USE_INDEX_ADVISOR
+  db_advisor_area_header advisor;
+#endif
   // field/table name structures
   syn_var_area locks;   /** currently holds a single global lock */
   extdb_area extdbs;    /** offset ranges of external databases */
@@ -511,6 +666,8 @@ typedef struct _db_memsegment_header {
 typedef struct {
   db_memsegment_header *db; /** shared memory header */
   void *logdata;            /** log data structure in local memory */
+  void *querydata;          /** cached query memory pools in local memory */
+  void *bulkdata;           /** index updates deferred by wg_begin_bulk() */
 } db_handle;
 #endif
 
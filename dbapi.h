@@ -73,13 +73,26 @@ extern "C" {
 #define WG_COND_GREATER     0x0008      /** > */
 #define WG_COND_LTEQUAL     0x0010      /** <= */
 #define WG_COND_GTEQUAL     0x0020      /** >= */
+#define WG_COND_CONTAINS    0x0040      /** string contains the value */
 
 /* Query types. Python extension module uses the API and needs these. */
 #define WG_QTYPE_TTREE      0x01
 #define WG_QTYPE_HASH       0x02
 #define WG_QTYPE_SCAN       0x04
+#define WG_QTYPE_TRIGRAM    0x08
+#define WG_QTYPE_BTREE      0x10
+#define WG_QTYPE_SPATIAL    0x20
 #define WG_QTYPE_PREFETCH   0x80
 
+#define WG_JTYPE_TTREE      0x01        /** inner rows from a T-tree index */
+#define WG_JTYPE_HASH       0x02        /** inner rows from a hash index */
+#define WG_JTYPE_LOCALHASH  0x04        /** hash table on the smaller side */
+
+/* Change feed event types */
+#define WG_CHANGE_CREATE 1
+#define WG_CHANGE_SET 2
+#define WG_CHANGE_DELETE 3
+
 /* Direct access to field */
 #define RECORD_HEADER_GINTS 3
 #define wg_field_addr(db,record,fieldnr) (((wg_int*)(record))+RECORD_HEADER_GINTS+(fieldnr))
@@ -96,6 +109,32 @@ typedef struct {
   wg_int value;       /** encoded value */
 } wg_query_arg;
 
+/** Query execution statistics */
+typedef struct {
+  wg_uint nodes_visited;      /** T-tree nodes walked */
+  wg_uint records_examined;   /** rows checked against the argument list */
+  wg_uint records_returned;   /** rows returned by wg_fetch() */
+  wg_uint compare_calls;      /** value comparisons done by the query engine */
+  wg_uint elapsed_ns;         /** time spent building and fetching */
+  wg_uint blocks_skipped;     /** full scan blocks passed over by a zone map */
+} wg_query_stats;
+
+/** Query plan, as chosen by the query builder */
+typedef struct {
+  wg_int qtype;             /** access path (T-tree or full scan) */
+  wg_int index_id;          /** index used, 0 if none */
+  wg_int column;            /** indexed column, -1 if none */
+  wg_int start_bound;       /** encoded start value, WG_ILLEGAL if unbounded */
+  wg_int start_inclusive;
+  wg_int end_bound;         /** encoded end value, WG_ILLEGAL if unbounded */
+  wg_int end_inclusive;
+  wg_int empty;             /** bounds are contradictory, no rows match */
+  wg_int prefix;            /** leading composite key columns fixed by
+                             * equality, the bounds apply to column */
+  wg_query_arg *arglist;    /** residual conditions checked on each row */
+  wg_int argc;              /** number of elements in arglist */
+} wg_query_plan;
+
 /** Query object */
 typedef struct {
   wg_int qtype;         /** Query type (T-tree, hash, full scan, prefetch) */
@@ -103,6 +142,7 @@ typedef struct {
   wg_query_arg *arglist;    /** check each row in result set against these */
   wg_int argc;              /** number of elements in arglist */
   wg_int column;            /** index on this column used */
+  wg_int index_id;          /** T-tree index used, 0 if none */
   /* Fields for T-tree query (XXX: some may be re-usable for
    * other types as well) */
   wg_int curr_offset;
@@ -110,15 +150,91 @@ typedef struct {
   wg_int curr_slot;
   wg_int end_slot;
   wg_int direction;
+  wg_int last_offset;       /** node of the row returned last */
+  wg_int last_slot;
   /* Fields for full scan */
   wg_int curr_record;       /** offset of the current record */
+  wg_int zone_index;        /** zone map used to skip blocks, 0 if none */
+  wg_uint zone_lo;          /** normalized bounds of the values that match */
+  wg_uint zone_hi;
+  wg_int zone_nulls;        /** NULL values can match */
+  wg_int zone_start;        /** block of the current record */
+  wg_int zone_end;
+  wg_uint scan_examined;    /** rows examined, for the index advisor */
+  wg_uint scan_returned;    /** rows returned */
+  wg_uint scan_ns;          /** time spent in the timed fetches */
+  wg_uint scan_timed;       /** rows examined by the timed fetches */
+  wg_uint scan_sampled;     /** rows checked for the selectivity of columns */
+  wg_uint scan_pass[8];     /** sampled rows passing the conditions on
+                             *  each column (ADVISOR_MAX_COLUMNS) */
+  /* Fields for trigram query */
+  wg_int *cand;             /** candidate row offsets, sorted */
+  wg_int cand_count;        /** number of candidates */
+  wg_int cand_pos;          /** next candidate to examine */
+  /* Fields for spatial query (uses curr_offset and curr_slot) */
+  wg_uint box_lo;           /** Z-order keys of the corners of the box */
+  wg_uint box_hi;
   /* Fields for prefetch; with/without mpool */
   void *mpool;              /** storage for row offsets */
   void *curr_page;          /** current page of results */
   wg_int curr_pidx;         /** current index on page */
   wg_uint res_count;        /** number of rows in results */
+  void *arena;              /** caller-owned mpool the query was built in */
+  /* Fields for profiling */
+  wg_int profile;           /** collect execution statistics */
+  wg_query_stats stats;
 } wg_query;
 
+/** Continuation token of a keyset query. Remembers the last row
+ *  returned, so that the next page resumes right after it. */
+typedef struct {
+  wg_int column;            /** ordering column, needs a T-tree index */
+  wg_int key;               /** value of the last row (private copy) */
+  wg_int offset;            /** last row returned, 0 before the first page */
+} wg_query_token;
+
+/** Join object (rows of two queries paired on equal column values) */
+typedef struct {
+  wg_int jtype;             /** join method */
+  wg_int outer_column;      /** join column of the outer rows */
+  wg_int inner_column;      /** join column of the inner rows */
+  wg_query *driver;         /** outer rows, or the probe side of a hash join */
+  wg_query_arg *inner_arglist; /** conditions on inner rows (index joins) */
+  wg_int inner_argc;
+  wg_int index_id;          /** index on the inner column, 0 if none */
+  void *curr_probe;         /** row currently being matched */
+  wg_int curr_key;          /** join value of curr_probe */
+  /* Fields for index joins */
+  wg_query inner;           /** T-tree cursor over the matching inner rows */
+  wg_int curr_cell;         /** next list cell of a hash index match */
+  /* Fields for local hash join */
+  void *table;              /** hash table on the build side */
+  wg_int build_outer;       /** the table holds the outer rows */
+  wg_int curr_entry;        /** next table entry to check, -1 if none */
+  wg_uint curr_hash;        /** hash of curr_key */
+} wg_join;
+
+/** Change feed event, as returned by wg_wait_changes() */
+typedef struct {
+  wg_int seq;               /** sequence number of the event */
+  wg_int op;                /** WG_CHANGE_CREATE, WG_CHANGE_SET or WG_CHANGE_DELETE */
+  wg_int column;            /** changed column, -1 for the whole record */
+  void *record;             /** changed record, already gone for WG_CHANGE_DELETE */
+} wg_change;
+
+/** Index suggested by wg_get_index_advice() */
+typedef struct {
+  wg_int columns[2];        /** key columns of the index */
+  wg_int col_count;         /** 1, or 2 for a composite index */
+  wg_int scans;             /** full scans with conditions on the leading column */
+  wg_int examined;          /** rows examined by the scans */
+  wg_int returned;          /** rows returned by the scans */
+  wg_int visited;           /** rows the index would have visited (estimate) */
+  wg_int elapsed_us;        /** time spent in the scans */
+  wg_int savings_us;        /** estimated time saved by the index */
+  wg_int index_id;          /** index created by the advisor, 0 if none */
+} wg_index_advice;
+
 /* prototypes of wg database api functions
 
 */
@@ -330,8 +446,36 @@ wg_query *wg_make_query(void *db, void *matchrec, wg_int reclen,
 #define wg_make_prefetch_query wg_make_query
 wg_query *wg_make_query_rc(void *db, void *matchrec, wg_int reclen,
   wg_query_arg *arglist, wg_int argc, wg_uint rowlimit);
+wg_query *wg_make_query_profile(void *db, void *matchrec, wg_int reclen,
+  wg_query_arg *arglist, wg_int argc, wg_uint rowlimit);
+wg_query *wg_make_query_arena(void *db, void *matchrec, wg_int reclen,
+  wg_query_arg *arglist, wg_int argc, wg_uint rowlimit,
+  void *arena, wg_query *query);
+wg_query *wg_make_query_cursor(void *db, void *matchrec, wg_int reclen,
+  wg_query_arg *arglist, wg_int argc);
+wg_query *wg_make_query_page(void *db, void *matchrec, wg_int reclen,
+  wg_query_arg *arglist, wg_int argc, wg_uint offset, wg_uint rowlimit);
+void wg_init_query_token(void *db, wg_query_token *token, wg_int column);
+wg_query *wg_make_query_after(void *db, void *matchrec, wg_int reclen,
+  wg_query_arg *arglist, wg_int argc, wg_query_token *token, wg_uint rowlimit);
+void wg_free_query_token(void *db, wg_query_token *token);
 void *wg_fetch(void *db, wg_query *query);
+void *wg_fetch_columns(void *db, wg_query *query, wg_int *columns,
+  wg_int count, wg_int *values);
+wg_uint wg_query_skip(void *db, wg_query *query, wg_uint count);
+wg_int wg_query_count(void *db, void *matchrec, wg_int reclen,
+  wg_query_arg *arglist, wg_int argc);
+wg_int wg_query_sum(void *db, void *matchrec, wg_int reclen,
+  wg_query_arg *arglist, wg_int argc, wg_int column, double *sum);
 void wg_free_query(void *db, wg_query *query);
+wg_int wg_explain_query(void *db, void *matchrec, wg_int reclen,
+  wg_query_arg *arglist, wg_int argc, wg_query_plan *plan);
+void wg_free_query_plan(void *db, wg_query_plan *plan);
+wg_join *wg_make_join(void *db,
+  wg_query_arg *outer_arglist, wg_int outer_argc, wg_int outer_column,
+  wg_query_arg *inner_arglist, wg_int inner_argc, wg_int inner_column);
+wg_int wg_fetch_join(void *db, wg_join *join, void **outer, void **inner);
+void wg_free_join(void *db, wg_join *join);
 
 wg_int wg_encode_query_param_null(void *db, char *data);
 wg_int wg_encode_query_param_record(void *db, void *data);
@@ -374,6 +518,42 @@ void *wg_find_record_xmlliteral(void *db, wg_int fieldnr, wg_int cond,
 void *wg_find_record_uri(void *db, wg_int fieldnr, wg_int cond, char *data,
     char *prefix, void* lastrecord);
 
+/* ---------- materialized aggregate views ------ */
+
+wg_int wg_create_aggr_view(void *db, wg_int group_column, wg_int *columns,
+  wg_int col_count, wg_query_arg *arglist, wg_int argc);
+wg_int wg_drop_aggr_view(void *db, wg_int view_id);
+void *wg_get_all_aggr_views(void *db, wg_int *count);
+wg_int wg_aggr_view_columns(void *db, wg_int view_id);
+void *wg_aggr_first_group(void *db, wg_int view_id);
+void *wg_aggr_next_group(void *db, wg_int view_id, void *group);
+void *wg_aggr_find_group(void *db, wg_int view_id, wg_int value);
+wg_int wg_aggr_group_value(void *db, void *group);
+wg_int wg_aggr_group_count(void *db, void *group);
+double wg_aggr_group_sum(void *db, void *group, wg_int idx);
+wg_int wg_aggr_group_values(void *db, void *group, wg_int idx);
+
+/* ---------- change feed ------------------ */
+
+void *wg_subscribe_changes(void *db, wg_query_arg *arglist, wg_int argc);
+wg_int wg_unsubscribe_changes(void *db, void *sub);
+wg_int wg_wait_changes(void *db, void *sub, wg_change *events, wg_int max,
+  wg_int timeout);
+wg_int wg_lost_changes(void *db, void *sub);
+
+/* ---------- index advisor ---------------- */
+
+wg_int wg_get_index_advice(void *db, wg_index_advice *advice, wg_int max,
+  wg_int create_us);
+void wg_reset_index_advice(void *db);
+
+/* ---------- local memory pools ----------- */
+
+void* wg_create_mpool(void* db, int bytes);
+void* wg_alloc_mpool(void* db, void* mpool, int bytes);
+void wg_reset_mpool(void* db, void* mpool);
+void wg_free_mpool(void* db, void* mpool);
+
 /* ---------- child database handling ------ */
 
 wg_int wg_register_external_db(void *db, void *extdb);
@@ -60,6 +60,8 @@ extern "C" {
 #include "dbhash.h"
 #include "dblog.h"
 #include "dbindex.h"
+#include "dbaggr.h"
+#include "dbfeed.h"
 #include "dbcompare.h"
 #include "dblock.h"
 
@@ -120,6 +122,10 @@ void* wg_create_record(void* db, wg_int length) {
   if(rec) {
     if(wg_index_add_rec(db, rec) < -1)
       return NULL; /* index error */
+    if(wg_aggr_add_rec(db, rec) < -1)
+      return NULL; /* aggregate view error */
+    if(dbmemsegh(db)->feed_area_header.active)
+      wg_feed_add(db, rec, -1, WG_CHANGE_CREATE, 0);
   }
   return rec;
 }
@@ -230,6 +236,10 @@ gint wg_delete_record(void* db, void *rec) {
   if(!is_special_record(rec)) {
     if(wg_index_del_rec(db, rec) < -1)
       return -3; /* index error */
+    if(wg_aggr_del_rec(db, rec) < -1)
+      return -3; /* aggregate view error */
+    if(dbmemsegh(db)->feed_area_header.active)
+      wg_feed_add(db, rec, -1, WG_CHANGE_DELETE, wg_feed_match(db, rec));
   }
 
   offset = ptrtooffset(db, rec);
@@ -488,7 +498,8 @@ static gint remove_backlink_index_entries(void *db, gint *record,
          * we don't need to deal with index templates here
          * (record links are not allowed in templates).
          */
-        if(dbh->index_control_area_header.index_table[col]) {
+        if(dbh->index_control_area_header.index_table[col] ||\
+          dbh->index_control_area_header.online_build) {
           if(wg_index_del_field(db, record, col) < -1)
             return -1;
         }
@@ -542,7 +553,8 @@ static gint restore_backlink_index_entries(void *db, gint *record,
 
     for(col=0; col<length; col++) {
       if(*(record + RECORD_HEADER_GINTS + col) == value) {
-        if(dbh->index_control_area_header.index_table[col]) {
+        if(dbh->index_control_area_header.index_table[col] ||\
+          dbh->index_control_area_header.online_build) {
           if(wg_index_add_field(db, record, col) < -1)
             return -1;
         }
@@ -602,10 +614,11 @@ wg_int* wg_get_record_dataarray(void* db, void* record) {
  *  returns 0 if successful
  *  returns -1 if invalid db pointer passed (by recordcheck macro)
  *  returns -2 if invalid record passed (by recordcheck macro)
- *  returns -3 for fatal index error
+ *  returns -3 for fatal index or aggregate view error
  *  returns -4 for backlink-related error
  *  returns -5 for invalid external data
  *  returns -6 for journal error
+ *  returns -7 if the value would duplicate the key of a unique index
  */
 wg_int wg_set_field(void* db, void* record, wg_int fieldnr, wg_int data) {
   gint* fieldadr;
@@ -615,6 +628,7 @@ wg_int wg_set_field(void* db, void* record, wg_int fieldnr, wg_int data) {
   gint backlink_list;           /** start of backlinks for this record */
   gint rec_enc = WG_ILLEGAL;    /** this record as encoded value. */
 #endif
+  gint feedmask = 0;            /** subscriptions matching the old contents */
   db_memsegment_header *dbh = dbmemsegh(db);
 #ifdef USE_CHILD_DB
   void *offset_owner = dbmemseg(db);
@@ -624,6 +638,13 @@ wg_int wg_set_field(void* db, void* record, wg_int fieldnr, wg_int data) {
   recordcheck(db,record,fieldnr,"wg_set_field");
 #endif
 
+  /* Refuse a value that would duplicate the key of a unique index */
+  if(!is_special_record(record) && fieldnr<=MAX_INDEXED_FIELDNR &&\
+    dbh->index_control_area_header.index_table[fieldnr]) {
+    if(wg_index_check_unique(db, record, fieldnr, data))
+      return -7;
+  }
+
 #ifdef USE_DBLOG
   /* Do not proceed before we've logged the operation */
   if(dbh->logging.active) {
@@ -640,14 +661,23 @@ wg_int wg_set_field(void* db, void* record, wg_int fieldnr, wg_int data) {
 #ifdef USE_INDEX_TEMPLATE
   if(!is_special_record(record) && fieldnr<=MAX_INDEXED_FIELDNR &&\
     (dbh->index_control_area_header.index_table[fieldnr] ||\
-     dbh->index_control_area_header.index_template_table[fieldnr])) {
+     dbh->index_control_area_header.index_template_table[fieldnr] ||\
+     dbh->index_control_area_header.online_build)) {
 #else
   if(!is_special_record(record) && fieldnr<=MAX_INDEXED_FIELDNR &&\
-    dbh->index_control_area_header.index_table[fieldnr]) {
+    (dbh->index_control_area_header.index_table[fieldnr] ||\
+     dbh->index_control_area_header.online_build)) {
 #endif
     if(wg_index_del_field(db, record, fieldnr) < -1)
       return -3; /* index error */
   }
+  if(!is_special_record(record) && fieldnr<=MAX_INDEXED_FIELDNR &&\
+    dbh->aggr_control_area_header.view_table[fieldnr]) {
+    if(wg_aggr_del_field(db, record, fieldnr) < -1)
+      return -3; /* aggregate view error */
+  }
+  if(dbh->feed_area_header.active)
+    feedmask = wg_feed_match(db, record);
 
   /* If there are backlinks, go up the chain and remove the reference
    * to this record from all indexes (updating a field in the record
@@ -739,14 +769,21 @@ setfld_backlink_removed:
 #ifdef USE_INDEX_TEMPLATE
   if(!is_special_record(record) && fieldnr<=MAX_INDEXED_FIELDNR &&\
     (dbh->index_control_area_header.index_table[fieldnr] ||\
-     dbh->index_control_area_header.index_template_table[fieldnr])) {
+     dbh->index_control_area_header.index_template_table[fieldnr] ||\
+     dbh->index_control_area_header.online_build)) {
 #else
   if(!is_special_record(record) && fieldnr<=MAX_INDEXED_FIELDNR &&\
-    dbh->index_control_area_header.index_table[fieldnr]) {
+    (dbh->index_control_area_header.index_table[fieldnr] ||\
+     dbh->index_control_area_header.online_build)) {
 #endif
     if(wg_index_add_field(db, record, fieldnr) < -1)
       return -3;
   }
+  if(!is_special_record(record) && fieldnr<=MAX_INDEXED_FIELDNR &&\
+    dbh->aggr_control_area_header.view_table[fieldnr]) {
+    if(wg_aggr_add_field(db, record, fieldnr) < -1)
+      return -3;
+  }
 
 #ifdef USE_BACKLINKING
   /* Is the new field value a record pointer? If so, add a backlink */
@@ -789,6 +826,8 @@ setfld_backlink_removed:
   }
 #endif
 
+  if(dbh->feed_area_header.active)
+    wg_feed_add(db, record, fieldnr, WG_CHANGE_SET, feedmask);
   return 0;
 }
 
@@ -803,6 +842,9 @@ setfld_backlink_removed:
  *  to ensure that this function is not called on fields that already
  *  contain data.
  *
+ *  Aggregate views are not updated, as they count whole rows. Call
+ *  wg_aggr_add_rec() once all the fields of a data record are set.
+ *
  *  returns 0 if successful
  *  returns -1 if invalid db pointer passed
  *  returns -2 if invalid record or field passed
@@ -810,6 +852,7 @@ setfld_backlink_removed:
  *  returns -4 for backlink-related error
  *  returns -5 for invalid external data
  *  returns -6 for journal error
+ *  returns -7 if the value would duplicate the key of a unique index
  */
 wg_int wg_set_new_field(void* db, void* record, wg_int fieldnr, wg_int data) {
   gint* fieldadr;
@@ -826,6 +869,13 @@ wg_int wg_set_new_field(void* db, void* record, wg_int fieldnr, wg_int data) {
   recordcheck(db,record,fieldnr,"wg_set_field");
 #endif
 
+  /* Refuse a value that would duplicate the key of a unique index */
+  if(!is_special_record(record) && fieldnr<=MAX_INDEXED_FIELDNR &&\
+    dbh->index_control_area_header.index_table[fieldnr]) {
+    if(wg_index_check_unique(db, record, fieldnr, data))
+      return -7;
+  }
+
 #ifdef USE_DBLOG
   /* Do not proceed before we've logged the operation */
   if(dbh->logging.active) {
@@ -869,10 +919,12 @@ wg_int wg_set_new_field(void* db, void* record, wg_int fieldnr, wg_int data) {
 #ifdef USE_INDEX_TEMPLATE
   if(!is_special_record(record) && fieldnr<=MAX_INDEXED_FIELDNR &&\
     (dbh->index_control_area_header.index_table[fieldnr] ||\
-     dbh->index_control_area_header.index_template_table[fieldnr])) {
+     dbh->index_control_area_header.index_template_table[fieldnr] ||\
+     dbh->index_control_area_header.online_build)) {
 #else
   if(!is_special_record(record) && fieldnr<=MAX_INDEXED_FIELDNR &&\
-    dbh->index_control_area_header.index_table[fieldnr]) {
+    (dbh->index_control_area_header.index_table[fieldnr] ||\
+     dbh->index_control_area_header.online_build)) {
 #endif
     if(wg_index_add_field(db, record, fieldnr) < -1)
       return -3;
@@ -990,7 +1042,8 @@ wg_int wg_set_rec_field(void* db, void* record, wg_int fieldnr, void* data) {
  *  returns -10 if new value non-immediate
  *  returns -11 if old value non-immediate
  *  returns -12 if cannot fetch old data
- *  returns -13 if the field has an index
+ *  returns -13 if the field has an index or an aggregate view,
+ *  or if there are change feed subscriptions
  *  returns -14 if logging is active
  *  returns -15 if the field value has been changed from old_data
  *  may return other field-setting error codes from wg_set_new_field
@@ -1013,13 +1066,24 @@ wg_int wg_update_atomic_field(void* db, void* record, wg_int fieldnr, wg_int dat
 #ifdef USE_INDEX_TEMPLATE
   if(!is_special_record(record) && fieldnr<=MAX_INDEXED_FIELDNR &&\
     (dbh->index_control_area_header.index_table[fieldnr] ||\
-     dbh->index_control_area_header.index_template_table[fieldnr])) {
+     dbh->index_control_area_header.index_template_table[fieldnr] ||\
+     dbh->index_control_area_header.online_build)) {
 #else
   if(!is_special_record(record) && fieldnr<=MAX_INDEXED_FIELDNR &&\
-    dbh->index_control_area_header.index_table[fieldnr]) {
+    (dbh->index_control_area_header.index_table[fieldnr] ||\
+     dbh->index_control_area_header.online_build)) {
 #endif
     return -13;
   }
+  // aggregate views need the old value as well
+  if(!is_special_record(record) && fieldnr<=MAX_INDEXED_FIELDNR &&\
+    dbh->aggr_control_area_header.view_table[fieldnr]) {
+    return -13;
+  }
+  // change events are only added under the write lock
+  if(dbh->feed_area_header.active) {
+    return -13;
+  }
   // check that no logging is used
 #ifdef USE_DBLOG
   if(dbh->logging.active) {
@@ -2577,7 +2641,6 @@ gint wg_encode_uniblob(void* db, char* str, char* lang, gint type, gint len) {
 
 
 static gint find_create_longstr(void* db, char* data, char* extrastr, gint type, gint length) {
-  db_memsegment_header* dbh = dbmemsegh(db);
   gint offset;
   size_t i;
   gint tmp;
@@ -2585,8 +2648,7 @@ static gint find_create_longstr(void* db, char* data, char* extrastr, gint type,
   gint lenrest;
   char* lstrptr;
   gint old=0;
-  int hash;
-  gint hasharrel;
+  wg_uint hash;
   gint res;
 
   if (0) {
@@ -2594,18 +2656,13 @@ static gint find_create_longstr(void* db, char* data, char* extrastr, gint type,
 
     // find hash, check if exists and use if found
     hash=wg_hash_typedstr(db,data,extrastr,type,length);
-    //hasharrel=((gint*)(offsettoptr(db,((db->strhash_area_header).arraystart))))[hash];
-    hasharrel=dbfetch(db,((dbh->strhash_area_header).arraystart)+(sizeof(gint)*hash));
-    //printf("hash %d((dbh->strhash_area_header).arraystart)+(sizeof(gint)*hash) %d hasharrel %d\n",
-    //        hash,((dbh->strhash_area_header).arraystart)+(sizeof(gint)*hash), hasharrel);
-    if (hasharrel) old=wg_find_strhash_bucket(db,data,extrastr,type,length,hasharrel);
+    old=wg_find_strhash_bucket(db,data,extrastr,type,length,hash);
     //printf("old %d \n",old);
     if (old) {
       //printf("str found in hash\n");
       return old;
     }
     //printf("str not found in hash\n");
-    //printf("hasharrel 1 %d \n",hasharrel);
     // equal string not found in hash
     // allocate a new string
     lengints=length/sizeof(gint);  // 7/4=1, 8/4=2, 9/4=2,
@@ -2656,9 +2713,7 @@ static gint find_create_longstr(void* db, char* data, char* extrastr, gint type,
     // encode
     res=encode_longstr_offset(offset);
     // store to hash and update hashchain
-    dbstore(db,((dbh->strhash_area_header).arraystart)+(sizeof(gint)*hash),res);
-    //printf("hasharrel 2 %d \n",hasharrel);
-    dbstore(db,offset+LONGSTR_HASHCHAIN_POS*sizeof(gint),hasharrel); // store old hash array el
+    wg_add_to_strhash(db,res,hash);
     // return result
     return res;
   }
@@ -600,6 +600,7 @@ gint usage from start:
 1:  metainfo, incl object type (longstr/xmlliteral/uri/blob/datarec etc):
     - last byte object type
     - byte before last: nr to delete from obj length to get real actual-bytes length
+    - two bytes before that: strhash hash tag
 2:  refcount
 3:  backlinks
 4:  pointer to next longstr in the hash bucket, 0 if no following
@@ -617,12 +618,14 @@ gint usage from start:
    last byte (low 0) object type (WG_STRTYPE,WG_XMLLITERALTYPE, etc)
    byte before last (low 1):
          lendif: nr to delete from obj length to get real actual-bytes length of str
-   low 2: unused
-   low 3: unused
+   low 2 and low 3:
+         hash tag: high bits of the strhash hash, 0 if not in strhash
   */
 #define LONGSTR_META_LENDIFMASK 0xFF00 /** second lowest bytes contains lendif*/
 #define LONGSTR_META_LENDIFSHFT 8 /** shift 8 bits right to get lendif */
 #define LONGSTR_META_TYPEMASK  0xFF /*** lowest byte contains actual subtype: str,uri,xmllliteral */
+#define LONGSTR_META_HASHTAGMASK 0xFFFF /** hash tag after shifting */
+#define LONGSTR_META_HASHTAGSHFT 16 /** shift 16 bits right to get the hash tag */
 #define LONGSTR_REFCOUNT_POS 2 /**  reference count, if 0, delete*/
 #define LONGSTR_BACKLINKS_POS 3 /**   backlinks structure offset */
 #define LONGSTR_HASHCHAIN_POS 4 /**  offset of next longstr in the hash bucket, 0 if no following */
@@ -41,6 +41,8 @@
 #define FEATURE_BITS_BACKLINK 0x8
 #define FEATURE_BITS_CHILD_DB 0x10
 #define FEATURE_BITS_INDEX_TMPL 0x20
+#define FEATURE_BITS_TTREE_PREFIX 0x40
+#define FEATURE_BITS_INDEX_ADVISOR 0x80
 
 /* Construct the bit vector */
 #ifdef HAVE_64BIT_GINT
@@ -79,11 +81,25 @@
   #define FEATURE_BITS_06 0x0
 #endif
 
+#ifdef TTREE_KEY_PREFIX
+  #define FEATURE_BITS_07 FEATURE_BITS_TTREE_PREFIX
+#else
+  #define FEATURE_BITS_07 0x0
+#endif
+
+#ifdef USE_INDEX_ADVISOR
+  #define FEATURE_BITS_08 FEATURE_BITS_INDEX_ADVISOR
+#else
+  #define FEATURE_BITS_08 0x0
+#endif
+
 #define MEMSEGMENT_FEATURES (FEATURE_BITS_01 |\
   FEATURE_BITS_02 |\
   FEATURE_BITS_03 |\
   FEATURE_BITS_04 |\
   FEATURE_BITS_05 |\
-  FEATURE_BITS_06)
+  FEATURE_BITS_06 |\
+  FEATURE_BITS_07 |\
+  FEATURE_BITS_08)
 
 #endif /* DEFINED_DBFEATURES_H */
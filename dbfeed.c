@@ -0,0 +1,448 @@
+/*
+* $Id:  $
+* $Version: $
+*
+* Copyright (c) WhiteDB contributors 2026
+*
+* This file is part of WhiteDB
+*
+* WhiteDB is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* WhiteDB is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with WhiteDB.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+ /** @file dbfeed.c
+ * Change feed.
+ *
+ * Record creation, field updates and record deletion append an
+ * event to a ring in shared memory when some subscription is
+ * interested in the record. A subscription is a stored query
+ * argument list; the filter is checked when the event is added,
+ * against the record contents both before and after the change,
+ * so a subscriber also sees the update that moves a record out of
+ * its filter.
+ *
+ * Writers append under the database write lock, as with any other
+ * update. Readers do not take locks: each event carries its
+ * sequence number, which is cleared while the slot is rewritten,
+ * so a reader that falls more than a ring behind notices it and
+ * counts the events as lost. Blocked readers wait on the sequence
+ * counter of the ring (a futex on Linux).
+ *
+ * A subscription records the process that made it. A process that
+ * exits without cancelling its subscriptions leaves them in shared
+ * memory; their slots are reclaimed by the next wg_subscribe_changes().
+ */
+
+/* ====== Includes =============== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+/* ====== Private headers and defs ======== */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef _WIN32
+#include "config-w32.h"
+#else
+#include "config-gcc.h"
+#endif
+
+#include "dballoc.h"
+#include "dbdata.h"
+#include "dblock.h"
+#include "dbaggr.h"
+#include "dbfeed.h"
+
+/* ====== Private protos ======== */
+
+static gint feed_clock_ms(void);
+static void add_waiter(volatile gint *waiters, gint incr);
+static gint feed_pid(void);
+static int feed_owner_alive(gint pid);
+static void release_slot(void *db, gint slot);
+
+static gint show_feed_error(void* db, char* errmsg);
+
+/* ====== Functions ============== */
+
+/* ------------------- helpers ------------------------------ */
+
+/** Monotonic clock in milliseconds, for wait timeouts
+ */
+static gint feed_clock_ms(void) {
+#ifdef _WIN32
+  return (gint) GetTickCount();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((gint) ts.tv_sec) * 1000 + (gint) (ts.tv_nsec / 1000000);
+#endif
+}
+
+/** Atomically change the count of blocked readers
+ */
+static void add_waiter(volatile gint *waiters, gint incr) {
+  gint old;
+  do {
+    old = *waiters;
+  } while(!wg_compare_and_swap(waiters, old, old + incr));
+}
+
+/** Id of the current process
+ */
+static gint feed_pid(void) {
+#ifdef _WIN32
+  return (gint) GetCurrentProcessId();
+#else
+  return (gint) getpid();
+#endif
+}
+
+/** Check if the process that owns a subscription still runs
+ *  A process we may not signal is running as well.
+ */
+static int feed_owner_alive(gint pid) {
+#ifdef _WIN32
+  HANDLE proc = OpenProcess(SYNCHRONIZE, FALSE, (DWORD) pid);
+  DWORD res;
+  if(!proc)
+    return GetLastError() == ERROR_ACCESS_DENIED;
+  res = WaitForSingleObject(proc, 0);
+  CloseHandle(proc);
+  return res == WAIT_TIMEOUT;
+#else
+  return kill((pid_t) pid, 0) == 0 || errno == EPERM;
+#endif
+}
+
+/** Free the filter of a subscription slot
+ *  The event ring is released with the last subscription.
+ */
+static void release_slot(void *db, gint slot) {
+  db_memsegment_header* dbh = dbmemsegh(db);
+  db_feed_area_header *fh = &dbh->feed_area_header;
+  db_feed_subscription *fsub;
+
+  fh->active &= ~((gint) 1 << slot);
+  fsub = (db_feed_subscription *) offsettoptr(db, fh->subscription[slot]);
+  wg_free_stored_filter(db, &fsub->filter);
+  wg_free_object(db, &dbh->indexhash_area_header, fh->subscription[slot]);
+  fh->subscription[slot] = 0;
+
+  if(!fh->active && fh->ring) {
+    wg_free_object(db, &dbh->indexhash_area_header, fh->ring);
+    fh->ring = 0;
+    fh->size = 0;
+  }
+}
+
+/* ------------------- event producer ----------------------- */
+
+/** Find the subscriptions that a record matches
+ *  returns the bitmask of the matching subscription slots
+ */
+gint wg_feed_match(void *db, void *rec) {
+  db_feed_area_header *fh = &dbmemsegh(db)->feed_area_header;
+  gint i, mask = 0;
+
+  if(is_special_record(rec))
+    return 0;
+  for(i=0; i<MAX_FEED_SUBSCRIPTIONS; i++) {
+    if(fh->active & ((gint) 1 << i)) {
+      db_feed_subscription *sub = (db_feed_subscription *) \
+        offsettoptr(db, fh->subscription[i]);
+      if(wg_match_stored_filter(db, &sub->filter, rec))
+        mask |= (gint) 1 << i;
+    }
+  }
+  return mask;
+}
+
+/** Append a change event
+ *  mask contains the subscriptions that matched the record before
+ *  the change. Except for deletions, the record is matched again
+ *  in its current state. Nothing is added if no subscription
+ *  matches. Called with the write lock held.
+ *  returns 0
+ */
+gint wg_feed_add(void *db, void *rec, gint column, gint op, gint mask) {
+  db_feed_area_header *fh = &dbmemsegh(db)->feed_area_header;
+  db_feed_event *ev;
+  gint seq;
+
+  if(!fh->ring)
+    return 0;
+  if(op != WG_CHANGE_DELETE)
+    mask |= wg_feed_match(db, rec);
+  if(!mask)
+    return 0;
+
+  seq = fh->seq + 1;
+  ev = FEED_EVENTS(db, fh) + (seq % fh->size);
+
+  /* Invalidate the slot for readers before rewriting it. The
+   * compare-and-swap calls also act as memory barriers. */
+  wg_compare_and_swap(&ev->seq, ev->seq, 0);
+  ev->offset = ptrtooffset(db, rec);
+  ev->column = column;
+  ev->op = op;
+  ev->mask = mask;
+  wg_compare_and_swap(&ev->seq, 0, seq);
+  wg_compare_and_swap(&fh->seq, seq - 1, seq);
+
+  if(fh->waiters)
+    wg_wake_value(&fh->seq);
+  return 0;
+}
+
+/* ------------------- subscriptions ------------------------ */
+
+/** Subscribe to changes of the records passing a filter
+ *  arglist (may be NULL) is copied, the caller may free its
+ *  encoded values afterwards. Only the changes made after this
+ *  call are seen. Slots of processes that exited without
+ *  unsubscribing are freed first. Should be called with the
+ *  write lock held.
+ *  returns a subscription handle, NULL on error
+ */
+void *wg_subscribe_changes(void *db, wg_query_arg *arglist, gint argc) {
+  db_memsegment_header* dbh = dbmemsegh(db);
+  db_feed_area_header *fh = &dbh->feed_area_header;
+  db_feed_subscription *fsub;
+  wg_subscription *sub;
+  gint slot, offset, size;
+
+#ifdef CHECK
+  if (!dbcheck(db)) {
+    show_feed_error(db, "wrong database pointer given to wg_subscribe_changes");
+    return NULL;
+  }
+#endif
+
+  for(slot=0; slot<MAX_FEED_SUBSCRIPTIONS; slot++) {
+    if(fh->active & ((gint) 1 << slot)) {
+      fsub = (db_feed_subscription *) \
+        offsettoptr(db, fh->subscription[slot]);
+      if(!feed_owner_alive(fsub->pid))
+        release_slot(db, slot);
+    }
+  }
+  for(slot=0; slot<MAX_FEED_SUBSCRIPTIONS; slot++) {
+    if(!(fh->active & ((gint) 1 << slot)))
+      break;
+  }
+  if(slot == MAX_FEED_SUBSCRIPTIONS) {
+    show_feed_error(db, "Too many subscriptions");
+    return NULL;
+  }
+
+  sub = (wg_subscription *) malloc(sizeof(wg_subscription));
+  if(!sub) {
+    show_feed_error(db, "Failed to allocate memory");
+    return NULL;
+  }
+
+  size = (sizeof(db_feed_subscription) + sizeof(gint) - 1) / sizeof(gint);
+  offset = wg_alloc_gints(db, &dbh->indexhash_area_header, size);
+  if(!offset) {
+    free(sub);
+    show_feed_error(db, "Failed to allocate the subscription");
+    return NULL;
+  }
+  fsub = (db_feed_subscription *) offsettoptr(db, offset);
+  fsub->pid = feed_pid();
+  if(wg_store_filter(db, &fsub->filter, arglist, argc)) {
+    wg_free_object(db, &dbh->indexhash_area_header, offset);
+    free(sub);
+    return NULL;
+  }
+
+  if(!fh->ring) {
+    gint ring = wg_alloc_gints(db, &dbh->indexhash_area_header,
+      FEED_RING_SIZE * FEED_EVENT_GINTS + 1);
+    if(!ring) {
+      wg_free_stored_filter(db, &fsub->filter);
+      wg_free_object(db, &dbh->indexhash_area_header, offset);
+      free(sub);
+      show_feed_error(db, "Failed to allocate the event ring");
+      return NULL;
+    }
+    memset((gint *) offsettoptr(db, ring) + 1, 0,
+      FEED_RING_SIZE * FEED_EVENT_GINTS * sizeof(gint));
+    fh->size = FEED_RING_SIZE;
+    fh->ring = ring;
+  }
+
+  fh->subscription[slot] = offset;
+  fh->active |= (gint) 1 << slot;
+
+  sub->slot = slot;
+  sub->next_seq = fh->seq + 1;
+  sub->lost = 0;
+  return sub;
+}
+
+/** Cancel a subscription
+ *  The handle is freed. The event ring is released with the
+ *  last subscription. Should be called with the write lock held.
+ *  returns 0 on success
+ *  returns -1 on error
+ */
+gint wg_unsubscribe_changes(void *db, void *sub) {
+  db_feed_area_header *fh = &dbmemsegh(db)->feed_area_header;
+  gint slot;
+
+#ifdef CHECK
+  if (!dbcheck(db)) {
+    show_feed_error(db, "wrong database pointer given to wg_unsubscribe_changes");
+    return -1;
+  }
+#endif
+
+  slot = ((wg_subscription *) sub)->slot;
+  if(slot < 0 || slot >= MAX_FEED_SUBSCRIPTIONS ||\
+    !(fh->active & ((gint) 1 << slot))) {
+    show_feed_error(db, "Invalid subscription");
+    return -1;
+  }
+
+  release_slot(db, slot);
+  free(sub);
+  return 0;
+}
+
+/* ------------------- event consumer ----------------------- */
+
+/** Read the events of a subscription
+ *  Copies at most max pending events into the events array. If
+ *  there are none, blocks until some arrive or timeout milliseconds
+ *  have passed (negative timeout waits indefinitely, 0 does not
+ *  wait). Does not take locks; the records of the events may have
+ *  been changed again or deleted by the time they are read.
+ *  returns the number of events copied, 0 on timeout
+ *  returns -1 on error
+ */
+gint wg_wait_changes(void *db, void *sub, wg_change *events, gint max,
+  gint timeout) {
+  db_feed_area_header *fh = &dbmemsegh(db)->feed_area_header;
+  wg_subscription *s = (wg_subscription *) sub;
+  gint bit, count = 0, start = 0;
+
+#ifdef CHECK
+  if (!dbcheck(db)) {
+    show_feed_error(db, "wrong database pointer given to wg_wait_changes");
+    return -1;
+  }
+#endif
+
+  if(s->slot < 0 || s->slot >= MAX_FEED_SUBSCRIPTIONS ||\
+    !(fh->active & ((gint) 1 << s->slot)) || !fh->ring) {
+    show_feed_error(db, "Invalid subscription");
+    return -1;
+  }
+  bit = (gint) 1 << s->slot;
+  if(timeout > 0)
+    start = feed_clock_ms();
+
+  for(;;) {
+    gint last = fh->seq;
+
+    while(s->next_seq <= last && count < max) {
+      gint seq = s->next_seq++;
+      db_feed_event *ev, copy;
+
+      if(last - seq >= fh->size) {
+        /* skip to the oldest event still in the ring */
+        s->lost += last - fh->size + 1 - seq;
+        s->next_seq = last - fh->size + 1;
+        continue;
+      }
+      ev = FEED_EVENTS(db, fh) + (seq % fh->size);
+      if(!wg_compare_and_swap(&ev->seq, seq, seq)) {
+        s->lost++;
+        continue;
+      }
+      copy.offset = ev->offset;
+      copy.column = ev->column;
+      copy.op = ev->op;
+      copy.mask = ev->mask;
+      if(!wg_compare_and_swap(&ev->seq, seq, seq)) {
+        s->lost++; /* overwritten while reading */
+        continue;
+      }
+      if(copy.mask & bit) {
+        events[count].seq = seq;
+        events[count].op = copy.op;
+        events[count].column = copy.column;
+        events[count].record = offsettoptr(db, copy.offset);
+        count++;
+      }
+    }
+
+    if(count || !timeout || (s->next_seq <= last))
+      return count;
+
+    /* Nothing for us yet, sleep until the sequence moves */
+    add_waiter(&fh->waiters, 1);
+    if(fh->seq == last) {
+      gint left = -1;
+      if(timeout > 0) {
+        left = timeout - (feed_clock_ms() - start);
+        if(left <= 0)
+          left = 0;
+      }
+      if(left)
+        wg_wait_value(&fh->seq, last, left);
+    }
+    add_waiter(&fh->waiters, -1);
+
+    if(timeout > 0 && feed_clock_ms() - start >= timeout && fh->seq == last)
+      return 0;
+  }
+}
+
+/** Get the number of events lost by a subscription
+ *  Events are lost when the subscriber falls more than the
+ *  size of the ring behind the writers. Events that did not
+ *  match the subscription are counted as well.
+ */
+gint wg_lost_changes(void *db, void *sub) {
+  return ((wg_subscription *) sub)->lost;
+}
+
+/* ------------------- error handling ---------------------- */
+
+static gint show_feed_error(void* db, char* errmsg) {
+#ifdef WG_NO_ERRPRINT
+#else
+  fprintf(stderr,"change feed error: %s\n",errmsg);
+#endif
+  return -1;
+}
+
+#ifdef __cplusplus
+}
+#endif
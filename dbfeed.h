@@ -0,0 +1,88 @@
+/*
+* $Id:  $
+* $Version: $
+*
+* Copyright (c) WhiteDB contributors 2026
+*
+* This file is part of WhiteDB
+*
+* WhiteDB is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* WhiteDB is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with WhiteDB.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+ /** @file dbfeed.h
+ * Public headers for the change feed.
+ */
+
+#ifndef DEFINED_DBFEED_H
+#define DEFINED_DBFEED_H
+
+#ifdef _WIN32
+#include "config-w32.h"
+#else
+#include "config-gcc.h"
+#endif
+
+/* For gint data type */
+#include "dbdata.h"
+/* For wg_query_arg */
+#include "dbquery.h"
+
+/* ==== Public macros ==== */
+
+#define WG_CHANGE_CREATE 1
+#define WG_CHANGE_SET 2
+#define WG_CHANGE_DELETE 3
+
+#define FEED_EVENT_GINTS \
+  ((sizeof(db_feed_event) + sizeof(gint) - 1) / sizeof(gint))
+
+/* The event ring follows the allocator header of its object */
+#define FEED_EVENTS(d, h) \
+  ((db_feed_event *) ((gint *) offsettoptr(d, h->ring) + 1))
+
+/* ====== data structures ======== */
+
+/** change event as returned to a subscriber */
+typedef struct {
+  gint seq;         /** sequence number of the event */
+  gint op;          /** WG_CHANGE_CREATE, WG_CHANGE_SET or WG_CHANGE_DELETE */
+  gint column;      /** changed column, -1 for the whole record */
+  void *record;     /** changed record, already gone for WG_CHANGE_DELETE */
+} wg_change;
+
+/** subscription handle, local to the subscribing process */
+typedef struct {
+  gint slot;        /** slot in the shared subscription table */
+  gint next_seq;    /** first event not read yet */
+  gint lost;        /** events overwritten before they were read */
+} wg_subscription;
+
+/* ==== Protos ==== */
+
+/* API functions (copied in dbapi.h) */
+
+void *wg_subscribe_changes(void *db, wg_query_arg *arglist, gint argc);
+gint wg_unsubscribe_changes(void *db, void *sub);
+gint wg_wait_changes(void *db, void *sub, wg_change *events, gint max,
+  gint timeout);
+gint wg_lost_changes(void *db, void *sub);
+
+/* WhiteDB internal functions */
+
+gint wg_feed_match(void *db, void *rec);
+gint wg_feed_add(void *db, void *rec, gint column, gint op, gint mask);
+
+
+#endif /* DEFINED_DBFEED_H */
@@ -100,6 +100,35 @@ typedef struct {
 #define FNV_prime ((wg_uint) 16777619UL)
 #endif
 
+/* Multiply-xorshift constants of wg_hash_bytes()
+ * The hash values and the wg_encode_for_hashing() keys are kept in
+ * the hash index chains of the memory image. Changing either of them
+ * requires raising the version in config-gcc.h and config-w32.h, so that
+ * wg_check_header_compat() refuses older segments and dump files. */
+#ifdef HAVE_64BIT_GINT
+#define BYTEHASH_SEED ((wg_uint) 0x9E3779B97F4A7C15ULL)
+#define BYTEHASH_MUL1 ((wg_uint) 0xA0761D6478BD642FULL)
+#define BYTEHASH_MUL2 ((wg_uint) 0xE7037ED1A0B428DBULL)
+#define BYTEHASH_SHIFT 32
+#else
+#define BYTEHASH_SEED ((wg_uint) 0x9E3779B9UL)
+#define BYTEHASH_MUL1 ((wg_uint) 0x85EBCA6BUL)
+#define BYTEHASH_MUL2 ((wg_uint) 0xC2B2AE35UL)
+#define BYTEHASH_SHIFT 16
+#endif
+
+/* Field length in wg_encode_for_hashing() output */
+#define HASHKEY_LEN_BYTES 4
+
+/* Hash tag of a longstr: the high bits of the hash, as the low
+ * bits select the array element. The tag is kept in the longstr
+ * metadata, so changing wg_hash_typedstr() or the tag bits also
+ * requires raising the memory image version. */
+#define STRHASH_TAG(h) ((gint) ((h) >> (sizeof(wg_uint)*8 - \
+  LONGSTR_META_HASHTAGSHFT)) & LONGSTR_META_HASHTAGMASK)
+#define LONGSTR_HASHTAG(m) ((gint) ((wg_uint) (m) >> \
+  LONGSTR_META_HASHTAGSHFT) & LONGSTR_META_HASHTAGMASK)
+
 /* ======= Private protos ================ */
 
 
@@ -111,7 +140,15 @@ static gint show_consistency_error_nr(void* db, char* errmsg, gint nr) ;
 static gint show_hash_error(void* db, char* errmsg);
 static gint show_ginthash_error(void *db, char* errmsg);
 
-static wg_uint hash_bytes(void *db, char *data, gint length, gint hashsz);
+static gint put_hash_part(char *buf, gint pos, gint bufsize,
+  char *data, gint len);
+static gint hash_chain(db_hash_area_header *ha, wg_uint hash);
+static wg_uint longstr_hash(void *db, gint longstr);
+static void strhash_rehash(void *db, db_hash_area_header *ha, gint steps);
+static void strhash_grow(void *db, db_hash_area_header *ha);
+static void idxhash_rehash(void *db, db_hash_area_header *ha, gint steps);
+static void idxhash_grow(void *db, db_hash_area_header *ha);
+static void idxhash_free_chains(void *db, gint arraystart, gint length);
 static gint find_idxhash_bucket(void *db, char *data, gint length,
   gint *chainoffset);
 
@@ -133,50 +170,78 @@ static gint remove_from_bucket(ginthash_bucket *bucket, int idx);
 
 /* Hash function for two-part strings and blobs.
 *
-* Based on sdbm.
+* Returns the full hash. The strhash array element is selected by
+* its low bits and the hash tag stored in the longstr by its high bits.
 *
 */
 
-int wg_hash_typedstr(void* db, char* data, char* extrastr, gint type, gint length) {
-  char* endp;
-  unsigned long hash = 0;
-  int c;
+wg_uint wg_hash_typedstr(void* db, char* data, char* extrastr, gint type, gint length) {
+  wg_uint hash;
 
-  //printf("in wg_hash_typedstr %s %s %d %d \n",data,extrastr,type,length);
-  if (data!=NULL) {
-    for(endp=data+length; data<endp; data++) {
-      c = (int)(*data);
-      hash = c + (hash << 6) + (hash << 16) - hash;
-    }
-  }
+  hash=wg_hash_bytes(data,(data!=NULL ? length : 0));
   if (extrastr!=NULL) {
-    while ((c = *extrastr++))
-      hash = c + (hash << 6) + (hash << 16) - hash;
+    hash^=wg_hash_bytes(extrastr,strlen(extrastr));
+    hash*=BYTEHASH_MUL2;
+    hash^=hash>>BYTEHASH_SHIFT;
   }
-
-  return (int)(hash % (dbmemsegh(db)->strhash_area_header).arraylength);
+  return hash;
 }
 
 
 
 /* Find longstr from strhash bucket chain
 *
+* Strings whose hash tag differs from that of the hash are
+* skipped without comparing the contents.
 *
 */
 
-gint wg_find_strhash_bucket(void* db, char* data, char* extrastr, gint type, gint size, gint hashchain) {
-  //printf("wg_find_strhash_bucket called %s %s type %d size %d hashchain %d\n",data,extrastr,type,size,hashchain);
+gint wg_find_strhash_bucket(void* db, char* data, char* extrastr, gint type, gint size, wg_uint hash) {
+  gint hashchain;
+  gint tag=STRHASH_TAG(hash);
+  gint offset;
+
+  hashchain=dbfetch(db,hash_chain(&(dbmemsegh(db)->strhash_area_header),hash));
   for(;hashchain!=0;
-      hashchain=dbfetch(db,decode_longstr_offset(hashchain)+LONGSTR_HASHCHAIN_POS*sizeof(gint))) {
+      hashchain=dbfetch(db,offset+LONGSTR_HASHCHAIN_POS*sizeof(gint))) {
+    offset=decode_longstr_offset(hashchain);
+    if (LONGSTR_HASHTAG(dbfetch(db,offset+LONGSTR_META_POS*sizeof(gint)))!=tag)
+      continue;
     if (wg_right_strhash_bucket(db,hashchain,data,extrastr,type,size)) {
       // found equal longstr, return it
-      //printf("wg_find_strhash_bucket found hashchain %d\n",hashchain);
       return hashchain;
     }
   }
   return 0;
 }
 
+/* Add a new longstr to strhash
+*
+*  Stores the hash tag in the longstr and grows the hash
+*  when it gets too full.
+*
+*/
+
+void wg_add_to_strhash(void* db, gint longstr, wg_uint hash) {
+  db_hash_area_header *ha = &(dbmemsegh(db)->strhash_area_header);
+  gint offset;
+  gint meta;
+  gint chainoffset;
+
+  offset=decode_longstr_offset(longstr);
+  meta=dbfetch(db,offset+LONGSTR_META_POS*sizeof(gint));
+  meta&=~((gint) LONGSTR_META_HASHTAGMASK<<LONGSTR_META_HASHTAGSHFT);
+  meta|=(gint) ((wg_uint) STRHASH_TAG(hash)<<LONGSTR_META_HASHTAGSHFT);
+  dbstore(db,offset+LONGSTR_META_POS*sizeof(gint),meta);
+
+  strhash_rehash(db,ha,STRHASH_REHASH_STEP);
+  chainoffset=hash_chain(ha,hash);
+  dbstore(db,offset+LONGSTR_HASHCHAIN_POS*sizeof(gint),dbfetch(db,chainoffset));
+  dbstore(db,chainoffset,longstr);
+  if (++(ha->entries) > ha->arraylength*STRHASH_MAX_LOAD)
+    strhash_grow(db,ha);
+}
+
 /* Check whether longstr hash bucket matches given new str
 *
 *
@@ -210,49 +275,24 @@ int wg_right_strhash_bucket
 */
 
 gint wg_remove_from_strhash(void* db, gint longstr) {
-  db_memsegment_header* dbh = dbmemsegh(db);
-  gint type;
-  gint* extrastrptr;
-  char* extrastr;
-  char* data;
-  gint length;
-  gint hash;
+  db_hash_area_header *ha = &(dbmemsegh(db)->strhash_area_header);
+  wg_uint hash;
   gint chainoffset;
   gint hashchain;
   gint nextchain;
   gint offset;
-  gint* objptr;
-  gint fldval;
-  gint objsize;
-  gint strsize;
-  gint* typeptr;
 
-  //printf("wg_remove_from_strhash called on %d\n",longstr);
-  //wg_debug_print_value(db,longstr);
-  //printf("\n\n");
   offset=decode_longstr_offset(longstr);
-  objptr=(gint*) offsettoptr(db,offset);
-  // get string data elements
-  //type=objptr=offsettoptr(db,decode_longstr_offset(data));
-  extrastrptr=(gint *) (((char*)(objptr))+(LONGSTR_EXTRASTR_POS*sizeof(gint)));
-  fldval=*extrastrptr;
-  if (fldval==0) extrastr=NULL;
-  else extrastr=wg_decode_str(db,fldval);
-  data=((char*)(objptr))+(LONGSTR_HEADER_GINTS*sizeof(gint));
-  objsize=getusedobjectsize(*objptr);
-  strsize=objsize-(((*(objptr+LONGSTR_META_POS))&LONGSTR_META_LENDIFMASK)>>LONGSTR_META_LENDIFSHFT);
-  length=strsize;
-  typeptr=(gint*)(((char*)(objptr))+(+LONGSTR_META_POS*sizeof(gint)));
-  type=(*typeptr)&LONGSTR_META_TYPEMASK;
-  //type=wg_get_encoded_type(db,longstr);
+  strhash_rehash(db,ha,STRHASH_REHASH_STEP);
   // get hash of data elements and find the location in hashtable/chains
-  hash=wg_hash_typedstr(db,data,extrastr,type,length);
-  chainoffset=((dbh->strhash_area_header).arraystart)+(sizeof(gint)*hash);
+  hash=longstr_hash(db,longstr);
+  chainoffset=hash_chain(ha,hash);
   hashchain=dbfetch(db,chainoffset);
   while(hashchain!=0) {
     if (hashchain==longstr) {
       nextchain=dbfetch(db,decode_longstr_offset(hashchain)+(LONGSTR_HASHCHAIN_POS*sizeof(gint)));
       dbstore(db,chainoffset,nextchain);
+      ha->entries--;
       return 0;
     }
     chainoffset=decode_longstr_offset(hashchain)+(LONGSTR_HASHCHAIN_POS*sizeof(gint));
@@ -262,6 +302,90 @@ gint wg_remove_from_strhash(void* db, gint longstr) {
   return -1;
 }
 
+/* Compute the strhash hash of a stored longstr
+*
+*/
+
+static wg_uint longstr_hash(void *db, gint longstr) {
+  gint* objptr;
+  char* extrastr;
+  char* data;
+  gint fldval;
+  gint length;
+  gint type;
+
+  objptr=(gint*) offsettoptr(db,decode_longstr_offset(longstr));
+  fldval=*(objptr+LONGSTR_EXTRASTR_POS);
+  if (fldval==0) extrastr=NULL;
+  else extrastr=wg_decode_str(db,fldval);
+  data=((char*)(objptr))+(LONGSTR_HEADER_GINTS*sizeof(gint));
+  length=getusedobjectsize(*objptr)-
+    (((*(objptr+LONGSTR_META_POS))&LONGSTR_META_LENDIFMASK)>>LONGSTR_META_LENDIFSHFT);
+  type=(*(objptr+LONGSTR_META_POS))&LONGSTR_META_TYPEMASK;
+  return wg_hash_typedstr(db,data,extrastr,type,length);
+}
+
+/* Move the chains of up to steps old strhash array elements
+*  to the current array. The old array is freed after the last one.
+*
+*/
+
+static void strhash_rehash(void *db, db_hash_area_header *ha, gint steps) {
+  while(ha->oldstart && steps-- > 0) {
+    gint head_offset=ha->oldstart+sizeof(gint)*ha->rehashpos;
+    gint longstr=dbfetch(db,head_offset);
+
+    while(longstr) {
+      gint chainpos=decode_longstr_offset(longstr)+LONGSTR_HASHCHAIN_POS*sizeof(gint);
+      gint next=dbfetch(db,chainpos);
+      wg_uint hash=longstr_hash(db,longstr);
+      gint new_head=ha->arraystart+sizeof(gint)*(hash%ha->arraylength);
+
+      dbstore(db,chainpos,dbfetch(db,new_head));
+      dbstore(db,new_head,longstr);
+      longstr=next;
+    }
+    dbstore(db,head_offset,0);
+
+    if (++(ha->rehashpos)==ha->oldlength) {
+      wg_free_object(db,&(dbmemsegh(db)->longstr_area_header),
+        ha->oldstart-sizeof(gint));
+      ha->oldstart=0;
+      ha->oldlength=0;
+      ha->rehashpos=0;
+    }
+  }
+}
+
+/* Start growing the strhash to twice the array size
+*
+*  Like the index hash, the chains are moved over a few at a time
+*  by the following updates. If the new array cannot be allocated,
+*  the strhash keeps working at its current size.
+*
+*/
+
+static void strhash_grow(void *db, db_hash_area_header *ha) {
+  gint length=ha->arraylength*2;
+  gint arr;
+
+  if (ha->oldstart)
+    strhash_rehash(db,ha,ha->oldlength); /* finish the previous one */
+  arr=wg_alloc_gints(db,&(dbmemsegh(db)->longstr_area_header),length+1);
+  if (!arr)
+    return;
+  memset(offsettoptr(db,arr+sizeof(gint)),0,length*sizeof(gint));
+
+  ha->oldstart=ha->arraystart;
+  ha->oldlength=ha->arraylength;
+  ha->rehashpos=0;
+  ha->offset=arr;
+  ha->size=(length+1)*sizeof(gint);
+  ha->arraysize=length*sizeof(gint);
+  ha->arraystart=arr+sizeof(gint);
+  ha->arraylength=length;
+}
+
 
 /* -------------- hash index support ------------------ */
 
@@ -384,18 +508,267 @@ gint wg_decode_for_hashing(void *db, gint enc, char **decbytes) {
 }
 
 /*
- * Calculate a hash for a byte buffer. Truncates the hash to given size.
+ * Append one length-prefixed part of a hash key, if it fits.
+ * Returns the position after the part.
+ */
+static gint put_hash_part(char *buf, gint pos, gint bufsize,
+  char *data, gint len) {
+  if(pos + HASHKEY_LEN_BYTES + len <= bufsize) {
+    gint32 len32 = (gint32) len;
+    memcpy(buf + pos, &len32, HASHKEY_LEN_BYTES);
+    if(len)
+      memcpy(buf + pos + HASHKEY_LEN_BYTES, data, len);
+  }
+  return pos + HASHKEY_LEN_BYTES + len;
+}
+
+/*
+ * Write an encoded value into a caller supplied buffer in hashable form:
+ * the type byte, followed by the length and the bytes of the value.
+ * URIs and XML literals have a second part holding the prefix or
+ * the type. Since the parts are length-prefixed, keys built of several
+ * values can be concatenated without ambiguity. Unlike
+ * wg_decode_for_hashing(), nothing is allocated.
+ *
+ * returns the number of bytes needed. The buffer is only filled
+ *   if this is not more than bufsize.
+ * returns 0 if the value cannot be hashed.
+ */
+gint wg_encode_for_hashing(void *db, gint enc, char *buf, gint bufsize) {
+  gint type, len = 0, pos = 1;
+  gint gintdata;
+  double doubledata;
+  char *bytedata = NULL, *exdata = NULL;
+
+  type = wg_get_encoded_type(db, enc);
+  switch(type) {
+    case WG_NULLTYPE:
+      gintdata = 0;
+      bytedata = (char *) &gintdata;
+      len = sizeof(gint);
+      break;
+    case WG_RECORDTYPE:
+      gintdata = enc;
+      bytedata = (char *) &gintdata;
+      len = sizeof(gint);
+      break;
+    case WG_INTTYPE:
+      gintdata = wg_decode_int(db, enc);
+      bytedata = (char *) &gintdata;
+      len = sizeof(gint);
+      break;
+    case WG_DOUBLETYPE:
+      doubledata = wg_decode_double(db, enc);
+      bytedata = (char *) &doubledata;
+      len = sizeof(double);
+      break;
+    case WG_FIXPOINTTYPE:
+      doubledata = wg_decode_fixpoint(db, enc);
+      bytedata = (char *) &doubledata;
+      len = sizeof(double);
+      break;
+    case WG_STRTYPE:
+      len = wg_decode_str_len(db, enc);
+      bytedata = wg_decode_str(db, enc);
+      break;
+    case WG_URITYPE:
+      len = wg_decode_uri_len(db, enc);
+      bytedata = wg_decode_uri(db, enc);
+      exdata = wg_decode_uri_prefix(db, enc);
+      break;
+    case WG_XMLLITERALTYPE:
+      len = wg_decode_xmlliteral_len(db, enc);
+      bytedata = wg_decode_xmlliteral(db, enc);
+      exdata = wg_decode_xmlliteral_xsdtype(db, enc);
+      break;
+    case WG_CHARTYPE:
+      gintdata = wg_decode_char(db, enc);
+      bytedata = (char *) &gintdata;
+      len = sizeof(gint);
+      break;
+    case WG_DATETYPE:
+      gintdata = wg_decode_date(db, enc);
+      bytedata = (char *) &gintdata;
+      len = sizeof(gint);
+      break;
+    case WG_TIMETYPE:
+      gintdata = wg_decode_time(db, enc);
+      bytedata = (char *) &gintdata;
+      len = sizeof(gint);
+      break;
+    case WG_VARTYPE:
+      gintdata = wg_decode_var(db, enc);
+      bytedata = (char *) &gintdata;
+      len = sizeof(gint);
+      break;
+    case WG_ANONCONSTTYPE:
+      /* Ignore anonconst */
+    default:
+      return 0;
+  }
+
+  if(bufsize > 0)
+    buf[0] = (char) type;
+  pos = put_hash_part(buf, pos, bufsize, bytedata, len);
+  if(type == WG_URITYPE || type == WG_XMLLITERALTYPE)
+    pos = put_hash_part(buf, pos, bufsize, exdata,
+      (exdata ? (gint) strlen(exdata) : 0));
+  return pos;
+}
+
+/*
+ * Hash a single encoded value. Equal values get equal hashes
+ * regardless of how they are stored.
+ *
+ * returns 0 on success
+ * returns -1 if the value cannot be hashed.
  */
-static wg_uint hash_bytes(void *db, char *data, gint length, gint hashsz) {
-  char* endp;
-  wg_uint hash = 0;
+gint wg_hash_encoded(void *db, gint enc, wg_uint *hash) {
+  char buf[64], *bytes = buf;
+  gint len;
+
+  len = wg_encode_for_hashing(db, enc, buf, sizeof(buf));
+  if(len < 1)
+    return -1;
+  if(len > (gint) sizeof(buf)) {
+    bytes = malloc(len);
+    if(!bytes)
+      return -1;
+    wg_encode_for_hashing(db, enc, bytes, len);
+  }
+  *hash = wg_hash_bytes(bytes, len);
+  if(bytes != buf)
+    free(bytes);
+  return 0;
+}
+
+/*
+ * Calculate a hash for a byte buffer. The buffer is consumed a word
+ * at a time with a multiply-xorshift mix. The caller truncates the
+ * hash to the array size, so that it can be reused when the array grows.
+ */
+wg_uint wg_hash_bytes(char *data, gint length) {
+  wg_uint hash = BYTEHASH_SEED ^ ((wg_uint) length * BYTEHASH_MUL1);
+  wg_uint word;
+
+  while(length > 0) {
+    if(length >= (gint) sizeof(wg_uint)) {
+      memcpy(&word, data, sizeof(wg_uint));
+      data += sizeof(wg_uint);
+      length -= sizeof(wg_uint);
+    } else {
+      word = 0;
+      memcpy(&word, data, length);
+      length = 0;
+    }
+    word *= BYTEHASH_MUL1;
+    word ^= word >> BYTEHASH_SHIFT;
+    hash = (hash ^ word) * BYTEHASH_MUL2;
+    hash ^= hash >> BYTEHASH_SHIFT;
+  }
+  hash *= BYTEHASH_MUL1;
+  hash ^= hash >> BYTEHASH_SHIFT;
+  return hash;
+}
 
-  if (data!=NULL) {
-    for(endp=data+length; data<endp; data++) {
-      hash = *data + (hash << 6) + (hash << 16) - hash;
+/*
+ * Find the array element holding the hash chain of a value.
+ * While the hash is growing, values whose old array element has
+ * not been rehashed yet are still chained from the old array.
+ * Returns the offset of the chain head.
+ */
+static gint hash_chain(db_hash_area_header *ha, wg_uint hash) {
+  if(ha->oldstart) {
+    gint i = hash % ha->oldlength;
+    if(i >= ha->rehashpos)
+      return ha->oldstart + sizeof(gint) * i;
+  }
+  return ha->arraystart + sizeof(gint) * (hash % ha->arraylength);
+}
+
+/*
+ * Move the chains of up to steps old array elements to the
+ * current array. The old array is freed after the last one.
+ */
+static void idxhash_rehash(void *db, db_hash_area_header *ha, gint steps) {
+  while(ha->oldstart && steps-- > 0) {
+    gint head_offset = ha->oldstart + sizeof(gint) * ha->rehashpos;
+    gint bucket = dbfetch(db, head_offset);
+
+    while(bucket) {
+      gint next = dbfetch(db, bucket + HASHIDX_HASHCHAIN_POS*sizeof(gint));
+      gint length = dbfetch(db, bucket + HASHIDX_META_POS*sizeof(gint));
+      wg_uint hash = wg_hash_bytes((char *) offsettoptr(db,
+        bucket + HASHIDX_HEADER_SIZE*sizeof(gint)), length);
+      gint new_head = ha->arraystart + sizeof(gint) * (hash % ha->arraylength);
+
+      dbstore(db, bucket + HASHIDX_HASHCHAIN_POS*sizeof(gint),
+        dbfetch(db, new_head));
+      dbstore(db, new_head, bucket);
+      bucket = next;
+    }
+    dbstore(db, head_offset, 0);
+
+    if(++(ha->rehashpos) == ha->oldlength) {
+      wg_free_object(db, &(dbmemsegh(db)->indexhash_area_header),
+        ha->oldstart - sizeof(gint));
+      ha->oldstart = 0;
+      ha->oldlength = 0;
+      ha->rehashpos = 0;
+    }
+  }
+}
+
+/*
+ * Start growing the hash to twice the array size. The chains are
+ * moved over a few at a time by the following updates, so that no
+ * single update pays for rehashing the whole table. If the new
+ * array cannot be allocated, the hash keeps working at its
+ * current size.
+ */
+static void idxhash_grow(void *db, db_hash_area_header *ha) {
+  gint length = ha->arraylength * 2;
+  gint arr;
+
+  if(ha->oldstart)
+    idxhash_rehash(db, ha, ha->oldlength); /* finish the previous one */
+  arr = wg_alloc_gints(db, &(dbmemsegh(db)->indexhash_area_header),
+    length + 1);
+  if(!arr)
+    return;
+  memset(offsettoptr(db, arr + sizeof(gint)), 0, length * sizeof(gint));
+
+  ha->oldstart = ha->arraystart;
+  ha->oldlength = ha->arraylength;
+  ha->rehashpos = 0;
+  ha->offset = arr;
+  ha->size = (length + 1) * sizeof(gint);
+  ha->arraysize = length * sizeof(gint);
+  ha->arraystart = arr + sizeof(gint);
+  ha->arraylength = length;
+}
+
+/*
+ * Free the buckets and record lists chained from a hash array.
+ */
+static void idxhash_free_chains(void *db, gint arraystart, gint length) {
+  db_memsegment_header* dbh = dbmemsegh(db);
+  gint i;
+
+  for(i=0; i<length; i++) {
+    gint bucket = dbfetch(db, arraystart + sizeof(gint) * i);
+    while(bucket) {
+      gint next = dbfetch(db, bucket + HASHIDX_HASHCHAIN_POS*sizeof(gint));
+      gint cell = dbfetch(db, bucket + HASHIDX_RECLIST_POS*sizeof(gint));
+      while(cell) {
+        gint nextcell = ((gcell *) offsettoptr(db, cell))->cdr;
+        wg_free_listcell(db, cell);
+        cell = nextcell;
+      }
+      wg_free_object(db, &(dbh->indexhash_area_header), bucket);
+      bucket = next;
     }
   }
-  return hash % hashsz;
 }
 
 /*
@@ -435,12 +808,14 @@ gint wg_idxhash_store(void* db, db_hash_area_header *ha,
 {
   db_memsegment_header* dbh = dbmemsegh(db);
   wg_uint hash;
-  gint head_offset, head, bucket;
+  gint chain, head_offset, head, bucket;
   gint rec_head, rec_offset;
   gcell *rec_cell;
 
-  hash = hash_bytes(db, data, length, ha->arraylength);
-  head_offset = (ha->arraystart)+(sizeof(gint) * hash);
+  hash = wg_hash_bytes(data, length);
+  idxhash_rehash(db, ha, IDXHASH_REHASH_STEP);
+  chain = hash_chain(ha, hash);
+  head_offset = chain;
   head = dbfetch(db, head_offset);
 
   /* Traverse the hash chain to check if there is a matching
@@ -477,8 +852,11 @@ gint wg_idxhash_store(void* db, db_hash_area_header *ha,
     dbstore(db, bucket + HASHIDX_RECLIST_POS*sizeof(gint), 0);
 
     /* Prepend to hash chain */
-    dbstore(db, ((ha->arraystart)+(sizeof(gint) * hash)), bucket);
+    dbstore(db, chain, bucket);
     dbstore(db, bucket + HASHIDX_HASHCHAIN_POS*sizeof(gint), head);
+
+    if(++(ha->entries) > ha->arraylength * IDXHASH_MAX_LOAD && !ha->oldstart)
+      idxhash_grow(db, ha);
   }
 
   /* Add the record offset to the list. */
@@ -505,8 +883,9 @@ gint wg_idxhash_remove(void* db, db_hash_area_header *ha,
   gint bucket_offset, bucket;
   gint *next_offset, *reclist_offset;
 
-  hash = hash_bytes(db, data, length, ha->arraylength);
-  bucket_offset = (ha->arraystart)+(sizeof(gint) * hash); /* points to head */
+  hash = wg_hash_bytes(data, length);
+  idxhash_rehash(db, ha, IDXHASH_REHASH_STEP);
+  bucket_offset = hash_chain(ha, hash); /* points to head */
 
   /* Find the correct bucket. */
   bucket = find_idxhash_bucket(db, data, length, &bucket_offset);
@@ -534,6 +913,7 @@ is_bucket_empty:
     gint nextchain = dbfetch(db, bucket + HASHIDX_HASHCHAIN_POS*sizeof(gint));
     dbstore(db, bucket_offset, nextchain);
     wg_free_object(db, &(dbmemsegh(db)->indexhash_area_header), bucket);
+    ha->entries--;
   }
 
   return 0;
@@ -551,8 +931,8 @@ gint wg_idxhash_find(void* db, db_hash_area_header *ha,
   wg_uint hash;
   gint head_offset, bucket;
 
-  hash = hash_bytes(db, data, length, ha->arraylength);
-  head_offset = (ha->arraystart)+(sizeof(gint) * hash); /* points to head */
+  hash = wg_hash_bytes(data, length);
+  head_offset = hash_chain(ha, hash); /* points to head */
 
   /* Find the correct bucket. */
   bucket = find_idxhash_bucket(db, data, length, &head_offset);
@@ -562,6 +942,27 @@ gint wg_idxhash_find(void* db, db_hash_area_header *ha,
   return dbfetch(db, bucket + HASHIDX_RECLIST_POS*sizeof(gint));
 }
 
+/*
+ * Free an index hash: the record lists, the buckets and the array(s).
+ */
+void wg_idxhash_free(void* db, db_hash_area_header *ha)
+{
+  db_memsegment_header* dbh = dbmemsegh(db);
+
+  if(ha->oldstart) {
+    idxhash_free_chains(db, ha->oldstart, ha->oldlength);
+    wg_free_object(db, &(dbh->indexhash_area_header),
+      ha->oldstart - sizeof(gint));
+    ha->oldstart = 0;
+  }
+  if(ha->arraystart) {
+    idxhash_free_chains(db, ha->arraystart, ha->arraylength);
+    wg_free_object(db, &(dbh->indexhash_area_header), ha->offset);
+    ha->arraystart = 0;
+  }
+  ha->entries = 0;
+}
+
 /* ------- local-memory extendible gint hash ---------- */
 
 /*
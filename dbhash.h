@@ -37,6 +37,8 @@
 #include "config-gcc.h"
 #endif
 #include "dballoc.h"
+/* For wg_uint data type */
+#include "dbdata.h"
 
 /* ==== Public macros ==== */
 
@@ -47,19 +49,24 @@
 
 /* ==== Protos ==== */
 
-int wg_hash_typedstr(void* db, char* data, char* extrastr, gint type, gint length);
-gint wg_find_strhash_bucket(void* db, char* data, char* extrastr, gint type, gint size, gint hashchain);
+wg_uint wg_hash_typedstr(void* db, char* data, char* extrastr, gint type, gint length);
+gint wg_find_strhash_bucket(void* db, char* data, char* extrastr, gint type, gint size, wg_uint hash);
+void wg_add_to_strhash(void* db, gint longstr, wg_uint hash);
 int wg_right_strhash_bucket
             (void* db, gint longstr, char* cstr, char* cextrastr, gint ctype, gint cstrsize);
 gint wg_remove_from_strhash(void* db, gint longstr);
 
 gint wg_decode_for_hashing(void *db, gint enc, char **decbytes);
+gint wg_encode_for_hashing(void *db, gint enc, char *buf, gint bufsize);
+wg_uint wg_hash_bytes(char *data, gint length);
+gint wg_hash_encoded(void *db, gint enc, wg_uint *hash);
 gint wg_idxhash_store(void* db, db_hash_area_header *ha,
   char* data, gint length, gint offset);
 gint wg_idxhash_remove(void* db, db_hash_area_header *ha,
   char* data, gint length, gint offset);
 gint wg_idxhash_find(void* db, db_hash_area_header *ha,
   char* data, gint length);
+void wg_idxhash_free(void* db, db_hash_area_header *ha);
 
 void *wg_ginthash_init(void *db);
 gint wg_ginthash_addkey(void *db, void *tbl, gint key, gint val);
@@ -45,6 +45,8 @@ extern "C" {
 #include "dbindex.h"
 #include "dbcompare.h"
 #include "dbhash.h"
+#include "dbaggr.h"
+#include "dblock.h"
 
 
 /* ====== Private defs =========== */
@@ -58,22 +60,108 @@ extern "C" {
 #define max(a,b) (a>b ? a : b)
 #endif
 
+#define TTREE_SORT_RUN 16  /** rows sorted by insertion before merging */
+#define BTREE_BUILD_FILL (WG_BNODE_SIZE * 3 / 4) /** bulk build node fill */
+#define INDEX_TABLE_COLUMNS \
+  (MAX_INDEX_FIELDS + MAX_INDEX_INCLUDE + MAX_FILTER_ARGS)
+
+#define ONLINE_BUILD_BATCH 1000  /** rows scanned under one read lock */
+#define ONLINE_BUILD_ADD 1
+#define ONLINE_BUILD_REMOVE 2
+
 #define HASHIDX_OP_STORE 1
 #define HASHIDX_OP_REMOVE 2
 #define HASHIDX_OP_FIND 3
+#define HASHIDX_KEY_BUFSIZE 256  /** key bytes built on the stack */
+#define UPSERT_BUFSIZE 16  /** fields of an upsert held on the stack */
+
+#define BULK_INITIAL_SIZE 1024  /** slots in the table of deferred rows */
+#define BULK_MERGE_RATIO 4  /** rebuild a T-tree that has at most this
+                               many times the deferred rows */
+#define BULK_REMOVED -1  /** index_id of a slot whose row was taken back */
+
+#ifdef USE_DATABASE_HANDLE
+#define BULK_DATA(d) ((index_bulk *) ((db_handle *) d)->bulkdata)
+#else
+#define BULK_DATA(d) ((index_bulk *) NULL)
+#endif
+
+/* T-tree and non-unique hash index updates are deferred in bulk mode */
+#define INDEX_BULK(d, h) (BULK_DATA(d) && \
+  (h->type == WG_INDEX_TYPE_TTREE || \
+  (h->type == WG_INDEX_TYPE_HASH && !HASHIDX_UNIQUE(h))))
+
+/* Compare a key to the min/max bound of a node (key relative to bound) */
+#define TNODE_COMPARE_MIN(d, n, k, kp) \
+  tnode_compare_bound(d, n, 0, (n)->current_min, k, kp)
+#define TNODE_COMPARE_MAX(d, n, k, kp) \
+  tnode_compare_bound(d, n, (n)->number_of_elements - 1, \
+    (n)->current_max, k, kp)
+
+#define TTREE_PREFIX_VALUE_BITS (sizeof(wg_uint)*8 - 4) /** below type bits */
+
+/** row of a T-tree bulk build, with its leading key value */
+typedef struct {
+  gint key;
+  gint offset;
+} ttree_entry;
+
+/** row of an index whose entry is deferred by wg_begin_bulk() */
+typedef struct {
+  gint index_id;  /** 0 if the slot is free, BULK_REMOVED if taken back */
+  gint offset;
+} bulk_entry;
+
+/** rows deferred by wg_begin_bulk(), kept in the database handle
+*   Open addressing hash table of (index, row) pairs.
+*/
+typedef struct {
+  bulk_entry *table;
+  gint size;      /** number of slots, a power of two */
+  gint used;      /** slots that are not free, including taken back */
+  gint count;     /** deferred rows */
+} index_bulk;
 
 /* ======= Private protos ================ */
 
 #ifndef TTREE_SINGLE_COMPARE
 static gint db_find_bounding_tnode(void *db, gint rootoffset, gint key,
-  gint *result, struct wg_tnode *rb_node);
+  wg_uint kp, gint *result, struct wg_tnode *rb_node);
 #endif
+static gint ttree_search_rightmost(void *db, gint rootoffset,
+  gint key, wg_uint kp, gint *result, struct wg_tnode *rb_node);
+static gint ttree_search_leftmost(void *db, gint rootoffset,
+  gint key, wg_uint kp, gint *result, struct wg_tnode *lb_node);
+static gint tnode_compare_bound(void *db, struct wg_tnode *node, gint slot,
+  gint bound, gint key, wg_uint kp);
+static gint ttree_compare_key(void *db, wg_index_header *hdr, void *rec,
+  gint *keys, gint nkeys);
+static gint ttree_compare_slot(void *db, wg_index_header *hdr,
+  struct wg_tnode *node, gint slot, gint *keys, gint nkeys, wg_uint kp);
+static gint db_find_bounding_tnode_multi(void *db, wg_index_header *hdr,
+  gint rootoffset, gint *keys, wg_uint kp, gint *result);
 static int db_which_branch_causes_overweight(void *db, struct wg_tnode *root);
 static int db_rotate_ttree(void *db, gint index_id, struct wg_tnode *root,
   int overw);
+static void tnode_recount(void *db, struct wg_tnode *node);
+static void ttree_adjust_count(void *db, gint nodeoffset, gint delta);
+static gint ttree_alloc_node(void *db, wg_index_header *hdr);
+static void ttree_free_node(void *db, gint nodeoffset);
 static gint ttree_add_row(void *db, gint index_id, void *rec);
 static gint ttree_remove_row(void *db, gint index_id, void * rec);
 
+static gint ttree_compare_entries(void *db, wg_index_header *hdr,
+  ttree_entry *a, ttree_entry *b);
+static void ttree_sort_entries(void *db, wg_index_header *hdr,
+  ttree_entry *entries, ttree_entry *tmp, gint count);
+static gint ttree_build_nodes(void *db, wg_index_header *hdr,
+  ttree_entry *entries, gint count, gint lo, gint hi, gint parent,
+  gint *prev, gint *height);
+static ttree_entry *ttree_collect_rows(void *db, wg_index_header *hdr,
+  gint *count);
+#ifdef TTREE_CHAINED_NODES
+static void ttree_free_chain(void *db, gint nodeoffset);
+#endif
 static gint create_ttree_index(void *db, gint index_id);
 static gint drop_ttree_index(void *db, gint column);
 
@@ -87,16 +175,92 @@ static gint remove_index_template(void *db, gint template_offset);
 
 static gint hash_add_row(void *db, gint index_id, void *rec);
 static gint hash_remove_row(void *db, gint index_id, void *rec);
-static gint hash_recurse(void *db, wg_index_header *hdr, char *prefix,
-  gint prefixlen, gint *values, gint count, void *rec, gint op, gint expand);
-static gint hash_extend_prefix(void *db, wg_index_header *hdr, char *prefix,
-  gint prefixlen, gint nextval, gint *values, gint count, void *rec, gint op,
-  gint expand);
+static gint hash_recurse(void *db, wg_index_header *hdr, char *buf,
+  gint bufsize, gint prefixlen, gint *values, gint count, void *rec,
+  gint op, gint expand);
+static gint hash_extend_prefix(void *db, wg_index_header *hdr, char *buf,
+  gint bufsize, gint prefixlen, gint nextval, gint *values, gint count,
+  void *rec, gint op, gint expand);
+static gint hash_unique_find(void *db, wg_index_header *hdr, gint *values,
+  gint self);
+static gint upsert_check_unique(void *db, void *rec, gint *values,
+  gint count);
+static gint upsert_hold(void *db, gint enc);
+static void upsert_drop(void *db, gint held, int stored);
 
 static gint create_hash_index(void *db, gint index_id);
 static gint drop_hash_index(void *db, gint index_id);
 
+static int trigram_cmp(const void *a, const void *b);
+static void trigram_bytes(gint gram, char *buf);
+static gint trigram_update_row(void *db, gint index_id, void *rec, gint op);
+static gint create_trigram_index(void *db, gint index_id);
+
+static gint bnode_compare(void *db, struct wg_bnode *node, gint slot,
+  wg_uint kp, gint key, gint row);
+static gint bnode_lower_bound(void *db, struct wg_bnode *node, gint lo,
+  wg_uint kp, gint key, gint row, gint strict);
+static void bnode_insert_slot(void *db, struct wg_bnode *node, gint slot,
+  wg_uint kp, gint key, gint row, gint child);
+static void bnode_remove_slot(struct wg_bnode *node, gint slot);
+static gint bnode_child_slot(struct wg_bnode *node, gint child);
+static gint btree_new_node(void *db, gint leaf);
+static void btree_update_bounds(void *db, struct wg_bnode *node);
+static gint btree_find_leaf(void *db, wg_index_header *hdr, wg_uint kp,
+  gint key, gint row, gint strict);
+static gint btree_insert(void *db, wg_index_header *hdr, gint offset,
+  gint slot, wg_uint kp, gint key, gint row, gint child);
+static void btree_row_key(void *db, wg_index_header *hdr, void *rec,
+  wg_uint *kp, gint *key);
+static gint btree_add_row(void *db, gint index_id, void *rec);
+static gint btree_remove_row(void *db, gint index_id, void *rec);
+static gint btree_build_nodes(void *db, wg_index_header *hdr,
+  ttree_entry *entries, gint count);
+static gint create_btree_index(void *db, gint index_id);
+static void btree_free_nodes(void *db, gint offset);
+static gint drop_btree_index(void *db, gint index_id);
+
+static wg_uint spatial_row_key(void *db, wg_index_header *hdr, void *rec);
+
+static gint zonemap_locate(void *db, gint offset, gint *block);
+static gint zonemap_blocks(void *db, gint subarea);
+static wg_zone *zonemap_block(void *db, wg_index_header *hdr,
+  gint subarea, gint block, gint create);
+static gint zonemap_add_row(void *db, gint index_id, void *rec);
+static gint zonemap_remove_row(void *db, gint index_id, void *rec);
+static gint create_zonemap_index(void *db, gint index_id);
+static gint drop_zonemap_index(void *db, gint index_id);
+
 static gint sort_columns(gint *sorted_cols, gint *columns, gint col_count);
+static gint create_index(void *db, gint *columns, gint col_count, gint type,
+  gint *include, gint inc_count, wg_query_arg *arglist, gint argc,
+  gint *matchrec, gint reclen, gint unique, gint online);
+static gint publish_index(void *db, gint index_id);
+static void *index_first_row(void *db, gint index_id);
+static wg_online_build *find_online_build(void *db, gint index_id);
+static void end_online_build(void *db);
+static gint online_build_column(void *db, wg_index_header *hdr, gint column);
+static gint online_row_scanned(void *db, wg_online_build *build, gint offset);
+static gint online_build_update(void *db, void *rec, gint column, gint op);
+static gint online_add_row(void *db, wg_index_header *hdr, gint index_id,
+  void *rec);
+static gint same_index_predicate(void *db, wg_index_header *hdr,
+  wg_query_arg *arglist, gint argc);
+static wg_uint bulk_hash(gint index_id, gint offset);
+static bulk_entry *bulk_slot(index_bulk *bulk, gint index_id, gint offset);
+static gint bulk_grow(index_bulk *bulk);
+static gint bulk_defer_row(void *db, wg_index_header *hdr, gint index_id,
+  void *rec);
+static gint bulk_cancel_row(void *db, gint index_id, void *rec);
+static void bulk_forget_index(void *db, gint index_id);
+static gint bulk_apply(void *db, gint index_id, gint *rows, gint count);
+static int bulk_offset_cmp(const void *a, const void *b);
+#ifdef TTREE_CHAINED_NODES
+static gint ttree_merge_rows(void *db, gint index_id,
+  ttree_entry *entries, gint count);
+#endif
+static gint index_table_columns(void *db, wg_index_header *hdr, gint *cols);
+static gint index_table_listed(void *db, wg_index_header *hdr, gint column);
 
 static gint show_index_error(void* db, char* errmsg);
 static gint show_index_error_nr(void* db, char* errmsg, gint nr);
@@ -117,6 +281,19 @@ static gint show_index_error_nr(void* db, char* errmsg, gint nr);
  *
  * - hash index (allows multi-column indexes) (not done yet)
  *
+ * - composite T-tree. Rows are ordered by a tuple of columns,
+ *   compared lexicographically in the key order given at creation.
+ *   current_min and current_max of the nodes hold the leading key
+ *   column only, so single-value searches work unchanged on the
+ *   leading column. Full key comparisons are done on the rows
+ *   in the node slots.
+ *   A covering T-tree also keeps copies of some other (included)
+ *   columns next to the node slots, so that queries can read them
+ *   without touching the rows.
+ *
+ * - B+tree with wide nodes and linked leaves (single column). The
+ *   keys are kept in the nodes, so searches do not touch the rows.
+ *
  * Index metainfo:
  * data about indexes in system is stored in dbh->index_control_area_header
  *
@@ -135,7 +312,8 @@ static gint show_index_error_nr(void* db, char* errmsg, gint nr);
  *  unique, index list elements are not).
  *
  *  In the above example, A is a (hash) index on columns 2 and 5, while B
- *  is an index on column 5.
+ *  is an index on column 5. Covering T-trees are listed under their
+ *  included columns as well, so that updates of these reach the index.
  *
  * Note: offset to index header struct is also used as an index id.
  */
@@ -148,7 +326,7 @@ static gint show_index_error_nr(void* db, char* errmsg, gint nr);
 *  returns bounding node offset or if no really bounding node exists, then the closest node
 */
 static gint db_find_bounding_tnode(void *db, gint rootoffset, gint key,
-  gint *result, struct wg_tnode *rb_node) {
+  wg_uint kp, gint *result, struct wg_tnode *rb_node) {
 
   struct wg_tnode * node = (struct wg_tnode *)offsettoptr(db,rootoffset);
 
@@ -156,23 +334,23 @@ static gint db_find_bounding_tnode(void *db, gint rootoffset, gint key,
    * the node to determine immediately if the value falls between them.
    */
 
-  if(WG_COMPARE(db, key, node->current_min) == WG_LESSTHAN) {
+  if(TNODE_COMPARE_MIN(db, node, key, kp) == WG_LESSTHAN) {
     /* if(key < node->current_max) */
     if(node->left_child_offset != 0)
       return db_find_bounding_tnode(db, node->left_child_offset,
-        key, result, NULL);
+        key, kp, result, NULL);
     else {
       *result = DEAD_END_LEFT_NOT_BOUNDING;
       return rootoffset;
     }
-  } else if(WG_COMPARE(db, key, node->current_max) != WG_GREATER) {
+  } else if(TNODE_COMPARE_MAX(db, node, key, kp) != WG_GREATER) {
     *result = REALLY_BOUNDING_NODE;
     return rootoffset;
   }
   else { /* if(key > node->current_max) */
     if(node->right_child_offset != 0)
       return db_find_bounding_tnode(db, node->right_child_offset,
-        key, result, NULL);
+        key, kp, result, NULL);
     else{
       *result = DEAD_END_RIGHT_NOT_BOUNDING;
       return rootoffset;
@@ -183,8 +361,133 @@ static gint db_find_bounding_tnode(void *db, gint rootoffset, gint key,
 /* "rightmost" node search is the improved tree search described in
  * the original T-tree paper.
  */
-#define db_find_bounding_tnode wg_search_ttree_rightmost
+#define db_find_bounding_tnode ttree_search_rightmost
+#endif
+
+/**
+*  Compare a key to the min or max bound of a node. The key
+*  prefix is checked first, the bound itself is only compared
+*  if the prefixes are equal.
+*  returns WG_LESSTHAN, WG_EQUAL or WG_GREATER (key relative to bound)
+*/
+static gint tnode_compare_bound(void *db, struct wg_tnode *node, gint slot,
+  gint bound, gint key, wg_uint kp) {
+#ifdef TTREE_KEY_PREFIX
+  if(node->number_of_elements) {
+    if(kp < node->key_prefix[slot])
+      return WG_LESSTHAN;
+    if(kp > node->key_prefix[slot])
+      return WG_GREATER;
+  }
+#endif
+  return WG_COMPARE(db, key, bound);
+}
+
+/**
+*  Compare the key columns of a row to a tuple of encoded values.
+*  The first nkeys columns are compared in key order.
+*  returns WG_LESSTHAN, WG_EQUAL or WG_GREATER (row relative to key)
+*/
+static gint ttree_compare_key(void *db, wg_index_header *hdr, void *rec,
+  gint *keys, gint nkeys) {
+  gint i, cr;
+
+  for(i=0; i<nkeys; i++) {
+    cr = WG_COMPARE(db, wg_get_field(db, rec, TTREE_KEY_COLUMN(hdr, i)),
+      keys[i]);
+    if(cr != WG_EQUAL)
+      return cr;
+  }
+  return WG_EQUAL;
+}
+
+/**
+*  Compare the row in a node slot to a tuple of encoded values.
+*  kp is the key prefix of keys[0]. The row is only fetched
+*  if its prefix is equal to it.
+*  returns WG_LESSTHAN, WG_EQUAL or WG_GREATER (row relative to key)
+*/
+static gint ttree_compare_slot(void *db, wg_index_header *hdr,
+  struct wg_tnode *node, gint slot, gint *keys, gint nkeys, wg_uint kp) {
+#ifdef TTREE_KEY_PREFIX
+  if(nkeys) {
+    if(node->key_prefix[slot] < kp)
+      return WG_LESSTHAN;
+    if(node->key_prefix[slot] > kp)
+      return WG_GREATER;
+  }
 #endif
+  return ttree_compare_key(db, hdr,
+    offsettoptr(db, node->array_of_values[slot]), keys, nkeys);
+}
+
+/**
+*  Composite key version of db_find_bounding_tnode(). Since current_min
+*  and current_max only hold the leading column, the bounds are taken
+*  from the rows in the leftmost and rightmost slot of the node.
+*/
+static gint db_find_bounding_tnode_multi(void *db, wg_index_header *hdr,
+  gint rootoffset, gint *keys, wg_uint kp, gint *result) {
+
+  struct wg_tnode * node = (struct wg_tnode *)offsettoptr(db,rootoffset);
+
+  if(node->number_of_elements == 0) {
+    /* empty root node, the key is simply appended */
+    *result = DEAD_END_RIGHT_NOT_BOUNDING;
+    return rootoffset;
+  }
+
+  if(ttree_compare_slot(db, hdr, node, 0,
+    keys, hdr->fields, kp) == WG_GREATER) {
+    /* key < leftmost row */
+    if(node->left_child_offset != 0)
+      return db_find_bounding_tnode_multi(db, hdr, node->left_child_offset,
+        keys, kp, result);
+    else {
+      *result = DEAD_END_LEFT_NOT_BOUNDING;
+      return rootoffset;
+    }
+  } else if(ttree_compare_slot(db, hdr, node, node->number_of_elements-1,
+    keys, hdr->fields, kp) != WG_LESSTHAN) {
+    *result = REALLY_BOUNDING_NODE;
+    return rootoffset;
+  }
+  else { /* key > rightmost row */
+    if(node->right_child_offset != 0)
+      return db_find_bounding_tnode_multi(db, hdr, node->right_child_offset,
+        keys, kp, result);
+    else{
+      *result = DEAD_END_RIGHT_NOT_BOUNDING;
+      return rootoffset;
+    }
+  }
+}
+
+/**
+*  recomputes the subtree row count of a node from its children.
+*  Used after rotations, where the children are already up to date.
+*/
+static void tnode_recount(void *db, struct wg_tnode *node){
+  gint count = node->number_of_elements;
+  if(node->left_child_offset)
+    count += ((struct wg_tnode *)offsettoptr(db,
+      node->left_child_offset))->subtree_count;
+  if(node->right_child_offset)
+    count += ((struct wg_tnode *)offsettoptr(db,
+      node->right_child_offset))->subtree_count;
+  node->subtree_count = count;
+}
+
+/**
+*  adds delta to the subtree row counts of a node and all its ancestors
+*/
+static void ttree_adjust_count(void *db, gint nodeoffset, gint delta){
+  while(nodeoffset){
+    struct wg_tnode *node = (struct wg_tnode *)offsettoptr(db, nodeoffset);
+    node->subtree_count += delta;
+    nodeoffset = node->parent_offset;
+  }
+}
 
 /**
 *  returns the description of imbalance - 4 cases possible
@@ -211,7 +514,7 @@ static int db_rotate_ttree(void *db, gint index_id, struct wg_tnode *root, int o
   struct wg_tnode *r = NULL;
   struct wg_tnode *g = (struct wg_tnode *)offsettoptr(db,grandparent);
   wg_index_header *hdr = (wg_index_header *)offsettoptr(db,index_id);
-  gint column = hdr->rec_field_index[0]; /* always one column for T-tree */
+  gint column = TTREE_KEY_COLUMN(hdr, 0); /* min/max use the leading column */
 
   if(overw == LL_CASE){
 
@@ -239,6 +542,8 @@ static int db_rotate_ttree(void *db, gint index_id, struct wg_tnode *root, int o
     root->parent_offset = offset_left_child;
     //for later grandparent fix
     r = (struct wg_tnode *)offsettoptr(db,offset_left_child);
+    tnode_recount(db, root);
+    tnode_recount(db, r);
 
   }else if(overw == RR_CASE){
 
@@ -264,6 +569,8 @@ static int db_rotate_ttree(void *db, gint index_id, struct wg_tnode *root, int o
     root->parent_offset = offset_right_child;
     //for later grandparent fix
     r = (struct wg_tnode *)offsettoptr(db,offset_right_child);
+    tnode_recount(db, root);
+    tnode_recount(db, r);
 
   }else if(overw == LR_CASE){
 /*               A                    E
@@ -302,11 +609,11 @@ static int db_rotate_ttree(void *db, gint index_id, struct wg_tnode *root, int o
       int i;
 
       /* Create space for elements from B */
-      ee->array_of_values[bb->number_of_elements - 1] = ee->array_of_values[0];
+      TNODE_COPY_SLOT(db, ee, bb->number_of_elements - 1, ee, 0)
 
       /* All the values moved are smaller than in E */
       for(i=1; i<bb->number_of_elements; i++)
-        ee->array_of_values[i-1] = bb->array_of_values[i];
+        TNODE_COPY_SLOT(db, ee, i-1, bb, i)
       ee->number_of_elements = bb->number_of_elements;
 
       /* Examine the new leftmost element to find current_min */
@@ -327,6 +634,9 @@ static int db_rotate_ttree(void *db, gint index_id, struct wg_tnode *root, int o
     root -> parent_offset = offset_right_grandchild;
     //for later grandparent fix
     r = ee;
+    tnode_recount(db, root);
+    tnode_recount(db, bb);
+    tnode_recount(db, r);
 
   }else if(overw == RL_CASE){
 
@@ -365,7 +675,7 @@ static int db_rotate_ttree(void *db, gint index_id, struct wg_tnode *root, int o
 
       /* All the values moved are larger than in E */
       for(i=1; i<bb->number_of_elements; i++)
-        ee->array_of_values[i] = bb->array_of_values[i-1];
+        TNODE_COPY_SLOT(db, ee, i, bb, i-1)
       ee->number_of_elements = bb->number_of_elements;
 
       /* Examine the new rightmost element to find current_max */
@@ -373,8 +683,7 @@ static int db_rotate_ttree(void *db, gint index_id, struct wg_tnode *root, int o
         ee->array_of_values[ee->number_of_elements - 1]), column);
 
       /* Remaining B node array element should sit in slot 0 */
-      bb->array_of_values[0] = \
-        bb->array_of_values[bb->number_of_elements - 1];
+      TNODE_COPY_SLOT(db, bb, 0, bb, bb->number_of_elements - 1)
       bb -> number_of_elements = 1;
       bb -> current_min = bb -> current_max;
     }
@@ -389,6 +698,9 @@ static int db_rotate_ttree(void *db, gint index_id, struct wg_tnode *root, int o
     root -> parent_offset = offset_left_grandchild;
     //for later grandparent fix
     r = ee;
+    tnode_recount(db, root);
+    tnode_recount(db, bb);
+    tnode_recount(db, r);
 
   } else {
     /* catch an error case (can't really happen) */
@@ -418,6 +730,50 @@ static int db_rotate_ttree(void *db, gint index_id, struct wg_tnode *root, int o
   return 0;
 }
 
+/** Allocate a T-node
+*  Nodes of a covering index get an object for the copies of the
+*  included columns as well. Other fields are left to the caller.
+*  returns the offset of the node, 0 on error
+*/
+static gint ttree_alloc_node(void *db, wg_index_header *hdr) {
+  gint offset, count, i;
+  struct wg_tnode *node;
+  db_memsegment_header* dbh = dbmemsegh(db);
+
+  offset = wg_alloc_fixlen_object(db, &dbh->tnode_area_header);
+  if(!offset)
+    return 0;
+  node = (struct wg_tnode *) offsettoptr(db, offset);
+  node->cover_offset = 0;
+
+  count = TTREE_INCLUDE_COUNT(hdr);
+  if(count) {
+    gint *cover;
+    node->cover_offset = wg_alloc_gints(db, &dbh->indexhash_area_header,
+      2 + count + WG_TNODE_ARRAY_SIZE * count);
+    if(!node->cover_offset) {
+      wg_free_tnode(db, offset);
+      return 0;
+    }
+    cover = TNODE_COVER(db, node);
+    cover[1] = count;
+    for(i=0; i<count; i++)
+      cover[2 + i] = hdr->ctl.t.include_columns[i];
+  }
+  return offset;
+}
+
+/** Free a T-node and the copies of the included columns
+*/
+static void ttree_free_node(void *db, gint nodeoffset) {
+  struct wg_tnode *node = (struct wg_tnode *) offsettoptr(db, nodeoffset);
+  db_memsegment_header* dbh = dbmemsegh(db);
+
+  if(node->cover_offset)
+    wg_free_object(db, &dbh->indexhash_area_header, node->cover_offset);
+  wg_free_tnode(db, nodeoffset);
+}
+
 /**  inserts pointer to data row into index tree structure
 *
 *  returns:
@@ -425,11 +781,12 @@ static int db_rotate_ttree(void *db, gint index_id, struct wg_tnode *root, int o
 *  -1 - if error
 */
 static gint ttree_add_row(void *db, gint index_id, void *rec) {
-  gint rootoffset, column;
-  gint newvalue, boundtype, bnodeoffset, newoffset;
+  gint rootoffset, column, k;
+  gint newvalue, boundtype, bnodeoffset, newoffset, countoffset;
+  gint keys[MAX_INDEX_FIELDS];
+  wg_uint newprefix;
   struct wg_tnode *node;
   wg_index_header *hdr = (wg_index_header *)offsettoptr(db,index_id);
-  db_memsegment_header* dbh = dbmemsegh(db);
 
   rootoffset = TTREE_ROOT_NODE(hdr);
 #ifdef CHECK
@@ -441,15 +798,40 @@ static gint ttree_add_row(void *db, gint index_id, void *rec) {
     return -1;
   }
 #endif
-  column = hdr->rec_field_index[0]; /* always one column for T-tree */
+  column = TTREE_KEY_COLUMN(hdr, 0); /* min/max use the leading column */
 
-  //extract real value from the row (rec)
-  newvalue = wg_get_field(db, rec, column);
+  //extract real value(s) from the row (rec)
+  for(k=0; k<hdr->fields; k++)
+    keys[k] = wg_get_field(db, rec, TTREE_KEY_COLUMN(hdr, k));
+  newvalue = keys[0];
+  newprefix = TTREE_KEY_PREFIX_OF(db, newvalue);
 
   //find bounding node for the value
-  bnodeoffset = db_find_bounding_tnode(db, rootoffset, newvalue, &boundtype, NULL);
+#ifdef TTREE_CHAINED_NODES
+  /* Append fast path. Increasing keys (timestamps, sequence numbers)
+   * always land at or right of the rightmost row of the tree. The max
+   * node has no right child, so the descent from the root would end
+   * there as a dead end anyway. Such rows are appended to the max node,
+   * a new right-most node is started when it is full. Rebalancing is
+   * then only needed once per WG_TNODE_ARRAY_SIZE rows.
+   */
+  node = (struct wg_tnode *)offsettoptr(db, TTREE_MAX_NODE(hdr));
+  if(node->number_of_elements > 0 &&\
+    ttree_compare_slot(db, hdr, node, node->number_of_elements - 1,
+      keys, hdr->fields, newprefix) != WG_GREATER) {
+    bnodeoffset = TTREE_MAX_NODE(hdr);
+    boundtype = DEAD_END_RIGHT_NOT_BOUNDING;
+  } else
+#endif
+  if(hdr->fields > 1)
+    bnodeoffset = db_find_bounding_tnode_multi(db, hdr, rootoffset,
+      keys, newprefix, &boundtype);
+  else
+    bnodeoffset = db_find_bounding_tnode(db, rootoffset, newvalue,
+      newprefix, &boundtype, NULL);
   node = (struct wg_tnode *)offsettoptr(db,bnodeoffset);
   newoffset = 0;//save here the offset of newly created tnode - 0 if no node added into the tree
+  countoffset = bnodeoffset;//node that gets the extra row
   //if bounding node exists - follow one algorithm, else the other
   if(boundtype == REALLY_BOUNDING_NODE){
 
@@ -468,20 +850,19 @@ static gint ttree_add_row(void *db, gint index_id, void *rec) {
          * since here the compare is more expensive than the slot
          * copying.
          */
-        cr = WG_COMPARE(db, wg_get_field(db,
-          (void *)offsettoptr(db,node->array_of_values[i]), column),
-          newvalue);
+        cr = ttree_compare_slot(db, hdr, node, i,
+          keys, hdr->fields, newprefix);
 
         if(cr != WG_LESSTHAN) { /* value >= newvalue */
           /* Push remaining values to the right */
           for(j=node->number_of_elements; j>i; j--)
-            node->array_of_values[j] = node->array_of_values[j-1];
+            TNODE_COPY_SLOT(db, node, j, node, j-1)
           break;
         }
       }
       /* i is either number_of_elements or a vacated slot
        * in the array now. */
-      node->array_of_values[i] = ptrtooffset(db,rec);
+      TNODE_SET_SLOT(db, node, i, ptrtooffset(db,rec), newprefix)
       node->number_of_elements++;
 
       /* Update min. Due to the >= comparison max is preserved
@@ -499,27 +880,30 @@ static gint ttree_add_row(void *db, gint index_id, void *rec) {
       //get the minimum element from this node
       int i, j;
       gint cr, minvalue, minvaluerowoffset;
+      wg_uint minvalueprefix = 0;
 
       minvalue = node->current_min;
       minvaluerowoffset = node->array_of_values[0];
+#ifdef TTREE_KEY_PREFIX
+      minvalueprefix = node->key_prefix[0];
+#endif
 
       /* Now scan for the matching slot. However, since
        * we already know the 0 slot will be re-filled, we
        * do this scan (and sort) in reverse order, compared to the case
        * where array had some space left. */
       for(i=WG_TNODE_ARRAY_SIZE-1; i>0; i--) {
-        cr = WG_COMPARE(db, wg_get_field(db,
-          (void *)offsettoptr(db,node->array_of_values[i]), column),
-          newvalue);
+        cr = ttree_compare_slot(db, hdr, node, i,
+          keys, hdr->fields, newprefix);
         if(cr != WG_GREATER) { /* value <= newvalue */
           /* Push remaining values to the left */
           for(j=0; j<i; j++)
-            node->array_of_values[j] = node->array_of_values[j+1];
+            TNODE_COPY_SLOT(db, node, j, node, j+1)
           break;
         }
       }
       /* i is either 0 or a freshly vacated slot */
-      node->array_of_values[i] = ptrtooffset(db,rec);
+      TNODE_SET_SLOT(db, node, i, ptrtooffset(db,rec), newprefix)
 
       /* Update minimum. Thanks to the sorted array, we know for a fact
        * that the minimum sits in slot 0. */
@@ -550,14 +934,17 @@ static gint ttree_add_row(void *db, gint index_id, void *rec) {
       //otherwise make the new node as right child and put the value there
       if(node->number_of_elements < WG_TNODE_ARRAY_SIZE){
         //add array entry and update control data
-        node->array_of_values[node->number_of_elements] = minvaluerowoffset;//save offset, use first free slot
+        //save offset, use first free slot
+        TNODE_SET_SLOT(db, node, node->number_of_elements,
+          minvaluerowoffset, minvalueprefix)
         node->number_of_elements++;
         node->current_max = minvalue;
+        countoffset = ptrtooffset(db, node);
 
       }else{
         //create, initialize and save first value
         struct wg_tnode *leaf;
-        gint newnode = wg_alloc_fixlen_object(db, &dbh->tnode_area_header);
+        gint newnode = ttree_alloc_node(db, hdr);
         if(newnode == 0)return -1;
         leaf =(struct wg_tnode *)offsettoptr(db,newnode);
         leaf->parent_offset = ptrtooffset(db,node);
@@ -566,9 +953,10 @@ static gint ttree_add_row(void *db, gint index_id, void *rec) {
         leaf->current_max = minvalue;
         leaf->current_min = minvalue;
         leaf->number_of_elements = 1;
+        leaf->subtree_count = 0; /* counted below */
         leaf->left_child_offset = 0;
         leaf->right_child_offset = 0;
-        leaf->array_of_values[0] = minvaluerowoffset;
+        TNODE_SET_SLOT(db, leaf, 0, minvaluerowoffset, minvalueprefix)
         /* If the original, full node did not have a left child, then
          * there also wasn't a separate GLB node, so we are adding one now
          * as the left child. Otherwise, the new node is added as the right
@@ -616,6 +1004,7 @@ static gint ttree_add_row(void *db, gint index_id, void *rec) {
 #endif /* TTREE_CHAINED_NODES */
         }
         newoffset = newnode;
+        countoffset = newnode;
       }
     }
 
@@ -633,16 +1022,18 @@ static gint ttree_add_row(void *db, gint index_id, void *rec) {
       if(boundtype == DEAD_END_LEFT_NOT_BOUNDING) {
         /* our new value is the new min, push everything right */
         for(i=node->number_of_elements; i>0; i--)
-          node->array_of_values[i] = node->array_of_values[i-1];
-        node->array_of_values[0] = ptrtooffset(db,rec);
+          TNODE_COPY_SLOT(db, node, i, node, i-1)
+        TNODE_SET_SLOT(db, node, 0, ptrtooffset(db,rec), newprefix)
         node->current_min = newvalue;
       } else { /* DEAD_END_RIGHT_NOT_BOUNDING */
         /* even simpler case, new value is added to the right */
-        node->array_of_values[node->number_of_elements] = ptrtooffset(db,rec);
+        TNODE_SET_SLOT(db, node, node->number_of_elements,
+          ptrtooffset(db,rec), newprefix)
         node->current_max = newvalue;
       }
 
       node->number_of_elements++;
+      countoffset = ptrtooffset(db, node);
 
       /* XXX: not clear if the empty node can occur here. Until this
        * is checked, we'll be paranoid and overwrite both min and max. */
@@ -653,7 +1044,7 @@ static gint ttree_add_row(void *db, gint index_id, void *rec) {
     }else{
       //make a new node and put data there
       struct wg_tnode *leaf;
-      gint newnode = wg_alloc_fixlen_object(db, &dbh->tnode_area_header);
+      gint newnode = ttree_alloc_node(db, hdr);
       if(newnode == 0)return -1;
       leaf =(struct wg_tnode *)offsettoptr(db,newnode);
       leaf->parent_offset = ptrtooffset(db,node);
@@ -662,10 +1053,12 @@ static gint ttree_add_row(void *db, gint index_id, void *rec) {
       leaf->current_max = newvalue;
       leaf->current_min = newvalue;
       leaf->number_of_elements = 1;
+      leaf->subtree_count = 0; /* counted below */
       leaf->left_child_offset = 0;
       leaf->right_child_offset = 0;
-      leaf->array_of_values[0] = ptrtooffset(db,rec);
+      TNODE_SET_SLOT(db, leaf, 0, ptrtooffset(db,rec), newprefix)
       newoffset = newnode;
+      countoffset = newnode;
       //set new node as left or right leaf
       if(boundtype == DEAD_END_LEFT_NOT_BOUNDING){
         node->left_child_offset = newnode;
@@ -707,6 +1100,10 @@ static gint ttree_add_row(void *db, gint index_id, void *rec) {
     }
   }//no bounding node found - algorithm 2
 
+  /* One node below or at the bounding node gained a row. Counts must
+   * be correct along the whole path before any rotation. */
+  ttree_adjust_count(db, countoffset, 1);
+
   //if new node was added to tree - must update child height data in nodes from leaf to root
   //or until find a node with imbalance
   //then determine the bad balance case: LL, LR, RR or RL and execute proper rotation
@@ -763,6 +1160,7 @@ static gint ttree_remove_row(void *db, gint index_id, void * rec) {
   int i, found;
   gint key, rootoffset, column, boundtype, bnodeoffset;
   gint rowoffset;
+  wg_uint kp;
   struct wg_tnode *node, *parent;
   wg_index_header *hdr = (wg_index_header *)offsettoptr(db,index_id);
 
@@ -776,17 +1174,52 @@ static gint ttree_remove_row(void *db, gint index_id, void * rec) {
     return -1;
   }
 #endif
-  column = hdr->rec_field_index[0]; /* always one column for T-tree */
+  column = TTREE_KEY_COLUMN(hdr, 0); /* min/max use the leading column */
   key = wg_get_field(db, rec, column);
+  kp = TTREE_KEY_PREFIX_OF(db, key);
   rowoffset = ptrtooffset(db, rec);
+  found = -1;
+
+  if(hdr->fields > 1) {
+    /* Composite key. Seek directly to the first row with an equal
+     * key, the leading column alone may have many duplicates.
+     */
+    gint keys[MAX_INDEX_FIELDS];
+    gint slot;
+
+    for(i=0; i<hdr->fields; i++)
+      keys[i] = wg_get_field(db, rec, TTREE_KEY_COLUMN(hdr, i));
+    bnodeoffset = wg_search_ttree_multi(db, index_id,
+      keys, hdr->fields, 0, &slot);
+    if(!bnodeoffset) return -2;
+    node = (struct wg_tnode *)offsettoptr(db,bnodeoffset);
+
+    for(;;) {
+      for(i=slot;i<node->number_of_elements;i++){
+        if(node->array_of_values[i] == rowoffset) {
+          found = i;
+          goto found_row;
+        }
+        if(ttree_compare_slot(db, hdr, node, i,
+          keys, hdr->fields, kp) == WG_GREATER)
+          goto found_row; /* past the key, row not present */
+      }
+      bnodeoffset = TNODE_SUCCESSOR(db, node);
+      if(!bnodeoffset)
+        break; /* no more successors */
+      node = (struct wg_tnode *)offsettoptr(db,bnodeoffset);
+      slot = 0;
+    }
+    goto found_row;
+  }
 
   /* find bounding node for the value. Since non-unique values
    * are allowed, we will find the leftmost node and scan
    * right from there (we *need* the exact row offset).
    */
 
-  bnodeoffset = wg_search_ttree_leftmost(db,
-          rootoffset, key, &boundtype, NULL);
+  bnodeoffset = ttree_search_leftmost(db,
+          rootoffset, key, kp, &boundtype, NULL);
   node = (struct wg_tnode *)offsettoptr(db,bnodeoffset);
 
   //if bounding node does not exist - error
@@ -796,7 +1229,6 @@ static gint ttree_remove_row(void *db, gint index_id, void * rec) {
    * are many repeated values, so unnecessary deleting should be avoided
    * on higher level.
    */
-  found = -1;
   for(;;) {
     for(i=0;i<node->number_of_elements;i++){
       if(node->array_of_values[i] == rowoffset) {
@@ -808,7 +1240,7 @@ static gint ttree_remove_row(void *db, gint index_id, void * rec) {
     if(!bnodeoffset)
       break; /* no more successors */
     node = (struct wg_tnode *)offsettoptr(db,bnodeoffset);
-    if(WG_COMPARE(db, node->current_min, key) == WG_GREATER)
+    if(TNODE_COMPARE_MIN(db, node, key, kp) == WG_LESSTHAN)
       break; /* successor is not a bounding node */
   }
 
@@ -821,7 +1253,7 @@ found_row:
     /* slide the elements to the right of the found value
      * one step to the left */
     for(i=found; i<node->number_of_elements; i++)
-      node->array_of_values[i] = node->array_of_values[i+1];
+      TNODE_COPY_SLOT(db, node, i, node, i+1)
   }
 
   /* Update min/max */
@@ -849,12 +1281,11 @@ found_row:
 
       /* Make space for a new min value */
       for(i=node->number_of_elements; i>0; i--)
-        node->array_of_values[i] = node->array_of_values[i-1];
+        TNODE_COPY_SLOT(db, node, i, node, i-1)
 
       /* take the glb value (always the rightmost in the array) and
        * insert it in our node */
-      node -> array_of_values[0] = \
-        glbnode->array_of_values[glbnode->number_of_elements-1];
+      TNODE_COPY_SLOT(db, node, 0, glbnode, glbnode->number_of_elements-1)
       node -> number_of_elements++;
       node -> current_min = glbnode -> current_max;
       if(node->number_of_elements == 1) /* we just got our first element */
@@ -873,6 +1304,7 @@ found_row:
 
   //now variable node points to the node which really lost an element
   //this is definitely leaf or half-leaf
+  ttree_adjust_count(db, ptrtooffset(db, node), -1);
   //if the node is empty - free it and rebalanc the tree
   parent = NULL;
   //delete the empty leaf
@@ -907,7 +1339,7 @@ found_row:
 #endif
     /* Free the node, unless it's the root node */
     if(node != offsettoptr(db, TTREE_ROOT_NODE(hdr))) {
-      wg_free_tnode(db, ptrtooffset(db,node));
+      ttree_free_node(db, ptrtooffset(db,node));
     } else {
       /* Set empty state of root node */
       node->current_max = WG_ILLEGAL;
@@ -946,11 +1378,10 @@ found_row:
       if(left){
         /* Left child elements are all smaller than in current node */
         for(j=i-1; j>=0; j--){
-          node->array_of_values[j + child->number_of_elements] = \
-            node->array_of_values[j];
+          TNODE_COPY_SLOT(db, node, j + child->number_of_elements, node, j)
         }
         for(j=0;j<child->number_of_elements;j++){
-          node->array_of_values[j]=child->array_of_values[j];
+          TNODE_COPY_SLOT(db, node, j, child, j)
         }
         node->left_subtree_height=0;
         node->left_child_offset=0;
@@ -959,7 +1390,7 @@ found_row:
       }else{
         /* Right child elements are all larger than in current node */
         for(j=0;j<child->number_of_elements;j++){
-          node->array_of_values[i+j]=child->array_of_values[j];
+          TNODE_COPY_SLOT(db, node, i+j, child, j)
         }
         node->right_subtree_height=0;
         node->right_child_offset=0;
@@ -983,7 +1414,7 @@ found_row:
         TTREE_MIN_NODE(hdr) = child->succ_offset;
       }
 #endif
-      wg_free_tnode(db, ptrtooffset(db, child));
+      ttree_free_node(db, ptrtooffset(db, child));
       if(node->parent_offset) {
         parent = (struct wg_tnode *)offsettoptr(db, node->parent_offset);
         if(parent->left_child_offset==ptrtooffset(db,node)){
@@ -1043,6 +1474,7 @@ gint wg_search_ttree_index(void *db, gint index_id, gint key){
   int i;
   gint rootoffset, bnodetype, bnodeoffset;
   gint rowoffset, column;
+  wg_uint kp;
   struct wg_tnode * node;
   wg_index_header *hdr = (wg_index_header *)offsettoptr(db,index_id);
 
@@ -1059,17 +1491,22 @@ gint wg_search_ttree_index(void *db, gint index_id, gint key){
 #endif
 
   /* Find the leftmost bounding node */
-  bnodeoffset = wg_search_ttree_leftmost(db,
-          rootoffset, key, &bnodetype, NULL);
+  kp = TTREE_KEY_PREFIX_OF(db, key);
+  bnodeoffset = ttree_search_leftmost(db,
+          rootoffset, key, kp, &bnodetype, NULL);
   node = (struct wg_tnode *)offsettoptr(db,bnodeoffset);
 
   if(bnodetype != REALLY_BOUNDING_NODE) return 0;
 
-  column = hdr->rec_field_index[0]; /* always one column for T-tree */
+  column = TTREE_KEY_COLUMN(hdr, 0); /* matches the leading column */
   /* find the record inside the node. */
   for(;;) {
     for(i=0;i<node->number_of_elements;i++){
       rowoffset = node->array_of_values[i];
+#ifdef TTREE_KEY_PREFIX
+      if(node->key_prefix[i] != kp)
+        continue;
+#endif
       if(WG_COMPARE(db,
         wg_get_field(db, (void *)offsettoptr(db,rowoffset), column),
         key) == WG_EQUAL) {
@@ -1083,7 +1520,7 @@ gint wg_search_ttree_index(void *db, gint index_id, gint key){
     if(!bnodeoffset)
       break; /* no more successors */
     node = (struct wg_tnode *)offsettoptr(db,bnodeoffset);
-    if(WG_COMPARE(db, node->current_min, key) == WG_GREATER)
+    if(TNODE_COMPARE_MIN(db, node, key, kp) == WG_LESSTHAN)
       break; /* successor is not a bounding node */
   }
 
@@ -1179,6 +1616,15 @@ gint wg_ttree_find_leaf_successor(void *db, gint nodeoffset) {
  */
 gint wg_search_ttree_rightmost(void *db, gint rootoffset,
   gint key, gint *result, struct wg_tnode *rb_node) {
+  return ttree_search_rightmost(db, rootoffset, key,
+    TTREE_KEY_PREFIX_OF(db, key), result, rb_node);
+}
+
+/** Find rightmost node containing given value
+ *  kp is the key prefix of the value, computed once by the caller.
+ */
+static gint ttree_search_rightmost(void *db, gint rootoffset,
+  gint key, wg_uint kp, gint *result, struct wg_tnode *rb_node) {
 
   struct wg_tnode * node;
 
@@ -1190,14 +1636,14 @@ gint wg_search_ttree_rightmost(void *db, gint rootoffset,
    * is selected immediately. If the search ends in a dead end, the node where
    * the right branch was taken is examined again.
    */
-  if(WG_COMPARE(db, key, node->current_min) == WG_LESSTHAN) {
+  if(TNODE_COMPARE_MIN(db, node, key, kp) == WG_LESSTHAN) {
     /* key < node->current_min */
     if(node->left_child_offset != 0) {
-      return wg_search_ttree_rightmost(db, node->left_child_offset, key,
-        result, rb_node);
+      return ttree_search_rightmost(db, node->left_child_offset, key,
+        kp, result, rb_node);
     } else if (rb_node) {
       /* Dead end, but we still have an unexamined node left */
-      if(WG_COMPARE(db, key, rb_node->current_max) != WG_GREATER) {
+      if(TNODE_COMPARE_MAX(db, rb_node, key, kp) != WG_GREATER) {
         /* key<=rb_node->current_max */
         *result = REALLY_BOUNDING_NODE;
         return ptrtooffset(db, rb_node);
@@ -1213,9 +1659,9 @@ gint wg_search_ttree_rightmost(void *db, gint rootoffset,
        * current_max of the node (therefore avoiding one expensive
        * compare operation).
        */
-      return wg_search_ttree_rightmost(db, node->right_child_offset, key,
-        result, node);
-    } else if(WG_COMPARE(db, key, node->current_max) != WG_GREATER) {
+      return ttree_search_rightmost(db, node->right_child_offset, key,
+        kp, result, node);
+    } else if(TNODE_COMPARE_MAX(db, node, key, kp) != WG_GREATER) {
       /* key<=node->current_max */
       *result = REALLY_BOUNDING_NODE;
       return rootoffset;
@@ -1228,18 +1674,19 @@ gint wg_search_ttree_rightmost(void *db, gint rootoffset,
 #else
   gint bnodeoffset;
 
-  bnodeoffset = db_find_bounding_tnode(db, rootoffset, key, result, NULL);
+  bnodeoffset = db_find_bounding_tnode(db, rootoffset, key, kp,
+    result, NULL);
   if(*result != REALLY_BOUNDING_NODE)
     return bnodeoffset;
 
   /* There is at least one node with the key we're interested in,
    * now make sure we have the rightmost */
   node = offsettoptr(db, bnodeoffset);
-  while(WG_COMPARE(db, node->current_max, key) == WG_EQUAL) {
+  while(TNODE_COMPARE_MAX(db, node, key, kp) == WG_EQUAL) {
     gint nextoffset = TNODE_SUCCESSOR(db, node);
     if(nextoffset) {
       struct wg_tnode *next = offsettoptr(db, nextoffset);
-        if(WG_COMPARE(db, next->current_min, key) == WG_GREATER)
+        if(TNODE_COMPARE_MIN(db, next, key, kp) == WG_LESSTHAN)
           /* next->current_min > key */
           break; /* overshot */
       node = next;
@@ -1256,6 +1703,15 @@ gint wg_search_ttree_rightmost(void *db, gint rootoffset,
  */
 gint wg_search_ttree_leftmost(void *db, gint rootoffset,
   gint key, gint *result, struct wg_tnode *lb_node) {
+  return ttree_search_leftmost(db, rootoffset, key,
+    TTREE_KEY_PREFIX_OF(db, key), result, lb_node);
+}
+
+/** Find leftmost node containing given value
+ *  kp is the key prefix of the value, computed once by the caller.
+ */
+static gint ttree_search_leftmost(void *db, gint rootoffset,
+  gint key, wg_uint kp, gint *result, struct wg_tnode *lb_node) {
 
   struct wg_tnode * node;
 
@@ -1263,14 +1719,14 @@ gint wg_search_ttree_leftmost(void *db, gint rootoffset,
   node = (struct wg_tnode *)offsettoptr(db,rootoffset);
 
   /* Rightmost bound search mirrored */
-  if(WG_COMPARE(db, key, node->current_max) == WG_GREATER) {
+  if(TNODE_COMPARE_MAX(db, node, key, kp) == WG_GREATER) {
     /* key > node->current_max */
     if(node->right_child_offset != 0) {
-      return wg_search_ttree_leftmost(db, node->right_child_offset, key,
-        result, lb_node);
+      return ttree_search_leftmost(db, node->right_child_offset, key,
+        kp, result, lb_node);
     } else if (lb_node) {
       /* Dead end, but we still have an unexamined node left */
-      if(WG_COMPARE(db, key, lb_node->current_min) != WG_LESSTHAN) {
+      if(TNODE_COMPARE_MIN(db, lb_node, key, kp) != WG_LESSTHAN) {
         /* key>=lb_node->current_min */
         *result = REALLY_BOUNDING_NODE;
         return ptrtooffset(db, lb_node);
@@ -1281,9 +1737,9 @@ gint wg_search_ttree_leftmost(void *db, gint rootoffset,
   }
   else {
     if(node->left_child_offset != 0) {
-      return wg_search_ttree_leftmost(db, node->left_child_offset, key,
-        result, node);
-    } else if(WG_COMPARE(db, key, node->current_min) != WG_LESSTHAN) {
+      return ttree_search_leftmost(db, node->left_child_offset, key,
+        kp, result, node);
+    } else if(TNODE_COMPARE_MIN(db, node, key, kp) != WG_LESSTHAN) {
       /* key>=node->current_min */
       *result = REALLY_BOUNDING_NODE;
       return rootoffset;
@@ -1294,18 +1750,19 @@ gint wg_search_ttree_leftmost(void *db, gint rootoffset,
 #else
   gint bnodeoffset;
 
-  bnodeoffset = db_find_bounding_tnode(db, rootoffset, key, result, NULL);
+  bnodeoffset = db_find_bounding_tnode(db, rootoffset, key, kp,
+    result, NULL);
   if(*result != REALLY_BOUNDING_NODE)
     return bnodeoffset;
 
   /* One (we don't know which) bounding node found, traverse the
    * tree to the leftmost. */
   node = offsettoptr(db, bnodeoffset);
-  while(WG_COMPARE(db, node->current_min, key) == WG_EQUAL) {
+  while(TNODE_COMPARE_MIN(db, node, key, kp) == WG_EQUAL) {
     gint prevoffset = TNODE_PREDECESSOR(db, node);
     if(prevoffset) {
       struct wg_tnode *prev = offsettoptr(db, prevoffset);
-      if(WG_COMPARE(db, prev->current_max, key) == WG_LESSTHAN)
+      if(TNODE_COMPARE_MAX(db, prev, key, kp) == WG_GREATER)
         /* prev->current_max < key */
         break; /* overshot */
       node = prev;
@@ -1321,15 +1778,25 @@ gint wg_search_ttree_leftmost(void *db, gint rootoffset,
  *  returns the number of the slot. If the value itself
  *  is missing, the location of the first value that
  *  exceeds it is returned.
+ *  column must be the leading key column of the index.
  */
 gint wg_search_tnode_first(void *db, gint nodeoffset, gint key,
   gint column) {
 
   gint i, encoded;
   struct wg_tnode *node = (struct wg_tnode *) offsettoptr(db, nodeoffset);
+#ifdef TTREE_KEY_PREFIX
+  wg_uint kp = wg_ttree_key_prefix(db, key);
+#endif
 
   for(i=0; i<node->number_of_elements; i++) {
     /* Naive scan is ok for small values of WG_TNODE_ARRAY_SIZE. */
+#ifdef TTREE_KEY_PREFIX
+    if(node->key_prefix[i] < kp)
+      continue; /* encoded < key */
+    if(node->key_prefix[i] > kp)
+      return i;
+#endif
     encoded = wg_get_field(db,
       (void *)offsettoptr(db,node->array_of_values[i]), column);
     if(WG_COMPARE(db, encoded, key) != WG_LESSTHAN)
@@ -1350,8 +1817,17 @@ gint wg_search_tnode_last(void *db, gint nodeoffset, gint key,
 
   gint i, encoded;
   struct wg_tnode *node = (struct wg_tnode *) offsettoptr(db, nodeoffset);
+#ifdef TTREE_KEY_PREFIX
+  wg_uint kp = wg_ttree_key_prefix(db, key);
+#endif
 
   for(i=node->number_of_elements -1; i>=0; i--) {
+#ifdef TTREE_KEY_PREFIX
+    if(node->key_prefix[i] > kp)
+      continue; /* encoded > key */
+    if(node->key_prefix[i] < kp)
+      return i;
+#endif
     encoded = wg_get_field(db,
       (void *)offsettoptr(db,node->array_of_values[i]), column);
     if(WG_COMPARE(db, encoded, key) != WG_GREATER)
@@ -1362,7 +1838,447 @@ gint wg_search_tnode_last(void *db, gint nodeoffset, gint key,
   return -1;
 }
 
+/** Find the first row that is not below a (partial) key
+ *  Compares the first nkeys key columns of the index. Finds the
+ *  leftmost row that is >= keys, or > keys if strict is set. This
+ *  is the seek used for composite indexes, where current_min
+ *  and current_max of the nodes are not enough to locate a key.
+ *
+ *  returns the node offset and sets *slot, or 0 if all rows
+ *  are below the key.
+ */
+gint wg_search_ttree_multi(void *db, gint index_id, gint *keys, gint nkeys,
+  gint strict, gint *slot) {
+
+  gint i, cr, nodeoffset, candidate = 0;
+  struct wg_tnode *node;
+  wg_index_header *hdr = (wg_index_header *) offsettoptr(db, index_id);
+  wg_uint kp = (nkeys ? TTREE_KEY_PREFIX_OF(db, keys[0]) : 0);
+
+  /* Descend to the leftmost node whose last row is in range. Nodes
+   * in the left subtree precede the current one, so once a node
+   * qualifies, only its left subtree can hold a better candidate.
+   */
+  nodeoffset = TTREE_ROOT_NODE(hdr);
+  while(nodeoffset) {
+    node = (struct wg_tnode *) offsettoptr(db, nodeoffset);
+    if(!node->number_of_elements)
+      break; /* empty tree */
+    cr = ttree_compare_slot(db, hdr, node, node->number_of_elements-1,
+      keys, nkeys, kp);
+    if(cr == WG_GREATER || (cr == WG_EQUAL && !strict)) {
+      candidate = nodeoffset;
+      nodeoffset = node->left_child_offset;
+    } else {
+      nodeoffset = node->right_child_offset;
+    }
+  }
+
+  if(candidate) {
+    node = (struct wg_tnode *) offsettoptr(db, candidate);
+    for(i=0; i<node->number_of_elements; i++) {
+      cr = ttree_compare_slot(db, hdr, node, i, keys, nkeys, kp);
+      if(cr == WG_GREATER || (cr == WG_EQUAL && !strict)) {
+        *slot = i;
+        return candidate;
+      }
+    }
+  }
+  return 0;
+}
+
+/** Compute the normalized prefix of a T-tree or B+tree key
+*  The prefix is an unsigned word that orders like wg_compare():
+*  the type is in the high bits, followed by the leading bits of an
+*  order-preserving form of the value. If the prefixes of two values
+*  differ, the values compare the same way, otherwise they need to be
+*  compared in full. Values with no simple order-preserving form
+*  (records, URIs, XML literals) only carry the type.
+*/
+wg_uint wg_ttree_key_prefix(void *db, gint enc) {
+  gint type = wg_get_encoded_type(db, enc);
+  wg_uint val = 0;
+  gint i, len = 0;
+  char *bytes = NULL;
+
+  switch(type) {
+    case WG_INTTYPE:
+    case WG_DATETYPE:
+    case WG_TIMETYPE:
+    case WG_VARTYPE:
+      {
+        gint dec;
+        if(type == WG_INTTYPE) dec = wg_decode_int(db, enc);
+        else if(type == WG_DATETYPE) dec = wg_decode_date(db, enc);
+        else if(type == WG_TIMETYPE) dec = wg_decode_time(db, enc);
+        else dec = wg_decode_var(db, enc);
+        /* flip the sign bit so that negative values sort first */
+        val = (wg_uint) dec ^ ((wg_uint) 1 << (sizeof(wg_uint)*8 - 1));
+      }
+      break;
+    case WG_DOUBLETYPE:
+    case WG_FIXPOINTTYPE:
+      {
+        double d = (type == WG_DOUBLETYPE ? wg_decode_double(db, enc) :
+          wg_decode_fixpoint(db, enc));
+        unsigned long long bits;
+        if(d == 0.0)
+          d = 0.0; /* -0.0 is equal to 0.0 */
+        memcpy(&bits, &d, sizeof(double));
+        /* IEEE 754: negative values sort in reverse */
+        if(bits & (1ULL << 63))
+          bits = ~bits;
+        else
+          bits |= (1ULL << 63);
+        val = (wg_uint) (bits >> (64 - sizeof(wg_uint)*8));
+      }
+      break;
+    case WG_STRTYPE:
+      bytes = wg_decode_str(db, enc);
+      len = (bytes ? (gint) strlen(bytes) : 0);
+      break;
+    case WG_BLOBTYPE:
+      bytes = wg_decode_blob(db, enc);
+      len = wg_decode_blob_len(db, enc);
+      break;
+    case WG_CHARTYPE:
+      val = (wg_uint) (unsigned char) wg_decode_char(db, enc) << \
+        (sizeof(wg_uint)*8 - 8);
+      break;
+    default:
+      break;
+  }
+
+  if(bytes) {
+    /* leading bytes in big-endian order, compared as unsigned
+     * like strcmp() and memcmp() do */
+    for(i=0; i<(gint) sizeof(wg_uint); i++) {
+      val <<= 8;
+      if(i < len)
+        val |= (unsigned char) bytes[i];
+    }
+  }
+  return ((wg_uint) type << TTREE_PREFIX_VALUE_BITS) | (val >> 4);
+}
+
+/** Find the rank of a row in the index order
+*  nodeoffset, slot - position of the row in the tree
+*  returns the number of rows that precede it (0-based rank)
+*/
+gint wg_ttree_rank(void *db, gint nodeoffset, gint slot) {
+  struct wg_tnode *node = (struct wg_tnode *) offsettoptr(db, nodeoffset);
+  gint rank = slot;
+
+  if(node->left_child_offset)
+    rank += ((struct wg_tnode *) offsettoptr(db,
+      node->left_child_offset))->subtree_count;
+
+  /* Walking up, every time we arrive from a right child the parent
+   * and its left subtree precede the row. */
+  while(node->parent_offset) {
+    struct wg_tnode *parent = \
+      (struct wg_tnode *) offsettoptr(db, node->parent_offset);
+    if(parent->right_child_offset == nodeoffset) {
+      rank += parent->number_of_elements;
+      if(parent->left_child_offset)
+        rank += ((struct wg_tnode *) offsettoptr(db,
+          parent->left_child_offset))->subtree_count;
+    }
+    nodeoffset = node->parent_offset;
+    node = parent;
+  }
+  return rank;
+}
+
+/** Find the row with the given rank in the index order
+*  returns the offset of the node holding the row and sets *slot.
+*  returns 0 if the rank is beyond the last row.
+*/
+gint wg_ttree_seek(void *db, gint index_id, gint rank, gint *slot) {
+  gint nodeoffset;
+  wg_index_header *hdr = (wg_index_header *) offsettoptr(db, index_id);
+
+  if(rank < 0)
+    return 0;
+  nodeoffset = TTREE_ROOT_NODE(hdr);
+  while(nodeoffset) {
+    struct wg_tnode *node = (struct wg_tnode *) offsettoptr(db, nodeoffset);
+    gint leftcount = 0;
+    if(node->left_child_offset)
+      leftcount = ((struct wg_tnode *) offsettoptr(db,
+        node->left_child_offset))->subtree_count;
+    if(rank < leftcount) {
+      nodeoffset = node->left_child_offset;
+    } else if(rank < leftcount + node->number_of_elements) {
+      *slot = rank - leftcount;
+      return nodeoffset;
+    } else {
+      rank -= leftcount + node->number_of_elements;
+      nodeoffset = node->right_child_offset;
+    }
+  }
+  return 0;
+}
+
+/** Count the rows between two positions in the tree (both inclusive)
+*  Takes the bounds returned by the query code. A start_offset
+*  of 0 means an empty range.
+*/
+gint wg_ttree_count_range(void *db, gint start_offset, gint start_slot,
+  gint end_offset, gint end_slot) {
+  if(!start_offset)
+    return 0;
+  return wg_ttree_rank(db, end_offset, end_slot) -\
+    wg_ttree_rank(db, start_offset, start_slot) + 1;
+}
+
+/** Copy the included columns of the row in a slot into the node
+*  Fields beyond the end of the row are stored as NULL.
+*/
+void wg_tnode_set_cover(void *db, struct wg_tnode *node, gint slot) {
+  gint *cover = TNODE_COVER(db, node);
+  gint *values = TNODE_COVER_VALUES(cover, slot);
+  void *rec = offsettoptr(db, node->array_of_values[slot]);
+  gint reclen = wg_get_record_len(db, rec);
+  gint i;
+
+  for(i=0; i<cover[1]; i++) {
+    if(cover[2 + i] < reclen)
+      values[i] = wg_get_field(db, rec, cover[2 + i]);
+    else
+      values[i] = 0;
+  }
+}
+
+/** Copy the included columns between two node slots
+*/
+void wg_tnode_copy_cover(void *db, struct wg_tnode *node, gint slot,
+  struct wg_tnode *src, gint srcslot) {
+  gint *dst = TNODE_COVER_VALUES(TNODE_COVER(db, node), slot);
+  gint *from = TNODE_COVER_VALUES(TNODE_COVER(db, src), srcslot);
+  gint i, count = TNODE_COVER(db, node)[1];
+
+  if(dst != from) {
+    for(i=0; i<count; i++)
+      dst[i] = from[i];
+  }
+}
+
+/** Read an included column of a row from the index
+*  nodeoffset, slot - position of the row in the tree
+*  returns 0 and sets *value if the index carries a copy of the column
+*  returns -1 if it does not
+*/
+gint wg_tnode_covered_value(void *db, gint nodeoffset, gint slot,
+  gint column, gint *value) {
+  struct wg_tnode *node = (struct wg_tnode *) offsettoptr(db, nodeoffset);
+  gint *cover, i;
+
+  if(!node->cover_offset)
+    return -1;
+  cover = TNODE_COVER(db, node);
+  for(i=0; i<cover[1]; i++) {
+    if(cover[2 + i] == column) {
+      *value = TNODE_COVER_VALUES(cover, slot)[i];
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/* ------------- T-tree bulk build ------------- */
+
+/**
+*  Compare two bulk build rows by all the key columns. B+tree
+*  entries with equal keys are ordered by row offset.
+*  returns WG_LESSTHAN, WG_EQUAL or WG_GREATER
+*/
+static gint ttree_compare_entries(void *db, wg_index_header *hdr,
+  ttree_entry *a, ttree_entry *b) {
+  gint k, cr;
+
+  if(hdr->type == WG_INDEX_TYPE_SPATIAL) {
+    /* the key is the Z-order key, rows follow in offset order */
+    if(a->key != b->key)
+      return ((wg_uint) a->key < (wg_uint) b->key ? WG_LESSTHAN : WG_GREATER);
+    if(a->offset != b->offset)
+      return (a->offset < b->offset ? WG_LESSTHAN : WG_GREATER);
+    return WG_EQUAL;
+  }
+
+  cr = WG_COMPARE(db, a->key, b->key);
+
+  for(k=1; cr == WG_EQUAL && k<hdr->fields; k++) {
+    gint col = TTREE_KEY_COLUMN(hdr, k);
+    cr = WG_COMPARE(db, wg_get_field(db, offsettoptr(db, a->offset), col),
+      wg_get_field(db, offsettoptr(db, b->offset), col));
+  }
+  if(cr == WG_EQUAL && hdr->type == WG_INDEX_TYPE_BTREE &&\
+    a->offset != b->offset)
+    cr = (a->offset < b->offset ? WG_LESSTHAN : WG_GREATER);
+  return cr;
+}
+
+/**
+*  Sort bulk build rows in key order. Bottom-up merge sort, tmp
+*  must have room for count entries. Runs of TTREE_SORT_RUN rows
+*  are sorted by insertion first.
+*/
+static void ttree_sort_entries(void *db, wg_index_header *hdr,
+  ttree_entry *entries, ttree_entry *tmp, gint count) {
+  gint i, j, width;
+  ttree_entry *src = entries, *dst = tmp, *swap;
+
+  for(i=0; i<count; i+=TTREE_SORT_RUN) {
+    gint end = (i + TTREE_SORT_RUN < count ? i + TTREE_SORT_RUN : count);
+    for(j=i+1; j<end; j++) {
+      ttree_entry e = entries[j];
+      gint k = j;
+      while(k > i &&\
+        ttree_compare_entries(db, hdr, &entries[k-1], &e) == WG_GREATER) {
+        entries[k] = entries[k-1];
+        k--;
+      }
+      entries[k] = e;
+    }
+  }
+
+  for(width=TTREE_SORT_RUN; width<count; width*=2) {
+    for(i=0; i<count; i+=2*width) {
+      gint l = i, mid = (i + width < count ? i + width : count);
+      gint r = mid, end = (i + 2*width < count ? i + 2*width : count);
+      gint out = i;
+      if(r < end &&\
+        ttree_compare_entries(db, hdr, &src[r], &src[r-1]) != WG_LESSTHAN) {
+        l = mid; /* already in order, copy the whole range */
+        r = i;
+      }
+      while(l < mid && r < end) {
+        if(ttree_compare_entries(db, hdr, &src[r], &src[l]) == WG_LESSTHAN)
+          dst[out++] = src[r++];
+        else
+          dst[out++] = src[l++];
+      }
+      while(l < mid)
+        dst[out++] = src[l++];
+      while(r < end)
+        dst[out++] = src[r++];
+    }
+    swap = src;
+    src = dst;
+    dst = swap;
+  }
+  if(src != entries)
+    memcpy(entries, src, count * sizeof(ttree_entry));
+}
+
+/**
+*  Build a perfectly balanced subtree over the nodes lo..hi.
+*  Nodes are numbered in key order and node i holds the sorted rows
+*  starting from i*WG_TNODE_ARRAY_SIZE, so all nodes are full except
+*  the last one, which always ends up a leaf. *prev is the node that
+*  precedes the subtree in key order and is updated to its last node,
+*  linking the sequential chain as the nodes are filled.
+*  returns the offset of the subtree root, 0 on error
+*/
+static gint ttree_build_nodes(void *db, wg_index_header *hdr,
+  ttree_entry *entries, gint count, gint lo, gint hi, gint parent,
+  gint *prev, gint *height) {
+  gint offset, first, i, mid = lo + (hi - lo) / 2;
+  gint lheight = 0, rheight = 0;
+  struct wg_tnode *node;
+
+  offset = ttree_alloc_node(db, hdr);
+  if(!offset)
+    return 0;
+  node = (struct wg_tnode *) offsettoptr(db, offset);
+  node->parent_offset = parent;
+  node->left_child_offset = 0;
+  node->right_child_offset = 0;
+
+  if(lo < mid) {
+    node->left_child_offset = ttree_build_nodes(db, hdr, entries, count,
+      lo, mid - 1, offset, prev, &lheight);
+    if(!node->left_child_offset)
+      return 0;
+  }
+
+  first = mid * WG_TNODE_ARRAY_SIZE;
+  for(i=0; i<WG_TNODE_ARRAY_SIZE && first+i<count; i++)
+    TNODE_SET_SLOT(db, node, i, entries[first+i].offset,
+      TTREE_KEY_PREFIX_OF(db, entries[first+i].key))
+  node->number_of_elements = i;
+  node->current_min = entries[first].key;
+  node->current_max = entries[first+i-1].key;
+#ifdef TTREE_CHAINED_NODES
+  node->pred_offset = *prev;
+  node->succ_offset = 0;
+  if(*prev)
+    ((struct wg_tnode *) offsettoptr(db, *prev))->succ_offset = offset;
+  else
+    TTREE_MIN_NODE(hdr) = offset;
+#endif
+  *prev = offset;
+
+  if(mid < hi) {
+    node->right_child_offset = ttree_build_nodes(db, hdr, entries, count,
+      mid + 1, hi, offset, prev, &rheight);
+    if(!node->right_child_offset)
+      return 0;
+  }
+
+  node->left_subtree_height = (unsigned char) lheight;
+  node->right_subtree_height = (unsigned char) rheight;
+  tnode_recount(db, node);
+  *height = max(lheight, rheight) + 1;
+  return offset;
+}
+
+/**
+*  Collect the rows that belong to a T-tree index with their
+*  leading key values. The array is allocated with malloc().
+*  returns the array, NULL if out of memory
+*/
+static ttree_entry *ttree_collect_rows(void *db, wg_index_header *hdr,
+  gint *count) {
+  gint size = 1024, n = 0;
+  gint column = TTREE_KEY_COLUMN(hdr, 0);
+  gint lastcol = hdr->rec_field_index[hdr->fields - 1];
+  ttree_entry *entries = (ttree_entry *) malloc(size * sizeof(ttree_entry));
+  void *rec;
+
+  if(!entries)
+    return NULL;
+  rec = index_first_row(db, ptrtooffset(db, hdr));
+  while(rec != NULL) {
+    if(lastcol < wg_get_record_len(db, rec) && MATCH_INDEX(db, hdr, rec)) {
+      if(n == size) {
+        ttree_entry *tmp = (ttree_entry *) realloc(entries,
+          2 * size * sizeof(ttree_entry));
+        if(!tmp) {
+          free(entries);
+          return NULL;
+        }
+        entries = tmp;
+        size *= 2;
+      }
+      if(hdr->type == WG_INDEX_TYPE_SPATIAL)
+        entries[n].key = (gint) spatial_row_key(db, hdr, rec);
+      else
+        entries[n].key = wg_get_field(db, rec, column);
+      entries[n].offset = ptrtooffset(db, rec);
+      n++;
+    }
+    rec = wg_get_next_record(db, rec);
+  }
+  *count = n;
+  return entries;
+}
+
 /** Create T-tree index on a column
+*  The existing rows are sorted and the tree is built bottom-up,
+*  perfectly balanced with full nodes. If there is not enough local
+*  memory for that, the rows are added one by one instead.
 *  returns:
 *  0 - on success
 *  -1 - error (failed to create the index)
@@ -1372,13 +2288,49 @@ static gint create_ttree_index(void *db, gint index_id){
   unsigned int rowsprocessed;
   struct wg_tnode *nodest;
   void *rec;
-  db_memsegment_header* dbh = dbmemsegh(db);
   wg_index_header *hdr = (wg_index_header *) offsettoptr(db, index_id);
-  gint column = hdr->rec_field_index[0];
+  gint column = TTREE_KEY_COLUMN(hdr, 0);
+  gint lastcol = hdr->rec_field_index[hdr->fields - 1];
+  ttree_entry *entries, *tmp;
+  gint count = 0;
+
+  entries = ttree_collect_rows(db, hdr, &count);
+  if(entries && count) {
+    tmp = (ttree_entry *) malloc(count * sizeof(ttree_entry));
+    if(tmp) {
+      gint prev = 0, height;
+
+      ttree_sort_entries(db, hdr, entries, tmp, count);
+      free(tmp);
+      node = ttree_build_nodes(db, hdr, entries, count, 0,
+        (count - 1) / WG_TNODE_ARRAY_SIZE, 0, &prev, &height);
+      free(entries);
+      if(!node) {
+        show_index_error(db, "Failed to allocate T-tree nodes");
+        return -1;
+      }
+      TTREE_ROOT_NODE(hdr) = node;
+#ifdef TTREE_CHAINED_NODES
+      TTREE_MAX_NODE(hdr) = prev;
+#endif
+#ifdef WG_NO_ERRPRINT
+#else
+      fprintf(stderr,"new index created on rec field %d into slot %d and %d data rows inserted\n",
+        (int) column, (int) index_id, (int) count);
+#endif
+      return 0;
+    }
+  }
+  if(entries)
+    free(entries);
 
   /* allocate (+ init) root node for new index tree and save
    * the offset into index_array */
-  node = wg_alloc_fixlen_object(db, &dbh->tnode_area_header);
+  node = ttree_alloc_node(db, hdr);
+  if(!node) {
+    show_index_error(db, "Failed to allocate the root node");
+    return -1;
+  }
   nodest =(struct wg_tnode *)offsettoptr(db,node);
   nodest->parent_offset = 0;
   nodest->left_subtree_height = 0;
@@ -1386,6 +2338,7 @@ static gint create_ttree_index(void *db, gint index_id){
   nodest->current_max = WG_ILLEGAL;
   nodest->current_min = WG_ILLEGAL;
   nodest->number_of_elements = 0;
+  nodest->subtree_count = 0;
   nodest->left_child_offset = 0;
   nodest->right_child_offset = 0;
 #ifdef TTREE_CHAINED_NODES
@@ -1400,15 +2353,15 @@ static gint create_ttree_index(void *db, gint index_id){
 #endif
 
   //scan all the data - make entry for every suitable row
-  rec = wg_get_first_record(db);
+  rec = index_first_row(db, index_id);
   rowsprocessed = 0;
 
   while(rec != NULL) {
-    if(column >= wg_get_record_len(db, rec)) {
+    if(lastcol >= wg_get_record_len(db, rec)) {
       rec=wg_get_next_record(db,rec);
       continue;
     }
-    if(MATCH_TEMPLATE(db, hdr, rec)) {
+    if(MATCH_INDEX(db, hdr, rec)) {
       ttree_add_row(db, index_id, rec);
       rowsprocessed++;
     }
@@ -1430,7 +2383,6 @@ static gint create_ttree_index(void *db, gint index_id){
 *  -1 - error
 */
 static gint drop_ttree_index(void *db, gint index_id){
-  struct wg_tnode *node;
   wg_index_header *hdr;
 
   hdr = (wg_index_header *) offsettoptr(db, index_id);
@@ -1441,20 +2393,11 @@ static gint drop_ttree_index(void *db, gint index_id){
    * traversal often runs down and up parent-child chains, which means
    * that some parents cannot be deleted before their children.
    */
-  node = NULL;
 #ifdef TTREE_CHAINED_NODES
   if(TTREE_MIN_NODE(hdr))
-    node = (struct wg_tnode *) offsettoptr(db, TTREE_MIN_NODE(hdr));
+    ttree_free_chain(db, TTREE_MIN_NODE(hdr));
   else if(TTREE_ROOT_NODE(hdr)) /* normally this does not happen */
-    node = (struct wg_tnode *) offsettoptr(db, TTREE_ROOT_NODE(hdr));
-  while(node) {
-    gint deleteme = ptrtooffset(db, node);
-    if(node->succ_offset)
-      node = (struct wg_tnode *) offsettoptr(db, node->succ_offset);
-    else
-      node = NULL;
-    wg_free_tnode(db, deleteme);
-  }
+    ttree_free_chain(db, TTREE_ROOT_NODE(hdr));
 #else
   /* XXX: not implemented */
   show_index_error(db, "Warning: T-node memory cannot be deallocated");
@@ -1463,6 +2406,658 @@ static gint drop_ttree_index(void *db, gint index_id){
   return 0;
 }
 
+#ifdef TTREE_CHAINED_NODES
+/** Free the T-nodes from a node to the end of the sequential chain
+*/
+static void ttree_free_chain(void *db, gint nodeoffset) {
+  while(nodeoffset) {
+    struct wg_tnode *node = (struct wg_tnode *) offsettoptr(db, nodeoffset);
+    gint deleteme = nodeoffset;
+    nodeoffset = node->succ_offset;
+    ttree_free_node(db, deleteme);
+  }
+}
+#endif
+
+/* ------------------- B+tree private functions ------------- */
+
+/**
+*  Compare the entry in a B+tree node slot to a key. The normalized
+*  prefixes are compared first, the encoded keys only if they are
+*  equal. Entries with equal keys are ordered by the row offset;
+*  a row of 0 compares equal to all of them.
+*  returns the entry relative to the key
+*/
+static gint bnode_compare(void *db, struct wg_bnode *node, gint slot,
+  wg_uint kp, gint key, gint row) {
+  gint cr;
+
+  if(node->key_prefix[slot] != kp)
+    return (node->key_prefix[slot] < kp ? WG_LESSTHAN : WG_GREATER);
+  cr = WG_COMPARE(db, node->key[slot], key);
+  if(cr != WG_EQUAL || !row || node->row[slot] == row)
+    return cr;
+  return (node->row[slot] < row ? WG_LESSTHAN : WG_GREATER);
+}
+
+/**
+*  Binary search in a node, starting from slot lo.
+*  returns the first slot that is greater than or equal to the key
+*  (greater than, if strict is set), node->count if there is none
+*/
+static gint bnode_lower_bound(void *db, struct wg_bnode *node, gint lo,
+  wg_uint kp, gint key, gint row, gint strict) {
+  gint hi = node->count;
+
+  while(lo < hi) {
+    gint mid = lo + (hi - lo) / 2;
+    gint cr = bnode_compare(db, node, mid, kp, key, row);
+    if(cr == WG_LESSTHAN || (cr == WG_EQUAL && strict))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/**
+*  Insert an entry into a node that has room for it. In inner
+*  nodes, child is the subtree of the entry and gets the node
+*  as its new parent.
+*/
+static void bnode_insert_slot(void *db, struct wg_bnode *node, gint slot,
+  wg_uint kp, gint key, gint row, gint child) {
+  gint i;
+
+  for(i=node->count; i>slot; i--) {
+    node->key_prefix[i] = node->key_prefix[i-1];
+    node->key[i] = node->key[i-1];
+    node->row[i] = node->row[i-1];
+    node->child[i] = node->child[i-1];
+  }
+  node->key_prefix[slot] = kp;
+  node->key[slot] = key;
+  node->row[slot] = row;
+  node->child[slot] = child;
+  node->count++;
+  if(child) {
+    ((struct wg_bnode *) offsettoptr(db, child))->parent_offset = \
+      ptrtooffset(db, node);
+  }
+}
+
+/**
+*  Remove an entry from a node
+*/
+static void bnode_remove_slot(struct wg_bnode *node, gint slot) {
+  gint i;
+
+  node->count--;
+  for(i=slot; i<node->count; i++) {
+    node->key_prefix[i] = node->key_prefix[i+1];
+    node->key[i] = node->key[i+1];
+    node->row[i] = node->row[i+1];
+    node->child[i] = node->child[i+1];
+  }
+}
+
+/**
+*  Find the slot of a subtree in its parent
+*  returns the slot, -1 if not found
+*/
+static gint bnode_child_slot(struct wg_bnode *node, gint child) {
+  gint i;
+
+  for(i=0; i<node->count; i++) {
+    if(node->child[i] == child)
+      return i;
+  }
+  return -1;
+}
+
+/**
+*  Allocate and initialize an empty B+tree node
+*  returns the offset of the node, 0 on error
+*/
+static gint btree_new_node(void *db, gint leaf) {
+  struct wg_bnode *node;
+  gint offset = wg_alloc_fixlen_object(db, &dbmemsegh(db)->bnode_area_header);
+
+  if(!offset)
+    return 0;
+  node = (struct wg_bnode *) offsettoptr(db, offset);
+  node->parent_offset = 0;
+  node->leaf = leaf;
+  node->count = 0;
+  node->next_offset = 0;
+  node->prev_offset = 0;
+  return offset;
+}
+
+/**
+*  Copy the first entry of a node into its ancestors after it has
+*  changed. The lower bound of a subtree is always its first entry,
+*  so that the encoded keys in the inner nodes refer to values that
+*  are still stored in the rows.
+*/
+static void btree_update_bounds(void *db, struct wg_bnode *node) {
+  while(node->parent_offset && node->count) {
+    struct wg_bnode *parent = (struct wg_bnode *) offsettoptr(db,
+      node->parent_offset);
+    gint slot = bnode_child_slot(parent, ptrtooffset(db, node));
+    parent->key_prefix[slot] = node->key_prefix[0];
+    parent->key[slot] = node->key[0];
+    parent->row[slot] = node->row[0];
+    if(slot)
+      break;
+    node = parent;
+  }
+}
+
+/**
+*  Descend from the root to the leaf where the search for a key
+*  begins. In each inner node the last subtree with a lower bound
+*  less than the key (less than or equal, if strict is set) is taken.
+*  returns the offset of the leaf
+*/
+static gint btree_find_leaf(void *db, wg_index_header *hdr, wg_uint kp,
+  gint key, gint row, gint strict) {
+  gint offset = BTREE_ROOT_NODE(hdr);
+  struct wg_bnode *node = (struct wg_bnode *) offsettoptr(db, offset);
+
+  while(!node->leaf) {
+    offset = node->child[bnode_lower_bound(db, node, 1, kp, key, row,
+      strict) - 1];
+    node = (struct wg_bnode *) offsettoptr(db, offset);
+  }
+  return offset;
+}
+
+/**
+*  Insert an entry into a node, splitting the node if it is full.
+*  The upper half of a full node moves to a new right sibling, whose
+*  first entry is then inserted into the parent. Splitting the root
+*  adds a new root above it.
+*  returns 0 on success, -1 on error
+*/
+static gint btree_insert(void *db, wg_index_header *hdr, gint offset,
+  gint slot, wg_uint kp, gint key, gint row, gint child) {
+  struct wg_bnode *node, *sibling;
+  gint siboffset, i, half = WG_BNODE_SIZE / 2;
+
+  for(;;) {
+    node = (struct wg_bnode *) offsettoptr(db, offset);
+    if(node->count < WG_BNODE_SIZE) {
+      bnode_insert_slot(db, node, slot, kp, key, row, child);
+      if(!slot)
+        btree_update_bounds(db, node);
+      return 0;
+    }
+
+    siboffset = btree_new_node(db, node->leaf);
+    if(!siboffset) {
+      show_index_error(db, "Failed to allocate a B+tree node");
+      return -1;
+    }
+    sibling = (struct wg_bnode *) offsettoptr(db, siboffset);
+    for(i=half; i<WG_BNODE_SIZE; i++) {
+      sibling->key_prefix[i-half] = node->key_prefix[i];
+      sibling->key[i-half] = node->key[i];
+      sibling->row[i-half] = node->row[i];
+      sibling->child[i-half] = node->child[i];
+      if(!node->leaf) {
+        ((struct wg_bnode *) offsettoptr(db, node->child[i]))->parent_offset = \
+          siboffset;
+      }
+    }
+    sibling->count = WG_BNODE_SIZE - half;
+    node->count = half;
+    sibling->parent_offset = node->parent_offset;
+    if(node->leaf) {
+      sibling->prev_offset = offset;
+      sibling->next_offset = node->next_offset;
+      if(node->next_offset)
+        ((struct wg_bnode *) offsettoptr(db,
+          node->next_offset))->prev_offset = siboffset;
+      else
+        BTREE_LAST_LEAF(hdr) = siboffset;
+      node->next_offset = siboffset;
+    }
+
+    if(slot <= half) {
+      bnode_insert_slot(db, node, slot, kp, key, row, child);
+      if(!slot)
+        btree_update_bounds(db, node);
+    } else
+      bnode_insert_slot(db, sibling, slot - half, kp, key, row, child);
+
+    /* The sibling becomes a new subtree of the parent */
+    kp = sibling->key_prefix[0];
+    key = sibling->key[0];
+    row = sibling->row[0];
+    child = siboffset;
+
+    if(!node->parent_offset) {
+      gint rootoffset = btree_new_node(db, 0);
+      struct wg_bnode *root;
+      if(!rootoffset) {
+        show_index_error(db, "Failed to allocate a B+tree node");
+        return -1;
+      }
+      root = (struct wg_bnode *) offsettoptr(db, rootoffset);
+      bnode_insert_slot(db, root, 0, node->key_prefix[0], node->key[0],
+        node->row[0], offset);
+      bnode_insert_slot(db, root, 1, kp, key, row, child);
+      BTREE_ROOT_NODE(hdr) = rootoffset;
+      return 0;
+    }
+    slot = bnode_child_slot((struct wg_bnode *) offsettoptr(db,
+      node->parent_offset), offset) + 1;
+    offset = node->parent_offset;
+  }
+}
+
+/**
+*  Get the key of a row in a B+tree index. A spatial index has
+*  the Z-order key of the row and no encoded key.
+*/
+static void btree_row_key(void *db, wg_index_header *hdr, void *rec,
+  wg_uint *kp, gint *key) {
+  if(hdr->type == WG_INDEX_TYPE_SPATIAL) {
+    *kp = spatial_row_key(db, hdr, rec);
+    *key = 0;
+  } else {
+    *key = wg_get_field(db, rec, hdr->rec_field_index[0]);
+    *kp = wg_ttree_key_prefix(db, *key);
+  }
+}
+
+/**  inserts pointer to data row into B+tree index
+ *  returns:
+ *  0 - on success
+ *  -1 - if error
+ */
+static gint btree_add_row(void *db, gint index_id, void *rec) {
+  wg_index_header *hdr = (wg_index_header *) offsettoptr(db, index_id);
+  gint row = ptrtooffset(db, rec);
+  gint offset, slot, key;
+  wg_uint kp;
+
+  btree_row_key(db, hdr, rec, &kp, &key);
+  offset = btree_find_leaf(db, hdr, kp, key, row, 1);
+  slot = bnode_lower_bound(db, (struct wg_bnode *) offsettoptr(db, offset),
+    0, kp, key, row, 1);
+  return btree_insert(db, hdr, offset, slot, kp, key, row, 0);
+}
+
+/**  removes pointer to data row from B+tree index
+ *  Nodes are not merged, but they are freed when they become empty.
+ *  returns:
+ *  0 - on success
+ *  -3 - if error, row not found in the index
+ */
+static gint btree_remove_row(void *db, gint index_id, void *rec) {
+  wg_index_header *hdr = (wg_index_header *) offsettoptr(db, index_id);
+  gint row = ptrtooffset(db, rec);
+  gint offset, slot, key;
+  wg_uint kp;
+  struct wg_bnode *node, *root;
+  db_memsegment_header* dbh = dbmemsegh(db);
+
+  btree_row_key(db, hdr, rec, &kp, &key);
+  offset = btree_find_leaf(db, hdr, kp, key, row, 1);
+  node = (struct wg_bnode *) offsettoptr(db, offset);
+  slot = bnode_lower_bound(db, node, 0, kp, key, row, 0);
+  if(slot >= node->count || node->row[slot] != row)
+    return -3;
+  bnode_remove_slot(node, slot);
+  if(!slot)
+    btree_update_bounds(db, node);
+
+  while(!node->count && node->parent_offset) {
+    gint parent = node->parent_offset;
+    if(node->leaf) {
+      if(node->prev_offset)
+        ((struct wg_bnode *) offsettoptr(db,
+          node->prev_offset))->next_offset = node->next_offset;
+      else
+        BTREE_FIRST_LEAF(hdr) = node->next_offset;
+      if(node->next_offset)
+        ((struct wg_bnode *) offsettoptr(db,
+          node->next_offset))->prev_offset = node->prev_offset;
+      else
+        BTREE_LAST_LEAF(hdr) = node->prev_offset;
+    }
+    wg_free_fixlen_object(db, &dbh->bnode_area_header, offset);
+    node = (struct wg_bnode *) offsettoptr(db, parent);
+    slot = bnode_child_slot(node, offset);
+    bnode_remove_slot(node, slot);
+    if(!slot)
+      btree_update_bounds(db, node);
+    offset = parent;
+  }
+
+  /* Shrink the tree if the root has a single subtree left */
+  root = (struct wg_bnode *) offsettoptr(db, BTREE_ROOT_NODE(hdr));
+  while(!root->leaf && root->count == 1) {
+    gint child = root->child[0];
+    wg_free_fixlen_object(db, &dbh->bnode_area_header, BTREE_ROOT_NODE(hdr));
+    BTREE_ROOT_NODE(hdr) = child;
+    root = (struct wg_bnode *) offsettoptr(db, child);
+    root->parent_offset = 0;
+  }
+  return 0;
+}
+
+/**
+*  Build the B+tree bottom-up from rows sorted in index order.
+*  Nodes are filled to BTREE_BUILD_FILL entries, leaving room for
+*  later inserts. Every level is built from the first entries and
+*  offsets of the level below.
+*  returns the offset of the root, 0 on error
+*/
+static gint btree_build_nodes(void *db, wg_index_header *hdr,
+  ttree_entry *entries, gint count) {
+  gint *level, n, i, j, prev = 0, root;
+  struct wg_bnode *node;
+
+  n = (count + BTREE_BUILD_FILL - 1) / BTREE_BUILD_FILL;
+  level = (gint *) malloc(n * sizeof(gint));
+  if(!level)
+    return 0;
+
+  for(i=0; i<n; i++) {
+    gint offset = btree_new_node(db, 1);
+    if(!offset) {
+      free(level);
+      return 0;
+    }
+    node = (struct wg_bnode *) offsettoptr(db, offset);
+    for(j=0; j<BTREE_BUILD_FILL && i*BTREE_BUILD_FILL+j < count; j++) {
+      ttree_entry *e = &entries[i*BTREE_BUILD_FILL+j];
+      if(hdr->type == WG_INDEX_TYPE_SPATIAL) {
+        node->key_prefix[j] = (wg_uint) e->key;
+        node->key[j] = 0;
+      } else {
+        node->key_prefix[j] = wg_ttree_key_prefix(db, e->key);
+        node->key[j] = e->key;
+      }
+      node->row[j] = e->offset;
+      node->child[j] = 0;
+    }
+    node->count = j;
+    node->prev_offset = prev;
+    if(prev)
+      ((struct wg_bnode *) offsettoptr(db, prev))->next_offset = offset;
+    else
+      BTREE_FIRST_LEAF(hdr) = offset;
+    prev = offset;
+    level[i] = offset;
+  }
+  BTREE_LAST_LEAF(hdr) = prev;
+
+  while(n > 1) {
+    gint m = (n + BTREE_BUILD_FILL - 1) / BTREE_BUILD_FILL;
+    for(i=0; i<m; i++) {
+      gint offset = btree_new_node(db, 0);
+      if(!offset) {
+        free(level);
+        return 0;
+      }
+      node = (struct wg_bnode *) offsettoptr(db, offset);
+      for(j=0; j<BTREE_BUILD_FILL && i*BTREE_BUILD_FILL+j < n; j++) {
+        struct wg_bnode *child = (struct wg_bnode *) offsettoptr(db,
+          level[i*BTREE_BUILD_FILL+j]);
+        bnode_insert_slot(db, node, j, child->key_prefix[0], child->key[0],
+          child->row[0], level[i*BTREE_BUILD_FILL+j]);
+      }
+      level[i] = offset;
+    }
+    n = m;
+  }
+
+  root = level[0];
+  free(level);
+  return root;
+}
+
+/** Create B+tree index on a column
+*  Like T-trees, the existing rows are sorted and the tree is built
+*  bottom-up. If there is not enough local memory for that, the rows
+*  are added one by one instead. Spatial indexes are built the same way.
+*  returns:
+*  0 - on success
+*  -1 - error (failed to create the index)
+*/
+static gint create_btree_index(void *db, gint index_id){
+  gint root;
+  unsigned int rowsprocessed;
+  void *rec;
+  wg_index_header *hdr = (wg_index_header *) offsettoptr(db, index_id);
+  gint column = hdr->rec_field_index[0];
+  gint lastcol = hdr->rec_field_index[hdr->fields - 1];
+  ttree_entry *entries, *tmp;
+  gint count = 0;
+
+  entries = ttree_collect_rows(db, hdr, &count);
+  if(entries && count) {
+    tmp = (ttree_entry *) malloc(count * sizeof(ttree_entry));
+    if(tmp) {
+      ttree_sort_entries(db, hdr, entries, tmp, count);
+      free(tmp);
+      root = btree_build_nodes(db, hdr, entries, count);
+      free(entries);
+      if(!root) {
+        show_index_error(db, "Failed to allocate B+tree nodes");
+        return -1;
+      }
+      BTREE_ROOT_NODE(hdr) = root;
+#ifdef WG_NO_ERRPRINT
+#else
+      fprintf(stderr,"new B+tree index created on rec field %d into slot %d and %d data rows inserted\n",
+        (int) column, (int) index_id, (int) count);
+#endif
+      return 0;
+    }
+  }
+  if(entries)
+    free(entries);
+
+  root = btree_new_node(db, 1);
+  if(!root) {
+    show_index_error(db, "Failed to allocate a B+tree node");
+    return -1;
+  }
+  BTREE_ROOT_NODE(hdr) = root;
+  BTREE_FIRST_LEAF(hdr) = root;
+  BTREE_LAST_LEAF(hdr) = root;
+
+  rec = index_first_row(db, index_id);
+  rowsprocessed = 0;
+  while(rec != NULL) {
+    if(lastcol < wg_get_record_len(db, rec) && MATCH_INDEX(db, hdr, rec)) {
+      if(btree_add_row(db, index_id, rec))
+        return -1;
+      rowsprocessed++;
+    }
+    rec = wg_get_next_record(db, rec);
+  }
+#ifdef WG_NO_ERRPRINT
+#else
+  fprintf(stderr,"new B+tree index created on rec field %d into slot %d and %d data rows inserted\n",
+    (int) column, (int) index_id, rowsprocessed);
+#endif
+  return 0;
+}
+
+/**
+*  Free a B+tree subtree
+*/
+static void btree_free_nodes(void *db, gint offset) {
+  struct wg_bnode *node = (struct wg_bnode *) offsettoptr(db, offset);
+  gint i;
+
+  if(!node->leaf) {
+    for(i=0; i<node->count; i++)
+      btree_free_nodes(db, node->child[i]);
+  }
+  wg_free_fixlen_object(db, &dbmemsegh(db)->bnode_area_header, offset);
+}
+
+/** Drop B+tree index by id
+*  Frees the memory in the B+tree node area
+*  returns:
+*  0 - on success
+*  -1 - error
+*/
+static gint drop_btree_index(void *db, gint index_id){
+  wg_index_header *hdr = (wg_index_header *) offsettoptr(db, index_id);
+
+  if(BTREE_ROOT_NODE(hdr))
+    btree_free_nodes(db, BTREE_ROOT_NODE(hdr));
+  return 0;
+}
+
+/** Find the first entry of a B+tree index at or after a key
+*  index_id - B+tree index
+*  key - encoded value
+*  strict - skip the entries equal to the key
+*  slot - set to the slot of the entry in the leaf
+*  returns the offset of the leaf, 0 if there is no such entry
+*/
+gint wg_search_btree(void *db, gint index_id, gint key, gint strict,
+  gint *slot) {
+  wg_index_header *hdr = (wg_index_header *) offsettoptr(db, index_id);
+  wg_uint kp = wg_ttree_key_prefix(db, key);
+  gint offset, i;
+  struct wg_bnode *node;
+
+  offset = btree_find_leaf(db, hdr, kp, key, 0, strict);
+  node = (struct wg_bnode *) offsettoptr(db, offset);
+  i = bnode_lower_bound(db, node, 0, kp, key, 0, strict);
+  if(i >= node->count) {
+    /* The entry is the first one in the next leaf. Only the
+     * root leaf can be empty, so the next leaf has one. */
+    offset = node->next_offset;
+    i = 0;
+  }
+  *slot = i;
+  return offset;
+}
+
+/* -------------- Spatial index functions ------------- */
+
+/** Compute the key of a coordinate in a spatial index
+*  The key orders like wg_compare(): the two high bits are the class
+*  of the type (below integers, integers, doubles, above doubles),
+*  the rest are the leading bits of an order-preserving form of the
+*  number. Integers are converted to doubles, so they keep about
+*  SPATIAL_AXIS_BITS - 14 significant bits. Values that are not
+*  numbers only carry the type.
+*/
+wg_uint wg_spatial_axis_key(void *db, gint enc) {
+  gint type = wg_get_encoded_type(db, enc);
+  gint shift = SPATIAL_AXIS_BITS - 2;
+  unsigned long long bits;
+  double d;
+
+  if(type < WG_INTTYPE)
+    return 0;
+  if(type > WG_DOUBLETYPE)
+    return ((wg_uint) 3 << shift) | ((wg_uint) type << (shift - 4));
+
+  d = (type == WG_INTTYPE ? (double) wg_decode_int(db, enc) :
+    wg_decode_double(db, enc));
+  if(d == 0.0)
+    d = 0.0; /* -0.0 is equal to 0.0 */
+  memcpy(&bits, &d, sizeof(double));
+  /* IEEE 754: negative values sort in reverse */
+  if(bits & (1ULL << 63))
+    bits = ~bits;
+  else
+    bits |= (1ULL << 63);
+  return ((wg_uint) (type == WG_INTTYPE ? 1 : 2) << shift) |\
+    (wg_uint) (bits >> (64 - shift));
+}
+
+/** Interleave the keys of two coordinates into a Z-order key
+*  The bits of x go to the odd positions and the bits of y to the
+*  even positions.
+*/
+wg_uint wg_spatial_key(wg_uint x, wg_uint y) {
+  wg_uint z = 0;
+  gint i;
+
+  for(i=0; i<(gint) SPATIAL_AXIS_BITS; i++) {
+    z |= ((x >> i) & 1) << (2*i + 1);
+    z |= ((y >> i) & 1) << (2*i);
+  }
+  return z;
+}
+
+/** Find the next Z-order key that is inside a box
+*  lo and hi are the keys of the lower and upper corner of the box,
+*  z is a key between them that is outside the box. The search
+*  follows the bits from the top, narrowing the box to the half that
+*  z is in (Tropf and Herzog, the BIGMIN computation).
+*  returns 1 and sets *next to the smallest key in the box greater
+*  than z, 0 if there is none.
+*/
+gint wg_spatial_next(wg_uint z, wg_uint lo, wg_uint hi, wg_uint *next) {
+  gint b, found = 0;
+
+  for(b=sizeof(wg_uint)*8-1; b>=0; b--) {
+    wg_uint bit = (wg_uint) 1 << b;
+    /* lower bits of the same coordinate */
+    wg_uint axis = (b & 1 ? SPATIAL_X_BITS : SPATIAL_Y_BITS) & (bit - 1);
+
+    if(z & bit) {
+      if(!(lo & bit) && !(hi & bit))
+        break; /* z is past the box, the candidate is the answer */
+      if(!(lo & bit))
+        lo = (lo | bit) & ~axis; /* continue in the upper half */
+    } else if(lo & bit) {
+      *next = lo; /* the whole box is above z */
+      return 1;
+    } else if(hi & bit) {
+      /* the upper half starts above z, continue in the lower half */
+      *next = (lo | bit) & ~axis;
+      found = 1;
+      hi = (hi & ~bit) | axis;
+    }
+  }
+  return found;
+}
+
+/** Find the first entry of a spatial index at or after a Z-order key
+*  slot - set to the slot of the entry in the leaf
+*  returns the offset of the leaf, 0 if there is no such entry
+*/
+gint wg_search_spatial(void *db, gint index_id, wg_uint z, gint *slot) {
+  wg_index_header *hdr = (wg_index_header *) offsettoptr(db, index_id);
+  gint offset, i;
+  struct wg_bnode *node;
+
+  offset = btree_find_leaf(db, hdr, z, 0, 0, 0);
+  node = (struct wg_bnode *) offsettoptr(db, offset);
+  i = bnode_lower_bound(db, node, 0, z, 0, 0, 0);
+  if(i >= node->count) {
+    offset = node->next_offset;
+    i = 0;
+  }
+  *slot = i;
+  return offset;
+}
+
+/**
+*  Get the Z-order key of a row in a spatial index
+*/
+static wg_uint spatial_row_key(void *db, wg_index_header *hdr, void *rec) {
+  return wg_spatial_key(
+    wg_spatial_axis_key(db, wg_get_field(db, rec, hdr->rec_field_index[0])),
+    wg_spatial_axis_key(db, wg_get_field(db, rec, hdr->rec_field_index[1])));
+}
+
 /* -------------- Hash index private functions ------------- */
 
 /**  inserts pointer to data row into index tree structure
@@ -1474,12 +3069,13 @@ static gint hash_add_row(void *db, gint index_id, void *rec) {
   wg_index_header *hdr = (wg_index_header *)offsettoptr(db,index_id);
   gint i;
   gint values[MAX_INDEX_FIELDS];
+  char keybuf[HASHIDX_KEY_BUFSIZE];
 
   for(i=0; i<hdr->fields; i++) {
     values[i] = wg_get_field(db, rec, hdr->rec_field_index[i]);
   }
-  return hash_recurse(db, hdr, NULL, 0, values, hdr->fields, rec,
-    HASHIDX_OP_STORE, (hdr->type == WG_INDEX_TYPE_HASH_JSON));
+  return hash_recurse(db, hdr, keybuf, HASHIDX_KEY_BUFSIZE, 0,
+    values, hdr->fields, rec, HASHIDX_OP_STORE, (hdr->type == WG_INDEX_TYPE_HASH_JSON));
 }
 
 /** Remove all entries connected to a row from hash index
@@ -1491,18 +3087,23 @@ static gint hash_remove_row(void *db, gint index_id, void *rec) {
   wg_index_header *hdr = (wg_index_header *)offsettoptr(db,index_id);
   gint i;
   gint values[MAX_INDEX_FIELDS];
+  char keybuf[HASHIDX_KEY_BUFSIZE];
 
   for(i=0; i<hdr->fields; i++) {
     values[i] = wg_get_field(db, rec, hdr->rec_field_index[i]);
   }
-  return hash_recurse(db, hdr, NULL, 0, values, hdr->fields, rec,
-    HASHIDX_OP_REMOVE, (hdr->type == WG_INDEX_TYPE_HASH_JSON));
+  return hash_recurse(db, hdr, keybuf, HASHIDX_KEY_BUFSIZE, 0,
+    values, hdr->fields, rec, HASHIDX_OP_REMOVE, (hdr->type == WG_INDEX_TYPE_HASH_JSON));
 }
 
 /**
  * Construct a byte array for hashing recursively.
  * Hash it when it is complete.
  *
+ * The key is built in buf, which holds the first prefixlen bytes
+ * of it already. Each value is appended as a length-prefixed field
+ * (see wg_encode_for_hashing()).
+ *
  * If we have a JSON index *and* we're acting on an indexable row,
  * all arrays are expanded. This does not happen if we're called
  * by updating a value *in* an array.
@@ -1511,8 +3112,9 @@ static gint hash_remove_row(void *db, gint index_id, void *rec) {
  * 0 - on success
  * -1 - on error
  */
-static gint hash_recurse(void *db, wg_index_header *hdr, char *prefix,
-  gint prefixlen, gint *values, gint count, void *rec, gint op, gint expand) {
+static gint hash_recurse(void *db, wg_index_header *hdr, char *buf,
+  gint bufsize, gint prefixlen, gint *values, gint count, void *rec,
+  gint op, gint expand) {
 
   if(count) {
     gint nextvalue = values[0];
@@ -1526,7 +3128,7 @@ static gint hash_recurse(void *db, wg_index_header *hdr, char *prefix,
           gint i, reclen, retv = 0;
           reclen = wg_get_record_len(db, valrec);
           for(i=0; i<reclen; i++) {
-            retv = hash_extend_prefix(db, hdr, prefix, prefixlen,
+            retv = hash_extend_prefix(db, hdr, buf, bufsize, prefixlen,
               wg_get_field(db, valrec, i),
               &values[1], count - 1, rec, op, expand);
             if(retv)
@@ -1538,66 +3140,189 @@ static gint hash_recurse(void *db, wg_index_header *hdr, char *prefix,
       }
     }
     /* Regular index. JSON/array index also falls back to this. */
-    return hash_extend_prefix(db, hdr, prefix, prefixlen,
+    return hash_extend_prefix(db, hdr, buf, bufsize, prefixlen,
       nextvalue, &values[1], count - 1, rec, op, expand);
   }
   else {
     /* No more values, the hash string is complete. Add it to the index */
     if(op == HASHIDX_OP_STORE) {
       return wg_idxhash_store(db, HASHIDX_ARRAYP(hdr),
-        prefix, prefixlen, ptrtooffset(db, rec));
+        buf, prefixlen, ptrtooffset(db, rec));
     } else if(op == HASHIDX_OP_REMOVE) {
       return wg_idxhash_remove(db, HASHIDX_ARRAYP(hdr),
-        prefix, prefixlen, ptrtooffset(db, rec));
+        buf, prefixlen, ptrtooffset(db, rec));
     } else {
       /* assume HASHIDX_OP_FIND */
-      return wg_idxhash_find(db, HASHIDX_ARRAYP(hdr), prefix, prefixlen);
+      return wg_idxhash_find(db, HASHIDX_ARRAYP(hdr), buf, prefixlen);
     }
   }
   return 0; /* pacify the compiler */
 }
 
 /*
- * Helper function to convert the next value into an array of
- * bytes and append it to the existing prefix. Always calls
- * hash_recurse() to complete the recursion.
+ * Helper function to encode the next value and append it to the
+ * existing prefix in buf. Always calls hash_recurse() to complete
+ * the recursion. The encoding overwrites whatever follows the prefix,
+ * so the caller may reuse buf for the next array element.
+ *
+ * Only when the key outgrows buf, a larger buffer is allocated
+ * for the rest of the recursion.
  */
-static gint hash_extend_prefix(void *db, wg_index_header *hdr, char *prefix,
-  gint prefixlen, gint nextval, gint *values, gint count, void *rec, gint op,
-  gint expand) {
+static gint hash_extend_prefix(void *db, wg_index_header *hdr, char *buf,
+  gint bufsize, gint prefixlen, gint nextval, gint *values, gint count,
+  void *rec, gint op, gint expand) {
 
-  char *fldbytes, *newprefix;
-  gint newlen, fldlen, retv;
+  char *bigbuf;
+  gint fldlen, retv;
 
-  fldlen = wg_decode_for_hashing(db, nextval, &fldbytes);
+  fldlen = wg_encode_for_hashing(db, nextval, buf + prefixlen,
+    bufsize - prefixlen);
   if(fldlen < 1) {
     show_index_error(db,"Failed to decode a field value for hash");
     return -1;
   }
 
-  if(prefix && prefixlen) {
-    newlen = prefixlen + fldlen + 1;
-  } else {
-    newlen = fldlen;
+  if(prefixlen + fldlen <= bufsize) {
+    return hash_recurse(db, hdr, buf, bufsize,
+      prefixlen + fldlen, values, count, rec, op, expand);
   }
 
-  newprefix = malloc(newlen);
-  if(!newprefix) {
-    free(fldbytes);
+  /* Long value. Leave room for the remaining fields, too. */
+  bigbuf = malloc(2*(prefixlen + fldlen) + HASHIDX_KEY_BUFSIZE);
+  if(!bigbuf) {
     show_index_error(db, "Failed to allocate memory");
     return -1;
   }
-  if(prefix) {
-    memcpy(newprefix, prefix, prefixlen);
-    newprefix[prefixlen] = '\0'; /* XXX: why? double-check this */
+  memcpy(bigbuf, buf, prefixlen);
+  wg_encode_for_hashing(db, nextval, bigbuf + prefixlen, fldlen);
+  retv = hash_recurse(db, hdr, bigbuf,
+    2*(prefixlen + fldlen) + HASHIDX_KEY_BUFSIZE,
+    prefixlen + fldlen, values, count, rec, op, expand);
+  free(bigbuf);
+  return retv;
+}
+
+/**
+ * Find a row with the given key in a unique hash index.
+ * Keys that contain a NULL value are never reported, since they
+ * are not checked for duplicates.
+ * self - row to ignore, 0 if none
+ * returns the offset of the row, 0 if none, -1 on error
+ */
+static gint hash_unique_find(void *db, wg_index_header *hdr, gint *values,
+  gint self) {
+  char keybuf[HASHIDX_KEY_BUFSIZE];
+  gint i, list;
+
+  for(i=0; i<hdr->fields; i++) {
+    if(wg_get_encoded_type(db, values[i]) == WG_NULLTYPE)
+      return 0;
+  }
+  list = hash_recurse(db, hdr, keybuf, HASHIDX_KEY_BUFSIZE, 0,
+    values, hdr->fields, NULL, HASHIDX_OP_FIND, 0);
+  while(list > 0) {
+    gcell *cell = (gcell *) offsettoptr(db, list);
+    if(cell->car != self)
+      return cell->car;
+    list = cell->cdr;
   }
+  return list;
+}
 
-  memcpy(newprefix + (newlen - fldlen), fldbytes, fldlen);
-  retv = hash_recurse(db, hdr, newprefix,
-    newlen, values, count, rec, op, expand);
-  free(fldbytes);
-  free(newprefix);
-  return retv;
+/**
+ * Check the values of an upsert against all unique indexes.
+ * rec - the row that gets the values, NULL for a new row. Its
+ * fields past count keep their current values.
+ * returns 0 if the values can be written
+ * returns -1 if they would duplicate the key of another row
+ */
+static gint upsert_check_unique(void *db, void *rec, gint *values,
+  gint count) {
+  db_memsegment_header* dbh = dbmemsegh(db);
+  gint reclen = (rec ? wg_get_record_len(db, rec) : count);
+  gint self = (rec ? ptrtooffset(db, rec) : 0);
+  gint column, ilist;
+
+  for(column=0; column<count && column<=MAX_INDEXED_FIELDNR; column++) {
+    ilist = dbh->index_control_area_header.index_table[column];
+    while(ilist) {
+      gcell *ilistelem = (gcell *) offsettoptr(db, ilist);
+      if(ilistelem->car) {
+        wg_index_header *hdr = \
+          (wg_index_header *) offsettoptr(db, ilistelem->car);
+        /* Each index is checked once, from its first column */
+        if(HASHIDX_UNIQUE(hdr) && hdr->rec_field_index[0] == column &&\
+          reclen > hdr->rec_field_index[hdr->fields - 1]) {
+          gint i, keys[MAX_INDEX_FIELDS];
+          for(i=0; i<hdr->fields; i++) {
+            gint col = hdr->rec_field_index[i];
+            keys[i] = (col < count ? values[col] : wg_get_field(db, rec, col));
+          }
+          if(hash_unique_find(db, hdr, keys, self)) {
+            show_index_error(db, "Duplicate key in a unique index");
+            return -1;
+          }
+        }
+      }
+      ilist = ilistelem->cdr;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Keep a value valid while an upsert changes the row.
+ * A long string gets an extra reference, other values kept outside
+ * the field are copied and the copy is written instead. So the value
+ * survives if the field is overwritten again to undo a failed upsert.
+ * returns the value to use
+ * returns WG_ILLEGAL on error
+ */
+static gint upsert_hold(void *db, gint enc) {
+  if(!isptr(enc))
+    return enc;
+  if(islongstr(enc)) {
+    gint *strptr = (gint *) offsettoptr(db, decode_longstr_offset(enc));
+    ++(*(strptr+LONGSTR_REFCOUNT_POS));
+    return enc;
+  }
+  switch(wg_get_encoded_type(db, enc)) {
+    case WG_INTTYPE:
+      return wg_encode_int(db, wg_decode_int(db, enc));
+    case WG_DOUBLETYPE:
+      return wg_encode_double(db, wg_decode_double(db, enc));
+    case WG_STRTYPE:
+      return wg_encode_str(db, wg_decode_str(db, enc),
+        wg_decode_str_lang(db, enc));
+    case WG_XMLLITERALTYPE:
+      return wg_encode_xmlliteral(db, wg_decode_xmlliteral(db, enc),
+        wg_decode_xmlliteral_xsdtype(db, enc));
+    case WG_URITYPE:
+      return wg_encode_uri(db, wg_decode_uri(db, enc),
+        wg_decode_uri_prefix(db, enc));
+    case WG_BLOBTYPE:
+      return wg_encode_blob(db, wg_decode_blob(db, enc),
+        wg_decode_blob_type(db, enc), wg_decode_blob_len(db, enc));
+    default:
+      return enc; /* records */
+  }
+}
+
+/**
+ * Release a value returned by upsert_hold().
+ * stored - a copy is owned by the field it was written to (or
+ * was freed when that field was overwritten)
+ * The reference of a long string is dropped without freeing it.
+ */
+static void upsert_drop(void *db, gint held, int stored) {
+  if(!isptr(held))
+    return;
+  if(islongstr(held)) {
+    gint *strptr = (gint *) offsettoptr(db, decode_longstr_offset(held));
+    --(*(strptr+LONGSTR_REFCOUNT_POS));
+  } else if(!stored && wg_get_encoded_type(db, held) != WG_RECORDTYPE) {
+    wg_free_encoded(db, held);
+  }
 }
 
 /*
@@ -1618,7 +3343,7 @@ static gint create_hash_index(void *db, gint index_id){
     return -1;
 
   /* Add existing records */
-  rec = wg_get_first_record(db);
+  rec = index_first_row(db, index_id);
   rowsprocessed = 0;
 
   while(rec != NULL) {
@@ -1626,7 +3351,7 @@ static gint create_hash_index(void *db, gint index_id){
       rec=wg_get_next_record(db,rec);
       continue;
     }
-    if(MATCH_TEMPLATE(db, hdr, rec)) {
+    if(MATCH_INDEX(db, hdr, rec)) {
       if(type == WG_INDEX_TYPE_HASH_JSON) {
         /* Ignore array and object records. Their data is indexed
          * from the rows that point to them.
@@ -1637,6 +3362,16 @@ static gint create_hash_index(void *db, gint index_id){
         }
       } else {
         /* Add all rows normally */
+        if(HASHIDX_UNIQUE(hdr)) {
+          gint values[MAX_INDEX_FIELDS];
+          for(i=0; i<hdr->fields; i++)
+            values[i] = wg_get_field(db, rec, hdr->rec_field_index[i]);
+          if(hash_unique_find(db, hdr, values, 0)) {
+            show_index_error(db, "Duplicate key, cannot create a unique index");
+            wg_idxhash_free(db, HASHIDX_ARRAYP(hdr));
+            return -1;
+          }
+        }
         hash_add_row(db, index_id, rec);
         rowsprocessed++;
       }
@@ -1666,44 +3401,631 @@ static gint create_hash_index(void *db, gint index_id){
 }
 
 /** Drop a hash index by id
+ *  Frees the hash array, the buckets and their row lists.
+ *  Also used for trigram indexes.
  *  returns:
  *  0 - on success
  *  -1 - error
- *
- * XXX: implement this. Needs some method of de-allocating or reusing
- * the main hash table (list cells/varlen storage can be freed piece by
- * piece if necessary).
  */
 static gint drop_hash_index(void *db, gint index_id){
-  show_index_error(db, "Cannot drop hash index: not implemented");
+  wg_index_header *hdr = (wg_index_header *) offsettoptr(db, index_id);
+  wg_idxhash_free(db, HASHIDX_ARRAYP(hdr));
+  return 0;
+}
+
+/* -------------- Hash index public functions -------------- */
+
+/**
+ *  Search the hash index for given values.
+ *
+ *  returns offset to data row:
+ *  -1 - error
+ *  0 - if key NOT found
+ *  >0 - offset to the linked list that contains the row offsets
+ */
+gint wg_search_hash(void *db, gint index_id, gint *values, gint count) {
+  wg_index_header *hdr = (wg_index_header *) offsettoptr(db, index_id);
+  char keybuf[HASHIDX_KEY_BUFSIZE];
+#ifdef CHECK
+  gint type = wg_get_index_type(db, index_id); /* also validates the id */
+  if(type < 0)
+    return type;
+  if(type != WG_INDEX_TYPE_HASH && type != WG_INDEX_TYPE_HASH_JSON)
+    return show_index_error(db, "wg_search_hash: Not a hash index");
+  if(hdr->fields != count) {
+    show_index_error(db, "Number of indexed fields does not match");
+    return -1;
+  }
+#endif
+  return hash_recurse(db, hdr, keybuf, HASHIDX_KEY_BUFSIZE, 0,
+    values, count, NULL, HASHIDX_OP_FIND, 0);
+}
+
+/**
+ *  Find or create the row with a key of a unique hash index.
+ *
+ *  values - array of count encoded values for the fields of the row.
+ *  The key is made of the values of the indexed columns. If a row
+ *  with the key exists, the values are written into its fields,
+ *  otherwise a new record of count fields is created with them.
+ *  The hash is probed only once. The caller holds the write lock,
+ *  so no other writer can create the key in between.
+ *
+ *  The values are checked against all unique indexes before anything
+ *  is written. If a write fails anyway, the old values are put back
+ *  or the new record is deleted. The values then still belong to
+ *  the caller, who frees them with wg_free_encoded().
+ *
+ *  returns the record, NULL on error
+ */
+void *wg_upsert(void *db, gint index_id, gint *values, gint count) {
+  wg_index_header *hdr;
+  gint keys[MAX_INDEX_FIELDS];
+  gint buf[2 * UPSERT_BUFSIZE], *held = buf, *old;
+  gint i, n, offset, err = 0;
+  void *rec;
+
+#ifdef CHECK
+  if (!dbcheck(db)) {
+    show_index_error(db, "Invalid database pointer in wg_upsert");
+    return NULL;
+  }
+#endif
+  if(wg_get_index_type(db, index_id) != WG_INDEX_TYPE_HASH) {
+    show_index_error(db, "wg_upsert: Not a hash index");
+    return NULL;
+  }
+  hdr = (wg_index_header *) offsettoptr(db, index_id);
+  if(!HASHIDX_UNIQUE(hdr)) {
+    show_index_error(db, "wg_upsert: Not a unique index");
+    return NULL;
+  }
+  if(count <= hdr->rec_field_index[hdr->fields - 1]) {
+    show_index_error(db, "wg_upsert: The values do not include the key");
+    return NULL;
+  }
+
+  for(i=0; i<hdr->fields; i++) {
+    keys[i] = values[hdr->rec_field_index[i]];
+    if(wg_get_encoded_type(db, keys[i]) == WG_NULLTYPE) {
+      show_index_error(db, "wg_upsert: NULL value in the key");
+      return NULL;
+    }
+  }
+  offset = hash_unique_find(db, hdr, keys, 0);
+  if(offset < 0)
+    return NULL;
+
+  rec = NULL;
+  if(offset) {
+    rec = offsettoptr(db, offset);
+    if(wg_get_record_len(db, rec) < count) {
+      show_index_error(db, "wg_upsert: The record is too short for the values");
+      return NULL;
+    }
+  }
+  /* Refuse duplicate keys before anything is changed */
+  if(upsert_check_unique(db, rec, values, count))
+    return NULL;
+
+  if(count > UPSERT_BUFSIZE) {
+    held = (gint *) malloc(2 * count * sizeof(gint));
+    if(!held) {
+      show_index_error(db, "Failed to allocate memory");
+      return NULL;
+    }
+  }
+  old = held + count;
+
+  if(rec) {
+    for(n=0; n<count; n++) {
+      gint cur = wg_get_field(db, rec, n);
+      old[n] = WG_ILLEGAL; /* field not changed */
+      if(cur == values[n])
+        continue;
+      held[n] = upsert_hold(db, values[n]);
+      if(held[n] == WG_ILLEGAL) {
+        err = 1;
+        break;
+      }
+      old[n] = upsert_hold(db, cur);
+      if(old[n] == WG_ILLEGAL) {
+        upsert_drop(db, held[n], 0);
+        err = 1;
+        break;
+      }
+      if(wg_set_field(db, rec, n, held[n])) {
+        err = 1;
+        break;
+      }
+    }
+    if(err) {
+      /* Put the old values back. Writing the old value frees
+       * the new one if it was stored. */
+      for(i=0; i<=n && i<count; i++) {
+        if(old[i] == WG_ILLEGAL)
+          continue;
+        if(wg_get_field(db, rec, i) == held[i]) {
+          wg_set_field(db, rec, i, old[i]);
+          upsert_drop(db, held[i], 1);
+          upsert_drop(db, old[i], 1);
+        } else {
+          upsert_drop(db, held[i], 0);
+          upsert_drop(db, old[i], 0);
+        }
+      }
+      rec = NULL;
+    } else {
+      for(i=0; i<count; i++) {
+        if(old[i] == WG_ILLEGAL)
+          continue;
+        if(held[i] != values[i])
+          wg_free_encoded(db, values[i]); /* a copy was stored */
+        upsert_drop(db, held[i], 1);
+        upsert_drop(db, old[i], 0);
+        if(isptr(old[i]) && islongstr(old[i]))
+          wg_free_encoded(db, old[i]); /* unless another row uses it */
+      }
+    }
+  } else {
+    rec = wg_create_record(db, count);
+    for(n=0; rec && n<count; n++) {
+      held[n] = values[n];
+      if(wg_get_encoded_type(db, values[n]) == WG_NULLTYPE)
+        continue;
+      held[n] = upsert_hold(db, values[n]);
+      if(held[n] == WG_ILLEGAL || wg_set_field(db, rec, n, held[n])) {
+        err = 1;
+        break;
+      }
+    }
+    if(err) {
+      /* Delete the new row, it frees the values stored in it */
+      for(i=0; i<=n && i<count; i++) {
+        if(held[i] != WG_ILLEGAL && wg_get_field(db, rec, i) != held[i]) {
+          upsert_drop(db, held[i], 0);
+          held[i] = WG_ILLEGAL;
+        }
+      }
+      wg_delete_record(db, rec);
+      for(i=0; i<=n && i<count; i++) {
+        if(held[i] != WG_ILLEGAL)
+          upsert_drop(db, held[i], 1);
+      }
+      rec = NULL;
+    } else if(rec) {
+      for(i=0; i<count; i++) {
+        if(held[i] != values[i])
+          wg_free_encoded(db, values[i]); /* a copy was stored */
+        upsert_drop(db, held[i], 1);
+      }
+    }
+  }
+
+  if(held != buf)
+    free(held);
+  return rec;
+}
+
+
+/* -------------- Trigram index private functions ------------- */
+
+/** Compare two packed trigrams (for qsort)
+ */
+static int trigram_cmp(const void *a, const void *b) {
+  gint x = *((gint *) a), y = *((gint *) b);
+  return (x > y) - (x < y);
+}
+
+/** Collect the distinct trigrams of a string
+ *  Each gram is packed into the low three bytes of a gint. The
+ *  array is allocated with malloc() and returned sorted.
+ *  returns the number of grams (0 if the string is too short)
+ *  returns -1 on error
+ */
+gint wg_trigram_split(void *db, char *str, gint len, gint **grams) {
+  gint i, j, count;
+  gint *g;
+
+  *grams = NULL;
+  if(len < WG_TRIGRAM_LEN)
+    return 0;
+  count = len - WG_TRIGRAM_LEN + 1;
+  g = (gint *) malloc(count * sizeof(gint));
+  if(!g) {
+    show_index_error(db, "Failed to allocate memory");
+    return -1;
+  }
+  for(i=0; i<count; i++) {
+    g[i] = (((unsigned char) str[i]) << 16) |\
+      (((unsigned char) str[i+1]) << 8) | ((unsigned char) str[i+2]);
+  }
+  qsort(g, count, sizeof(gint), trigram_cmp);
+  for(i=1, j=0; i<count; i++) {
+    if(g[i] != g[j])
+      g[++j] = g[i];
+  }
+  *grams = g;
+  return j + 1;
+}
+
+/** Unpack a trigram into hash key bytes
+ */
+static void trigram_bytes(gint gram, char *buf) {
+  buf[0] = (char) ((gram >> 16) & 0xff);
+  buf[1] = (char) ((gram >> 8) & 0xff);
+  buf[2] = (char) (gram & 0xff);
+}
+
+/** Add or remove the row in the posting list of every trigram
+ *  of the indexed string. Rows with other value types, and strings
+ *  shorter than a gram, are not in the index.
+ *  returns:
+ *  0 - on success
+ *  -1 - if error
+ */
+static gint trigram_update_row(void *db, gint index_id, void *rec, gint op) {
+  wg_index_header *hdr = (wg_index_header *)offsettoptr(db,index_id);
+  gint enc, count, i, retv = 0;
+  gint *grams;
+  char *str, key[WG_TRIGRAM_LEN];
+
+  enc = wg_get_field(db, rec, hdr->rec_field_index[0]);
+  if(wg_get_encoded_type(db, enc) != WG_STRTYPE)
+    return 0;
+  str = wg_decode_str(db, enc);
+  count = wg_trigram_split(db, str, strlen(str), &grams);
+  if(count < 0)
+    return -1;
+
+  for(i=0; i<count; i++) {
+    trigram_bytes(grams[i], key);
+    if(op == HASHIDX_OP_STORE)
+      retv = wg_idxhash_store(db, HASHIDX_ARRAYP(hdr),
+        key, WG_TRIGRAM_LEN, ptrtooffset(db, rec));
+    else
+      retv = wg_idxhash_remove(db, HASHIDX_ARRAYP(hdr),
+        key, WG_TRIGRAM_LEN, ptrtooffset(db, rec));
+    if(retv)
+      break;
+  }
+  if(grams)
+    free(grams);
+  return retv;
+}
+
+/*
+ * Create trigram index.
+ * Returns 0 on success
+ * Returns -1 on failure.
+ */
+static gint create_trigram_index(void *db, gint index_id){
+  unsigned int rowsprocessed;
+  void *rec;
+  wg_index_header *hdr = (wg_index_header *) offsettoptr(db, index_id);
+  gint column = hdr->rec_field_index[0];
+
+  /* Initialize the hash table (0 - use default size) */
+  if(wg_create_hash(db, HASHIDX_ARRAYP(hdr), 0))
+    return -1;
+
+  /* Add existing records */
+  rec = index_first_row(db, index_id);
+  rowsprocessed = 0;
+
+  while(rec != NULL) {
+    if(column < wg_get_record_len(db, rec) && MATCH_INDEX(db, hdr, rec)) {
+      if(trigram_update_row(db, index_id, rec, HASHIDX_OP_STORE))
+        return -1;
+      rowsprocessed++;
+    }
+    rec=wg_get_next_record(db,rec);
+  }
+#ifdef WG_NO_ERRPRINT
+#else
+  fprintf(stderr,"new trigram index created on rec field %d into slot %d and %d data rows inserted\n",
+    (int) column, (int) index_id, rowsprocessed);
+#endif
+  return 0;
+}
+
+/* ------------- Trigram index public functions ------------- */
+
+/**
+ *  Find the posting list of a trigram.
+ *  gram - WG_TRIGRAM_LEN bytes
+ *
+ *  returns:
+ *  -1 - error
+ *  0 - if no row contains the gram
+ *  >0 - offset to the linked list that contains the row offsets
+ */
+gint wg_search_trigram(void *db, gint index_id, char *gram) {
+  wg_index_header *hdr = (wg_index_header *) offsettoptr(db, index_id);
+#ifdef CHECK
+  gint type = wg_get_index_type(db, index_id); /* also validates the id */
+  if(type < 0)
+    return type;
+  if(type != WG_INDEX_TYPE_TRIGRAM)
+    return show_index_error(db, "wg_search_trigram: Not a trigram index");
+#endif
+  return wg_idxhash_find(db, HASHIDX_ARRAYP(hdr), gram, WG_TRIGRAM_LEN);
+}
+
+/* -------------- Zone map private functions ------------- */
+
+/*
+ * A zone map summarizes the indexed column for each block of
+ * WG_ZONE_BLOCK_SIZE bytes of the datarec subareas, so that full scans
+ * can pass over the blocks that have no matching values. The rows of
+ * a block are found by the offset of the first one, since a block
+ * boundary may fall inside a record.
+ */
+
+/**
+*  Find the block of the datarec area that an offset is in
+*  returns the subarea index, -1 if the offset is not in the area
+*/
+static gint zonemap_locate(void *db, gint offset, gint *block) {
+  db_area_header *area = &dbmemsegh(db)->datarec_area_header;
+  gint i;
+
+  for(i=0; i<=area->last_subarea_index; i++) {
+    gint start = area->subarea_array[i].offset;
+    if(offset >= start && offset < start + area->subarea_array[i].size) {
+      *block = (offset - start) / WG_ZONE_BLOCK_SIZE;
+      return i;
+    }
+  }
   return -1;
 }
 
-/* -------------- Hash index public functions -------------- */
+/**
+*  Number of zone map blocks in a datarec subarea
+*/
+static gint zonemap_blocks(void *db, gint subarea) {
+  db_area_header *area = &dbmemsegh(db)->datarec_area_header;
+  return (area->subarea_array[subarea].size + WG_ZONE_BLOCK_SIZE - 1) /\
+    WG_ZONE_BLOCK_SIZE;
+}
+
+/**
+*  Get the summary of a block. The block table of the subarea is
+*  allocated if create is set.
+*  returns NULL if the table does not exist or cannot be allocated
+*/
+static wg_zone *zonemap_block(void *db, wg_index_header *hdr,
+  gint subarea, gint block, gint create) {
+  wg_zonemap_tables *tables = \
+    (wg_zonemap_tables *) offsettoptr(db, ZONEMAP_TABLES(hdr));
+  wg_zone_table *table;
+
+  if(!tables->table[subarea]) {
+    gint blocks = zonemap_blocks(db, subarea);
+    gint offset;
+
+    if(!create)
+      return NULL;
+    offset = wg_alloc_gints(db, &dbmemsegh(db)->indexhash_area_header,
+      (sizeof(wg_zone_table) + (blocks - 1) * sizeof(wg_zone)) / sizeof(gint));
+    if(!offset) {
+      show_index_error(db, "Failed to allocate a zone map table");
+      return NULL;
+    }
+    table = (wg_zone_table *) offsettoptr(db, offset);
+    table->blocks = blocks;
+    memset(table->zone, 0, blocks * sizeof(wg_zone));
+    tables->table[subarea] = offset;
+  }
+  table = (wg_zone_table *) offsettoptr(db, tables->table[subarea]);
+  return &table->zone[block];
+}
+
+/**
+*  Add a row to the summary of its block
+*  returns 0 on success, -1 on error
+*/
+static gint zonemap_add_row(void *db, gint index_id, void *rec) {
+  wg_index_header *hdr = (wg_index_header *) offsettoptr(db, index_id);
+  gint value = wg_get_field(db, rec, hdr->rec_field_index[0]);
+  gint offset = ptrtooffset(db, rec);
+  gint subarea, block;
+  wg_zone *zone;
+
+  subarea = zonemap_locate(db, offset, &block);
+  if(subarea < 0)
+    return show_index_error(db, "Record is not in the data area");
+  zone = zonemap_block(db, hdr, subarea, block, 1);
+  if(!zone)
+    return -1;
+
+  if(wg_get_encoded_type(db, value) == WG_NULLTYPE) {
+    zone->nulls++;
+  } else {
+    wg_uint kp = wg_ttree_key_prefix(db, value);
+    if(zone->count == zone->nulls) {
+      /* first value, or the old ones are all gone */
+      zone->min = kp;
+      zone->max = kp;
+    } else if(kp < zone->min) {
+      zone->min = kp;
+    } else if(kp > zone->max) {
+      zone->max = kp;
+    }
+  }
+  zone->count++;
+  if(!zone->first || offset < zone->first)
+    zone->first = offset;
+  return 0;
+}
+
+/**
+*  Remove a row from the summary of its block
+*  If the row was the first one, the block is scanned for the next
+*  row that is in the index.
+*  returns 0 on success, -3 if the row is not in the zone map
+*/
+static gint zonemap_remove_row(void *db, gint index_id, void *rec) {
+  wg_index_header *hdr = (wg_index_header *) offsettoptr(db, index_id);
+  gint column = hdr->rec_field_index[0];
+  gint offset = ptrtooffset(db, rec);
+  gint subarea, block, end;
+  wg_online_build *build;
+  wg_zone *zone;
+  void *next;
+
+  subarea = zonemap_locate(db, offset, &block);
+  if(subarea < 0)
+    return -3;
+  zone = zonemap_block(db, hdr, subarea, block, 0);
+  if(!zone || !zone->count || offset < zone->first)
+    return -3;
+
+  if(wg_get_encoded_type(db, wg_get_field(db, rec, column)) == WG_NULLTYPE)
+    zone->nulls--;
+  zone->count--;
+  if(zone->first != offset)
+    return 0;
+
+  /* Rows that an online build has not reached are not in the index */
+  build = find_online_build(db, index_id);
+  end = dbmemsegh(db)->datarec_area_header.subarea_array[subarea].offset +\
+    (block + 1) * WG_ZONE_BLOCK_SIZE;
+  zone->first = 0;
+  for(next = wg_get_next_record(db, rec); zone->count && next;
+    next = wg_get_next_record(db, next)) {
+    gint nextoffset = ptrtooffset(db, next);
+    if(nextoffset < offset || nextoffset >= end)
+      break; /* past the block */
+    if(column < wg_get_record_len(db, next) && MATCH_INDEX(db, hdr, next) &&\
+      (!build || online_row_scanned(db, build, nextoffset))) {
+      zone->first = nextoffset;
+      break;
+    }
+  }
+  if(zone->count && !zone->first) {
+    show_index_error(db, "Zone map is corrupt");
+    return -3;
+  }
+  return 0;
+}
+
+/**
+*  Create a zone map. The block tables are allocated as rows are added.
+*  returns:
+*  0 - on success
+*  -1 - error (failed to create the index)
+*/
+static gint create_zonemap_index(void *db, gint index_id) {
+  wg_index_header *hdr = (wg_index_header *) offsettoptr(db, index_id);
+  gint column = hdr->rec_field_index[0];
+  unsigned int rowsprocessed = 0;
+  wg_zonemap_tables *tables;
+  gint offset;
+  void *rec;
+
+  offset = wg_alloc_gints(db, &dbmemsegh(db)->indexhash_area_header,
+    sizeof(wg_zonemap_tables) / sizeof(gint));
+  if(!offset) {
+    show_index_error(db, "Failed to allocate the zone map");
+    return -1;
+  }
+  tables = (wg_zonemap_tables *) offsettoptr(db, offset);
+  memset(tables->table, 0, sizeof(tables->table));
+  ZONEMAP_TABLES(hdr) = offset;
+
+  rec = index_first_row(db, index_id);
+  while(rec != NULL) {
+    if(column < wg_get_record_len(db, rec) && MATCH_INDEX(db, hdr, rec)) {
+      if(zonemap_add_row(db, index_id, rec))
+        return -1;
+      rowsprocessed++;
+    }
+    rec = wg_get_next_record(db, rec);
+  }
+#ifdef WG_NO_ERRPRINT
+#else
+  fprintf(stderr,"new zone map index created on rec field %d into slot %d and %d data rows inserted\n",
+    (int) column, (int) index_id, rowsprocessed);
+#endif
+  return 0;
+}
+
+/** Drop zone map by id
+*  returns:
+*  0 - on success
+*  -1 - error
+*/
+static gint drop_zonemap_index(void *db, gint index_id) {
+  wg_index_header *hdr = (wg_index_header *) offsettoptr(db, index_id);
+  db_memsegment_header* dbh = dbmemsegh(db);
+  wg_zonemap_tables *tables;
+  gint i;
+
+  if(!ZONEMAP_TABLES(hdr))
+    return 0;
+  tables = (wg_zonemap_tables *) offsettoptr(db, ZONEMAP_TABLES(hdr));
+  for(i=0; i<SUBAREA_ARRAY_SIZE; i++) {
+    if(tables->table[i])
+      wg_free_object(db, &dbh->indexhash_area_header, tables->table[i]);
+  }
+  wg_free_object(db, &dbh->indexhash_area_header, ZONEMAP_TABLES(hdr));
+  return 0;
+}
+
+/* -------------- Zone map public functions ------------- */
 
 /**
- *  Search the hash index for given values.
- *
- *  returns offset to data row:
- *  -1 - error
- *  0 - if key NOT found
- *  >0 - offset to the linked list that contains the row offsets
- */
-gint wg_search_hash(void *db, gint index_id, gint *values, gint count) {
+*  Find where a full scan should continue
+*  offset - the next record of the scan
+*  lo, hi - normalized bounds (see wg_ttree_key_prefix()) of the
+*           values that can match
+*  nulls - NULL values can match
+*  The blocks that have no rows that can match are passed over. The
+*  block of the returned row is stored in start and end, the number
+*  of blocks passed over is added to skipped, if it is not NULL.
+*  returns the offset of the next record to examine, 0 if there is none
+*/
+gint wg_search_zonemap(void *db, gint index_id, gint offset,
+  wg_uint lo, wg_uint hi, gint nulls, gint *start, gint *end,
+  wg_uint *skipped) {
+  db_area_header *area = &dbmemsegh(db)->datarec_area_header;
   wg_index_header *hdr = (wg_index_header *) offsettoptr(db, index_id);
-#ifdef CHECK
-  gint type = wg_get_index_type(db, index_id); /* also validates the id */
-  if(type < 0)
-    return type;
-  if(type != WG_INDEX_TYPE_HASH && type != WG_INDEX_TYPE_HASH_JSON)
-    return show_index_error(db, "wg_search_hash: Not a hash index");
-  if(hdr->fields != count) {
-    show_index_error(db, "Number of indexed fields does not match");
-    return -1;
+  gint subarea, block;
+
+  subarea = zonemap_locate(db, offset, &block);
+  if(subarea < 0)
+    return offset; /* not a record, the scan decides */
+
+  for(; subarea<=area->last_subarea_index; subarea++, block=0) {
+    gint blocks = zonemap_blocks(db, subarea);
+    wg_zone *zone = zonemap_block(db, hdr, subarea, 0, 0);
+
+    if(!zone) {
+      /* no rows in the subarea */
+      if(skipped)
+        *skipped += blocks - block;
+      continue;
+    }
+    for(; block<blocks; block++) {
+      if(zone[block].count &&\
+        ((zone[block].count > zone[block].nulls &&\
+          zone[block].min <= hi && zone[block].max >= lo) ||\
+        (zone[block].nulls && nulls))) {
+        *start = area->subarea_array[subarea].offset +\
+          block * WG_ZONE_BLOCK_SIZE;
+        *end = *start + WG_ZONE_BLOCK_SIZE;
+        /* Records before the first row are not in the index,
+         * so they do not match either. */
+        if(offset >= *start && offset > zone[block].first)
+          return offset;
+        return zone[block].first;
+      }
+      if(skipped)
+        (*skipped)++;
+    }
   }
-#endif
-  return hash_recurse(db, hdr, NULL, 0, values, count, NULL,
-    HASHIDX_OP_FIND, 0);
+  return 0;
 }
 
 
@@ -2017,6 +4339,75 @@ static gint sort_columns(gint *sorted_cols, gint *columns,
   return i;
 }
 
+/** Compare the predicate of an index to a query argument list
+ * returns 1 if they are the same, 0 if not
+ */
+static gint same_index_predicate(void *db, wg_index_header *hdr,
+  wg_query_arg *arglist, gint argc)
+{
+  wg_stored_filter *filter;
+  gint i;
+
+  if(!hdr->predicate_offset)
+    return !argc;
+  filter = INDEX_PREDICATE(db, hdr);
+  if(filter->count != argc)
+    return 0;
+  for(i=0; i<argc; i++) {
+    if(filter->column[i] != arglist[i].column ||\
+      filter->cond[i] != arglist[i].cond ||\
+      WG_COMPARE(db, filter->value[i], arglist[i].value) != WG_EQUAL)
+      return 0;
+  }
+  return 1;
+}
+
+/** Collect the columns an index is listed under in the index table
+ * Besides the key columns, these are the included columns of a
+ * covering T-tree and the predicate columns of a partial index, so
+ * that updates of any of them reach the index.
+ * returns the number of distinct columns, key columns first
+ */
+static gint index_table_columns(void *db, wg_index_header *hdr, gint *cols)
+{
+  gint extra[MAX_INDEX_INCLUDE + MAX_FILTER_ARGS];
+  gint count = 0, n = 0, i, j;
+
+  for(i=0; i<hdr->fields; i++)
+    cols[count++] = hdr->rec_field_index[i];
+  for(i=0; i<TTREE_INCLUDE_COUNT(hdr); i++)
+    extra[n++] = hdr->ctl.t.include_columns[i];
+  if(hdr->predicate_offset) {
+    wg_stored_filter *filter = INDEX_PREDICATE(db, hdr);
+    for(i=0; i<filter->count; i++)
+      extra[n++] = filter->column[i];
+  }
+
+  for(i=0; i<n; i++) {
+    for(j=0; j<count; j++) {
+      if(cols[j] == extra[i])
+        break;
+    }
+    if(j == count)
+      cols[count++] = extra[i];
+  }
+  return count;
+}
+
+/** Check if an index is listed in the index table under a column
+ */
+static gint index_table_listed(void *db, wg_index_header *hdr, gint column)
+{
+  gint tcols[INDEX_TABLE_COLUMNS], count, i;
+
+  count = index_table_columns(db, hdr, tcols);
+  for(i=0; i<count; i++) {
+    if(tcols[i] == column)
+      return 1;
+  }
+  return 0;
+}
+
 /** Create an index.
  *
  * Single-column backward compatibility wrapper.
@@ -2030,10 +4421,17 @@ gint wg_create_index(void *db, gint column, gint type,
 /** Create an index.
  *
  * Arguments -
- * type - WG_INDEX_TYPE_TTREE - single-column T-tree index
+ * type - WG_INDEX_TYPE_TTREE - T-tree index. With multiple columns,
+ *          rows are ordered by the columns in the order given.
  *        WG_INDEX_TYPE_TTREE_JSON - T-tree for JSON schema
  *        WG_INDEX_TYPE_HASH - multi-column hash index
  *        WG_INDEX_TYPE_HASH_JSON - hash index with JSON features
+ *        WG_INDEX_TYPE_TRIGRAM - substring index on a string column
+ *        WG_INDEX_TYPE_BTREE - B+tree index on a single column
+ *        WG_INDEX_TYPE_ZONEMAP - per-block value ranges of a single
+ *          column for full scans
+ *        WG_INDEX_TYPE_SPATIAL - Z-order index on two numeric columns
+ *          for bounding box queries
  *
  * columns - array of column numbers
  * col_count - size of the column number array
@@ -2047,14 +4445,89 @@ gint wg_create_index(void *db, gint column, gint type,
 gint wg_create_multi_index(void *db, gint *columns, gint col_count, gint type,
   gint *matchrec, gint reclen)
 {
-  gint index_id, template_offset = 0, i;
-  wg_index_header *hdr;
-#ifdef USE_INDEX_TEMPLATE
-  wg_index_template *tmpl = NULL;
-  gint fixed_columns = 0;
+  return create_index(db, columns, col_count, type, NULL, 0, NULL, 0,
+    matchrec, reclen, 0, 0);
+}
+
+/** Create a covering T-tree index.
+ *
+ * The index is ordered by the columns like a T-tree created with
+ * wg_create_multi_index(), but the nodes also carry copies of the
+ * included columns, so that wg_fetch_columns() can read them without
+ * touching the rows. Key columns may be included as well. Updating an
+ * included column refreshes the copy in the index.
+ *
+ * include - array of included column numbers
+ * inc_count - size of the include array, at most MAX_INDEX_INCLUDE
+ */
+gint wg_create_covering_index(void *db, gint *columns, gint col_count,
+  gint *include, gint inc_count, gint *matchrec, gint reclen)
+{
+#ifdef CHECK
+  if(!include) {
+    show_index_error(db, "include list is a NULL pointer");
+    return -1;
+  }
 #endif
-  gint *ilist[MAX_INDEX_FIELDS];
+  if(inc_count < 1) {
+    show_index_error(db, "need at least one included column");
+    return -1;
+  }
+  return create_index(db, columns, col_count, WG_INDEX_TYPE_TTREE,
+    include, inc_count, NULL, 0, matchrec, reclen, 0, 0);
+}
+
+/** Create a partial index.
+ *
+ * Only the rows that pass all the conditions of arglist (given as
+ * for wg_make_query()) are kept in the index. The condition values are
+ * copied, so the caller may free its query parameters afterwards.
+ * Queries use the index only if their own conditions imply the
+ * predicate. Updating a predicate column moves the row in or out
+ * of the index.
+ */
+gint wg_create_partial_index(void *db, gint *columns, gint col_count,
+  gint type, wg_query_arg *arglist, gint argc)
+{
+  if(argc < 1 || !arglist) {
+    show_index_error(db, "need at least one predicate condition");
+    return -1;
+  }
+  return create_index(db, columns, col_count, type, NULL, 0,
+    arglist, argc, NULL, 0, 0, 0);
+}
+
+/** Create a unique hash index.
+ *
+ * Like a hash index created with wg_create_multi_index(), but a
+ * write that would give two rows the same key is refused (see
+ * wg_index_check_unique()). Keys that contain a NULL value are not
+ * checked, so that new records can be created. Fails if the existing
+ * rows already have duplicate keys. Rows are found or created by
+ * their key with wg_upsert().
+ */
+gint wg_create_unique_index(void *db, gint *columns, gint col_count)
+{
+  return create_index(db, columns, col_count, WG_INDEX_TYPE_HASH, NULL, 0,
+    NULL, 0, NULL, 0, 1, 0);
+}
+
+/** Create an index of any type (see wg_create_multi_index()).
+ * include lists the columns copied into the nodes of a covering T-tree,
+ * arglist is the predicate of a partial index, unique is set for
+ * a unique hash index. If online is set, the
+ * index is created empty and left unpublished (see
+ * wg_start_online_index()); the index id is returned instead of 0.
+ */
+static gint create_index(void *db, gint *columns, gint col_count, gint type,
+  gint *include, gint inc_count, wg_query_arg *arglist, gint argc,
+  gint *matchrec, gint reclen, gint unique, gint online)
+{
+  gint index_id, template_offset = 0, predicate_offset = 0, i, err;
+  wg_index_header *hdr;
+  gint *ilist;
   gint sorted_cols[MAX_INDEX_FIELDS];
+  gint sorted_inc[MAX_INDEX_INCLUDE];
   db_memsegment_header* dbh = dbmemsegh(db);
 
   /* Check the arguments */
@@ -2077,6 +4550,13 @@ gint wg_create_multi_index(void *db, gint *columns, gint col_count, gint type,
   }
 #endif
 
+  /* The build is tracked by a single state, so other indexes
+   * wait until it is finished. */
+  if(dbh->index_control_area_header.online_build) {
+    show_index_error(db, "Online index build in progress");
+    return -1;
+  }
+
   /* Column count validation */
   if(col_count < 1) {
     show_index_error(db, "need at least one indexed column");
@@ -2085,13 +4565,44 @@ gint wg_create_multi_index(void *db, gint *columns, gint col_count, gint type,
     show_index_error_nr(db, "Max allowed indexed fields",
       MAX_INDEX_FIELDS);
     return -1;
-  } else if(col_count > 1 &&\
-    (type == WG_INDEX_TYPE_TTREE || type == WG_INDEX_TYPE_TTREE_JSON)) {
-    show_index_error(db, "Cannot create a T-tree index on multiple columns");
+  } else if(col_count > 1 && type == WG_INDEX_TYPE_TTREE_JSON) {
+    show_index_error(db, "Cannot create a JSON T-tree index on multiple columns");
+    return -1;
+  } else if(col_count > 1 && type == WG_INDEX_TYPE_TRIGRAM) {
+    show_index_error(db, "Cannot create a trigram index on multiple columns");
+    return -1;
+  } else if(col_count > 1 && type == WG_INDEX_TYPE_BTREE) {
+    show_index_error(db, "Cannot create a B+tree index on multiple columns");
+    return -1;
+  } else if(col_count > 1 && type == WG_INDEX_TYPE_ZONEMAP) {
+    show_index_error(db, "Cannot create a zone map on multiple columns");
+    return -1;
+  } else if(col_count != 2 && type == WG_INDEX_TYPE_SPATIAL) {
+    show_index_error(db, "A spatial index needs two columns");
+    return -1;
+  }
+
+  /* Unique indexes hold every row, so that the key can be checked */
+  if(unique && type != WG_INDEX_TYPE_HASH) {
+    show_index_error(db, "Only hash indexes can be unique");
+    return -1;
+  } else if(unique && (matchrec || argc)) {
+    show_index_error(db, "A unique index cannot have a template or predicate");
+    return -1;
+  }
+
+  /* Included column validation */
+  if(inc_count > 0 && type != WG_INDEX_TYPE_TTREE) {
+    show_index_error(db, "Included columns are only supported by T-tree indexes");
+    return -1;
+  } else if(inc_count > MAX_INDEX_INCLUDE) {
+    show_index_error_nr(db, "Max allowed included columns",
+      MAX_INDEX_INCLUDE);
     return -1;
   }
 
-  if(sort_columns(sorted_cols, columns, col_count) < col_count) {
+  if(sort_columns(sorted_cols, columns, col_count) < col_count ||\
+    sort_columns(sorted_inc, include, inc_count) < inc_count) {
     show_index_error(db, "Duplicate columns not allowed");
     return -1;
   }
@@ -2103,6 +4614,13 @@ gint wg_create_multi_index(void *db, gint *columns, gint col_count, gint type,
       return -1;
     }
   }
+  for(i=0; i<inc_count; i++) {
+    if(sorted_inc[i] > MAX_INDEXED_FIELDNR) {
+      show_index_error_nr(db, "Max allowed column number",
+        MAX_INDEXED_FIELDNR);
+      return -1;
+    }
+  }
 
 #ifdef USE_INDEX_TEMPLATE
   /* Handle the template */
@@ -2132,78 +4650,71 @@ gint wg_create_multi_index(void *db, gint *columns, gint col_count, gint type,
       show_index_error(db, "Error adding index template");
       return -1;
     }
-    tmpl = (wg_index_template *) offsettoptr(db, template_offset);
-    fixed_columns = tmpl->fixed_columns;
   }
 #endif
 
-  /* Scan to the end of index chain for each column. If templates are used,
-   * new indexes are inserted in between list elements to maintain
-   * the chains sorted by number of fixed columns.
+  /* Check for a matching index. The key columns are sorted, so an
+   * identical index is listed under the first of them.
    */
-  for(i=0; i<col_count; i++) {
-    gint column = sorted_cols[i];
-    ilist[i] = &dbh->index_control_area_header.index_table[column];
-    while(*(ilist[i])) {
-      gcell *ilistelem = (gcell *) offsettoptr(db, *(ilist[i]));
+  ilist = &dbh->index_control_area_header.index_table[sorted_cols[0]];
+  while(*ilist) {
+    gcell *ilistelem = (gcell *) offsettoptr(db, *ilist);
 
-      if(!ilistelem->car) {
-        show_index_error(db, "Invalid header in index list");
-        return -1;
+    if(!ilistelem->car) {
+      show_index_error(db, "Invalid header in index list");
+      return -1;
+    }
+    hdr = (wg_index_header *) offsettoptr(db, ilistelem->car);
+
+    if(hdr->type==type && template_offset==hdr->template_offset &&\
+      hdr->fields==col_count && same_index_predicate(db, hdr, arglist, argc)) {
+      gint j, match = 1;
+      /* Compare the field lists. For T-trees, the key order
+       * matters as well. */
+      for(j=0; j<col_count; j++) {
+        if(type == WG_INDEX_TYPE_TTREE ?\
+          TTREE_KEY_COLUMN(hdr, j) != columns[j] :\
+          hdr->rec_field_index[j] != sorted_cols[j]) {
+          match = 0;
+          break;
+        }
       }
-      hdr = (wg_index_header *) offsettoptr(db, ilistelem->car);
-
-      /* If this is the first column, check for a matching index.
-       * Note that this is simplified by having the column lists sorted.
-       */
-      if(!i && hdr->type==type && template_offset==hdr->template_offset &&\
-                                        hdr->fields==col_count) {
-        gint j, match = 1;
-        /* Compare the field lists */
-        for(j=0; j<col_count; j++) {
-          if(hdr->rec_field_index[j] != sorted_cols[j]) {
+      /* T-trees also differ by the included columns */
+      if(match && type == WG_INDEX_TYPE_TTREE) {
+        if(TTREE_INCLUDE_COUNT(hdr) != inc_count)
+          match = 0;
+        for(j=0; match && j<inc_count; j++) {
+          if(hdr->ctl.t.include_columns[j] != include[j])
             match = 0;
-            break;
-          }
-        }
-        if(match) {
-          show_index_error(db, "Identical index already exists on the column");
-          return -1;
         }
       }
-
-#ifdef USE_INDEX_TEMPLATE
-      if(hdr->template_offset) {
-        wg_index_template *t = \
-          (wg_index_template *) offsettoptr(db, hdr->template_offset);
-        if(t->fixed_columns < fixed_columns)
-          break; /* new template is more promising, insert here */
-      }
-      else if(fixed_columns) {
-        /* Current list element does not have a template, so
-         * the new one should be inserted before it.
-         */
-        break;
+      if(match) {
+        show_index_error(db, "Identical index already exists on the column");
+        return -1;
       }
-#endif
-      ilist[i] = &ilistelem->cdr;
     }
+    ilist = &ilistelem->cdr;
   }
 
-  /* Add new index header */
-  index_id = wg_alloc_fixlen_object(db, &dbh->indexhdr_area_header);
-
-  for(i=0; i<col_count; i++) {
-    if(!insert_into_list(db, ilist[i], index_id)) {
-      if(i) {
-        /* XXX: need to clean up the earlier inserts :-( */
-        return -1;
-      } else {
-        return -1;
-      }
+  /* Store the predicate of a partial index */
+  if(argc) {
+    wg_index_predicate *pred;
+    predicate_offset = wg_alloc_gints(db, &dbh->indexhash_area_header,
+      sizeof(wg_index_predicate) / sizeof(gint));
+    if(!predicate_offset) {
+      show_index_error(db, "Failed to allocate the index predicate");
+      return -1;
+    }
+    pred = (wg_index_predicate *) offsettoptr(db, predicate_offset);
+    if(wg_store_filter(db, &pred->filter, arglist, argc)) {
+      wg_free_object(db, &dbh->indexhash_area_header, predicate_offset);
+      return -1;
     }
   }
 
+  /* Add new index header */
+  index_id = wg_alloc_fixlen_object(db, &dbh->indexhdr_area_header);
+
   /* Set up the header */
   hdr = (wg_index_header *) offsettoptr(db, index_id);
   hdr->type = type;
@@ -2212,21 +4723,132 @@ gint wg_create_multi_index(void *db, gint *columns, gint col_count, gint type,
     hdr->rec_field_index[i] = sorted_cols[i];
   }
   hdr->template_offset = template_offset;
+  hdr->predicate_offset = predicate_offset;
+  if(type == WG_INDEX_TYPE_TTREE) {
+    for(i=0; i < col_count; i++) {
+      hdr->ctl.t.key_columns[i] = columns[i];
+    }
+    hdr->ctl.t.include_count = inc_count;
+    for(i=0; i < inc_count; i++) {
+      hdr->ctl.t.include_columns[i] = include[i];
+    }
+  } else if(type == WG_INDEX_TYPE_HASH) {
+    hdr->ctl.h.unique = unique;
+  }
+
+  /* An online build starts with an empty index. The rows are added
+   * later by wg_scan_online_index().
+   */
+  if(online) {
+    gint build_offset;
+    wg_online_build *build;
+    void *rec;
+
+    build_offset = wg_alloc_gints(db, &dbh->indexhash_area_header,
+      sizeof(wg_online_build) / sizeof(gint));
+    if(!build_offset) {
+      show_index_error(db, "Failed to allocate the online build state");
+      return -1;
+    }
+    build = (wg_online_build *) offsettoptr(db, build_offset);
+    build->index_id = index_id;
+    rec = wg_get_first_record(db);
+    build->scan_next = (rec ? ptrtooffset(db, rec) : 0);
+    dbh->index_control_area_header.online_build = build_offset;
+  }
 
   /* create the actual index */
   switch(hdr->type) {
     case WG_INDEX_TYPE_TTREE:
-      create_ttree_index(db, index_id);
+      err = create_ttree_index(db, index_id);
       break;
     case WG_INDEX_TYPE_HASH:
     case WG_INDEX_TYPE_HASH_JSON:
-      if(create_hash_index(db, index_id))
-        return -1;
+      err = create_hash_index(db, index_id);
+      break;
+    case WG_INDEX_TYPE_TRIGRAM:
+      err = create_trigram_index(db, index_id);
+      break;
+    case WG_INDEX_TYPE_BTREE:
+    case WG_INDEX_TYPE_SPATIAL: /* stored in B+tree nodes */
+      err = create_btree_index(db, index_id);
+      break;
+    case WG_INDEX_TYPE_ZONEMAP:
+      err = create_zonemap_index(db, index_id);
       break;
     case WG_INDEX_TYPE_TTREE_JSON:
       /* Return an error, until proper implementation exists */
     default:
       show_index_error(db, "Invalid index type");
+      err = -1;
+      break;
+  }
+  if(err) {
+    if(online)
+      end_online_build(db);
+    return -1;
+  }
+
+  if(online)
+    return index_id;
+  return publish_index(db, index_id);
+}
+
+/** Make a new index visible
+ * The index is listed in the index table under all of its columns
+ * and in the master list. Queries and writers only find it after this.
+ * returns 0 on success, -1 on error
+ */
+static gint publish_index(void *db, gint index_id)
+{
+  wg_index_header *hdr = (wg_index_header *) offsettoptr(db, index_id);
+  gint tcols[INDEX_TABLE_COLUMNS], count, i;
+  gint *ilist;
+#ifdef USE_INDEX_TEMPLATE
+  wg_index_template *tmpl = NULL;
+  gint fixed_columns = 0;
+#endif
+  db_memsegment_header* dbh = dbmemsegh(db);
+
+#ifdef USE_INDEX_TEMPLATE
+  if(hdr->template_offset) {
+    tmpl = (wg_index_template *) offsettoptr(db, hdr->template_offset);
+    fixed_columns = tmpl->fixed_columns;
+  }
+#endif
+
+  /* Scan to the end of index chain for each column. If templates are used,
+   * new indexes are inserted in between list elements to maintain
+   * the chains sorted by number of fixed columns.
+   */
+  count = index_table_columns(db, hdr, tcols);
+  for(i=0; i<count; i++) {
+    ilist = &dbh->index_control_area_header.index_table[tcols[i]];
+#ifdef USE_INDEX_TEMPLATE
+    while(*ilist) {
+      gcell *ilistelem = (gcell *) offsettoptr(db, *ilist);
+      wg_index_header *other = \
+        (wg_index_header *) offsettoptr(db, ilistelem->car);
+
+      if(other->template_offset) {
+        wg_index_template *t = \
+          (wg_index_template *) offsettoptr(db, other->template_offset);
+        if(t->fixed_columns < fixed_columns)
+          break; /* new template is more promising, insert here */
+      }
+      else if(fixed_columns) {
+        /* Current list element does not have a template, so
+         * the new one should be inserted before it.
+         */
+        break;
+      }
+      ilist = &ilistelem->cdr;
+    }
+#else
+    while(*ilist)
+      ilist = &((gcell *) offsettoptr(db, *ilist))->cdr;
+#endif
+    if(!insert_into_list(db, ilist, index_id))
       return -1;
   }
 
@@ -2236,11 +4858,12 @@ gint wg_create_multi_index(void *db, gint *columns, gint col_count, gint type,
     return -1;
 
 #ifdef USE_INDEX_TEMPLATE
-  if(hdr->template_offset) {
-    int i;
+  if(tmpl) {
+    void *matchrec = offsettoptr(db, tmpl->offset_matchrec);
+    gint reclen = wg_get_record_len(db, matchrec);
     /* Update the template index */
     for(i=0; i<reclen; i++) {
-      if(wg_get_encoded_type(db, matchrec[i]) != WG_VARTYPE) {
+      if(wg_get_encoded_type(db, wg_get_field(db, matchrec, i)) != WG_VARTYPE) {
         /* No checking/sorting required here, so we can insert
          * the new element at the head of the list.
          */
@@ -2273,6 +4896,7 @@ gint wg_create_multi_index(void *db, gint *columns, gint col_count, gint type,
 gint wg_drop_index(void *db, gint index_id){
   int i;
   wg_index_header *hdr = NULL;
+  gint tcols[INDEX_TABLE_COLUMNS], count;
   gint *ilist;
   gcell *ilistelem;
   db_memsegment_header* dbh = dbmemsegh(db);
@@ -2294,10 +4918,13 @@ gint wg_drop_index(void *db, gint index_id){
     show_index_error_nr(db, "Invalid index for delete", index_id);
     return -1;
   }
+  if(BULK_DATA(db))
+    bulk_forget_index(db, index_id);
 
   /* Remove the index from index table */
-  for(i=0; i<hdr->fields; i++) {
-    int column = hdr->rec_field_index[i];
+  count = index_table_columns(db, hdr, tcols);
+  for(i=0; i<count; i++) {
+    int column = tcols[i];
 
     ilist = &dbh->index_control_area_header.index_table[column];
     while(*ilist) {
@@ -2344,9 +4971,19 @@ gint wg_drop_index(void *db, gint index_id){
       break;
     case WG_INDEX_TYPE_HASH:
     case WG_INDEX_TYPE_HASH_JSON:
+    case WG_INDEX_TYPE_TRIGRAM: /* stored in a hash area */
       if(drop_hash_index(db, index_id))
         return -1;
       break;
+    case WG_INDEX_TYPE_BTREE:
+    case WG_INDEX_TYPE_SPATIAL:
+      if(drop_btree_index(db, index_id))
+        return -1;
+      break;
+    case WG_INDEX_TYPE_ZONEMAP:
+      if(drop_zonemap_index(db, index_id))
+        return -1;
+      break;
     default:
       show_index_error(db, "Invalid index type");
       return -1;
@@ -2361,6 +4998,11 @@ gint wg_drop_index(void *db, gint index_id){
   }
 #endif
 
+  if(hdr->predicate_offset) {
+    wg_free_stored_filter(db, INDEX_PREDICATE(db, hdr));
+    wg_free_object(db, &dbh->indexhash_area_header, hdr->predicate_offset);
+  }
+
   /* Now free the header */
   wg_free_fixlen_object(db, &dbh->indexhdr_area_header, index_id);
 
@@ -2465,11 +5107,19 @@ gint wg_multi_column_to_index_id(void *db, gint *columns, gint col_count,
       if((!type || type==hdr->type) &&\
          hdr->template_offset == template_offset) {
 #endif
-        if(hdr->fields == col_count) {
+        /* partial indexes are only found by the query planner */
+        if(hdr->fields == col_count && !hdr->predicate_offset) {
           for(i=0; i<col_count; i++) {
             if(hdr->rec_field_index[i]!=sorted_cols[i])
               goto nextindex;
           }
+          if(hdr->type == WG_INDEX_TYPE_TTREE) {
+            /* composite T-trees must also match the key order */
+            for(i=0; i<col_count; i++) {
+              if(TTREE_KEY_COLUMN(hdr, i)!=columns[i])
+                goto nextindex;
+            }
+          }
           return ilistelem->car; /* index id */
         }
       }
@@ -2597,7 +5247,10 @@ void * wg_get_all_indexes(void *db, gint *count) {
     ilist = &dbh->index_control_area_header.index_table[column];
     while(*ilist) {
       gcell *ilistelem = (gcell *) offsettoptr(db, *ilist);
-      if(ilistelem->car) {
+      /* Indexes on several columns are listed once per column,
+       * take them from the list of the first one only. */
+      if(ilistelem->car && ((wg_index_header *) offsettoptr(db,
+        ilistelem->car))->rec_field_index[0] == column) {
         res[(*count)++] = ilistelem->car;
       }
       ilist = &ilistelem->cdr;
@@ -2613,7 +5266,11 @@ void * wg_get_all_indexes(void *db, gint *count) {
 }
 
 #define INDEX_ADD_ROW(d, h, i, r) \
-  switch(h->type) { \
+  if(INDEX_BULK(d, h)) { \
+    if(bulk_defer_row(d, h, i, r)) \
+      return -2; \
+  } \
+  else switch(h->type) { \
     case WG_INDEX_TYPE_TTREE: \
       if(ttree_add_row(d, i, r)) \
         return -2; \
@@ -2634,12 +5291,26 @@ void * wg_get_all_indexes(void *db, gint *count) {
           return -2; \
       } \
       break; \
+    case WG_INDEX_TYPE_TRIGRAM: \
+      if(trigram_update_row(d, i, r, HASHIDX_OP_STORE)) \
+        return -2; \
+      break; \
+    case WG_INDEX_TYPE_BTREE: \
+    case WG_INDEX_TYPE_SPATIAL: \
+      if(btree_add_row(d, i, r)) \
+        return -2; \
+      break; \
+    case WG_INDEX_TYPE_ZONEMAP: \
+      if(zonemap_add_row(d, i, r)) \
+        return -2; \
+      break; \
     default: \
       show_index_error(db, "unknown index type, ignoring"); \
       break; \
   }
 
 #define INDEX_REMOVE_ROW(d, h, i, r) \
+  if(!INDEX_BULK(d, h) || !bulk_cancel_row(d, i, r)) \
   switch(h->type) { \
     case WG_INDEX_TYPE_TTREE: \
       if(ttree_remove_row(d, i, r) < -2) \
@@ -2661,11 +5332,59 @@ void * wg_get_all_indexes(void *db, gint *count) {
           return -2; \
       } \
       break; \
+    case WG_INDEX_TYPE_TRIGRAM: \
+      if(trigram_update_row(d, i, r, HASHIDX_OP_REMOVE) < -2) \
+        return -2; \
+      break; \
+    case WG_INDEX_TYPE_BTREE: \
+    case WG_INDEX_TYPE_SPATIAL: \
+      if(btree_remove_row(d, i, r) < -2) \
+        return -2; \
+      break; \
+    case WG_INDEX_TYPE_ZONEMAP: \
+      if(zonemap_remove_row(d, i, r) < -2) \
+        return -2; \
+      break; \
     default: \
       show_index_error(db, "unknown index type, ignoring"); \
       break; \
   }
 
+/** Check a new field value against the unique indexes on the column
+ * Called before the value is written, so that a duplicate key is
+ * refused without changing anything.
+ * returns 0 if the value can be written
+ * returns -1 if it would duplicate the key of another row
+ */
+gint wg_index_check_unique(void *db, void *rec, gint column, gint data) {
+  gint *ilist;
+  gcell *ilistelem;
+  db_memsegment_header* dbh = dbmemsegh(db);
+  gint reclen = wg_get_record_len(db, rec);
+
+  ilist = &dbh->index_control_area_header.index_table[column];
+  while(*ilist) {
+    ilistelem = (gcell *) offsettoptr(db, *ilist);
+    if(ilistelem->car) {
+      wg_index_header *hdr = \
+        (wg_index_header *) offsettoptr(db, ilistelem->car);
+      if(HASHIDX_UNIQUE(hdr) && reclen > hdr->rec_field_index[hdr->fields - 1]) {
+        gint i, values[MAX_INDEX_FIELDS];
+        for(i=0; i<hdr->fields; i++) {
+          values[i] = (hdr->rec_field_index[i] == column ? data :
+            wg_get_field(db, rec, hdr->rec_field_index[i]));
+        }
+        if(hash_unique_find(db, hdr, values, ptrtooffset(db, rec))) {
+          show_index_error(db, "Duplicate key in a unique index");
+          return -1;
+        }
+      }
+    }
+    ilist = &ilistelem->cdr;
+  }
+  return 0;
+}
+
 /** Add data of one field to all indexes
  * Loops over indexes in one field and inserts the data into
  * each one of them.
@@ -2700,7 +5419,7 @@ gint wg_index_add_field(void *db, void *rec, gint column) {
       wg_index_header *hdr = \
         (wg_index_header *) offsettoptr(db, ilistelem->car);
       if(reclen > hdr->rec_field_index[hdr->fields - 1]) {
-        if(MATCH_TEMPLATE(db, hdr, rec)) {
+        if(MATCH_INDEX(db, hdr, rec)) {
           INDEX_ADD_ROW(db, hdr, ilistelem->car, rec)
         }
       }
@@ -2719,8 +5438,10 @@ gint wg_index_add_field(void *db, void *rec, gint column) {
     if(ilistelem->car) {
       wg_index_header *hdr = \
         (wg_index_header *) offsettoptr(db, ilistelem->car);
-      if(reclen > hdr->rec_field_index[hdr->fields - 1]) {
-        if(MATCH_TEMPLATE(db, hdr, rec)) {
+      /* Skip the index if it was already updated from the index table */
+      if(reclen > hdr->rec_field_index[hdr->fields - 1] &&\
+        !index_table_listed(db, hdr, column)) {
+        if(MATCH_INDEX(db, hdr, rec)) {
           INDEX_ADD_ROW(db, hdr, ilistelem->car, rec)
         }
       }
@@ -2729,6 +5450,8 @@ gint wg_index_add_field(void *db, void *rec, gint column) {
   }
 #endif
 
+  if(dbh->index_control_area_header.online_build)
+    return online_build_update(db, rec, column, ONLINE_BUILD_ADD);
   return 0;
 }
 
@@ -2771,61 +5494,19 @@ gint wg_index_add_rec(void *db, void *rec) {
            * For a single-column index, the indexed column is
            * also the last column, therefore the above is valid,
            * altough the check is unnecessary.
+           * Indexes with a template are in this list as well,
+           * MATCH_INDEX checks the template.
            */
-          if(MATCH_TEMPLATE(db, hdr, rec)) {
+          if(MATCH_INDEX(db, hdr, rec)) {
             INDEX_ADD_ROW(db, hdr, ilistelem->car, rec)
           }
         }
       }
       ilist = &ilistelem->cdr;
     }
-
-#ifdef USE_INDEX_TEMPLATE
-    ilist = &dbh->index_control_area_header.index_template_table[i];
-    while(*ilist) {
-      ilistelem = (gcell *) offsettoptr(db, *ilist);
-      if(ilistelem->car) {
-        wg_index_header *hdr = \
-          (wg_index_header *) offsettoptr(db, ilistelem->car);
-        wg_index_template *tmpl = \
-          (wg_index_template *) offsettoptr(db, hdr->template_offset);
-        void *matchrec;
-        gint mreclen;
-        int j, firstmatch = -1;
-
-        /* Here the check for a match is slightly more complicated.
-         * If there is a match *but* the current column is not the
-         * first fixed one in the template, the match has
-         * already occurred earlier.
-         */
-        matchrec = offsettoptr(db, tmpl->offset_matchrec);
-        mreclen = wg_get_record_len(db, matchrec);
-        if(mreclen > reclen) {
-          goto nexttmpl1;
-        }
-        for(j=0; j<mreclen; j++) {
-          gint enc = wg_get_field(db, matchrec, j);
-          if(wg_get_encoded_type(db, enc) != WG_VARTYPE) {
-            if(WG_COMPARE(db, enc, wg_get_field(db, rec, j)) != WG_EQUAL)
-              goto nexttmpl1;
-            if(firstmatch < 0)
-              firstmatch = j;
-          }
-        }
-        if(firstmatch==i &&\
-          reclen > hdr->rec_field_index[hdr->fields - 1]) {
-          /* The record matches AND this is the first time we
-           * see this index. Update it.
-           */
-          INDEX_ADD_ROW(db, hdr, ilistelem->car, rec)
-        }
-      }
-nexttmpl1:
-      ilist = &ilistelem->cdr;
-    }
-#endif
-
   }
+  if(dbh->index_control_area_header.online_build)
+    return online_build_update(db, rec, -1, ONLINE_BUILD_ADD);
   return 0;
 }
 
@@ -2865,7 +5546,7 @@ gint wg_index_del_field(void *db, void *rec, gint column) {
         (wg_index_header *) offsettoptr(db, ilistelem->car);
 
       if(reclen > hdr->rec_field_index[hdr->fields - 1]) {
-        if(MATCH_TEMPLATE(db, hdr, rec)) {
+        if(MATCH_INDEX(db, hdr, rec)) {
           INDEX_REMOVE_ROW(db, hdr, ilistelem->car, rec)
         }
       }
@@ -2882,8 +5563,10 @@ gint wg_index_del_field(void *db, void *rec, gint column) {
       wg_index_header *hdr = \
         (wg_index_header *) offsettoptr(db, ilistelem->car);
 
-      if(reclen > hdr->rec_field_index[hdr->fields - 1]) {
-        if(MATCH_TEMPLATE(db, hdr, rec)) {
+      /* Skip the index if it was already updated from the index table */
+      if(reclen > hdr->rec_field_index[hdr->fields - 1] &&\
+        !index_table_listed(db, hdr, column)) {
+        if(MATCH_INDEX(db, hdr, rec)) {
           INDEX_REMOVE_ROW(db, hdr, ilistelem->car, rec)
         }
       }
@@ -2892,6 +5575,8 @@ gint wg_index_del_field(void *db, void *rec, gint column) {
   }
 #endif
 
+  if(dbh->index_control_area_header.online_build)
+    return online_build_update(db, rec, column, ONLINE_BUILD_REMOVE);
   return 0;
 }
 
@@ -2928,58 +5613,643 @@ gint wg_index_del_rec(void *db, void *rec) {
           /* Only update once per index. See also comment for
            * wg_index_add_rec function.
            */
-          if(MATCH_TEMPLATE(db, hdr, rec)) {
+          if(MATCH_INDEX(db, hdr, rec)) {
             INDEX_REMOVE_ROW(db, hdr, ilistelem->car, rec)
           }
         }
       }
       ilist = &ilistelem->cdr;
     }
+  }
+  if(dbh->index_control_area_header.online_build)
+    return online_build_update(db, rec, -1, ONLINE_BUILD_REMOVE);
+  return 0;
+}
+
+/* ----------------- Online index build -------------------- */
+
+/*
+ * An online build fills a new index in short batches, so that writers
+ * only wait for one batch at a time instead of the whole table scan.
+ *
+ * The records are scanned in the order of wg_get_next_record(). The
+ * index is complete for the records the scan has passed: writers
+ * update it for those records, just like a published index, and skip
+ * the rest (the scan reads their current values later). Applying the
+ * changes at once keeps the old values valid for removal, a deferred
+ * log would hold references to strings that the update has freed.
+ * Deleting the record the scan stops at moves the scan past it.
+ *
+ * Queries do not see the index until it is published. Only one index
+ * is built online at a time.
+ */
+
+/** Create an index without blocking writers for the whole build
+ * Runs the steps of an online build (see wg_start_online_index()),
+ * taking the locks itself, so the caller must not hold any. Writers
+ * wait for at most ONLINE_BUILD_BATCH rows at a time.
+ * returns 0 on success, -1 on error
+ */
+gint wg_create_multi_index_online(void *db, gint *columns, gint col_count,
+  gint type, gint *matchrec, gint reclen)
+{
+  gint lock, index_id, more = 1, err;
+
+  lock = wg_start_write(db);
+  if(!lock) {
+    show_index_error(db, "Failed to get the write lock");
+    return -1;
+  }
+  index_id = wg_start_online_index(db, columns, col_count, type,
+    matchrec, reclen);
+  wg_end_write(db, lock);
+  if(index_id < 0)
+    return -1;
+
+  while(more > 0) {
+    lock = wg_start_read(db);
+    if(!lock) {
+      show_index_error(db, "Failed to get the read lock");
+      more = -1;
+      break;
+    }
+    more = wg_scan_online_index(db, index_id, ONLINE_BUILD_BATCH);
+    wg_end_read(db, lock);
+  }
+
+  lock = wg_start_write(db);
+  if(!lock) {
+    show_index_error(db, "Failed to get the write lock");
+    return -1;
+  }
+  if(more < 0) {
+    wg_abort_online_index(db, index_id);
+    err = -1;
+  }
+  else
+    err = wg_finish_online_index(db, index_id);
+  wg_end_write(db, lock);
+  return err;
+}
+
+/** Start building an index online
+ * Creates the index empty and unpublished. The arguments are the same
+ * as for wg_create_multi_index(). The caller holds the write lock.
+ * The rows are then added by wg_scan_online_index() under read locks
+ * and the index is published by wg_finish_online_index() under the
+ * write lock. Other indexes cannot be created until then.
+ * returns the index id on success, -1 on error
+ */
+gint wg_start_online_index(void *db, gint *columns, gint col_count,
+  gint type, gint *matchrec, gint reclen)
+{
+  gint index_id = create_index(db, columns, col_count, type, NULL, 0,
+    NULL, 0, matchrec, reclen, 0, 1);
+  return (index_id > 0 ? index_id : -1);
+}
+
+/** Add existing rows to an index that is built online
+ * Scans at most rowlimit records, continuing where the previous call
+ * stopped. The caller holds a read lock: the records are only read and
+ * the index is not visible to other readers yet. Since the index
+ * itself is modified, only one process may run the scan.
+ * returns 1 if records remain, 0 when the scan is complete, -1 on error
+ */
+gint wg_scan_online_index(void *db, gint index_id, gint rowlimit)
+{
+  wg_online_build *build = find_online_build(db, index_id);
+  wg_index_header *hdr;
+  void *rec;
+  gint lastcol, n;
+
+  if(!build) {
+    show_index_error_nr(db, "No online build for index", index_id);
+    return -1;
+  }
+  if(rowlimit < 1) {
+    show_index_error(db, "Invalid row limit");
+    return -1;
+  }
+
+  hdr = (wg_index_header *) offsettoptr(db, index_id);
+  lastcol = hdr->rec_field_index[hdr->fields - 1];
+  rec = (build->scan_next ? offsettoptr(db, build->scan_next) : NULL);
+  for(n=0; rec && n<rowlimit; n++) {
+    if(lastcol < wg_get_record_len(db, rec) && MATCH_INDEX(db, hdr, rec)) {
+      if(online_add_row(db, hdr, index_id, rec)) {
+        show_index_error(db, "Failed to add a row to the index");
+        return -1;
+      }
+    }
+    rec = wg_get_next_record(db, rec);
+  }
+  build->scan_next = (rec ? ptrtooffset(db, rec) : 0);
+  return (rec ? 1 : 0);
+}
+
+/** Publish an index that was built online
+ * The caller holds the write lock. The scan has to be complete.
+ * returns 0 on success, -1 on error
+ */
+gint wg_finish_online_index(void *db, gint index_id)
+{
+  wg_online_build *build = find_online_build(db, index_id);
+
+  if(!build) {
+    show_index_error_nr(db, "No online build for index", index_id);
+    return -1;
+  }
+  if(build->scan_next) {
+    show_index_error(db, "Online index scan is not complete");
+    return -1;
+  }
+  end_online_build(db);
+  return publish_index(db, index_id);
+}
+
+/** Cancel an online build
+ * The caller holds the write lock. The partially built index is freed.
+ * returns 0 on success, -1 on error
+ */
+gint wg_abort_online_index(void *db, gint index_id)
+{
+  if(!find_online_build(db, index_id)) {
+    show_index_error_nr(db, "No online build for index", index_id);
+    return -1;
+  }
+  end_online_build(db);
+  /* Dropping frees all parts of an index, so it is published first */
+  if(publish_index(db, index_id))
+    return -1;
+  return wg_drop_index(db, index_id);
+}
+
+/** Find the state of an online build
+ * returns NULL if the index is not being built online
+ */
+static wg_online_build *find_online_build(void *db, gint index_id) {
+  gint offset = dbmemsegh(db)->index_control_area_header.online_build;
+  wg_online_build *build;
+
+  if(!offset)
+    return NULL;
+  build = (wg_online_build *) offsettoptr(db, offset);
+  return (build->index_id == index_id ? build : NULL);
+}
+
+/** Free the state of the online build
+ */
+static void end_online_build(void *db) {
+  db_memsegment_header* dbh = dbmemsegh(db);
+
+  wg_free_object(db, &dbh->indexhash_area_header,
+    dbh->index_control_area_header.online_build);
+  dbh->index_control_area_header.online_build = 0;
+}
+
+/** First record to add when the index structure is created
+ * An index that is built online starts out empty.
+ */
+static void *index_first_row(void *db, gint index_id) {
+  if(find_online_build(db, index_id))
+    return NULL;
+  return wg_get_first_record(db);
+}
 
+/** Check if a column affects the rows of an index
+ * These are the columns the index is listed under in the index table
+ * and the fixed columns of its template.
+ */
+static gint online_build_column(void *db, wg_index_header *hdr,
+  gint column) {
+  if(index_table_listed(db, hdr, column))
+    return 1;
 #ifdef USE_INDEX_TEMPLATE
-    ilist = &dbh->index_control_area_header.index_template_table[i];
-    while(*ilist) {
-      ilistelem = (gcell *) offsettoptr(db, *ilist);
-      if(ilistelem->car) {
-        wg_index_header *hdr = \
-          (wg_index_header *) offsettoptr(db, ilistelem->car);
-        wg_index_template *tmpl = \
-          (wg_index_template *) offsettoptr(db, hdr->template_offset);
-        void *matchrec;
-        gint mreclen;
-        int j, firstmatch = -1;
-
-        /* Similar check as in wg_index_add_rec() */
-        matchrec = offsettoptr(db, tmpl->offset_matchrec);
-        mreclen = wg_get_record_len(db, matchrec);
-        if(mreclen > reclen) {
-          goto nexttmpl2; /* no match */
-        }
-        for(j=0; j<mreclen; j++) {
-          gint enc = wg_get_field(db, matchrec, j);
-          if(wg_get_encoded_type(db, enc) != WG_VARTYPE) {
-            if(WG_COMPARE(db, enc, wg_get_field(db, rec, j)) != WG_EQUAL)
-              goto nexttmpl2;
-            if(firstmatch < 0)
-              firstmatch = j;
-          }
-        }
-        if(firstmatch==i &&\
-          reclen > hdr->rec_field_index[hdr->fields - 1]) {
-          /* The record matches AND this is the first time we
-           * see this index. Update it.
-           */
-          INDEX_REMOVE_ROW(db, hdr, ilistelem->car, rec)
+  if(hdr->template_offset) {
+    wg_index_template *tmpl = \
+      (wg_index_template *) offsettoptr(db, hdr->template_offset);
+    void *matchrec = offsettoptr(db, tmpl->offset_matchrec);
+    if(column < wg_get_record_len(db, matchrec) &&\
+      wg_get_encoded_type(db, wg_get_field(db, matchrec, column)) !=\
+      WG_VARTYPE)
+      return 1;
+  }
+#endif
+  return 0;
+}
+
+/** Check if the scan of the online build has passed a record
+ * The scan visits the subareas in order and the records in each
+ * subarea by offset, like wg_get_next_record().
+ */
+static gint online_row_scanned(void *db, wg_online_build *build,
+  gint offset) {
+  db_area_header *area = &dbmemsegh(db)->datarec_area_header;
+  gint i, rowarea = -1, scanarea = -1;
+
+  if(!build->scan_next)
+    return 1;
+  for(i=0; i<=area->last_subarea_index; i++) {
+    gint start = area->subarea_array[i].offset;
+    gint end = start + area->subarea_array[i].size;
+    if(offset >= start && offset < end)
+      rowarea = i;
+    if(build->scan_next >= start && build->scan_next < end)
+      scanarea = i;
+  }
+  if(rowarea != scanarea)
+    return (rowarea < scanarea);
+  return (offset < build->scan_next);
+}
+
+/** Update the index that is being built online
+ * Called by the index maintenance functions while a build is running.
+ * column is -1 if the whole record is added or deleted.
+ * returns 0 on success, -2 on error
+ */
+static gint online_build_update(void *db, void *rec, gint column, gint op) {
+  wg_online_build *build = (wg_online_build *) offsettoptr(db,
+    dbmemsegh(db)->index_control_area_header.online_build);
+  wg_index_header *hdr = \
+    (wg_index_header *) offsettoptr(db, build->index_id);
+  gint offset = ptrtooffset(db, rec);
+
+  if(column >= 0 && !online_build_column(db, hdr, column))
+    return 0;
+  if(!online_row_scanned(db, build, offset)) {
+    if(column < 0 && op == ONLINE_BUILD_REMOVE &&\
+      offset == build->scan_next) {
+      /* The record is being deleted, the scan continues after it */
+      void *next = wg_get_next_record(db, rec);
+      build->scan_next = (next ? ptrtooffset(db, next) : 0);
+    }
+    return 0;
+  }
+
+  if(wg_get_record_len(db, rec) > hdr->rec_field_index[hdr->fields - 1] &&\
+    MATCH_INDEX(db, hdr, rec)) {
+    if(op == ONLINE_BUILD_ADD) {
+      INDEX_ADD_ROW(db, hdr, build->index_id, rec)
+    }
+    else {
+      INDEX_REMOVE_ROW(db, hdr, build->index_id, rec)
+    }
+  }
+  return 0;
+}
+
+/** Add a row to an index
+ * returns 0 on success, -2 on error
+ */
+static gint online_add_row(void *db, wg_index_header *hdr, gint index_id,
+  void *rec) {
+  INDEX_ADD_ROW(db, hdr, index_id, rec)
+  return 0;
+}
+
+/* ----------------- Bulk index maintenance -------------------- */
+
+/*
+ * Between wg_begin_bulk() and wg_end_bulk(), rows are not added to
+ * T-tree and non-unique hash indexes one at a time. The index and the
+ * row offset are kept in a table in local memory instead, and
+ * wg_end_bulk() adds the rows in key order, with the key values the
+ * rows have by then.
+ *
+ * Removals of deferred rows only take them back from the table. A row
+ * that was in the index before is removed at once, while the record
+ * still holds the old key (for the same reason as in the online build).
+ * So a record that is created and then filled in field by field is
+ * added to each index once, with its final values.
+ *
+ * Searches do not find the deferred rows until wg_end_bulk(). The
+ * caller holds the write lock for the whole batch.
+ */
+
+/** Start deferring index updates
+ * Works on the database handle, other handles update the indexes
+ * normally.
+ * returns 0 on success, -1 on error
+ */
+gint wg_begin_bulk(void *db) {
+#ifdef USE_DATABASE_HANDLE
+  index_bulk *bulk;
+
+#ifdef CHECK
+  if (!dbcheck(db)) {
+    show_index_error(db, "Invalid database pointer in wg_begin_bulk");
+    return -1;
+  }
+#endif
+  if(BULK_DATA(db)) {
+    show_index_error(db, "Bulk index maintenance is already on");
+    return -1;
+  }
+  bulk = (index_bulk *) malloc(sizeof(index_bulk));
+  if(!bulk) {
+    show_index_error(db, "Failed to allocate bulk index data");
+    return -1;
+  }
+  bulk->table = (bulk_entry *) calloc(BULK_INITIAL_SIZE, sizeof(bulk_entry));
+  if(!bulk->table) {
+    free(bulk);
+    show_index_error(db, "Failed to allocate bulk index data");
+    return -1;
+  }
+  bulk->size = BULK_INITIAL_SIZE;
+  bulk->used = 0;
+  bulk->count = 0;
+  ((db_handle *) db)->bulkdata = bulk;
+  return 0;
+#else
+  show_index_error(db, "Bulk index maintenance needs the database handle");
+  return -1;
+#endif
+}
+
+/** Add the deferred rows to the indexes and stop deferring
+ * returns 0 on success
+ * returns -1 if wg_begin_bulk() was not called
+ * returns -2 for error (insert failed, index is no longer consistent)
+ */
+gint wg_end_bulk(void *db) {
+  index_bulk *bulk = BULK_DATA(db);
+  gint *rows;
+  gint i, n, index_id, err = 0;
+
+  if(!bulk) {
+    show_index_error(db, "Bulk index maintenance is not on");
+    return -1;
+  }
+#ifdef USE_DATABASE_HANDLE
+  ((db_handle *) db)->bulkdata = NULL;
+#endif
+
+  rows = (gint *) malloc((bulk->count + 1) * sizeof(gint));
+  if(!rows) {
+    show_index_error(db, "Failed to allocate bulk index data");
+    err = -2;
+  }
+  /* Take out the rows of one index at a time. There are only a few
+   * indexes, so the table is scanned once for each. */
+  while(rows) {
+    index_id = 0;
+    for(i=0, n=0; i<bulk->size; i++) {
+      if(bulk->table[i].index_id > 0) {
+        if(!index_id)
+          index_id = bulk->table[i].index_id;
+        if(bulk->table[i].index_id == index_id) {
+          rows[n++] = bulk->table[i].offset;
+          bulk->table[i].index_id = 0;
         }
       }
-nexttmpl2:
-      ilist = &ilistelem->cdr;
     }
+    if(!index_id)
+      break;
+    if(bulk_apply(db, index_id, rows, n))
+      err = -2;
+  }
+  if(rows)
+    free(rows);
+  free(bulk->table);
+  free(bulk);
+  return err;
+}
+
+/** Free the deferred rows of a database handle
+ * Normally called when closing the database connection. The
+ * rows are not added, wg_end_bulk() should be called before.
+ */
+void wg_cleanup_handle_bulkdata(void *db) {
+  index_bulk *bulk = BULK_DATA(db);
+
+  if(bulk) {
+    free(bulk->table);
+    free(bulk);
+#ifdef USE_DATABASE_HANDLE
+    ((db_handle *) db)->bulkdata = NULL;
+#endif
+  }
+}
+
+/** Hash of an (index, row) pair
+ * The row offset is not scrambled, so rows written one after
+ * another use nearby slots.
+ */
+static wg_uint bulk_hash(gint index_id, gint offset) {
+  return ((wg_uint) offset / sizeof(gint)) +\
+    (wg_uint) index_id * 2654435761U;
+}
+
+/** Find a row in the table of deferred rows
+ * If the row is not there, returns the slot where it would be added.
+ */
+static bulk_entry *bulk_slot(index_bulk *bulk, gint index_id, gint offset) {
+  gint mask = bulk->size - 1;
+  gint i = (gint) (bulk_hash(index_id, offset) & (wg_uint) mask);
+  bulk_entry *removed = NULL;
+
+  while(bulk->table[i].index_id) {
+    if(bulk->table[i].index_id == index_id &&\
+      bulk->table[i].offset == offset)
+      return &bulk->table[i];
+    if(bulk->table[i].index_id == BULK_REMOVED && !removed)
+      removed = &bulk->table[i];
+    i = (i + 1) & mask;
+  }
+  return (removed ? removed : &bulk->table[i]);
+}
+
+/** Make room in the table of deferred rows
+ * The table is doubled, unless most of the used slots only
+ * hold rows that were taken back.
+ * returns 0 on success, -1 if out of memory
+ */
+static gint bulk_grow(index_bulk *bulk) {
+  bulk_entry *old = bulk->table;
+  gint i, oldsize = bulk->size;
+  gint size = ((bulk->count + 1) * 4 > oldsize ? oldsize * 2 : oldsize);
+
+  bulk->table = (bulk_entry *) calloc(size, sizeof(bulk_entry));
+  if(!bulk->table) {
+    bulk->table = old;
+    return -1;
+  }
+  bulk->size = size;
+  for(i=0; i<oldsize; i++) {
+    if(old[i].index_id > 0)
+      *bulk_slot(bulk, old[i].index_id, old[i].offset) = old[i];
+  }
+  bulk->used = bulk->count;
+  free(old);
+  return 0;
+}
+
+/** Defer adding a row to an index
+ * If the table cannot grow, the row is added at once.
+ * returns 0 on success, -1 on error
+ */
+static gint bulk_defer_row(void *db, wg_index_header *hdr, gint index_id,
+  void *rec) {
+  index_bulk *bulk = BULK_DATA(db);
+  bulk_entry *e;
+
+  if((bulk->used + 1) * 2 > bulk->size && bulk_grow(bulk)) {
+    if(hdr->type == WG_INDEX_TYPE_TTREE)
+      return ttree_add_row(db, index_id, rec);
+    return hash_add_row(db, index_id, rec);
+  }
+  e = bulk_slot(bulk, index_id, ptrtooffset(db, rec));
+  if(e->index_id == index_id)
+    return 0;
+  if(!e->index_id)
+    bulk->used++;
+  e->index_id = index_id;
+  e->offset = ptrtooffset(db, rec);
+  bulk->count++;
+  return 0;
+}
+
+/** Take back a deferred row
+ * returns 1 if the row was deferred, 0 if it is in the index
+ */
+static gint bulk_cancel_row(void *db, gint index_id, void *rec) {
+  index_bulk *bulk = BULK_DATA(db);
+  bulk_entry *e = bulk_slot(bulk, index_id, ptrtooffset(db, rec));
+
+  if(e->index_id != index_id)
+    return 0;
+  e->index_id = BULK_REMOVED;
+  bulk->count--;
+  return 1;
+}
+
+/** Take back all deferred rows of an index that is dropped
+ */
+static void bulk_forget_index(void *db, gint index_id) {
+  index_bulk *bulk = BULK_DATA(db);
+  gint i;
+
+  for(i=0; i<bulk->size; i++) {
+    if(bulk->table[i].index_id == index_id) {
+      bulk->table[i].index_id = BULK_REMOVED;
+      bulk->count--;
+    }
+  }
+}
+
+/** Add the deferred rows of one index
+ * If the rows are a large part of a T-tree, they are sorted by key
+ * and the tree is rebuilt with them. Otherwise they are added one by
+ * one in record order, which keeps rows appended with increasing keys
+ * on the T-tree append path.
+ * returns 0 on success, -1 on error
+ */
+static gint bulk_apply(void *db, gint index_id, gint *rows, gint count) {
+  wg_index_header *hdr = (wg_index_header *) offsettoptr(db, index_id);
+  gint i, err = 0;
+
+#ifdef TTREE_CHAINED_NODES
+  if(hdr->type == WG_INDEX_TYPE_TTREE &&\
+    count * BULK_MERGE_RATIO >= ((struct wg_tnode *) offsettoptr(db,
+    TTREE_ROOT_NODE(hdr)))->subtree_count) {
+    ttree_entry *entries, *tmp;
+    gint column = TTREE_KEY_COLUMN(hdr, 0);
+
+    entries = (ttree_entry *) malloc(count * sizeof(ttree_entry));
+    tmp = (ttree_entry *) malloc(count * sizeof(ttree_entry));
+    if(entries && tmp) {
+      for(i=0; i<count; i++) {
+        entries[i].key = wg_get_field(db, offsettoptr(db, rows[i]), column);
+        entries[i].offset = rows[i];
+      }
+      ttree_sort_entries(db, hdr, entries, tmp, count);
+      err = ttree_merge_rows(db, index_id, entries, count);
+    }
+    else
+      err = 1;
+    if(entries)
+      free(entries);
+    if(tmp)
+      free(tmp);
+    if(err <= 0)
+      return err;
+    err = 0; /* not enough memory, insert the rows instead */
+  }
 #endif
 
+  qsort(rows, count, sizeof(gint), bulk_offset_cmp);
+  for(i=0; i<count; i++) {
+    void *rec = offsettoptr(db, rows[i]);
+    if(hdr->type == WG_INDEX_TYPE_TTREE) {
+      if(ttree_add_row(db, index_id, rec))
+        err = -1;
+    }
+    else if(hash_add_row(db, index_id, rec))
+      err = -1;
+  }
+  return err;
+}
+
+/** Compare two row offsets (for qsort)
+ */
+static int bulk_offset_cmp(const void *a, const void *b) {
+  gint x = *((gint *) a), y = *((gint *) b);
+  return (x > y) - (x < y);
+}
+
+#ifdef TTREE_CHAINED_NODES
+/** Rebuild a T-tree with new rows merged in
+ * entries holds the new rows in key order. The old rows are read
+ * in order from the node chain, and the tree is built bottom-up
+ * like in create_ttree_index(). The old nodes are freed after the
+ * new tree is complete.
+ * returns 0 on success, -1 on error, 1 if out of memory (the tree
+ * is left as it was)
+ */
+static gint ttree_merge_rows(void *db, gint index_id,
+  ttree_entry *entries, gint count) {
+  wg_index_header *hdr = (wg_index_header *) offsettoptr(db, index_id);
+  gint column = TTREE_KEY_COLUMN(hdr, 0);
+  gint total = ((struct wg_tnode *) offsettoptr(db,
+    TTREE_ROOT_NODE(hdr)))->subtree_count + count;
+  gint oldmin = TTREE_MIN_NODE(hdr), off, i, j = 0, n = 0;
+  gint node, prev = 0, height;
+  ttree_entry *merged = (ttree_entry *) malloc(total * sizeof(ttree_entry));
+
+  if(!merged)
+    return 1;
+  for(off = oldmin; off; ) {
+    struct wg_tnode *tnode = (struct wg_tnode *) offsettoptr(db, off);
+    for(i=0; i<tnode->number_of_elements; i++) {
+      ttree_entry e;
+      e.offset = tnode->array_of_values[i];
+      e.key = wg_get_field(db, offsettoptr(db, e.offset), column);
+      while(j < count &&\
+        ttree_compare_entries(db, hdr, &entries[j], &e) == WG_LESSTHAN)
+        merged[n++] = entries[j++];
+      merged[n++] = e;
+    }
+    off = tnode->succ_offset;
+  }
+  while(j < count)
+    merged[n++] = entries[j++];
+
+  node = ttree_build_nodes(db, hdr, merged, n, 0,
+    (n - 1) / WG_TNODE_ARRAY_SIZE, 0, &prev, &height);
+  free(merged);
+  if(!node) {
+    /* The nodes allocated so far are lost, the old tree is intact */
+    show_index_error(db, "Failed to allocate T-tree nodes");
+    TTREE_MIN_NODE(hdr) = oldmin;
+    return 1;
   }
+  ttree_free_chain(db, oldmin);
+  TTREE_ROOT_NODE(hdr) = node;
+  TTREE_MAX_NODE(hdr) = prev;
   return 0;
 }
+#endif
 
 /* --------------- error handling ------------------------------*/
 
@@ -36,6 +36,8 @@
 
 /* For gint data type */
 #include "dbdata.h"
+/* For wg_query_arg */
+#include "dbquery.h"
 
 /* ==== Public macros ==== */
 
@@ -55,6 +57,35 @@
                     wg_ttree_find_leaf_predecessor(d, ptrtooffset(d, x)))
 #endif
 
+/* Write node slots. With TTREE_KEY_PREFIX the normalized prefix of
+ * the leading key is kept next to the row offset. Nodes of a covering
+ * index also move the copies of the included columns with the slot. */
+#ifdef TTREE_KEY_PREFIX
+#define TNODE_SET_SLOT(d, n, i, off, pfx) { \
+                    (n)->array_of_values[i] = (off); \
+                    (n)->key_prefix[i] = (pfx); \
+                    if((n)->cover_offset) wg_tnode_set_cover(d, n, i); }
+#define TNODE_COPY_SLOT(d, n, i, src, j) { \
+                    (n)->array_of_values[i] = (src)->array_of_values[j]; \
+                    (n)->key_prefix[i] = (src)->key_prefix[j]; \
+                    if((n)->cover_offset) wg_tnode_copy_cover(d, n, i, src, j); }
+#define TTREE_KEY_PREFIX_OF(d, v) wg_ttree_key_prefix(d, v)
+#else
+#define TNODE_SET_SLOT(d, n, i, off, pfx) { \
+                    (n)->array_of_values[i] = (off); (void) (pfx); \
+                    if((n)->cover_offset) wg_tnode_set_cover(d, n, i); }
+#define TNODE_COPY_SLOT(d, n, i, src, j) { \
+                    (n)->array_of_values[i] = (src)->array_of_values[j]; \
+                    if((n)->cover_offset) wg_tnode_copy_cover(d, n, i, src, j); }
+#define TTREE_KEY_PREFIX_OF(d, v) ((wg_uint) 0)
+#endif
+
+/* Layout of the included column copies of a T-node: the allocator
+ * header, the number of included columns, the column numbers and then
+ * the values of each slot. */
+#define TNODE_COVER(d, n) ((gint *) offsettoptr(d, (n)->cover_offset))
+#define TNODE_COVER_VALUES(c, i) ((c) + 2 + (c)[1] + (i) * (c)[1])
+
 /* Check if record matches index (takes pointer arguments) */
 #ifndef USE_INDEX_TEMPLATE
 #define MATCH_TEMPLATE(d, h, r) 1
@@ -64,10 +95,24 @@
         (wg_index_template *) offsettoptr(d, h->template_offset), r) : 1)
 #endif
 
+/* Check if record passes the predicate of a partial index */
+#define INDEX_PREDICATE(d, h) \
+        (&((wg_index_predicate *) offsettoptr(d, h->predicate_offset))->filter)
+#define MATCH_PREDICATE(d, h, r) (h->predicate_offset ? \
+        wg_match_stored_filter(d, INDEX_PREDICATE(d, h), r) : 1)
+#define MATCH_INDEX(d, h, r) (MATCH_TEMPLATE(d, h, r) && \
+        MATCH_PREDICATE(d, h, r))
+
 #define WG_INDEX_TYPE_TTREE         50
 #define WG_INDEX_TYPE_TTREE_JSON    51
 #define WG_INDEX_TYPE_HASH          60
 #define WG_INDEX_TYPE_HASH_JSON     61
+#define WG_INDEX_TYPE_TRIGRAM       70
+#define WG_INDEX_TYPE_BTREE         80
+#define WG_INDEX_TYPE_ZONEMAP       90
+#define WG_INDEX_TYPE_SPATIAL       100
+
+#define WG_TRIGRAM_LEN 3            /** bytes in a trigram index key */
 
 /* Index header helpers */
 #define TTREE_ROOT_NODE(x) (x->ctl.t.offset_root_node)
@@ -75,7 +120,31 @@
 #define TTREE_MIN_NODE(x) (x->ctl.t.offset_min_node)
 #define TTREE_MAX_NODE(x) (x->ctl.t.offset_max_node)
 #endif
+/* Key columns of a T-tree in comparison order. rec_field_index[] is
+ * kept sorted, so composite indexes store the key order separately. */
+#define TTREE_KEY_COLUMN(x, i) (x->fields > 1 ? \
+                    x->ctl.t.key_columns[i] : x->rec_field_index[0])
+/* Included columns of a covering T-tree */
+#define TTREE_INCLUDE_COUNT(x) (x->type == WG_INDEX_TYPE_TTREE ? \
+                    x->ctl.t.include_count : 0)
 #define HASHIDX_ARRAYP(x) (&(x->ctl.h.hasharea))
+#define HASHIDX_UNIQUE(x) (x->type == WG_INDEX_TYPE_HASH && x->ctl.h.unique)
+#define BTREE_ROOT_NODE(x) (x->ctl.b.offset_root_node)
+#define BTREE_FIRST_LEAF(x) (x->ctl.b.offset_first_leaf)
+#define BTREE_LAST_LEAF(x) (x->ctl.b.offset_last_leaf)
+#define ZONEMAP_TABLES(x) (x->ctl.z.offset_tables)
+
+/* Z-order keys of spatial indexes. The bits of the first column are
+ * at the odd positions, so masking out the other column keeps the
+ * order of each coordinate. */
+#define SPATIAL_AXIS_BITS (sizeof(wg_uint)*4)
+#define SPATIAL_X_BITS (~((wg_uint) 0) / 3 * 2)
+#define SPATIAL_Y_BITS (~((wg_uint) 0) / 3)
+#define SPATIAL_IN_BOX(z, lo, hi) \
+        (((z) & SPATIAL_X_BITS) >= ((lo) & SPATIAL_X_BITS) && \
+        ((z) & SPATIAL_X_BITS) <= ((hi) & SPATIAL_X_BITS) && \
+        ((z) & SPATIAL_Y_BITS) >= ((lo) & SPATIAL_Y_BITS) && \
+        ((z) & SPATIAL_Y_BITS) <= ((hi) & SPATIAL_Y_BITS))
 
 /* ====== data structures ======== */
 
@@ -83,6 +152,13 @@
 *   (array of data pointers, pointers to parent/children nodes, control data)
 *   overall size is currently 64 bytes (cache line?) if array size is 10,
 *   with extra node chaining pointers the array size defaults to 8.
+*   subtree_count makes the tree order-statistic: ranks and range counts
+*   are found in O(log n) without visiting the nodes in between.
+*   key_prefix holds an order-preserving prefix of the leading key of
+*   each row (see wg_ttree_key_prefix()), so that searches only need
+*   to fetch the row when the prefixes are equal.
+*   cover_offset points to the copies of the included columns of
+*   a covering index (see wg_create_covering_index()).
 */
 struct wg_tnode{
   gint parent_offset;
@@ -91,7 +167,12 @@ struct wg_tnode{
   short number_of_elements;
   unsigned char left_subtree_height;
   unsigned char right_subtree_height;
+  gint subtree_count;   /** rows in this node and all its subtrees */
+  gint cover_offset;    /** included column copies, 0 if none */
   gint array_of_values[WG_TNODE_ARRAY_SIZE];
+#ifdef TTREE_KEY_PREFIX
+  wg_uint key_prefix[WG_TNODE_ARRAY_SIZE]; /** normalized leading keys */
+#endif
   gint left_child_offset;
   gint right_child_offset;
 #ifdef TTREE_CHAINED_NODES
@@ -100,6 +181,79 @@ struct wg_tnode{
 #endif
 };
 
+/** structure of B+tree node
+*   Entries are kept in (key, row offset) order, so that every row
+*   has a unique position even with duplicate keys. The key is stored
+*   in the node both as its normalized prefix (see wg_ttree_key_prefix())
+*   and encoded, so searches do not touch the rows at all. In leaves,
+*   row[] holds the indexed rows. In inner nodes, entry i is the first
+*   entry of the subtree at child[i] (searches do not use it for child 0).
+*   With WG_BNODE_SIZE 16 a node spans nine cache lines.
+*   Spatial indexes use the same nodes with the Z-order key of the
+*   two columns (see wg_spatial_key()) as the normalized key and
+*   0 as the encoded key.
+*/
+struct wg_bnode{
+  gint parent_offset;
+  gint leaf;            /** 1 for leaf nodes */
+  gint count;           /** entries in the node */
+  gint next_offset;     /** leaf chain (smaller to larger), leaves only */
+  gint prev_offset;     /** backward leaf chain */
+  wg_uint key_prefix[WG_BNODE_SIZE]; /** normalized keys */
+  gint key[WG_BNODE_SIZE];           /** encoded keys */
+  gint row[WG_BNODE_SIZE];           /** row offsets */
+  gint child[WG_BNODE_SIZE];         /** subtrees, inner nodes only */
+};
+
+/** summary of one block of a datarec subarea in a zone map
+*   A row belongs to the block its record starts in. min and max are
+*   normalized values (see wg_ttree_key_prefix()) of the non-NULL
+*   values. Removing rows does not shrink them, they only grow until
+*   the block has no values left.
+*/
+typedef struct {
+  gint count;               /** rows in the block */
+  gint nulls;               /** rows with a NULL value */
+  gint first;               /** first row of the block, 0 if none */
+  wg_uint min;              /** smallest normalized value */
+  wg_uint max;              /** largest normalized value */
+} wg_zone;
+
+/** zone map blocks of one datarec subarea
+*/
+typedef struct {
+  gint objhead;             /** allocator header of the object, do not use */
+  gint blocks;              /** number of blocks */
+  wg_zone zone[1];          /** block summaries */
+} wg_zone_table;
+
+/** block tables of a zone map, allocated when the first row of
+*   a subarea is added
+*/
+typedef struct {
+  gint objhead;             /** allocator header of the object, do not use */
+  gint table[SUBAREA_ARRAY_SIZE]; /** wg_zone_table of each subarea, 0 if none */
+} wg_zonemap_tables;
+
+/** predicate of a partial index
+*   Only rows that pass the filter are kept in the index.
+*/
+typedef struct {
+  gint objhead;             /** allocator header of the object, do not use */
+  wg_stored_filter filter;
+} wg_index_predicate;
+
+/** state of an online index build
+*   The index is kept complete for the rows that precede scan_next
+*   in the order of wg_get_next_record(). Writers update it for those
+*   rows only, the rest are added by the scan.
+*/
+typedef struct {
+  gint objhead;             /** allocator header of the object, do not use */
+  gint index_id;            /** header of the index, not yet published */
+  gint scan_next;           /** next record to scan, 0 when done */
+} wg_online_build;
+
 /* ==== Protos ==== */
 
 /* API functions (copied in indexapi.h) */
@@ -108,6 +262,18 @@ gint wg_create_index(void *db, gint column, gint type,
   gint *matchrec, gint reclen);
 gint wg_create_multi_index(void *db, gint *columns, gint col_count,
   gint type, gint *matchrec, gint reclen);
+gint wg_create_covering_index(void *db, gint *columns, gint col_count,
+  gint *include, gint inc_count, gint *matchrec, gint reclen);
+gint wg_create_partial_index(void *db, gint *columns, gint col_count,
+  gint type, wg_query_arg *arglist, gint argc);
+gint wg_create_unique_index(void *db, gint *columns, gint col_count);
+gint wg_create_multi_index_online(void *db, gint *columns, gint col_count,
+  gint type, gint *matchrec, gint reclen);
+gint wg_start_online_index(void *db, gint *columns, gint col_count,
+  gint type, gint *matchrec, gint reclen);
+gint wg_scan_online_index(void *db, gint index_id, gint rowlimit);
+gint wg_finish_online_index(void *db, gint index_id);
+gint wg_abort_online_index(void *db, gint index_id);
 gint wg_drop_index(void *db, gint index_id);
 gint wg_column_to_index_id(void *db, gint column, gint type,
   gint *matchrec, gint reclen);
@@ -116,6 +282,9 @@ gint wg_multi_column_to_index_id(void *db, gint *columns, gint col_count,
 gint wg_get_index_type(void *db, gint index_id);
 void * wg_get_index_template(void *db, gint index_id, gint *reclen);
 void * wg_get_all_indexes(void *db, gint *count);
+void *wg_upsert(void *db, gint index_id, gint *values, gint count);
+gint wg_begin_bulk(void *db);
+gint wg_end_bulk(void *db);
 
 /* WhiteDB internal functions */
 
@@ -135,17 +304,45 @@ gint wg_search_tnode_first(void *db, gint nodeoffset, gint key,
   gint column);
 gint wg_search_tnode_last(void *db, gint nodeoffset, gint key,
   gint column);
+gint wg_search_ttree_multi(void *db, gint index_id, gint *keys, gint nkeys,
+  gint strict, gint *slot);
+wg_uint wg_ttree_key_prefix(void *db, gint enc);
+gint wg_ttree_rank(void *db, gint nodeoffset, gint slot);
+gint wg_ttree_seek(void *db, gint index_id, gint rank, gint *slot);
+gint wg_ttree_count_range(void *db, gint start_offset, gint start_slot,
+  gint end_offset, gint end_slot);
+void wg_tnode_set_cover(void *db, struct wg_tnode *node, gint slot);
+void wg_tnode_copy_cover(void *db, struct wg_tnode *node, gint slot,
+  struct wg_tnode *src, gint srcslot);
+gint wg_tnode_covered_value(void *db, gint nodeoffset, gint slot,
+  gint column, gint *value);
+
+gint wg_search_btree(void *db, gint index_id, gint key, gint strict,
+  gint *slot);
+
+wg_uint wg_spatial_axis_key(void *db, gint enc);
+wg_uint wg_spatial_key(wg_uint x, wg_uint y);
+gint wg_spatial_next(wg_uint z, wg_uint lo, wg_uint hi, wg_uint *next);
+gint wg_search_spatial(void *db, gint index_id, wg_uint z, gint *slot);
+
+gint wg_search_zonemap(void *db, gint index_id, gint offset,
+  wg_uint lo, wg_uint hi, gint nulls, gint *start, gint *end,
+  wg_uint *skipped);
 
 gint wg_search_hash(void *db, gint index_id, gint *values, gint count);
+gint wg_search_trigram(void *db, gint index_id, char *gram);
+gint wg_trigram_split(void *db, char *str, gint len, gint **grams);
 
 #ifdef USE_INDEX_TEMPLATE
 gint wg_match_template(void *db, wg_index_template *tmpl, void *rec);
 #endif
 
+gint wg_index_check_unique(void *db, void *rec, gint column, gint data);
 gint wg_index_add_field(void *db, void *rec, gint column);
 gint wg_index_add_rec(void *db, void *rec);
 gint wg_index_del_field(void *db, void *rec, gint column);
 gint wg_index_del_rec(void *db, void *rec);
+void wg_cleanup_handle_bulkdata(void *db);
 
 
 #endif /* DEFINED_DBINDEX_H */
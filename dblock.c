@@ -56,14 +56,12 @@ extern "C" {
 #include "dballoc.h"
 #include "dblock.h"
 
-#if (LOCK_PROTO==TFQUEUE)
 #ifdef __linux__
 #include <linux/futex.h>
 #include <unistd.h>
 #include <sys/syscall.h>
 #include <errno.h>
 #endif
-#endif
 
 /* ====== Private headers and defs ======== */
 
@@ -456,6 +454,62 @@ gint wg_compare_and_swap(volatile gint *ptr, gint oldv, gint newv) {
 #endif
 }
 
+/* ----------- waiting for changes in shared memory ----------- */
+
+/** Wait until the value at addr is no longer val.
+ *  Uses a futex on Linux, so that processes sharing the segment
+ *  can block until another one calls wg_wake_value(). Elsewhere
+ *  the value is polled. timeout is in milliseconds, negative
+ *  timeout waits indefinitely. Spurious wakeups are possible,
+ *  the caller should check the value again.
+ *  returns 0 when woken up or if the value differs
+ *  returns -1 on timeout
+ */
+gint wg_wait_value(volatile gint *addr, gint val, gint timeout) {
+#ifdef __linux__
+  struct timespec ts;
+
+  if(*addr != val)
+    return 0;
+  ts.tv_sec = timeout / 1000;
+  ts.tv_nsec = (timeout % 1000) * 1000000;
+  if(syscall(SYS_futex, (void *) addr, FUTEX_WAIT, (int) val,
+    (timeout < 0 ? NULL : &ts)) == -1 && errno == ETIMEDOUT)
+    return -1;
+  return 0;
+#else
+#ifdef _WIN32
+  int ts=1;
+#else
+  struct timespec ts;
+  ts.tv_sec=0;
+  ts.tv_nsec=1000000;
+#endif
+
+  while(*addr == val) {
+    if(!timeout)
+      return -1;
+    if(timeout > 0)
+      timeout--;
+#ifdef _WIN32
+    Sleep(ts);
+#else
+    nanosleep(&ts, NULL);
+#endif
+  }
+  return 0;
+#endif
+}
+
+/** Wake up all processes waiting on addr in wg_wait_value().
+ *  The value should be changed before calling this.
+ */
+void wg_wake_value(volatile gint *addr) {
+#ifdef __linux__
+  syscall(SYS_futex, (void *) addr, FUTEX_WAKE, INT_MAX);
+#endif
+}
+
 /* ----------- read and write transaction support ----------- */
 
 /*
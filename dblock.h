@@ -78,6 +78,8 @@ gint wg_end_read(void * dbase, gint lock);  /* end read transaction */
 /* WhiteDB internal functions */
 
 gint wg_compare_and_swap(volatile gint *ptr, gint oldv, gint newv);
+gint wg_wait_value(volatile gint *addr, gint val, gint timeout);
+void wg_wake_value(volatile gint *addr);
 gint wg_init_locks(void * db); /* (re-) initialize locking subsystem */
 
 #if (LOCK_PROTO==RPSPIN)
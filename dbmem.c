@@ -56,6 +56,8 @@ extern "C" {
 #include "dbfeatures.h"
 #include "dbmem.h"
 #include "dblog.h"
+#include "dbquery.h"
+#include "dbindex.h"
 
 /* ====== Private headers and defs ======== */
 
@@ -444,6 +446,13 @@ static void *init_dbhandle() {
     return NULL;
   }
 #endif
+  if(wg_init_handle_querydata(dbhandle)) {
+#ifdef USE_DBLOG
+    wg_cleanup_handle_logdata(dbhandle);
+#endif
+    free(dbhandle);
+    return NULL;
+  }
   return dbhandle;
 }
 
@@ -451,6 +460,8 @@ static void free_dbhandle(void *dbhandle) {
 #ifdef USE_DBLOG
   wg_cleanup_handle_logdata(dbhandle);
 #endif
+  wg_cleanup_handle_querydata(dbhandle);
+  wg_cleanup_handle_bulkdata(dbhandle);
   free(dbhandle);
 }
 
@@ -511,13 +522,17 @@ void wg_print_code_version(void) {
     "  chained nodes in T-tree: %s\n"\
     "  record backlinking: %s\n"\
     "  child databases: %s\n"\
-    "  index templates: %s\n",
+    "  index templates: %s\n"\
+    "  key prefixes in T-tree: %s\n"\
+    "  index advisor: %s\n",
     (MEMSEGMENT_FEATURES & FEATURE_BITS_64BIT ? "yes" : "no"),
     (MEMSEGMENT_FEATURES & FEATURE_BITS_QUEUED_LOCKS ? "yes" : "no"),
     (MEMSEGMENT_FEATURES & FEATURE_BITS_TTREE_CHAINED ? "yes" : "no"),
     (MEMSEGMENT_FEATURES & FEATURE_BITS_BACKLINK ? "yes" : "no"),
     (MEMSEGMENT_FEATURES & FEATURE_BITS_CHILD_DB ? "yes" : "no"),
-    (MEMSEGMENT_FEATURES & FEATURE_BITS_INDEX_TMPL ? "yes" : "no"));
+    (MEMSEGMENT_FEATURES & FEATURE_BITS_INDEX_TMPL ? "yes" : "no"),
+    (MEMSEGMENT_FEATURES & FEATURE_BITS_TTREE_PREFIX ? "yes" : "no"),
+    (MEMSEGMENT_FEATURES & FEATURE_BITS_INDEX_ADVISOR ? "yes" : "no"));
 }
 
 void wg_print_header_version(db_memsegment_header *dbh, int verbose) {
@@ -558,13 +573,17 @@ void wg_print_header_version(db_memsegment_header *dbh, int verbose) {
       "  chained nodes in T-tree: %s\n"\
       "  record backlinking: %s\n"\
       "  child databases: %s\n"\
-      "  index templates: %s\n",
+      "  index templates: %s\n"\
+      "  key prefixes in T-tree: %s\n"\
+      "  index advisor: %s\n",
       (features & FEATURE_BITS_64BIT ? "yes" : "no"),
       (features & FEATURE_BITS_QUEUED_LOCKS ? "yes" : "no"),
       (features & FEATURE_BITS_TTREE_CHAINED ? "yes" : "no"),
       (features & FEATURE_BITS_BACKLINK ? "yes" : "no"),
       (features & FEATURE_BITS_CHILD_DB ? "yes" : "no"),
-      (features & FEATURE_BITS_INDEX_TMPL ? "yes" : "no"));
+      (features & FEATURE_BITS_INDEX_TMPL ? "yes" : "no"),
+      (features & FEATURE_BITS_TTREE_PREFIX ? "yes" : "no"),
+      (features & FEATURE_BITS_INDEX_ADVISOR ? "yes" : "no"));
   } else {
     printf("%d.%d.%d%s\n",
       (version & 0xff), ((version>>8) & 0xff), ((version>>16) & 0xff),
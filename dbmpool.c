@@ -206,6 +206,40 @@ void wg_free_mpool(void* db, void* mpool) {
   free(mpool);
 }
 
+/** empty the memory pool for reuse
+*
+* keeps the last and largest subarea added by extensions and frees
+* the others. Allocation continues from the start of the kept
+* subarea (or the initial one if the pool was never extended), so a
+* pool that is reset after each use stops allocating once it has
+* grown to its working size. Earlier allocations from the pool become
+* invalid.
+*
+*/
+
+void wg_reset_mpool(void* db, void* mpool) {
+  int i;
+  mpool_header* mpoolh;
+  void* nextptr;
+
+  mpoolh=(mpool_header*)mpool;
+  i=mpoolh->cur_subarea;
+  if (i>0) {
+    for(i--;i>0;i--) {
+      free(((mpoolh->subarea_table)[i]).area_start);
+    }
+    (mpoolh->subarea_table)[1]=(mpoolh->subarea_table)[mpoolh->cur_subarea];
+    (mpoolh->cur_subarea)=1;
+    nextptr=((mpoolh->subarea_table)[1]).area_start;
+  } else {
+    nextptr=(void*)(((char*)mpool)+sizeof(mpool_header));
+  }
+  // set correct alignment for nextptr
+  i=((size_t)nextptr)%ALIGNMENT_BYTES;
+  if (i!=0) nextptr=((char*)nextptr)+(ALIGNMENT_BYTES-i);
+  (mpoolh->freeptr)=nextptr;
+}
+
 /** allocate bytes from a memory pool: analogous to malloc
 *
 * mpool is extended automatically if not enough free space present
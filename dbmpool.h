@@ -46,6 +46,7 @@ void* wg_create_mpool(void* db, int bytes);             // call this to init poo
 void* wg_alloc_mpool(void* db, void* mpool, int bytes); // call each time you want to "malloc":
                                                         // automatically extends pool if no space left
 void wg_free_mpool(void* db, void* mpool);              // remove the whole pool
+void wg_reset_mpool(void* db, void* mpool);             // empty the pool, keeping its largest area
 
 int wg_ispair(void* db, void* ptr);
 void* wg_mkpair(void* db, void* mpool, void* x, void* y);
@@ -30,6 +30,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
 
 /* ====== Private headers and defs ======== */
 
@@ -43,6 +48,7 @@ extern "C" {
 #include "dbmpool.h"
 #include "dbschema.h"
 #include "dbhash.h"
+#include "dbadvise.h"
 
 /* T-tree based scoring */
 #define TTREE_SCORE_EQUAL 5
@@ -53,11 +59,34 @@ extern "C" {
 
 /* Query flags for internal use */
 #define QUERY_FLAGS_PREFETCH 0x1000
+#define QUERY_FLAGS_PROFILE 0x2000
+
+/* Comparison that is counted in the query statistics if
+ * cnt is non-NULL (profiled queries).
+ */
+#define QUERY_COMPARE(d,a,b,cnt) ((cnt) ? ((*(cnt))++, WG_COMPARE(d,a,b)) :\
+  WG_COMPARE(d,a,b))
 
 #define QUERY_RESULTSET_PAGESIZE 63  /* mpool is aligned, so we can align
                                       * the result pages too by selecting an
                                       * appropriate size */
 
+#define QUERY_MRC_LOCAL_ARGS 16      /* most_restricting_column() keeps the
+                                      * scores on stack up to this many
+                                      * arguments */
+
+#define QUERY_TRIGRAM_SCAN_RATIO 8   /* a posting list is intersected with
+                                      * the candidates if it is at most this
+                                      * many times longer */
+
+#define QUERY_JSON_PROBE_RATIO 8     /* JSON query reads a row list from the
+                                      * hash index if it is at most this many
+                                      * times larger than the current result,
+                                      * otherwise the result is probed */
+
+#define QUERY_MPOOL_CACHE_SIZE 4     /* number of emptied result pools kept
+                                      * in the db handle for reuse */
+
 /* Emulate array index when doing a scan of key-value pairs
  * in a JSON query.
  * If this is not desirable, commenting this out makes
@@ -77,6 +106,27 @@ typedef struct {
   gint pidx;                      /** current index on page (reading) */
 } query_result_cursor;
 
+/** Query data in the database handle (local memory) */
+typedef struct {
+  void *mpools[QUERY_MPOOL_CACHE_SIZE]; /** emptied pools ready for reuse */
+  int mpool_count;                      /** number of cached pools */
+} db_handle_querydata;
+
+/** Entry in the local hash table of a join */
+typedef struct {
+  wg_uint hash;                   /** hash of the join value */
+  gint key;                       /** encoded join value */
+  gint rec;                       /** offset of the row */
+  gint next;                      /** next entry in the chain, -1 ends it */
+} join_hash_entry;
+
+typedef struct {
+  gint *buckets;                  /** first entry of each chain, -1 if none */
+  join_hash_entry *entries;
+  gint size;                      /** number of buckets (power of 2) */
+  gint count;                     /** number of entries */
+} join_hash_table;
+
 typedef struct {
   void *mpool;                    /** storage for row offsets */
   query_result_page *first_page;  /** first page of results, for rewinding */
@@ -88,37 +138,103 @@ typedef struct {
 /* ======= Private protos ================ */
 
 static gint most_restricting_column(void *db,
-  wg_query_arg *arglist, gint argc, gint *index_id);
+  wg_query_arg *arglist, gint argc, gint *index_id, gint *prefix);
+#ifdef USE_INDEX_TEMPLATE
+static int index_template_score(void *db, wg_index_header *hdr,
+  wg_query_arg *arglist, gint argc);
+#endif
 static gint check_arglist(void *db, void *rec, wg_query_arg *arglist,
-  gint argc);
+  gint argc, wg_uint *cmpcount);
+static gint find_trigram_arg(void *db, wg_query_arg *arglist, gint argc,
+  gint *index_id);
+static gint find_zone_map(void *db, wg_query_arg *arglist, gint argc,
+  gint *column);
+static gint zone_map_bounds(void *db, wg_query_arg *arglist, gint argc,
+  gint column, wg_uint *lo, wg_uint *hi);
+static gint zone_map_next(void *db, wg_query *query, gint offset);
+static gint spatial_bounds(void *db, wg_query_arg *arglist, gint argc,
+  gint column, wg_uint *lo, wg_uint *hi);
+static gint find_spatial_index(void *db, wg_query_arg *arglist, gint argc,
+  wg_uint *box_lo, wg_uint *box_hi);
+#ifdef USE_INDEX_ADVISOR
+static void sample_scan_row(void *db, wg_query *query, void *rec);
+static void advise_scan(void *db, wg_query *query);
+#endif
+static gint condition_implies(void *db, gint cond, gint value,
+  gint pcond, gint pvalue);
+static gint index_predicate_implied(void *db, wg_index_header *hdr,
+  wg_query_arg *arglist, gint argc);
+static int offset_cmp(const void *a, const void *b);
+static gint trigram_candidates(void *db, gint index_id, char *pattern,
+  void *arena, gint **cand, gint *count);
 static gint prepare_params(void *db, void *matchrec, gint reclen,
   wg_query_arg *arglist, gint argc,
-  wg_query_arg **farglist, gint *fargc);
+  wg_query_arg **farglist, gint *fargc, void *arena);
 static gint find_ttree_bounds(void *db, gint index_id, gint col,
   gint start_bound, gint end_bound, gint start_inclusive, gint end_inclusive,
   gint *curr_offset, gint *curr_slot, gint *end_offset, gint *end_slot);
+static gint find_ttree_multi_bounds(void *db, gint index_id,
+  gint *keys, gint prefix,
+  gint start_bound, gint end_bound, gint start_inclusive, gint end_inclusive,
+  gint *curr_offset, gint *curr_slot, gint *end_offset, gint *end_slot);
+static void check_ttree_range(void *db, gint *co, gint cs,
+  gint *eo, gint es);
+static void find_btree_bounds(void *db, gint index_id,
+  gint start_bound, gint end_bound, gint start_inclusive, gint end_inclusive,
+  gint *curr_offset, gint *curr_slot, gint *end_offset, gint *end_slot);
+static gint covered_by_prefix(void *db, wg_index_header *hdr,
+  wg_query_arg *arg, gint *keys, gint prefix);
 static wg_query *internal_build_query(void *db, void *matchrec, gint reclen,
-  wg_query_arg *arglist, gint argc, gint flags, wg_uint rowlimit);
+  wg_query_arg *arglist, gint argc, gint flags, wg_uint rowlimit,
+  wg_query_plan *plan, wg_query_token *token,
+  void *arena, wg_query *query);
+static void *fetch_next(void *db, wg_query *query);
+static gint prefetch_rows(void *db, wg_query *query, wg_uint rowlimit);
+static wg_uint skip_ttree_rows(void *db, wg_query *query, wg_uint count);
+static gint copy_query_param(void *db, gint enc);
+static gint finish_keyset_run(void *db, wg_query_token *token,
+  gint *rows, gint start, gint count, gint key);
+static gint keyset_rows(void *db, wg_query *query, wg_query_token *token,
+  wg_uint rowlimit);
+static wg_uint query_clock_ns(void);
+static void *query_alloc(void *db, void *arena, size_t size);
+static void query_release(void *arena, void *ptr);
+static void *get_query_mpool(void *db);
+static void release_query_mpool(void *db, void *mpool);
 
 static query_result_set *create_resultset(void *db);
 static void free_resultset(void *db, query_result_set *set);
 static void rewind_resultset(void *db, query_result_set *set);
 static gint append_resultset(void *db, query_result_set *set, gint offset);
 static gint fetch_resultset(void *db, query_result_set *set);
+static gint gallop_offsets(gint *arr, gint count, gint pos, gint key);
+static gint *sorted_resultset(void *db, query_result_set *set, gint *count);
 static query_result_set *intersect_resultset(void *db,
-  query_result_set *seta, query_result_set *setb);
+  query_result_set *set, gint *arr, gint count);
+static query_result_set *array_resultset(void *db, gint *arr, gint count);
 static gint check_and_merge_by_kv(void *db, void *rec,
   wg_json_query_arg *arg, query_result_set *next_set);
 static gint check_and_merge_by_key(void *db, void *rec,
   wg_json_query_arg *arg, query_result_set *next_set);
 static gint check_and_merge_recursively(void *db, void *rec,
   wg_json_query_arg *arg, query_result_set *next_set, int depth);
+static void estimate_json_args(void *db, gint index_id,
+  wg_json_query_arg *arglist, gint argc, gint *sizes);
 static gint prepare_json_arglist(void *db, wg_json_query_arg *arglist,
-  wg_json_query_arg **sorted_arglist, gint argc,
+  wg_json_query_arg **sorted_arglist, gint **sizes, gint argc,
   gint *index_id, gint *vindex_id, gint *kindex_id);
 
+static gint join_value(void *db, void *rec, gint column);
+static gint join_hash_value(void *db, gint enc, wg_uint *hash);
+static join_hash_table *build_join_table(void *db, wg_query *query,
+  gint column);
+static void free_join_table(join_hash_table *tbl);
+static gint join_table_head(join_hash_table *tbl, wg_uint hash);
+static void *join_table_next(void *db, wg_join *join);
+
 static gint encode_query_param_unistr(void *db, char *data, gint type,
   char *extdata, int length);
+static gint query_param_offset(void *db, void *dptr);
 
 static gint show_query_error(void* db, char* errmsg);
 /*static gint show_query_error_nr(void* db, char* errmsg, gint nr);*/
@@ -133,24 +249,33 @@ static gint show_query_error(void* db, char* errmsg);
  *  with hash indexes.
  *  XXX: currently only considers the existence of T-tree
  *  index and nothing else.
+ *
+ *  Composite T-tree indexes are also considered. In that case
+ *  *prefix is set to the number of leading key columns that are
+ *  matched by equality conditions, and the returned column is
+ *  the key column that follows them.
  */
 static gint most_restricting_column(void *db,
-  wg_query_arg *arglist, gint argc, gint *index_id) {
+  wg_query_arg *arglist, gint argc, gint *index_id, gint *prefix) {
 
   struct column_score {
     gint column;
     int score;
     int index_id;
   };
-  struct column_score *sc;
+  struct column_score local_sc[QUERY_MRC_LOCAL_ARGS];
+  struct column_score *sc = local_sc;
   int i, j, mrc_score = -1;
   gint mrc = -1;
+  gint *ilist;
   db_memsegment_header* dbh = dbmemsegh(db);
 
-  sc = (struct column_score *) malloc(argc * sizeof(struct column_score));
-  if(!sc) {
-    show_query_error(db, "Failed to allocate memory");
-    return -1;
+  if(argc > QUERY_MRC_LOCAL_ARGS) {
+    sc = (struct column_score *) malloc(argc * sizeof(struct column_score));
+    if(!sc) {
+      show_query_error(db, "Failed to allocate memory");
+      return -1;
+    }
   }
 
   /* Scan through the arguments and calculate accumulated score
@@ -198,16 +323,24 @@ static gint most_restricting_column(void *db,
     if(sc[i].column == -1) break;
     /* Find the index on the column. The score is modified by the
      * estimated quality of the index (0 if no index found).
+     * Composite indexes qualify if the column is the leading
+     * key column.
      */
     if(sc[i].column <= MAX_INDEXED_FIELDNR) {
-      gint *ilist = &dbh->index_control_area_header.index_table[sc[i].column];
+      ilist = &dbh->index_control_area_header.index_table[sc[i].column];
       while(*ilist) {
         gcell *ilistelem = (gcell *) offsettoptr(db, *ilist);
         if(ilistelem->car) {
           wg_index_header *hdr = \
             (wg_index_header *) offsettoptr(db, ilistelem->car);
 
-          if(hdr->type == WG_INDEX_TYPE_TTREE) {
+          if((hdr->type == WG_INDEX_TYPE_TTREE ||\
+            hdr->type == WG_INDEX_TYPE_BTREE) &&\
+            hdr->rec_field_index[0] == sc[i].column) {
+            /* A partial index is usable only if the query
+             * asks for a subset of its rows */
+            if(!index_predicate_implied(db, hdr, arglist, argc))
+              goto nextindex;
 #ifdef USE_INDEX_TEMPLATE
             /* If index templates are available, we can increase the
              * score of the index if the template has any columns matching
@@ -217,47 +350,16 @@ static gint most_restricting_column(void *db,
              * the template, so if there is a match, the search is
              * complete (remaining index are likely to be worse)
              */
-            if(hdr->template_offset) {
-              wg_index_template *tmpl = \
-                (wg_index_template *) offsettoptr(db, hdr->template_offset);
-              void *matchrec = offsettoptr(db, tmpl->offset_matchrec);
-              gint reclen = wg_get_record_len(db, matchrec);
-              for(j=0; j<reclen; j++) {
-                gint enc = wg_get_field(db, matchrec, j);
-                if(wg_get_encoded_type(db, enc) != WG_VARTYPE) {
-                  /* defined column in matchrec. The score is increased
-                   * if arglist has a WG_COND_EQUAL column with the same
-                   * value. In any other case the index is not usable.
-                   */
-                  int match = 0, k;
-                  for(k=0; k<argc; k++) {
-                    if(arglist[k].column == j) {
-                      if(arglist[k].cond == WG_COND_EQUAL &&\
-                        WG_COMPARE(db, enc, arglist[k].value) == WG_EQUAL) {
-                        match = 1;
-                      }
-                      else
-                        goto nextindex;
-                    }
-                  }
-                  if(match) {
-                    sc[i].score += TTREE_SCORE_MASK;
-                    if(!enc)
-                      sc[i].score += TTREE_SCORE_NULL;
-                  }
-                  else
-                    goto nextindex;
-                }
-              }
-            }
+            int tscore = index_template_score(db, hdr, arglist, argc);
+            if(tscore < 0)
+              goto nextindex;
+            sc[i].score += tscore;
 #endif
             sc[i].index_id = ilistelem->car;
             break;
           }
         }
-#ifdef USE_INDEX_TEMPLATE
 nextindex:
-#endif
         ilist = &ilistelem->cdr;
       }
     }
@@ -270,20 +372,633 @@ nextindex:
     }
   }
 
+  /* Composite T-tree indexes. Leading key columns with equality
+   * conditions form the prefix of the search key, the next key column
+   * may be restricted by a range. If there is no range, the last
+   * equality column takes its place. An index that only covers
+   * its leading column was already scored above.
+   */
+  *prefix = 0;
+  ilist = &dbh->index_control_area_header.index_list;
+  while(*ilist) {
+    gcell *ilistelem = (gcell *) offsettoptr(db, *ilist);
+    wg_index_header *hdr = \
+      (wg_index_header *) offsettoptr(db, ilistelem->car);
+
+    if(hdr->type == WG_INDEX_TYPE_TTREE && hdr->fields > 1) {
+      int k, eq = 0, bounds = 0, score = 0;
+      gint pfx;
+
+      for(k=0; k<hdr->fields; k++) {
+        gint kcol = TTREE_KEY_COLUMN(hdr, k);
+        eq = bounds = 0;
+        for(j=0; j<argc; j++) {
+          if(arglist[j].column != kcol) continue;
+          switch(arglist[j].cond) {
+            case WG_COND_EQUAL:
+              eq = 1;
+              break;
+            case WG_COND_LESSTHAN:
+            case WG_COND_GREATER:
+            case WG_COND_LTEQUAL:
+            case WG_COND_GTEQUAL:
+              bounds++;
+              break;
+            default:
+              break;
+          }
+        }
+        if(!eq) break;
+        score += TTREE_SCORE_EQUAL;
+      }
+
+      if(k < hdr->fields && bounds) {
+        score += bounds * TTREE_SCORE_BOUND;
+        pfx = k;
+      } else {
+        pfx = k - 1;
+      }
+
+      if(!index_predicate_implied(db, hdr, arglist, argc))
+        pfx = 0;
+
+      if(pfx > 0) {
+#ifdef USE_INDEX_TEMPLATE
+        int tscore = index_template_score(db, hdr, arglist, argc);
+        if(tscore < 0)
+          score = -1;
+        else
+          score += tscore;
+#endif
+        if(score > mrc_score) {
+          mrc_score = score;
+          mrc = TTREE_KEY_COLUMN(hdr, pfx);
+          *index_id = ilistelem->car;
+          *prefix = pfx;
+        }
+      }
+    }
+    ilist = &ilistelem->cdr;
+  }
+
   /* TODO: does the best score have no index? In that case,
    * try to locate an index that would restrict at least
    * some columns.
    */
-  free(sc);
+  if(sc != local_sc)
+    free(sc);
   return mrc;
 }
 
+#ifdef USE_INDEX_TEMPLATE
+/** Score an index template against the query argument list
+ *  returns -1 if the template excludes rows that the query needs
+ *  (the index is unusable), otherwise the score of the matching
+ *  template columns.
+ */
+static int index_template_score(void *db, wg_index_header *hdr,
+  wg_query_arg *arglist, gint argc) {
+  int j, score = 0;
+
+  if(hdr->template_offset) {
+    wg_index_template *tmpl = \
+      (wg_index_template *) offsettoptr(db, hdr->template_offset);
+    void *matchrec = offsettoptr(db, tmpl->offset_matchrec);
+    gint reclen = wg_get_record_len(db, matchrec);
+    for(j=0; j<reclen; j++) {
+      gint enc = wg_get_field(db, matchrec, j);
+      if(wg_get_encoded_type(db, enc) != WG_VARTYPE) {
+        /* defined column in matchrec. The score is increased
+         * if arglist has a WG_COND_EQUAL column with the same
+         * value. In any other case the index is not usable.
+         */
+        int match = 0, k;
+        for(k=0; k<argc; k++) {
+          if(arglist[k].column == j) {
+            if(arglist[k].cond == WG_COND_EQUAL &&\
+              WG_COMPARE(db, enc, arglist[k].value) == WG_EQUAL) {
+              match = 1;
+            }
+            else
+              return -1;
+          }
+        }
+        if(match) {
+          score += TTREE_SCORE_MASK;
+          if(!enc)
+            score += TTREE_SCORE_NULL;
+        }
+        else
+          return -1;
+      }
+    }
+  }
+  return score;
+}
+#endif
+
+/** Check if a single query condition implies a predicate condition
+ *  on the same column, i.e. every value that passes the condition
+ *  also passes the predicate.
+ *  returns 1 if implied, 0 if not (or not known)
+ */
+static gint condition_implies(void *db, gint cond, gint value,
+  gint pcond, gint pvalue) {
+  gint cmp;
+
+  if(pcond == WG_COND_CONTAINS) {
+    return (cond == WG_COND_CONTAINS &&\
+      WG_COMPARE(db, value, pvalue) == WG_EQUAL);
+  }
+  if(cond == WG_COND_CONTAINS)
+    return 0;
+  cmp = WG_COMPARE(db, value, pvalue);
+
+  switch(pcond) {
+    case WG_COND_EQUAL:
+      return (cond == WG_COND_EQUAL && cmp == WG_EQUAL);
+    case WG_COND_NOT_EQUAL:
+      switch(cond) {
+        case WG_COND_EQUAL:
+          return (cmp != WG_EQUAL);
+        case WG_COND_NOT_EQUAL:
+          return (cmp == WG_EQUAL);
+        case WG_COND_LESSTHAN:
+          return (cmp != WG_GREATER);
+        case WG_COND_LTEQUAL:
+          return (cmp == WG_LESSTHAN);
+        case WG_COND_GREATER:
+          return (cmp != WG_LESSTHAN);
+        case WG_COND_GTEQUAL:
+          return (cmp == WG_GREATER);
+        default:
+          return 0;
+      }
+    case WG_COND_LESSTHAN:
+      if(cond == WG_COND_LESSTHAN)
+        return (cmp != WG_GREATER);
+      if(cond == WG_COND_EQUAL || cond == WG_COND_LTEQUAL)
+        return (cmp == WG_LESSTHAN);
+      return 0;
+    case WG_COND_LTEQUAL:
+      if(cond == WG_COND_EQUAL || cond == WG_COND_LESSTHAN ||\
+        cond == WG_COND_LTEQUAL)
+        return (cmp != WG_GREATER);
+      return 0;
+    case WG_COND_GREATER:
+      if(cond == WG_COND_GREATER)
+        return (cmp != WG_LESSTHAN);
+      if(cond == WG_COND_EQUAL || cond == WG_COND_GTEQUAL)
+        return (cmp == WG_GREATER);
+      return 0;
+    case WG_COND_GTEQUAL:
+      if(cond == WG_COND_EQUAL || cond == WG_COND_GREATER ||\
+        cond == WG_COND_GTEQUAL)
+        return (cmp != WG_LESSTHAN);
+      return 0;
+    default:
+      return 0;
+  }
+}
+
+/** Check if the query selects only rows of a partial index
+ *  Each condition of the index predicate has to be implied by
+ *  some condition of the query. Indexes without a predicate
+ *  always qualify.
+ *  returns 1 if the index can be used, 0 if not
+ */
+static gint index_predicate_implied(void *db, wg_index_header *hdr,
+  wg_query_arg *arglist, gint argc) {
+  wg_stored_filter *filter;
+  gint i, j;
+
+  if(!hdr->predicate_offset)
+    return 1;
+  filter = INDEX_PREDICATE(db, hdr);
+  for(i=0; i<filter->count; i++) {
+    for(j=0; j<argc; j++) {
+      if(arglist[j].column == filter->column[i] &&\
+        condition_implies(db, arglist[j].cond, arglist[j].value,
+          filter->cond[i], filter->value[i]))
+        break;
+    }
+    if(j == argc)
+      return 0;
+  }
+  return 1;
+}
+
+/** Find a substring condition that a trigram index can answer
+ *  Substrings shorter than a gram cannot be looked up. If there are
+ *  several candidates, the longest substring is used since it has
+ *  the most grams to intersect.
+ *  returns the position of the argument in arglist, -1 if none.
+ */
+static gint find_trigram_arg(void *db, wg_query_arg *arglist, gint argc,
+  gint *index_id) {
+  gint i, best = -1, bestlen = 0;
+  db_memsegment_header* dbh = dbmemsegh(db);
+
+  for(i=0; i<argc; i++) {
+    gint len, *ilist;
+
+    if(arglist[i].cond != WG_COND_CONTAINS ||\
+      arglist[i].column > MAX_INDEXED_FIELDNR)
+      continue;
+    len = strlen(wg_decode_str(db, arglist[i].value));
+    if(len < WG_TRIGRAM_LEN || len <= bestlen)
+      continue;
+
+    ilist = &dbh->index_control_area_header.index_table[arglist[i].column];
+    while(*ilist) {
+      gcell *ilistelem = (gcell *) offsettoptr(db, *ilist);
+      if(ilistelem->car) {
+        wg_index_header *hdr = \
+          (wg_index_header *) offsettoptr(db, ilistelem->car);
+        if(hdr->type == WG_INDEX_TYPE_TRIGRAM &&\
+          hdr->rec_field_index[0] == arglist[i].column &&\
+          index_predicate_implied(db, hdr, arglist, argc)
+#ifdef USE_INDEX_TEMPLATE
+          && index_template_score(db, hdr, arglist, argc) >= 0
+#endif
+          ) {
+          best = i;
+          bestlen = len;
+          *index_id = ilistelem->car;
+          break;
+        }
+      }
+      ilist = &ilistelem->cdr;
+    }
+  }
+  return best;
+}
+
+/** Find a zone map that can restrict a full scan
+ *  The column needs a comparison that the value ranges of the blocks
+ *  can rule out.
+ *  returns the id of the zone map, 0 if none.
+ */
+static gint find_zone_map(void *db, wg_query_arg *arglist, gint argc,
+  gint *column) {
+  gint i;
+  db_memsegment_header* dbh = dbmemsegh(db);
+
+  for(i=0; i<argc; i++) {
+    gint *ilist;
+
+    if(arglist[i].column > MAX_INDEXED_FIELDNR ||\
+      arglist[i].cond == WG_COND_NOT_EQUAL ||\
+      arglist[i].cond == WG_COND_CONTAINS)
+      continue;
+
+    ilist = &dbh->index_control_area_header.index_table[arglist[i].column];
+    while(*ilist) {
+      gcell *ilistelem = (gcell *) offsettoptr(db, *ilist);
+      if(ilistelem->car) {
+        wg_index_header *hdr = \
+          (wg_index_header *) offsettoptr(db, ilistelem->car);
+        if(hdr->type == WG_INDEX_TYPE_ZONEMAP &&\
+          hdr->rec_field_index[0] == arglist[i].column &&\
+          index_predicate_implied(db, hdr, arglist, argc)
+#ifdef USE_INDEX_TEMPLATE
+          && index_template_score(db, hdr, arglist, argc) >= 0
+#endif
+          ) {
+          *column = arglist[i].column;
+          return ilistelem->car;
+        }
+      }
+      ilist = &ilistelem->cdr;
+    }
+  }
+  return 0;
+}
+
+/** Find the range of values that the conditions on a column allow
+ *  The bounds are normalized values (see wg_ttree_key_prefix()), so
+ *  they only rule out the values with a different prefix.
+ *  returns 1 if a NULL value passes the conditions, 0 if not
+ */
+static gint zone_map_bounds(void *db, wg_query_arg *arglist, gint argc,
+  gint column, wg_uint *lo, wg_uint *hi) {
+  gint i, nulls = 1, null = wg_encode_null(db, NULL);
+
+  *lo = 0;
+  *hi = ~((wg_uint) 0);
+  for(i=0; i<argc; i++) {
+    wg_uint kp;
+    gint cr;
+
+    if(arglist[i].column != column)
+      continue;
+    kp = wg_ttree_key_prefix(db, arglist[i].value);
+    cr = WG_COMPARE(db, null, arglist[i].value);
+    switch(arglist[i].cond) {
+      case WG_COND_EQUAL:
+        if(kp > *lo) *lo = kp;
+        if(kp < *hi) *hi = kp;
+        nulls &= (cr == WG_EQUAL);
+        break;
+      case WG_COND_LESSTHAN:
+      case WG_COND_LTEQUAL:
+        if(kp < *hi) *hi = kp;
+        nulls &= (cr == WG_LESSTHAN ||\
+          (cr == WG_EQUAL && arglist[i].cond == WG_COND_LTEQUAL));
+        break;
+      case WG_COND_GREATER:
+      case WG_COND_GTEQUAL:
+        if(kp > *lo) *lo = kp;
+        nulls &= (cr == WG_GREATER ||\
+          (cr == WG_EQUAL && arglist[i].cond == WG_COND_GTEQUAL));
+        break;
+      case WG_COND_NOT_EQUAL:
+        nulls &= (cr != WG_EQUAL);
+        break;
+      default:
+        nulls = 0; /* substrings are not found in NULL */
+        break;
+    }
+  }
+  return nulls;
+}
+
+/** Move a full scan to the next block a zone map does not rule out
+ *  offset - the next record of the scan
+ *  returns the offset of the record to examine next, 0 if none
+ */
+static gint zone_map_next(void *db, wg_query *query, gint offset) {
+  if(offset >= query->zone_start && offset < query->zone_end)
+    return offset; /* still in the same block */
+  return wg_search_zonemap(db, query->zone_index, offset,
+    query->zone_lo, query->zone_hi, query->zone_nulls,
+    &query->zone_start, &query->zone_end,
+    (query->profile ? &query->stats.blocks_skipped : NULL));
+}
+
+/** Find the range of spatial index keys that the conditions on
+ *  a column allow (see wg_spatial_axis_key()).
+ *  returns 1 if the column has a range condition, 0 if not
+ */
+static gint spatial_bounds(void *db, wg_query_arg *arglist, gint argc,
+  gint column, wg_uint *lo, wg_uint *hi) {
+  gint i, found = 0;
+
+  *lo = 0;
+  *hi = ~((wg_uint) 0);
+  for(i=0; i<argc; i++) {
+    wg_uint k;
+
+    if(arglist[i].column != column)
+      continue;
+    k = wg_spatial_axis_key(db, arglist[i].value);
+    switch(arglist[i].cond) {
+      case WG_COND_EQUAL:
+        if(k > *lo) *lo = k;
+        if(k < *hi) *hi = k;
+        found = 1;
+        break;
+      case WG_COND_LESSTHAN:
+      case WG_COND_LTEQUAL:
+        if(k < *hi) *hi = k;
+        found = 1;
+        break;
+      case WG_COND_GREATER:
+      case WG_COND_GTEQUAL:
+        if(k > *lo) *lo = k;
+        found = 1;
+        break;
+      default:
+        break;
+    }
+  }
+  return found;
+}
+
+/** Find a spatial index for a bounding box
+ *  Both columns of the index need a range or equality condition.
+ *  box_lo and box_hi are set to the Z-order keys of the corners.
+ *  returns the id of the index, 0 if none.
+ */
+static gint find_spatial_index(void *db, wg_query_arg *arglist, gint argc,
+  wg_uint *box_lo, wg_uint *box_hi) {
+  gint i;
+  db_memsegment_header* dbh = dbmemsegh(db);
+
+  for(i=0; i<argc; i++) {
+    gint *ilist;
+
+    if(arglist[i].column > MAX_INDEXED_FIELDNR)
+      continue;
+
+    ilist = &dbh->index_control_area_header.index_table[arglist[i].column];
+    while(*ilist) {
+      gcell *ilistelem = (gcell *) offsettoptr(db, *ilist);
+      if(ilistelem->car) {
+        wg_index_header *hdr = \
+          (wg_index_header *) offsettoptr(db, ilistelem->car);
+        wg_uint xlo, xhi, ylo, yhi;
+        if(hdr->type == WG_INDEX_TYPE_SPATIAL &&\
+          spatial_bounds(db, arglist, argc, hdr->rec_field_index[0],
+            &xlo, &xhi) &&\
+          spatial_bounds(db, arglist, argc, hdr->rec_field_index[1],
+            &ylo, &yhi) &&\
+          index_predicate_implied(db, hdr, arglist, argc)
+#ifdef USE_INDEX_TEMPLATE
+          && index_template_score(db, hdr, arglist, argc) >= 0
+#endif
+          ) {
+          *box_lo = wg_spatial_key(xlo, ylo);
+          *box_hi = wg_spatial_key(xhi, yhi);
+          return ilistelem->car;
+        }
+      }
+      ilist = &ilistelem->cdr;
+    }
+  }
+  return 0;
+}
+
+#ifdef USE_INDEX_ADVISOR
+/** Check a scanned row against the conditions of each column alone
+ *  The pass rates tell how many rows an index on the column would
+ *  have visited. Columns are numbered in the order they first appear
+ *  in the argument list.
+ */
+static void sample_scan_row(void *db, wg_query *query, void *rec) {
+  gint i, j, n = 0;
+
+  for(i=0; i<query->argc && n<ADVISOR_MAX_COLUMNS; i++) {
+    gint col = query->arglist[i].column;
+    for(j=0; j<i; j++) {
+      if(query->arglist[j].column == col)
+        break;
+    }
+    if(j < i)
+      continue; /* already checked */
+    for(j=i; j<query->argc; j++) {
+      if(query->arglist[j].column == col &&\
+        !check_arglist(db, rec, &query->arglist[j], 1, NULL))
+        break;
+    }
+    if(j == query->argc)
+      query->scan_pass[n]++;
+    n++;
+  }
+  query->scan_sampled++;
+}
+
+/** Report the rows a full scan went through to the index advisor
+ *  The counters are cleared, so that a query is reported only
+ *  once, whether it runs to the end or not.
+ */
+static void advise_scan(void *db, wg_query *query) {
+  gint elapsed_us = 0;
+
+  if(!query->scan_examined)
+    return;
+  if(query->scan_timed)
+    elapsed_us = (gint) ((double) query->scan_ns * query->scan_examined /\
+      query->scan_timed / 1000 + 0.5);
+  wg_advise_scan(db, query->arglist, query->argc,
+    (gint) query->scan_examined, (gint) query->scan_returned,
+    elapsed_us, (gint) query->scan_sampled, query->scan_pass);
+  query->scan_examined = 0;
+  query->scan_returned = 0;
+  query->scan_ns = 0;
+  query->scan_timed = 0;
+  query->scan_sampled = 0;
+  memset(query->scan_pass, 0, sizeof(query->scan_pass));
+}
+#endif
+
+/** Compare two row offsets (for qsort and bsearch)
+ */
+static int offset_cmp(const void *a, const void *b) {
+  gint x = *((gint *) a), y = *((gint *) b);
+  return (x > y) - (x < y);
+}
+
+/** Collect the candidate rows for a substring from a trigram index
+ *
+ * The posting lists of all distinct grams of the substring are
+ * intersected. The shortest list is found by walking all lists in
+ * step, so the long lists are not read to the end. Each other list
+ * is then read only if it is not much longer than the remaining
+ * candidates, otherwise checking the candidates directly is cheaper.
+ *
+ * The candidates are sorted by row offset. They still have to be
+ * checked against the condition.
+ *
+ * returns 0 on success
+ * returns -1 on error
+ */
+static gint trigram_candidates(void *db, gint index_id, char *pattern,
+  void *arena, gint **cand, gint *count) {
+
+  gint *grams = NULL, *heads = NULL, *pos, *res = NULL;
+  char *keep = NULL;
+  gint ngrams, i, j, n, shortest, retv = 0;
+  char key[WG_TRIGRAM_LEN];
+
+  *cand = NULL;
+  *count = 0;
+  ngrams = wg_trigram_split(db, pattern, strlen(pattern), &grams);
+  if(ngrams < 1)
+    return ngrams;
+
+  heads = (gint *) malloc(2 * ngrams * sizeof(gint));
+  if(!heads) {
+    show_query_error(db, "Failed to allocate memory");
+    retv = -1;
+    goto done;
+  }
+  pos = heads + ngrams;
+  for(i=0; i<ngrams; i++) {
+    key[0] = (char) ((grams[i] >> 16) & 0xff);
+    key[1] = (char) ((grams[i] >> 8) & 0xff);
+    key[2] = (char) (grams[i] & 0xff);
+    heads[i] = pos[i] = wg_search_trigram(db, index_id, key);
+    if(heads[i] < 0) {
+      retv = -1;
+      goto done;
+    }
+    if(!heads[i])
+      goto done; /* gram does not occur, no candidates */
+  }
+
+  /* Find the shortest posting list */
+  for(n=1, shortest=-1; shortest < 0; n++) {
+    for(i=0; i<ngrams; i++) {
+      pos[i] = ((gcell *) offsettoptr(db, pos[i]))->cdr;
+      if(!pos[i]) {
+        shortest = i;
+        break;
+      }
+    }
+  }
+  n--;
+
+  res = (gint *) query_alloc(db, arena, n * sizeof(gint));
+  keep = (char *) malloc(n);
+  if(!res || !keep) {
+    show_query_error(db, "Failed to allocate memory");
+    retv = -1;
+    goto done;
+  }
+  for(i=0, pos[shortest]=heads[shortest]; i<n; i++) {
+    gcell *cell = (gcell *) offsettoptr(db, pos[shortest]);
+    res[i] = cell->car;
+    pos[shortest] = cell->cdr;
+  }
+  qsort(res, n, sizeof(gint), offset_cmp);
+
+  /* Intersect with the other lists */
+  for(i=0; i<ngrams && n; i++) {
+    gint budget = n * QUERY_TRIGRAM_SCAN_RATIO, cell;
+    if(i == shortest)
+      continue;
+    memset(keep, 0, n);
+    for(cell=heads[i]; cell && budget; budget--) {
+      gcell *c = (gcell *) offsettoptr(db, cell);
+      gint *hit = (gint *) bsearch(&(c->car), res, n, sizeof(gint),
+        offset_cmp);
+      if(hit)
+        keep[hit - res] = 1;
+      cell = c->cdr;
+    }
+    if(cell)
+      continue; /* list too long, not worth reading */
+    for(j=0, budget=0; j<n; j++) {
+      if(keep[j])
+        res[budget++] = res[j];
+    }
+    n = budget;
+  }
+
+  *cand = res;
+  *count = n;
+  res = NULL;
+
+done:
+  if(res)
+    query_release(arena, res);
+  if(keep)
+    free(keep);
+  if(heads)
+    free(heads);
+  if(grams)
+    free(grams);
+  return retv;
+}
+
 /** Check a record against list of conditions
  *  returns 1 if the record matches
  *  returns 0 if the record fails at least one condition
+ *  If cmpcount is not NULL, it is incremented for each comparison.
  */
 static gint check_arglist(void *db, void *rec, wg_query_arg *arglist,
-  gint argc) {
+  gint argc, wg_uint *cmpcount) {
 
   int i, reclen;
 
@@ -301,27 +1016,35 @@ static gint check_arglist(void *db, void *rec, wg_query_arg *arglist,
 
     switch(arglist[i].cond) {
       case WG_COND_EQUAL:
-        if(WG_COMPARE(db, encoded, arglist[i].value) != WG_EQUAL)
+        if(QUERY_COMPARE(db, encoded, arglist[i].value, cmpcount) != WG_EQUAL)
           return 0;
         break;
       case WG_COND_LESSTHAN:
-        if(WG_COMPARE(db, encoded, arglist[i].value) != WG_LESSTHAN)
+        if(QUERY_COMPARE(db, encoded, arglist[i].value, cmpcount) != WG_LESSTHAN)
           return 0;
         break;
       case WG_COND_GREATER:
-        if(WG_COMPARE(db, encoded, arglist[i].value) != WG_GREATER)
+        if(QUERY_COMPARE(db, encoded, arglist[i].value, cmpcount) != WG_GREATER)
           return 0;
         break;
       case WG_COND_LTEQUAL:
-        if(WG_COMPARE(db, encoded, arglist[i].value) == WG_GREATER)
+        if(QUERY_COMPARE(db, encoded, arglist[i].value, cmpcount) == WG_GREATER)
           return 0;
         break;
       case WG_COND_GTEQUAL:
-        if(WG_COMPARE(db, encoded, arglist[i].value) == WG_LESSTHAN)
+        if(QUERY_COMPARE(db, encoded, arglist[i].value, cmpcount) == WG_LESSTHAN)
           return 0;
         break;
       case WG_COND_NOT_EQUAL:
-        if(WG_COMPARE(db, encoded, arglist[i].value) == WG_EQUAL)
+        if(QUERY_COMPARE(db, encoded, arglist[i].value, cmpcount) == WG_EQUAL)
+          return 0;
+        break;
+      case WG_COND_CONTAINS:
+        if(cmpcount)
+          (*cmpcount)++;
+        if(wg_get_encoded_type(db, encoded) != WG_STRTYPE ||\
+          !strstr(wg_decode_str(db, encoded),
+            wg_decode_str(db, arglist[i].value)))
           return 0;
         break;
       default:
@@ -342,14 +1065,15 @@ static gint check_arglist(void *db, void *rec, wg_query_arg *arglist,
  *
  * If the function was successful, *farglist will be set to point
  * to a newly allocated unified argument list and *fargc will be set
- * to indicate the size of *farglist.
+ * to indicate the size of *farglist. If arena is not NULL, the list
+ * is allocated from it instead of the heap.
  *
  * If there was an error, *farglist and *fargc may be in
  * an undetermined state.
  */
 static gint prepare_params(void *db, void *matchrec, gint reclen,
   wg_query_arg *arglist, gint argc,
-  wg_query_arg **farglist, gint *fargc) {
+  wg_query_arg **farglist, gint *fargc, void *arena) {
   int i;
 
   if(matchrec) {
@@ -401,7 +1125,8 @@ static gint prepare_params(void *db, void *matchrec, gint reclen,
      * local copy will be attached to the query object and needs to
      * survive beyond that.
      */
-    tmp = (wg_query_arg *) malloc(*fargc * sizeof(wg_query_arg));
+    tmp = (wg_query_arg *) query_alloc(db, arena,
+      *fargc * sizeof(wg_query_arg));
     if(!tmp) {
       show_query_error(db, "Failed to allocate memory");
       return -2;
@@ -409,6 +1134,12 @@ static gint prepare_params(void *db, void *matchrec, gint reclen,
 
     /* Copy the arglist contents */
     for(i=0; i<argc; i++) {
+      if(arglist[i].cond == WG_COND_CONTAINS &&\
+        wg_get_encoded_type(db, arglist[i].value) != WG_STRTYPE) {
+        show_query_error(db, "Substring condition needs a string value");
+        query_release(arena, tmp);
+        return -1;
+      }
       tmp[i].column = arglist[i].column;
       tmp[i].cond = arglist[i].cond;
       tmp[i].value = arglist[i].value;
@@ -605,37 +1336,7 @@ static gint find_ttree_bounds(void *db, gint index_id, gint col,
     }
   }
 
-  /* Now detect the cases where the above bound search
-   * has produced a result with an empty range.
-   */
-  if(co) {
-    /* Value could be bounded inside a node, but actually
-     * not present. Note that we require the end_slot to be
-     * >= curr_slot, this implies that query->direction == 1.
-     */
-    if(eo == co && es < cs) {
-      co = 0; /* query will return no rows */
-      eo = 0;
-    } else if(!eo) {
-      /* If one offset is 0 the other should be forced to 0, so that
-       * if we want to switch direction we won't run into any surprises.
-       */
-      co = 0;
-    } else {
-      /* Another case we have to watch out for is when we have a
-       * range that fits in the space between two nodes. In that case
-       * the end offset will end up directly left of the start offset.
-       */
-      node = (struct wg_tnode *) offsettoptr(db, co);
-      if(eo == TNODE_PREDECESSOR(db, node)) {
-        co = 0; /* no rows */
-        eo = 0;
-      }
-    }
-  } else {
-    eo = 0; /* again, if one offset is 0,
-             * the other should be, too */
-  }
+  check_ttree_range(db, &co, cs, &eo, es);
 
   *curr_offset = co;
   *curr_slot = cs;
@@ -644,34 +1345,238 @@ static gint find_ttree_bounds(void *db, gint index_id, gint col,
   return 0;
 }
 
-/** Create a query object.
- *
- * matchrec - array of encoded integers. Can be a pointer to a database record
- * or a user-allocated array. If reclen is 0, it is treated as a native
- * database record. If reclen is non-zero, reclen number of gint-sized
- * words is read, starting from the pointer.
- *
- * Fields of type WG_VARTYPE in matchrec are treated as wildcards. Other
- * types, including NULL, are used as "equals" conditions.
- *
- * arglist - array of wg_query_arg objects. The size is must be given
- * by argc.
- *
- * flags - type of query requested and other parameters
- *
- * rowlimit - maximum number of rows fetched. Only has an effect if
- * QUERY_FLAGS_PREFETCH is set.
+/*
+ * Locate the node offset and slot for start and end bound
+ * in a composite T-tree index. keys[0..prefix-1] hold the values of
+ * the leading key columns, the bounds apply to the key column that
+ * follows them. keys must have room for prefix+1 values.
  *
- * returns NULL if constructing the query fails. Otherwise returns a pointer
+ * return -1 on error
+ * return 0 on success
+ */
+static gint find_ttree_multi_bounds(void *db, gint index_id,
+  gint *keys, gint prefix,
+  gint start_bound, gint end_bound, gint start_inclusive, gint end_inclusive,
+  gint *curr_offset, gint *curr_slot, gint *end_offset, gint *end_slot)
+{
+  gint co, cs = 0, eo, es = 0;
+  wg_index_header *hdr = (wg_index_header *) offsettoptr(db, index_id);
+  struct wg_tnode *node;
+
+  /* The range starts with the first row that is >= (keys, start_bound),
+   * or > for a non-inclusive bound. Without a start bound this is the
+   * first row that has the key prefix.
+   */
+  if(start_bound==WG_ILLEGAL) {
+    co = wg_search_ttree_multi(db, index_id, keys, prefix, 0, &cs);
+  } else {
+    keys[prefix] = start_bound;
+    co = wg_search_ttree_multi(db, index_id, keys, prefix + 1,
+      !start_inclusive, &cs);
+  }
+
+  /* The range ends right before the first row that is above it. */
+  if(end_bound==WG_ILLEGAL) {
+    eo = wg_search_ttree_multi(db, index_id, keys, prefix, 1, &es);
+  } else {
+    keys[prefix] = end_bound;
+    eo = wg_search_ttree_multi(db, index_id, keys, prefix + 1,
+      end_inclusive, &es);
+  }
+  if(eo) {
+    if(es > 0) {
+      es--;
+    } else {
+      /* Crossed node boundary */
+      node = (struct wg_tnode *) offsettoptr(db, eo);
+      eo = TNODE_PREDECESSOR(db, node);
+      if(eo) {
+        node = (struct wg_tnode *) offsettoptr(db, eo);
+        es = node->number_of_elements - 1;
+      }
+    }
+  } else {
+    /* No rows above the range, it ends with the rightmost row */
+#ifdef TTREE_CHAINED_NODES
+    eo = TTREE_MAX_NODE(hdr);
+#else
+    eo = wg_ttree_find_glb_node(db, TTREE_ROOT_NODE(hdr));
+#endif
+    if(eo) {
+      node = (struct wg_tnode *) offsettoptr(db, eo);
+      es = node->number_of_elements - 1;
+    }
+  }
+
+  check_ttree_range(db, &co, cs, &eo, es);
+
+  *curr_offset = co;
+  *curr_slot = cs;
+  *end_offset = eo;
+  *end_slot = es;
+  return 0;
+}
+
+/*
+ * Detect the cases where the bound search has produced
+ * a result with an empty range. Both offsets are set to 0
+ * if the range is empty.
+ */
+static void check_ttree_range(void *db, gint *co, gint cs,
+  gint *eo, gint es)
+{
+  struct wg_tnode *node;
+
+  if(*co) {
+    /* Value could be bounded inside a node, but actually
+     * not present. Note that we require the end_slot to be
+     * >= curr_slot, this implies that query->direction == 1.
+     */
+    if(*eo == *co && es < cs) {
+      *co = 0; /* query will return no rows */
+      *eo = 0;
+    } else if(!*eo) {
+      /* If one offset is 0 the other should be forced to 0, so that
+       * if we want to switch direction we won't run into any surprises.
+       */
+      *co = 0;
+    } else {
+      /* Another case we have to watch out for is when we have a
+       * range that fits in the space between two nodes. In that case
+       * the end offset will end up directly left of the start offset.
+       */
+      node = (struct wg_tnode *) offsettoptr(db, *co);
+      if(*eo == TNODE_PREDECESSOR(db, node)) {
+        *co = 0; /* no rows */
+        *eo = 0;
+      }
+    }
+  } else {
+    *eo = 0; /* again, if one offset is 0,
+              * the other should be, too */
+  }
+}
+
+/*
+ * Find the first and the last entry of a B+tree index that are
+ * in the range. Both offsets are set to 0 if the range is empty.
+ */
+static void find_btree_bounds(void *db, gint index_id,
+  gint start_bound, gint end_bound, gint start_inclusive, gint end_inclusive,
+  gint *curr_offset, gint *curr_slot, gint *end_offset, gint *end_slot)
+{
+  wg_index_header *hdr = (wg_index_header *) offsettoptr(db, index_id);
+  struct wg_bnode *node;
+  gint co, cs = 0, eo, es, cmp;
+
+  if(start_bound==WG_ILLEGAL) {
+    co = BTREE_FIRST_LEAF(hdr);
+    if(!((struct wg_bnode *) offsettoptr(db, co))->count)
+      co = 0; /* empty index */
+  } else {
+    co = wg_search_btree(db, index_id, start_bound, !start_inclusive, &cs);
+  }
+
+  if(co && end_bound!=WG_ILLEGAL) {
+    /* The range is empty if the first entry is already past the end */
+    node = (struct wg_bnode *) offsettoptr(db, co);
+    cmp = WG_COMPARE(db, node->key[cs], end_bound);
+    if(cmp == WG_GREATER || (cmp == WG_EQUAL && !end_inclusive))
+      co = 0;
+  }
+  if(!co) {
+    *curr_offset = 0;
+    *end_offset = 0;
+    return;
+  }
+
+  /* The last entry is the one before the first entry past the end */
+  if(end_bound==WG_ILLEGAL)
+    eo = 0;
+  else
+    eo = wg_search_btree(db, index_id, end_bound, end_inclusive, &es);
+  if(!eo) {
+    eo = BTREE_LAST_LEAF(hdr);
+    es = ((struct wg_bnode *) offsettoptr(db, eo))->count - 1;
+  } else if(es > 0) {
+    es--;
+  } else {
+    eo = ((struct wg_bnode *) offsettoptr(db, eo))->prev_offset;
+    es = ((struct wg_bnode *) offsettoptr(db, eo))->count - 1;
+  }
+
+  *curr_offset = co;
+  *curr_slot = cs;
+  *end_offset = eo;
+  *end_slot = es;
+}
+
+/*
+ * Check if an argument is satisfied by the key prefix of
+ * a composite index query.
+ *
+ * returns 1 if the argument need not be checked on the rows
+ * returns 0 otherwise
+ */
+static gint covered_by_prefix(void *db, wg_index_header *hdr,
+  wg_query_arg *arg, gint *keys, gint prefix)
+{
+  int i;
+
+  if(arg->cond != WG_COND_EQUAL)
+    return 0;
+  for(i=0; i<prefix; i++) {
+    if(arg->column == TTREE_KEY_COLUMN(hdr, i))
+      return (WG_COMPARE(db, arg->value, keys[i]) == WG_EQUAL);
+  }
+  return 0;
+}
+
+/** Create a query object.
+ *
+ * matchrec - array of encoded integers. Can be a pointer to a database record
+ * or a user-allocated array. If reclen is 0, it is treated as a native
+ * database record. If reclen is non-zero, reclen number of gint-sized
+ * words is read, starting from the pointer.
+ *
+ * Fields of type WG_VARTYPE in matchrec are treated as wildcards. Other
+ * types, including NULL, are used as "equals" conditions.
+ *
+ * arglist - array of wg_query_arg objects. The size is must be given
+ * by argc.
+ *
+ * flags - type of query requested and other parameters
+ *
+ * rowlimit - maximum number of rows fetched. Only has an effect if
+ * QUERY_FLAGS_PREFETCH is set.
+ *
+ * plan - if not NULL, the chosen access path and bounds are stored here.
+ * The residual argument list is not copied, it remains attached to
+ * the query.
+ *
+ * arena - if not NULL, all memory needed by the query (including the
+ * query object itself and the prefetched rows) is allocated from this
+ * memory pool and nothing is freed by wg_free_query().
+ *
+ * query - if not NULL, the query object is initialized in the
+ * storage provided by the caller.
+ *
+ * returns NULL if constructing the query fails. Otherwise returns a pointer
  * to a wg_query object.
  */
 static wg_query *internal_build_query(void *db, void *matchrec, gint reclen,
-  wg_query_arg *arglist, gint argc, gint flags, wg_uint rowlimit) {
+  wg_query_arg *arglist, gint argc, gint flags, wg_uint rowlimit,
+  wg_query_plan *plan, wg_query_token *token,
+  void *arena, wg_query *query) {
 
-  wg_query *query;
   wg_query_arg *full_arglist;
   gint fargc = 0;
-  gint col, index_id = -1;
+  gint col, index_id = -1, prefix = 0, cmp;
+  gint tg_arg = -1, tg_index = 0, sp_index = 0;
+  gint keys[MAX_INDEX_FIELDS];
+  wg_index_header *hdr = NULL;
+  wg_uint *cmpcount = NULL;
+  wg_uint start_ns = 0;
   int i;
 
 #ifdef CHECK
@@ -690,23 +1595,101 @@ static wg_query *internal_build_query(void *db, void *matchrec, gint reclen,
    * return immediately.
    */
   if(prepare_params(db, matchrec, reclen, arglist, argc,
-    &full_arglist, &fargc)) {
+    &full_arglist, &fargc, arena)) {
     return NULL;
   }
 
-  query = (wg_query *) malloc(sizeof(wg_query));
   if(!query) {
-    show_query_error(db, "Failed to allocate memory");
-    if(full_arglist) free(full_arglist);
-    return NULL;
+    query = (wg_query *) query_alloc(db, arena, sizeof(wg_query));
+    if(!query) {
+      show_query_error(db, "Failed to allocate memory");
+      if(full_arglist) query_release(arena, full_arglist);
+      return NULL;
+    }
   }
 
-  if(fargc) {
+  query->arena = arena;
+  query->mpool = NULL;
+  query->cand = NULL;
+  query->last_offset = 0;
+  query->zone_index = 0;
+  query->scan_examined = 0;
+  query->scan_returned = 0;
+  query->scan_ns = 0;
+  query->scan_timed = 0;
+  query->scan_sampled = 0;
+  memset(query->scan_pass, 0, sizeof(query->scan_pass));
+  memset(&query->stats, 0, sizeof(wg_query_stats));
+  if(flags & QUERY_FLAGS_PROFILE) {
+    query->profile = 1;
+    cmpcount = &query->stats.compare_calls;
+    start_ns = query_clock_ns();
+  } else {
+    query->profile = 0;
+  }
+  if(plan) {
+    plan->qtype = WG_QTYPE_SCAN;
+    plan->index_id = 0;
+    plan->column = -1;
+    plan->start_bound = WG_ILLEGAL;
+    plan->start_inclusive = 0;
+    plan->end_bound = WG_ILLEGAL;
+    plan->end_inclusive = 0;
+    plan->empty = 0;
+    plan->prefix = 0;
+    plan->arglist = NULL;
+    plan->argc = 0;
+  }
+
+  if(token) {
+    /* Keyset query, the rows must come in the order of the token
+     * column. */
+    col = token->column;
+    index_id = wg_column_to_index_id(db, col, WG_INDEX_TYPE_TTREE,
+      NULL, 0);
+    if(index_id < 1) {
+      show_query_error(db, "Keyset query needs a T-tree index on the column");
+      query->arglist = NULL;
+      wg_free_query(db, query);
+      if(full_arglist) query_release(arena, full_arglist);
+      return NULL;
+    }
+  }
+  else if(fargc) {
     /* Find the best (hopefully) index to base the query on.
      * Then initialise the query object to the first row in the
      * query result set.
      * XXX: only considering T-tree indexes now. */
-    col = most_restricting_column(db, full_arglist, fargc, &index_id);
+    col = most_restricting_column(db, full_arglist, fargc, &index_id,
+      &prefix);
+
+    /* A trigram index is preferred over T-tree range scans, but
+     * not over equality matches on a T-tree. */
+    tg_arg = find_trigram_arg(db, full_arglist, fargc, &tg_index);
+    if(tg_arg >= 0 && index_id > 0) {
+      if(prefix)
+        tg_arg = -1;
+      for(i=0; i<fargc && tg_arg >= 0; i++) {
+        if(full_arglist[i].column == col &&\
+          full_arglist[i].cond == WG_COND_EQUAL)
+          tg_arg = -1;
+      }
+    }
+
+    /* The same goes for a spatial index on a bounding box */
+    if(tg_arg < 0) {
+      sp_index = find_spatial_index(db, full_arglist, fargc,
+        &query->box_lo, &query->box_hi);
+    }
+    if(sp_index && index_id > 0) {
+      if(prefix)
+        sp_index = 0;
+      for(i=0; i<fargc && sp_index; i++) {
+        if(full_arglist[i].column == col &&\
+          full_arglist[i].cond == WG_COND_EQUAL)
+          sp_index = 0;
+      }
+    }
   }
   else {
     /* Create a "full scan" query with no arguments. */
@@ -714,19 +1697,87 @@ static wg_query *internal_build_query(void *db, void *matchrec, gint reclen,
     full_arglist = NULL; /* redundant/paranoia */
   }
 
-  if(index_id > 0) {
+  if(tg_arg >= 0) {
+    /* Rows come from the posting lists of the trigram index. The
+     * entire argument list is checked for each of them. */
+    query->qtype = WG_QTYPE_TRIGRAM;
+    query->column = -1;
+    query->index_id = 0;
+    query->cand_pos = 0;
+    if(trigram_candidates(db, tg_index,
+      wg_decode_str(db, full_arglist[tg_arg].value), arena,
+      &query->cand, &query->cand_count)) {
+      wg_free_query(db, query);
+      query_release(arena, full_arglist);
+      return NULL;
+    }
+    if(plan) {
+      plan->qtype = WG_QTYPE_TRIGRAM;
+      plan->index_id = tg_index;
+      plan->column = full_arglist[tg_arg].column;
+      plan->empty = (query->cand_count == 0);
+    }
+  }
+  else if(sp_index) {
+    /* Rows come from the Z-order range of the box, skipping the
+     * parts of the range outside the box. The cells at the edges
+     * may extend past the box, so the entire argument list is
+     * checked for each row. */
+    query->qtype = WG_QTYPE_SPATIAL;
+    query->column = -1;
+    query->index_id = sp_index;
+    query->curr_offset = 0;
+    query->curr_slot = 0;
+    if((query->box_lo & SPATIAL_X_BITS) <= (query->box_hi & SPATIAL_X_BITS) &&\
+      (query->box_lo & SPATIAL_Y_BITS) <= (query->box_hi & SPATIAL_Y_BITS)) {
+      query->curr_offset = wg_search_spatial(db, sp_index, query->box_lo,
+        &query->curr_slot);
+      if(query->profile && query->curr_offset)
+        query->stats.nodes_visited++;
+    }
+    if(plan) {
+      plan->qtype = WG_QTYPE_SPATIAL;
+      plan->index_id = sp_index;
+      plan->column = ((wg_index_header *) offsettoptr(db,
+        sp_index))->rec_field_index[0];
+      plan->empty = (query->curr_offset == 0);
+    }
+  }
+  else if(index_id > 0) {
     int start_inclusive = 0, end_inclusive = 0;
     gint start_bound = WG_ILLEGAL; /* encoded values */
     gint end_bound = WG_ILLEGAL;
 
     query->qtype = WG_QTYPE_TTREE;
+    if(((wg_index_header *) offsettoptr(db, index_id))->type ==\
+      WG_INDEX_TYPE_BTREE)
+      query->qtype = WG_QTYPE_BTREE;
     query->column = col;
+    query->index_id = index_id;
     query->curr_offset = 0;
     query->curr_slot = -1;
     query->end_offset = 0;
     query->end_slot = -1;
     query->direction = 1;
 
+    /* With a composite index, the leading key columns are fixed
+     * by equality conditions. The first condition found on each
+     * column is used, others stay in the argument list.
+     */
+    if(prefix) {
+      hdr = (wg_index_header *) offsettoptr(db, index_id);
+      for(i=0; i<prefix; i++) {
+        int j;
+        for(j=0; j<fargc; j++) {
+          if(full_arglist[j].column == TTREE_KEY_COLUMN(hdr, i) &&\
+            full_arglist[j].cond == WG_COND_EQUAL) {
+            keys[i] = full_arglist[j].value;
+            break;
+          }
+        }
+      }
+    }
+
     /* Determine the bounds for the given column/index.
      *
      * Examples of using rightmost and leftmost bounds in T-tree queries:
@@ -754,12 +1805,12 @@ static wg_query *internal_build_query(void *db, void *matchrec, gint reclen,
         case WG_COND_EQUAL:
           /* Set bounds as if we had val >= 1 & val <= 1 */
           if(start_bound==WG_ILLEGAL ||\
-            WG_COMPARE(db, start_bound, full_arglist[i].value)==WG_LESSTHAN) {
+            QUERY_COMPARE(db, start_bound, full_arglist[i].value, cmpcount)==WG_LESSTHAN) {
             start_bound = full_arglist[i].value;
             start_inclusive = 1;
           }
           if(end_bound==WG_ILLEGAL ||\
-            WG_COMPARE(db, end_bound, full_arglist[i].value)==WG_GREATER) {
+            QUERY_COMPARE(db, end_bound, full_arglist[i].value, cmpcount)==WG_GREATER) {
             end_bound = full_arglist[i].value;
             end_inclusive = 1;
           }
@@ -770,7 +1821,7 @@ static wg_query *internal_build_query(void *db, void *matchrec, gint reclen,
            * possibly reduced if the value is equal, because this
            * condition is non-inclusive. */
           if(end_bound==WG_ILLEGAL ||\
-            WG_COMPARE(db, end_bound, full_arglist[i].value)!=WG_LESSTHAN) {
+            QUERY_COMPARE(db, end_bound, full_arglist[i].value, cmpcount)!=WG_LESSTHAN) {
             end_bound = full_arglist[i].value;
             end_inclusive = 0;
           }
@@ -778,7 +1829,7 @@ static wg_query *internal_build_query(void *db, void *matchrec, gint reclen,
         case WG_COND_GREATER:
           /* No earlier left bound or new left bound is >= of old value */
           if(start_bound==WG_ILLEGAL ||\
-            WG_COMPARE(db, start_bound, full_arglist[i].value)!=WG_GREATER) {
+            QUERY_COMPARE(db, start_bound, full_arglist[i].value, cmpcount)!=WG_GREATER) {
             start_bound = full_arglist[i].value;
             start_inclusive = 0;
           }
@@ -786,7 +1837,7 @@ static wg_query *internal_build_query(void *db, void *matchrec, gint reclen,
         case WG_COND_LTEQUAL:
           /* Similar to "less than", but inclusive */
           if(end_bound==WG_ILLEGAL ||\
-            WG_COMPARE(db, end_bound, full_arglist[i].value)==WG_GREATER) {
+            QUERY_COMPARE(db, end_bound, full_arglist[i].value, cmpcount)==WG_GREATER) {
             end_bound = full_arglist[i].value;
             end_inclusive = 1;
           }
@@ -794,7 +1845,7 @@ static wg_query *internal_build_query(void *db, void *matchrec, gint reclen,
         case WG_COND_GTEQUAL:
           /* Similar to "greater", but inclusive */
           if(start_bound==WG_ILLEGAL ||\
-            WG_COMPARE(db, start_bound, full_arglist[i].value)==WG_LESSTHAN) {
+            QUERY_COMPARE(db, start_bound, full_arglist[i].value, cmpcount)==WG_LESSTHAN) {
             start_bound = full_arglist[i].value;
             start_inclusive = 1;
           }
@@ -806,31 +1857,80 @@ static wg_query *internal_build_query(void *db, void *matchrec, gint reclen,
            */
           query->column = -1;
           break;
+        case WG_COND_CONTAINS:
+          /* Not a bound, stays in the argument list (see below) */
+          break;
         default:
           show_query_error(db, "Invalid condition (ignoring)");
           break;
       }
     }
 
-    /* Simple sanity check. Is start_bound greater than end_bound? */
+    /* A keyset query continues from the value of the last row
+     * returned. Rows with that value are filtered by keyset_rows(). */
+    if(token && token->offset) {
+      if(start_bound==WG_ILLEGAL ||\
+        (cmp = QUERY_COMPARE(db, start_bound, token->key, cmpcount)) ==\
+          WG_LESSTHAN || (cmp == WG_EQUAL && start_inclusive)) {
+        start_bound = token->key;
+        start_inclusive = 1;
+      }
+    }
+
+    if(plan) {
+      plan->qtype = query->qtype;
+      plan->index_id = index_id;
+      plan->column = col;
+      plan->start_bound = start_bound;
+      plan->start_inclusive = start_inclusive;
+      plan->end_bound = end_bound;
+      plan->end_inclusive = end_inclusive;
+      plan->prefix = prefix;
+    }
+
+    /* Simple sanity check. Is start_bound greater than end_bound,
+     * or are they equal with one of them excluding the value? */
     if(start_bound!=WG_ILLEGAL && end_bound!=WG_ILLEGAL &&\
-      WG_COMPARE(db, start_bound, end_bound) == WG_GREATER) {
+      ((cmp = QUERY_COMPARE(db, start_bound, end_bound, cmpcount)) ==\
+        WG_GREATER || (cmp == WG_EQUAL &&\
+        (!start_inclusive || !end_inclusive)))) {
       /* return empty query */
       query->argc = 0;
       query->arglist = NULL;
-      free(full_arglist);
+      query_release(arena, full_arglist);
+      if(plan)
+        plan->empty = 1;
+      if(query->profile)
+        query->stats.elapsed_ns += query_clock_ns() - start_ns;
       return query;
     }
 
     /* Now find the bounding nodes for the query */
-    if(find_ttree_bounds(db, index_id, col,
+    if(query->qtype == WG_QTYPE_BTREE) {
+      find_btree_bounds(db, index_id,
+        start_bound, end_bound, start_inclusive, end_inclusive,
+        &query->curr_offset, &query->curr_slot, &query->end_offset,
+        &query->end_slot);
+    } else if(prefix ?
+      find_ttree_multi_bounds(db, index_id, keys, prefix,
+        start_bound, end_bound, start_inclusive, end_inclusive,
+        &query->curr_offset, &query->curr_slot, &query->end_offset,
+        &query->end_slot) :
+      find_ttree_bounds(db, index_id, col,
         start_bound, end_bound, start_inclusive, end_inclusive,
         &query->curr_offset, &query->curr_slot, &query->end_offset,
         &query->end_slot)) {
-      free(query);
-      free(full_arglist);
+      query->arglist = NULL;
+      wg_free_query(db, query);
+      query_release(arena, full_arglist);
       return NULL;
     }
+    if(query->curr_offset) {
+      if(query->profile)
+        query->stats.nodes_visited++;
+    } else if(plan) {
+      plan->empty = 1;
+    }
 
     /* XXX: here we can reverse the direction and switch the start and
      * end nodes/slots, if "descending" sort order is needed.
@@ -839,21 +1939,42 @@ static wg_query *internal_build_query(void *db, void *matchrec, gint reclen,
   } else {
     /* Nothing better than full scan available */
     void *rec;
+    gint zcol = -1;
 
     query->qtype = WG_QTYPE_SCAN;
     query->column = -1; /* no special column, entire argument list
                          * should be checked for each row */
+    query->index_id = 0;
+
+    /* A zone map on a compared column lets the scan skip the
+     * blocks whose values are all out of range. */
+    if(fargc)
+      query->zone_index = find_zone_map(db, full_arglist, fargc, &zcol);
+    if(query->zone_index) {
+      query->zone_nulls = zone_map_bounds(db, full_arglist, fargc, zcol,
+        &query->zone_lo, &query->zone_hi);
+      query->zone_start = 0;
+      query->zone_end = 0;
+      if(plan) {
+        plan->index_id = query->zone_index;
+        plan->column = zcol;
+      }
+    }
 
     rec = wg_get_first_record(db);
     if(rec)
       query->curr_record = ptrtooffset(db, rec);
     else
       query->curr_record = 0;
+    if(query->zone_index && query->curr_record)
+      query->curr_record = zone_map_next(db, query, query->curr_record);
   }
 
   /* Now attach the argument list to the query. If the query is based
    * on a column index, we will create a slimmer copy that does not contain
-   * the conditions already satisfied by the index bounds.
+   * the conditions already satisfied by the index bounds (including the
+   * key prefix of a composite index). Substring conditions are never
+   * satisfied by the bounds.
    */
   if(query->column == -1) {
     query->arglist = full_arglist;
@@ -862,22 +1983,27 @@ static wg_query *internal_build_query(void *db, void *matchrec, gint reclen,
   else {
     int cnt = 0;
     for(i=0; i<fargc; i++) {
-      if(full_arglist[i].column != query->column)
+      if((full_arglist[i].column != query->column ||\
+        full_arglist[i].cond == WG_COND_CONTAINS) &&\
+        !covered_by_prefix(db, hdr, &full_arglist[i], keys, prefix))
         cnt++;
     }
 
     /* The argument list is reduced, but still contains columns */
     if(cnt) {
       int j;
-      query->arglist = (wg_query_arg *) malloc(cnt * sizeof(wg_query_arg));
+      query->arglist = (wg_query_arg *) query_alloc(db, arena,
+        cnt * sizeof(wg_query_arg));
       if(!query->arglist) {
         show_query_error(db, "Failed to allocate memory");
-        free(query);
-        free(full_arglist);
+        wg_free_query(db, query);
+        query_release(arena, full_arglist);
         return NULL;
       }
       for(i=0, j=0; i<fargc; i++) {
-        if(full_arglist[i].column != query->column) {
+        if((full_arglist[i].column != query->column ||\
+          full_arglist[i].cond == WG_COND_CONTAINS) &&\
+          !covered_by_prefix(db, hdr, &full_arglist[i], keys, prefix)) {
           query->arglist[j].column = full_arglist[i].column;
           query->arglist[j].cond = full_arglist[i].cond;
           query->arglist[j++].value = full_arglist[i].value;
@@ -886,59 +2012,274 @@ static wg_query *internal_build_query(void *db, void *matchrec, gint reclen,
     } else
       query->arglist = NULL;
     query->argc = cnt;
-    free(full_arglist); /* Now we have a reduced argument list, free
-                         * the original one */
+    query_release(arena, full_arglist); /* Now we have a reduced argument
+                                         * list, free the original one */
+  }
+
+  if(plan) {
+    plan->arglist = query->arglist;
+    plan->argc = query->argc;
   }
 
   /* Now handle any post-processing required.
    */
   if(flags & QUERY_FLAGS_PREFETCH) {
-    query_result_page **prevnext;
-    query_result_page *currpage;
-    void *rec;
+    if(prefetch_rows(db, query, rowlimit))
+      return NULL;
+  }
 
-    query->curr_page = NULL; /* initialize as empty */
-    query->curr_pidx = 0;
-    query->res_count = 0;
+  if(query->profile)
+    query->stats.elapsed_ns += query_clock_ns() - start_ns;
+  return query;
+}
 
-    /* XXX: could move this inside the loop (speeds up empty
-     * query, slows down other queries) */
-    query->mpool = wg_create_mpool(db, sizeof(query_result_page));
-    if(!query->mpool) {
-      show_query_error(db, "Failed to allocate result memory pool");
-      wg_free_query(db, query);
-      return NULL;
-    }
+/** Fetch the remaining rows of a query into result pages
+ *
+ * Stops after rowlimit rows, if rowlimit is not 0. The query is
+ * converted to a prefetch query. On error the query is freed.
+ *
+ * returns 0 on success
+ * returns -1 on error
+ */
+static gint prefetch_rows(void *db, wg_query *query, wg_uint rowlimit) {
+  query_result_page **prevnext;
+  query_result_page *currpage = NULL;
+  void *rec;
+  int i;
 
-    i = QUERY_RESULTSET_PAGESIZE;
-    prevnext = (query_result_page **) &(query->curr_page);
+  query->curr_page = NULL; /* initialize as empty */
+  query->curr_pidx = 0;
+  query->res_count = 0;
+
+  /* XXX: could move this inside the loop (speeds up empty
+   * query, slows down other queries) */
+  if(query->arena)
+    query->mpool = query->arena;
+  else
+    query->mpool = get_query_mpool(db);
+  if(!query->mpool) {
+    show_query_error(db, "Failed to allocate result memory pool");
+    wg_free_query(db, query);
+    return -1;
+  }
 
-    while((rec = wg_fetch(db, query))) {
-      if(i >= QUERY_RESULTSET_PAGESIZE) {
-        currpage = (query_result_page *) \
-          wg_alloc_mpool(db, query->mpool, sizeof(query_result_page));
-        if(!currpage) {
-          show_query_error(db, "Failed to allocate a resultset row");
-          wg_free_query(db, query);
-          return NULL;
-        }
-        memset(currpage->rows, 0, sizeof(gint) * QUERY_RESULTSET_PAGESIZE);
-        *prevnext = currpage;
-        prevnext = &(currpage->next);
-        currpage->next = NULL;
-        i = 0;
+  i = QUERY_RESULTSET_PAGESIZE;
+  prevnext = (query_result_page **) &(query->curr_page);
+
+  while((rec = fetch_next(db, query))) {
+    if(i >= QUERY_RESULTSET_PAGESIZE) {
+      currpage = (query_result_page *) \
+        wg_alloc_mpool(db, query->mpool, sizeof(query_result_page));
+      if(!currpage) {
+        show_query_error(db, "Failed to allocate a resultset row");
+        query->qtype = WG_QTYPE_PREFETCH; /* so that mpool is released */
+        wg_free_query(db, query);
+        return -1;
       }
-      currpage->rows[i++] = ptrtooffset(db, rec);
-      query->res_count++;
-      if(rowlimit && query->res_count >= rowlimit)
+      memset(currpage->rows, 0, sizeof(gint) * QUERY_RESULTSET_PAGESIZE);
+      *prevnext = currpage;
+      prevnext = &(currpage->next);
+      currpage->next = NULL;
+      i = 0;
+    }
+    currpage->rows[i++] = ptrtooffset(db, rec);
+    query->res_count++;
+    if(rowlimit && query->res_count >= rowlimit)
+      break;
+  }
+
+#ifdef USE_INDEX_ADVISOR
+  /* A scan stopped by the row limit is reported here */
+  if(query->qtype == WG_QTYPE_SCAN)
+    advise_scan(db, query);
+#endif
+
+  /* Candidates of a trigram query are not needed anymore */
+  query_release(query->arena, query->cand);
+  query->cand = NULL;
+
+  /* Finally, convert the query type. */
+  query->qtype = WG_QTYPE_PREFETCH;
+  return 0;
+}
+
+/** Skip rows of a T-tree query without visiting them
+ *
+ * Only possible if the index bounds are the only conditions. The
+ * subtree counts of the T-tree give the rank of the current and
+ * the last row of the range, so the cursor can be moved directly.
+ *
+ * returns the number of rows skipped
+ */
+static wg_uint skip_ttree_rows(void *db, wg_query *query, wg_uint count) {
+  gint curr, last, slot;
+
+  curr = wg_ttree_rank(db, query->curr_offset, query->curr_slot);
+  last = wg_ttree_rank(db, query->end_offset, query->end_slot);
+  if(curr + (gint) count > last) {
+    query->curr_offset = 0; /* range exhausted */
+    return (wg_uint) (last - curr + 1);
+  }
+  query->curr_offset = wg_ttree_seek(db, query->index_id,
+    curr + count, &slot);
+  query->curr_slot = slot;
+  if(query->profile)
+    query->stats.nodes_visited++;
+  return count;
+}
+
+/** Make a private copy of an encoded value
+ *  Values that point to database storage are copied into local
+ *  memory like query parameters; immediate values are returned as is.
+ *  returns WG_ILLEGAL on error
+ */
+static gint copy_query_param(void *db, gint enc) {
+  switch(wg_get_encoded_type(db, enc)) {
+    case WG_INTTYPE:
+      return wg_encode_query_param_int(db, wg_decode_int(db, enc));
+    case WG_DOUBLETYPE:
+      return wg_encode_query_param_double(db, wg_decode_double(db, enc));
+    case WG_STRTYPE:
+      return wg_encode_query_param_str(db, wg_decode_str(db, enc), NULL);
+    case WG_XMLLITERALTYPE:
+      return wg_encode_query_param_xmlliteral(db,
+        wg_decode_xmlliteral(db, enc),
+        wg_decode_xmlliteral_xsdtype(db, enc));
+    case WG_URITYPE:
+      return wg_encode_query_param_uri(db, wg_decode_uri(db, enc),
+        wg_decode_uri_prefix(db, enc));
+    case WG_BLOBTYPE:
+      return encode_query_param_unistr(db, wg_decode_blob(db, enc),
+        WG_BLOBTYPE, wg_decode_blob_type(db, enc),
+        wg_decode_blob_len(db, enc));
+    default:
+      return enc;
+  }
+}
+
+/** Sort a run of rows with equal values by offset
+ *  If the value is that of the token, the rows up to and including
+ *  the token position were returned on earlier pages and are dropped.
+ *  returns the number of rows after the run is processed
+ */
+static gint finish_keyset_run(void *db, wg_query_token *token,
+  gint *rows, gint start, gint count, gint key) {
+
+  gint i;
+
+  qsort(rows + start, count - start, sizeof(gint), offset_cmp);
+  if(token->offset && WG_COMPARE(db, key, token->key) == WG_EQUAL) {
+    for(i=start; i<count && rows[i] <= token->offset; i++);
+    if(i > start) {
+      memmove(rows + start, rows + i, (count - i) * sizeof(gint));
+      count -= i - start;
+    }
+  }
+  return count;
+}
+
+/** Fetch one page of a keyset query
+ *
+ * Rows come from the T-tree in the order of the token column. Rows
+ * with equal values are in no particular order in the index, so each
+ * run of them is read completely and sorted by offset. The page then
+ * follows (value, offset) order and its last row marks the position
+ * exactly, even if that row is deleted before the next page is read.
+ *
+ * The query is converted to a prefetch query and the token is moved
+ * to the last row. On error the query is freed.
+ *
+ * returns 0 on success
+ * returns -1 on error
+ */
+static gint keyset_rows(void *db, wg_query *query, wg_query_token *token,
+  wg_uint rowlimit) {
+
+  gint *rows = NULL, count = 0, size = 0, run = 0, runkey = 0, i;
+  query_result_page **prevnext;
+  query_result_page *currpage = NULL;
+  void *rec;
+
+  for(;;) {
+    gint key = 0;
+    if((rec = fetch_next(db, query)))
+      key = wg_get_field(db, rec, token->column);
+    if(count > run && (!rec || WG_COMPARE(db, key, runkey) != WG_EQUAL)) {
+      /* run of equal values complete */
+      count = finish_keyset_run(db, token, rows, run, count, runkey);
+      run = count;
+      if(rowlimit && (wg_uint) count >= rowlimit)
         break;
     }
+    if(!rec)
+      break;
+    if(count >= size) {
+      gint *tmp;
+      size = (size ? size * 2 : QUERY_RESULTSET_PAGESIZE);
+      if(!(tmp = (gint *) realloc(rows, size * sizeof(gint)))) {
+        show_query_error(db, "Failed to allocate memory");
+        if(rows)
+          free(rows);
+        wg_free_query(db, query);
+        return -1;
+      }
+      rows = tmp;
+    }
+    if(count == run)
+      runkey = key;
+    rows[count++] = ptrtooffset(db, rec);
+  }
+  if(rowlimit && (wg_uint) count > rowlimit)
+    count = rowlimit;
 
-    /* Finally, convert the query type. */
-    query->qtype = WG_QTYPE_PREFETCH;
+  /* Store the page like prefetch_rows() does */
+  query->qtype = WG_QTYPE_PREFETCH;
+  query->curr_page = NULL;
+  query->curr_pidx = 0;
+  query->res_count = count;
+  query->mpool = get_query_mpool(db);
+  if(!query->mpool) {
+    show_query_error(db, "Failed to allocate result memory pool");
+    if(rows)
+      free(rows);
+    wg_free_query(db, query);
+    return -1;
+  }
+  prevnext = (query_result_page **) &(query->curr_page);
+  for(i=0; i<count; i++) {
+    if(!(i % QUERY_RESULTSET_PAGESIZE)) {
+      currpage = (query_result_page *) \
+        wg_alloc_mpool(db, query->mpool, sizeof(query_result_page));
+      if(!currpage) {
+        show_query_error(db, "Failed to allocate a resultset row");
+        free(rows);
+        wg_free_query(db, query);
+        return -1;
+      }
+      memset(currpage->rows, 0, sizeof(gint) * QUERY_RESULTSET_PAGESIZE);
+      *prevnext = currpage;
+      prevnext = &(currpage->next);
+      currpage->next = NULL;
+    }
+    currpage->rows[i % QUERY_RESULTSET_PAGESIZE] = rows[i];
   }
 
-  return query;
+  /* Move the token to the last row */
+  if(count) {
+    gint key = copy_query_param(db, wg_get_field(db,
+      offsettoptr(db, rows[count - 1]), token->column));
+    if(key == WG_ILLEGAL) {
+      free(rows);
+      wg_free_query(db, query);
+      return -1;
+    }
+    wg_free_query_token(db, token);
+    token->key = key;
+    token->offset = rows[count - 1];
+  }
+  if(rows)
+    free(rows);
+  return 0;
 }
 
 /** Create a query object and pre-fetch all data rows.
@@ -954,7 +2295,8 @@ wg_query *wg_make_query(void *db, void *matchrec, gint reclen,
   wg_query_arg *arglist, gint argc) {
 
   return internal_build_query(db,
-    matchrec, reclen, arglist, argc, QUERY_FLAGS_PREFETCH, 0);
+    matchrec, reclen, arglist, argc, QUERY_FLAGS_PREFETCH, 0,
+    NULL, NULL, NULL, NULL);
 }
 
 /** Create a query object and pre-fetch rowlimit number of rows.
@@ -966,7 +2308,182 @@ wg_query *wg_make_query_rc(void *db, void *matchrec, gint reclen,
   wg_query_arg *arglist, gint argc, wg_uint rowlimit) {
 
   return internal_build_query(db,
-    matchrec, reclen, arglist, argc, QUERY_FLAGS_PREFETCH, rowlimit);
+    matchrec, reclen, arglist, argc, QUERY_FLAGS_PREFETCH, rowlimit,
+    NULL, NULL, NULL, NULL);
+}
+
+/** Create a query object with execution statistics enabled.
+ *
+ * Same as wg_make_query_rc() (rowlimit 0 means no limit), but the
+ * query collects the counters in query->stats while it is being
+ * built and fetched from.
+ *
+ * returns NULL if constructing the query fails. Otherwise returns a pointer
+ * to a wg_query object.
+ */
+wg_query *wg_make_query_profile(void *db, void *matchrec, gint reclen,
+  wg_query_arg *arglist, gint argc, wg_uint rowlimit) {
+
+  return internal_build_query(db, matchrec, reclen, arglist, argc,
+    QUERY_FLAGS_PREFETCH|QUERY_FLAGS_PROFILE, rowlimit, NULL, NULL, NULL, NULL);
+}
+
+/** Create a query object in caller-owned memory.
+ *
+ * Same as wg_make_query_rc(), but the argument lists, the prefetched
+ * rows and, if query is NULL, the query object itself are allocated
+ * from arena. arena is a memory pool created with wg_create_mpool().
+ * If query is not NULL (for example, a local variable of the caller),
+ * it is initialized and returned.
+ *
+ * wg_free_query() does nothing for such queries. The caller releases
+ * the memory by calling wg_reset_mpool() or wg_free_mpool() on the arena
+ * once the query is no longer used. When the same arena is reset and
+ * reused, query construction does not allocate from the heap.
+ *
+ * returns NULL if constructing the query fails. Otherwise returns a pointer
+ * to a wg_query object.
+ */
+wg_query *wg_make_query_arena(void *db, void *matchrec, gint reclen,
+  wg_query_arg *arglist, gint argc, wg_uint rowlimit,
+  void *arena, wg_query *query) {
+
+  if(!arena) {
+    show_query_error(db, "Invalid memory pool (NULL)");
+    return NULL;
+  }
+  return internal_build_query(db, matchrec, reclen, arglist, argc,
+    QUERY_FLAGS_PREFETCH, rowlimit, NULL, NULL, arena, query);
+}
+
+/** Create a query object without pre-fetching the rows.
+ *
+ * The rows are found as the cursor advances, so wg_fetch_columns() can
+ * read the included columns of a covering index instead of the rows.
+ * The database must not be modified while the query is in use.
+ *
+ * returns NULL if constructing the query fails. Otherwise returns a pointer
+ * to a wg_query object.
+ */
+wg_query *wg_make_query_cursor(void *db, void *matchrec, gint reclen,
+  wg_query_arg *arglist, gint argc) {
+
+  return internal_build_query(db, matchrec, reclen, arglist, argc,
+    0, 0, NULL, NULL, NULL, NULL);
+}
+
+/** Create a query object and pre-fetch one page of rows.
+ *
+ * The first offset matching rows are skipped, then up to rowlimit rows
+ * are fetched (rowlimit 0 means no limit). If the query is answered
+ * from a T-tree index with no other conditions, the skipped rows are
+ * not visited at all, so large offsets cost O(log n).
+ *
+ * returns NULL if constructing the query fails. Otherwise returns a pointer
+ * to a wg_query object.
+ */
+wg_query *wg_make_query_page(void *db, void *matchrec, gint reclen,
+  wg_query_arg *arglist, gint argc, wg_uint offset, wg_uint rowlimit) {
+
+  wg_query *query = internal_build_query(db, matchrec, reclen,
+    arglist, argc, 0, 0, NULL, NULL, NULL, NULL);
+  if(!query)
+    return NULL;
+  if(offset)
+    wg_query_skip(db, query, offset);
+  if(prefetch_rows(db, query, rowlimit))
+    return NULL;
+  return query;
+}
+
+/** Initialize a continuation token for a keyset query.
+ *
+ * The rows of a keyset query are returned in the order of column,
+ * which needs a T-tree index (without a template).
+ */
+void wg_init_query_token(void *db, wg_query_token *token, gint column) {
+  token->column = column;
+  token->key = 0;
+  token->offset = 0;
+}
+
+/** Create a query object and pre-fetch the page after a token.
+ *
+ * Rows are returned in the order of the token column, starting right
+ * after the last row of the previous page. The position is found with
+ * a T-tree search, so the cost does not depend on how many pages came
+ * before. Rows inserted or deleted meanwhile do not shift the pages:
+ * the order is (value, row offset), rows that sort before the token
+ * are not returned again. The token is updated to the last row of
+ * the new page.
+ *
+ * returns NULL if constructing the query fails. Otherwise returns a pointer
+ * to a wg_query object.
+ */
+wg_query *wg_make_query_after(void *db, void *matchrec, gint reclen,
+  wg_query_arg *arglist, gint argc, wg_query_token *token, wg_uint rowlimit) {
+
+  wg_query *query;
+
+  if(!token) {
+    show_query_error(db, "Invalid query token");
+    return NULL;
+  }
+  query = internal_build_query(db, matchrec, reclen,
+    arglist, argc, 0, 0, NULL, token, NULL, NULL);
+  if(!query)
+    return NULL;
+  if(keyset_rows(db, query, token, rowlimit))
+    return NULL;
+  return query;
+}
+
+/** Release the value held by a continuation token.
+ *  The token can be initialized again after this.
+ */
+void wg_free_query_token(void *db, wg_query_token *token) {
+  if(token->offset)
+    wg_free_query_param(db, token->key);
+  token->key = 0;
+  token->offset = 0;
+}
+
+/** Describe the access path that would be used for a query.
+ *
+ * The arguments are the same as for wg_make_query(). No rows are
+ * fetched. The residual argument list in plan is allocated
+ * and should be released with wg_free_query_plan().
+ *
+ * returns 0 on success
+ * returns -1 on error
+ */
+gint wg_explain_query(void *db, void *matchrec, gint reclen,
+  wg_query_arg *arglist, gint argc, wg_query_plan *plan) {
+
+  wg_query *query;
+
+  if(!plan) {
+    return show_query_error(db, "Invalid plan object");
+  }
+  query = internal_build_query(db, matchrec, reclen, arglist, argc,
+    0, 0, plan, NULL, NULL, NULL);
+  if(!query)
+    return -1;
+
+  /* The plan inherits the residual argument list */
+  query->arglist = NULL;
+  wg_free_query(db, query);
+  return 0;
+}
+
+/** Release the memory allocated for the query plan
+ */
+void wg_free_query_plan(void *db, wg_query_plan *plan) {
+  if(plan->arglist) {
+    free(plan->arglist);
+    plan->arglist = NULL;
+  }
+  plan->argc = 0;
 }
 
 
@@ -975,6 +2492,7 @@ wg_query *wg_make_query_rc(void *db, void *matchrec, gint reclen,
  */
 void *wg_fetch(void *db, wg_query *query) {
   void *rec;
+  wg_uint start_ns;
 
 #ifdef CHECK
   if (!dbcheck(db)) {
@@ -990,16 +2508,169 @@ void *wg_fetch(void *db, wg_query *query) {
     return NULL;
   }
 #endif
+  if(!query->profile)
+    return fetch_next(db, query);
+
+  start_ns = query_clock_ns();
+  rec = fetch_next(db, query);
+  if(rec)
+    query->stats.records_returned++;
+  query->stats.elapsed_ns += query_clock_ns() - start_ns;
+  return rec;
+}
+
+/** Return next record and some of its fields
+ *  columns - array of column numbers to read
+ *  values - array of count elements, filled with the encoded
+ *           values of the columns (NULL for columns past the record end)
+ *  If the query runs on a covering T-tree index, the included columns
+ *  are read from the index and the record itself is not accessed.
+ *  returns NULL if no more records
+ */
+void *wg_fetch_columns(void *db, wg_query *query, gint *columns,
+  gint count, gint *values) {
+  void *rec;
+  gint i, reclen = -1;
+
+  rec = wg_fetch(db, query);
+  if(!rec)
+    return NULL;
+  for(i=0; i<count; i++) {
+    if(query->qtype == WG_QTYPE_TTREE && \
+      !wg_tnode_covered_value(db, query->last_offset, query->last_slot,
+      columns[i], &values[i]))
+      continue;
+    if(reclen < 0)
+      reclen = wg_get_record_len(db, rec);
+    values[i] = (columns[i] < reclen ? wg_get_field(db, rec, columns[i]) : 0);
+  }
+  return rec;
+}
+
+/** Skip rows of the query
+ *  Advances the cursor past the next count matching rows.
+ *  returns the number of rows skipped (less than count if the
+ *  query was exhausted)
+ */
+wg_uint wg_query_skip(void *db, wg_query *query, wg_uint count) {
+  wg_uint skipped = 0;
+
+#ifdef CHECK
+  if(!query) {
+    show_query_error(db, "Invalid query object");
+    return 0;
+  }
+#endif
+  if(!count)
+    return 0;
+  if(query->qtype == WG_QTYPE_TTREE && !query->arglist &&\
+    query->curr_offset && query->direction == 1) {
+    return skip_ttree_rows(db, query, count);
+  }
+  while(skipped < count && fetch_next(db, query))
+    skipped++;
+  return skipped;
+}
+
+/** Count the rows matching the query arguments
+ *
+ * The arguments are the same as for wg_make_query(). If the query is
+ * answered from a T-tree index with no other conditions, the rows are
+ * counted from the subtree counts of the index without visiting them.
+ *
+ * returns the number of rows
+ * returns -1 on error
+ */
+gint wg_query_count(void *db, void *matchrec, gint reclen,
+  wg_query_arg *arglist, gint argc) {
+
+  wg_query *query;
+  gint count = 0;
+
+  query = internal_build_query(db, matchrec, reclen, arglist, argc,
+    0, 0, NULL, NULL, NULL, NULL);
+  if(!query)
+    return -1;
+  if(query->qtype == WG_QTYPE_TTREE && !query->arglist) {
+    count = wg_ttree_count_range(db, query->curr_offset, query->curr_slot,
+      query->end_offset, query->end_slot);
+  } else {
+    while(fetch_next(db, query))
+      count++;
+  }
+  wg_free_query(db, query);
+  return count;
+}
+
+/** Sum a column over the rows matching the query arguments
+ *
+ * The arguments are the same as for wg_make_query(). Integer and
+ * double values of the column are added to *sum, other values are
+ * skipped. If the query runs on a covering T-tree index that includes
+ * the column, the rows are not accessed.
+ *
+ * returns the number of rows
+ * returns -1 on error
+ */
+gint wg_query_sum(void *db, void *matchrec, gint reclen,
+  wg_query_arg *arglist, gint argc, gint column, double *sum) {
+
+  wg_query *query;
+  gint count = 0, value;
+
+  *sum = 0;
+  query = internal_build_query(db, matchrec, reclen, arglist, argc,
+    0, 0, NULL, NULL, NULL, NULL);
+  if(!query)
+    return -1;
+  while(wg_fetch_columns(db, query, &column, 1, &value)) {
+    switch(wg_get_encoded_type(db, value)) {
+      case WG_INTTYPE:
+        *sum += wg_decode_int(db, value);
+        break;
+      case WG_DOUBLETYPE:
+        *sum += wg_decode_double(db, value);
+        break;
+      default:
+        break;
+    }
+    count++;
+  }
+  wg_free_query(db, query);
+  return count;
+}
+
+/** Advance the query cursor to the next matching record
+ *  returns NULL if no more records
+ */
+static void *fetch_next(void *db, wg_query *query) {
+  void *rec;
+  wg_uint *cmpcount = (query->profile ? &query->stats.compare_calls : NULL);
+
   if(query->qtype == WG_QTYPE_SCAN) {
+#ifdef USE_INDEX_ADVISOR
+    /* Only some of the calls are timed, the time of the scan is
+     * extrapolated from the rows they examined */
+    wg_uint start_ns = 0, start_examined = query->scan_examined;
+    if(query->scan_returned % ADVISOR_SAMPLE_RATE == 0)
+      start_ns = query_clock_ns();
+#endif
     for(;;) {
       void *next;
 
       if(!query->curr_record) {
         /* Query exhausted */
-        return NULL;
+        rec = NULL;
+        break;
       }
 
       rec = offsettoptr(db, query->curr_record);
+      if(query->profile)
+        query->stats.records_examined++;
+#ifdef USE_INDEX_ADVISOR
+      if(query->scan_examined++ % ADVISOR_SAMPLE_RATE == 0 && query->arglist)
+        sample_scan_row(db, query, rec);
+#endif
 
       /* Pre-fetch the next record */
       next = wg_get_next_record(db, rec);
@@ -1007,14 +2678,28 @@ void *wg_fetch(void *db, wg_query *query) {
         query->curr_record = ptrtooffset(db, next);
       else
         query->curr_record = 0;
+      if(query->zone_index && query->curr_record)
+        query->curr_record = zone_map_next(db, query,
+          query->curr_record);
 
       /* Check the record against all conditions; if it does
        * not match, go to next iteration.
        */
       if(!query->arglist || \
-        check_arglist(db, rec, query->arglist, query->argc))
-        return rec;
+        check_arglist(db, rec, query->arglist, query->argc, cmpcount))
+        break;
     }
+#ifdef USE_INDEX_ADVISOR
+    if(start_ns) {
+      query->scan_ns += query_clock_ns() - start_ns;
+      query->scan_timed += query->scan_examined - start_examined;
+    }
+    if(rec)
+      query->scan_returned++;
+    else
+      advise_scan(db, query);
+#endif
+    return rec;
   }
   else if(query->qtype == WG_QTYPE_TTREE) {
     struct wg_tnode *node;
@@ -1026,6 +2711,10 @@ void *wg_fetch(void *db, wg_query *query) {
       }
       node = (struct wg_tnode *) offsettoptr(db, query->curr_offset);
       rec = offsettoptr(db, node->array_of_values[query->curr_slot]);
+      if(query->profile)
+        query->stats.records_examined++;
+      query->last_offset = query->curr_offset;
+      query->last_slot = query->curr_slot;
 
       /* Increment the slot/and or node cursors before we
        * return. If the current node does not satisfy the
@@ -1050,6 +2739,8 @@ void *wg_fetch(void *db, wg_query *query) {
             if(query->curr_offset) {
               node = (struct wg_tnode *) offsettoptr(db, query->curr_offset);
               query->curr_slot = node->number_of_elements - 1;
+              if(query->profile)
+                query->stats.nodes_visited++;
             }
 #ifdef CHECK
           }
@@ -1064,6 +2755,8 @@ void *wg_fetch(void *db, wg_query *query) {
 #endif
             query->curr_offset = TNODE_SUCCESSOR(db, node);
             query->curr_slot = 0;
+            if(query->profile && query->curr_offset)
+              query->stats.nodes_visited++;
 #ifdef CHECK
           }
 #endif
@@ -1074,9 +2767,101 @@ void *wg_fetch(void *db, wg_query *query) {
        * all the conditions, we can return.
        */
       if(!query->arglist || \
-        check_arglist(db, rec, query->arglist, query->argc))
+        check_arglist(db, rec, query->arglist, query->argc, cmpcount))
+        return rec;
+    }
+  }
+  else if(query->qtype == WG_QTYPE_BTREE) {
+    struct wg_bnode *node;
+
+    while(query->curr_offset) {
+      node = (struct wg_bnode *) offsettoptr(db, query->curr_offset);
+      rec = offsettoptr(db, node->row[query->curr_slot]);
+      if(query->profile)
+        query->stats.records_examined++;
+
+      /* Leaves are chained, so the cursor simply moves right
+       * until the last slot of the range. */
+      if(query->curr_offset==query->end_offset && \
+        query->curr_slot==query->end_slot) {
+        query->curr_offset = 0;
+      } else if(++query->curr_slot >= node->count) {
+        query->curr_offset = node->next_offset;
+        query->curr_slot = 0;
+        if(query->profile && query->curr_offset)
+          query->stats.nodes_visited++;
+      }
+
+      if(!query->arglist || \
+        check_arglist(db, rec, query->arglist, query->argc, cmpcount))
+        return rec;
+    }
+    return NULL;
+  }
+  else if(query->qtype == WG_QTYPE_SPATIAL) {
+    struct wg_bnode *node;
+    wg_uint z, next;
+
+    while(query->curr_offset) {
+      node = (struct wg_bnode *) offsettoptr(db, query->curr_offset);
+      if(query->curr_slot >= node->count) {
+        query->curr_offset = node->next_offset;
+        query->curr_slot = 0;
+        if(query->profile && query->curr_offset)
+          query->stats.nodes_visited++;
+        continue;
+      }
+
+      z = node->key_prefix[query->curr_slot];
+      if(z > query->box_hi) {
+        query->curr_offset = 0; /* past the last corner */
+        break;
+      }
+      if(!SPATIAL_IN_BOX(z, query->box_lo, query->box_hi)) {
+        /* Jump to the next key in the box. Within the leaf it
+         * is found by binary search, otherwise from the root. */
+        gint lo = query->curr_slot + 1, hi = node->count;
+        if(!wg_spatial_next(z, query->box_lo, query->box_hi, &next)) {
+          query->curr_offset = 0;
+          break;
+        }
+        if(node->key_prefix[node->count - 1] < next) {
+          query->curr_offset = wg_search_spatial(db, query->index_id, next,
+            &query->curr_slot);
+          if(query->profile && query->curr_offset)
+            query->stats.nodes_visited++;
+          continue;
+        }
+        while(lo < hi) {
+          gint mid = lo + (hi - lo) / 2;
+          if(node->key_prefix[mid] < next)
+            lo = mid + 1;
+          else
+            hi = mid;
+        }
+        query->curr_slot = lo;
+        continue;
+      }
+
+      rec = offsettoptr(db, node->row[query->curr_slot++]);
+      if(query->profile)
+        query->stats.records_examined++;
+      if(!query->arglist || \
+        check_arglist(db, rec, query->arglist, query->argc, cmpcount))
+        return rec;
+    }
+    return NULL;
+  }
+  else if(query->qtype == WG_QTYPE_TRIGRAM) {
+    while(query->cand_pos < query->cand_count) {
+      rec = offsettoptr(db, query->cand[query->cand_pos++]);
+      if(query->profile)
+        query->stats.records_examined++;
+      if(!query->arglist || \
+        check_arglist(db, rec, query->arglist, query->argc, cmpcount))
         return rec;
     }
+    return NULL;
   }
   if(query->qtype == WG_QTYPE_PREFETCH) {
     if(query->curr_page) {
@@ -1097,20 +2882,120 @@ void *wg_fetch(void *db, wg_query *query) {
     else
       return NULL;
   }
-  else {
-    show_query_error(db, "Unsupported query type");
-    return NULL;
+  else {
+    show_query_error(db, "Unsupported query type");
+    return NULL;
+  }
+}
+
+/** Release the memory allocated for the query
+ */
+void wg_free_query(void *db, wg_query *query) {
+#ifdef USE_INDEX_ADVISOR
+  if(query->qtype == WG_QTYPE_SCAN)
+    advise_scan(db, query); /* abandoned before the end */
+#endif
+  if(query->arena)
+    return; /* everything is owned by the caller's memory pool */
+  if(query->arglist)
+    free(query->arglist);
+  if(query->cand)
+    free(query->cand);
+  if(query->qtype==WG_QTYPE_PREFETCH && query->mpool)
+    release_query_mpool(db, query->mpool);
+  free(query);
+}
+
+/** Allocate query memory from arena, or from the heap if arena is NULL
+ */
+static void *query_alloc(void *db, void *arena, size_t size) {
+  if(arena)
+    return wg_alloc_mpool(db, arena, (int) size);
+  return malloc(size);
+}
+
+/** Release memory allocated with query_alloc()
+ */
+static void query_release(void *arena, void *ptr) {
+  if(!arena && ptr)
+    free(ptr);
+}
+
+/** Get an empty memory pool for query results.
+ *  Reuses a pool cached in the database handle if one is available.
+ */
+static void *get_query_mpool(void *db) {
+#ifdef USE_DATABASE_HANDLE
+  db_handle_querydata *qd = \
+    (db_handle_querydata *) (((db_handle *) db)->querydata);
+  if(qd && qd->mpool_count)
+    return qd->mpools[--(qd->mpool_count)];
+#endif
+  return wg_create_mpool(db, sizeof(query_result_page));
+}
+
+/** Release a memory pool for query results.
+ *  The pool is emptied and cached in the database handle
+ *  if there is room, otherwise it is freed.
+ */
+static void release_query_mpool(void *db, void *mpool) {
+#ifdef USE_DATABASE_HANDLE
+  db_handle_querydata *qd = \
+    (db_handle_querydata *) (((db_handle *) db)->querydata);
+  if(qd && qd->mpool_count < QUERY_MPOOL_CACHE_SIZE) {
+    wg_reset_mpool(db, mpool);
+    qd->mpools[(qd->mpool_count)++] = mpool;
+    return;
+  }
+#endif
+  wg_free_mpool(db, mpool);
+}
+
+/** Set up the query data in the database handle
+ *  Normally called when opening the database connection.
+ */
+gint wg_init_handle_querydata(void *db) {
+#ifdef USE_DATABASE_HANDLE
+  db_handle_querydata **qd = \
+    (db_handle_querydata **) &(((db_handle *) db)->querydata);
+  *qd = malloc(sizeof(db_handle_querydata));
+  if(!(*qd)) {
+    return show_query_error(db, "Error initializing local query data");
   }
+  memset(*qd, 0, sizeof(db_handle_querydata));
+#endif
+  return 0;
 }
 
-/** Release the memory allocated for the query
+/** Free the memory pools cached in the database handle.
+ *  Normally called when closing the database connection.
  */
-void wg_free_query(void *db, wg_query *query) {
-  if(query->arglist)
-    free(query->arglist);
-  if(query->qtype==WG_QTYPE_PREFETCH && query->mpool)
-    wg_free_mpool(db, query->mpool);
-  free(query);
+void wg_cleanup_handle_querydata(void *db) {
+#ifdef USE_DATABASE_HANDLE
+  db_handle_querydata *qd = \
+    (db_handle_querydata *) (((db_handle *) db)->querydata);
+  if(qd) {
+    while(qd->mpool_count)
+      wg_free_mpool(db, qd->mpools[--(qd->mpool_count)]);
+    free(qd);
+    ((db_handle *) db)->querydata = NULL;
+  }
+#endif
+}
+
+/** Monotonic clock in nanoseconds, for query profiling
+ */
+static wg_uint query_clock_ns(void) {
+#ifdef _WIN32
+  LARGE_INTEGER cnt, freq;
+  QueryPerformanceCounter(&cnt);
+  QueryPerformanceFrequency(&freq);
+  return (wg_uint) ((double) cnt.QuadPart * 1e9 / (double) freq.QuadPart);
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((wg_uint) ts.tv_sec) * 1000000000 + (wg_uint) ts.tv_nsec;
+#endif
 }
 
 /* ----------- query parameter preparing functions -------------*/
@@ -1152,6 +3037,15 @@ gint wg_encode_query_param_var(void *db, gint data) {
  * size of the data (but similar assumptions exist in dbdata.c)
  */
 
+/** Offset of a malloc()-ed query parameter from the database base
+ * The difference is taken on integers: as a pointer difference
+ * between two unrelated objects, the compiler may assume the buffer
+ * is never read and drop the stores that fill it.
+ */
+static gint query_param_offset(void *db, void *dptr) {
+  return (gint) ((wg_uint) dptr - (wg_uint) dbmemsegbytes(db));
+}
+
 gint wg_encode_query_param_int(void *db, gint data) {
   void *dptr;
 
@@ -1164,7 +3058,7 @@ gint wg_encode_query_param_int(void *db, gint data) {
       return WG_ILLEGAL;
     }
     *((gint *) dptr) = data;
-    return encode_fullint_offset(ptrtooffset(db, dptr));
+    return encode_fullint_offset(query_param_offset(db, dptr));
   }
 }
 
@@ -1177,7 +3071,7 @@ gint wg_encode_query_param_double(void *db, double data) {
     return WG_ILLEGAL;
   }
   *((double *) dptr) = data;
-  return encode_fulldouble_offset(ptrtooffset(db, dptr));
+  return encode_fulldouble_offset(query_param_offset(db, dptr));
 }
 
 gint wg_encode_query_param_str(void *db, char *data, char *lang) {
@@ -1226,7 +3120,7 @@ static gint encode_query_param_unistr(void *db, char *data, gint type,
     }
     memcpy((char *) dptr, data, length);
     ((char *) dptr)[length] = '\0';
-    return encode_shortstr_offset(ptrtooffset(db, dptr));
+    return encode_shortstr_offset(query_param_offset(db, dptr));
   }
   else {
     size_t i;
@@ -1256,7 +3150,7 @@ static gint encode_query_param_unistr(void *db, char *data, gint type,
       show_query_error(db, "Failed to encode query parameter");
       return WG_ILLEGAL;
     }
-    offset = ptrtooffset(db, dptr);
+    offset = query_param_offset(db, dptr);
 
     /* Copy the data, fill the remainder with zeroes */
     memcpy((char *) dptr + (LONGSTR_HEADER_GINTS*sizeof(gint)), data, length);
@@ -1353,7 +3247,7 @@ static query_result_set *create_resultset(void *db) {
   set->first_page = NULL;
   set->res_count = 0;
 
-  set->mpool = wg_create_mpool(db, sizeof(query_result_page));
+  set->mpool = get_query_mpool(db);
   if(!set->mpool) {
     show_query_error(db, "Failed to allocate result memory pool");
     free(set);
@@ -1367,7 +3261,7 @@ static query_result_set *create_resultset(void *db) {
  */
 static void free_resultset(void *db, query_result_set *set) {
   if(set->mpool)
-    wg_free_mpool(db, set->mpool);
+    release_query_mpool(db, set->mpool);
   free(set);
 }
 
@@ -1433,156 +3327,126 @@ static gint fetch_resultset(void *db, query_result_set *set) {
   return 0;
 }
 
-#define NESTEDLOOP 0
-#define HASHJOIN 1
+/*
+ * Find the first position in a sorted array, starting from pos, where
+ * the value is not less than key. The step is doubled until the key is
+ * passed and the last step is then bisected, so skipping over k values
+ * takes O(log k) comparisons.
+ *
+ * Returns count if all values from pos on are less than key.
+ */
+static gint gallop_offsets(gint *arr, gint count, gint pos, gint key) {
+  gint lo, hi, step = 1;
+
+  if(pos >= count || arr[pos] >= key)
+    return pos;
+  lo = pos;
+  hi = lo + 1;
+  while(hi < count && arr[hi] < key) {
+    lo = hi;
+    step <<= 1;
+    hi = lo + step;
+  }
+  if(hi > count)
+    hi = count;
+  /* arr[lo] < key and either hi == count or arr[hi] >= key */
+  while(hi - lo > 1) {
+    gint mid = lo + (hi - lo) / 2;
+    if(arr[mid] < key)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return hi;
+}
+
+/*
+ * Copy the offsets of a result set into an array, sorted and
+ * with duplicates removed. The array is allocated with malloc().
+ *
+ * Returns the array (NULL if the set is empty).
+ * Returns NULL and sets *count to -1 on error.
+ */
+static gint *sorted_resultset(void *db, query_result_set *set, gint *count)
+{
+  gint *arr, offset, i, j;
+
+  *count = 0;
+  if(!set->res_count)
+    return NULL;
+  if(!(arr = malloc(set->res_count * sizeof(gint)))) {
+    show_query_error(db, "Failed to allocate memory");
+    *count = -1;
+    return NULL;
+  }
+
+  rewind_resultset(db, set);
+  for(i=0; (offset = fetch_resultset(db, set)); i++)
+    arr[i] = offset;
+  qsort(arr, i, sizeof(gint), offset_cmp);
+
+  for(j=1; j<i; j++) {
+    if(arr[j] != arr[*count])
+      arr[++(*count)] = arr[j];
+  }
+  (*count)++;
+  return arr;
+}
 
 /*
- * Create an intersection of two result sets.
- * Join strategy:
- *   if the number of inner loops expected is low (i.e. the sets
- *   are small), nested loop join is used. Otherwise, hash join
- *   is used.
+ * Create an intersection of a result set and an array of offsets.
+ * Both must be sorted. The set is read in order and each offset
+ * is looked up by galloping forward in the array, so large gaps
+ * in the array are skipped cheaply.
  *
  * Returns a new result set (can be empty).
  * Returns NULL on error.
  */
 static query_result_set *intersect_resultset(void *db,
-  query_result_set *seta, query_result_set *setb)
+  query_result_set *set, gint *arr, gint count)
 {
   query_result_set *intersection;
-  int strategy = HASHJOIN;
+  gint offset, pos = 0;
 
   if(!(intersection = create_resultset(db))) {
     return NULL;
   }
-  if(seta->res_count * setb->res_count < 200) {
-    strategy = NESTEDLOOP; /* don't bother with hash table */
-  }
-
-  if(strategy == HASHJOIN) {
-    void *hasht = NULL;
-    gint offset;
-
-    if(seta->res_count > setb->res_count) {
-      query_result_set *tmp = seta;
-      seta = setb;
-      setb = tmp;
-    }
-
-    if(!(hasht = wg_dhash_init(db, seta->res_count))) {
-      free_resultset(db, intersection);
-      return NULL;
-    }
 
-    rewind_resultset(db, seta);
-    while((offset = fetch_resultset(db, seta))) {
-      if(wg_dhash_addkey(db, hasht, offset)) {
+  rewind_resultset(db, set);
+  while(pos < count && (offset = fetch_resultset(db, set))) {
+    pos = gallop_offsets(arr, count, pos, offset);
+    if(pos < count && arr[pos] == offset) {
+      if(append_resultset(db, intersection, offset)) {
         free_resultset(db, intersection);
-        wg_dhash_free(db, hasht);
         return NULL;
       }
-    }
-    rewind_resultset(db, setb);
-    while((offset = fetch_resultset(db, setb))) {
-      if(wg_dhash_haskey(db, hasht, offset)) {
-        gint err = append_resultset(db, intersection, offset);
-        if(err) {
-          free_resultset(db, intersection);
-          wg_dhash_free(db, hasht);
-          return NULL;
-        }
-      }
-    }
-    wg_dhash_free(db, hasht);
-  }
-  else { /* nested loop strategy */
-    gint offseta;
-    rewind_resultset(db, seta);
-    while((offseta = fetch_resultset(db, seta))) {
-      gint offsetb;
-      rewind_resultset(db, setb);
-      while((offsetb = fetch_resultset(db, setb))) {
-        if(offseta == offsetb) {
-          gint err = append_resultset(db, intersection, offseta);
-          if(err) {
-            free_resultset(db, intersection);
-            return NULL;
-          }
-          break;
-        }
-      }
+      pos++;
     }
   }
   return intersection;
 }
 
 /*
- * Create a result set that contains only unique rows.
- * Uniqueness test uses similar strategy to the intersect function
- * (hash table for membership test, but revert to nested loop if
- * low number of elements).
+ * Create a result set from a sorted array of offsets.
  *
  * Returns a new result set (can be empty).
  * Returns NULL on error.
  */
-static query_result_set *unique_resultset(void *db, query_result_set *set)
+static query_result_set *array_resultset(void *db, gint *arr, gint count)
 {
-  gint offset;
-  query_result_set *unique;
-  int strategy = HASHJOIN;
+  query_result_set *set;
+  gint i;
 
-  if(!(unique = create_resultset(db))) {
+  if(!(set = create_resultset(db))) {
     return NULL;
   }
-  if(set->res_count < 20) {
-    strategy = NESTEDLOOP; /* don't bother with hash table */
-  }
-
-  rewind_resultset(db, set);
-
-  if(strategy == HASHJOIN) {
-    void *hasht = NULL;
-    if(!(hasht = wg_dhash_init(db, set->res_count))) {
-      free_resultset(db, unique);
+  for(i=0; i<count; i++) {
+    if(append_resultset(db, set, arr[i])) {
+      free_resultset(db, set);
       return NULL;
     }
-
-    while((offset = fetch_resultset(db, set))) {
-      if(!wg_dhash_haskey(db, hasht, offset)) {
-        gint err = append_resultset(db, unique, offset);
-        if(!err) {
-          err = wg_dhash_addkey(db, hasht, offset);
-        }
-        if(err) {
-          free_resultset(db, unique);
-          wg_dhash_free(db, hasht);
-          return NULL;
-        }
-      }
-    }
-    wg_dhash_free(db, hasht);
-  }
-  else { /* nested loop */
-    while((offset = fetch_resultset(db, set))) {
-      gint offsetu, found = 0;
-      rewind_resultset(db, unique);
-      while((offsetu = fetch_resultset(db, unique))) {
-        if(offset == offsetu) {
-          found = 1;
-          break;
-        }
-      }
-      if(!found) {
-        /* We're now at the end of the set and may append normally. */
-        gint err = append_resultset(db, unique, offset);
-        if(err) {
-          free_resultset(db, unique);
-          return NULL;
-        }
-      }
-    }
   }
-  return unique;
+  return set;
 }
 
 /* ------------------- (JSON) document query -------------------*/
@@ -1740,24 +3604,75 @@ static gint check_and_merge_recursively(void *db, void *rec,
   return 0; /* no match */
 }
 
+/*
+ * Estimate the number of rows for each key-value pair from the row
+ * lists of the JSON hash index. The lists are walked in step, so a
+ * long list is read only until it is QUERY_JSON_PROBE_RATIO times
+ * longer than the shortest one. For such lists the size is a lower
+ * bound; they will be probed against the smaller sets anyway.
+ */
+static void estimate_json_args(void *db, gint index_id,
+  wg_json_query_arg *arglist, gint argc, gint *sizes)
+{
+  gint *pos, i, active = 0, shortest = -1, steps;
+
+  memset(sizes, 0, argc * sizeof(gint));
+  if(!(pos = malloc(argc * sizeof(gint))))
+    return; /* no estimates, arguments are used in the given order */
+
+  for(i=0; i<argc; i++) {
+    gint values[2];
+    values[0] = arglist[i].key;
+    values[1] = arglist[i].value;
+    pos[i] = wg_search_hash(db, index_id, values, 2);
+    if(pos[i] > 0) {
+      sizes[i] = 1;
+      active++;
+    } else {
+      pos[i] = 0;
+      shortest = 0; /* pair does not occur */
+    }
+  }
+
+  for(steps=0; active &&\
+    (shortest < 0 || steps < shortest * QUERY_JSON_PROBE_RATIO); steps++) {
+    for(i=0; i<argc; i++) {
+      if(pos[i]) {
+        pos[i] = ((gcell *) offsettoptr(db, pos[i]))->cdr;
+        if(pos[i]) {
+          sizes[i]++;
+        } else {
+          active--;
+          if(shortest < 0 || sizes[i] < shortest)
+            shortest = sizes[i];
+        }
+      }
+    }
+  }
+  free(pos);
+}
+
 /* Prepare argument list. This sorts clauses that are either less
- * costly to query or restrict the following processing the most
- * (not yet implemented, depends on statistics). Also determines
- * which indexes can and should be used.
+ * costly to query or restrict the following processing the most.
+ * Literal values come first, ordered by the size of their row lists
+ * in the hash index (smallest first), if the index is available.
+ * Also determines which indexes can and should be used.
  *
  * Returns 0 on success.
  * Returns -1 on error.
  * in case of error, the contents of return parameters are unmodified.
  * in case of success, **sorted_arglist may be set to NULL, if the
  * argument list does not require sorting. The caller should always
- * check that.
+ * check that. If it is set, **sizes points to the size estimates
+ * of the sorted arguments (0 if unknown), stored in the same block.
  */
 static gint prepare_json_arglist(void *db, wg_json_query_arg *arglist,
-  wg_json_query_arg **sorted_arglist, gint argc,
+  wg_json_query_arg **sorted_arglist, gint **sizes, gint argc,
   gint *index_id, gint *vindex_id, gint *kindex_id)
 {
   gint icols[2], need_ttree = 0;
   wg_json_query_arg *tmp = NULL;
+  gint *est = NULL;
 
   /* Get index */
   icols[0] = WG_SCHEMA_KEY_OFFSET;
@@ -1769,11 +3684,12 @@ static gint prepare_json_arglist(void *db, wg_json_query_arg *arglist,
   if(argc > 1) {
     /* There is something to sort. In the future we can also sort by
      * cardinality here (provided that stats are available). */
-    gint i, j;
-    tmp = malloc(sizeof(wg_json_query_arg) * argc);
+    gint i, j, k;
+    tmp = malloc((sizeof(wg_json_query_arg) + sizeof(gint)) * argc);
     if(!tmp) {
       return show_query_error(db, "Failed to prepare query arguments");
     }
+    est = (gint *) (tmp + argc);
 
     /* First pass: literal values only */
     for(i=0, j=0; i<argc; i++) {
@@ -1791,6 +3707,22 @@ static gint prepare_json_arglist(void *db, wg_json_query_arg *arglist,
       need_ttree = 1;
     }
 
+    /* Order the literal values by the number of matching rows */
+    memset(est, 0, argc * sizeof(gint));
+    if(*index_id > 0 && j > 1) {
+      estimate_json_args(db, *index_id, tmp, j, est);
+      for(i=1; i<j; i++) {
+        wg_json_query_arg arg = tmp[i];
+        gint size = est[i];
+        for(k=i; k>0 && est[k-1] > size; k--) {
+          tmp[k] = tmp[k-1];
+          est[k] = est[k-1];
+        }
+        tmp[k] = arg;
+        est[k] = size;
+      }
+    }
+
     /* Second pass: complex structures only */
     for(i=0; i<argc; i++) {
       if(wg_get_encoded_type(db, arglist[i].value) == WG_RECORDTYPE) {
@@ -1819,6 +3751,7 @@ static gint prepare_json_arglist(void *db, wg_json_query_arg *arglist,
   }
 
   *sorted_arglist = tmp;
+  *sizes = est;
   return 0;
 }
 
@@ -1831,6 +3764,7 @@ wg_query *wg_make_json_query(void *db, wg_json_query_arg *arglist, gint argc) {
   wg_query *query = NULL;
   query_result_set *curr_res = NULL;
   wg_json_query_arg *sorted_arglist = NULL;
+  gint *sizes = NULL;
   gint index_id = -1, vindex_id = -1, kindex_id = -1;
   gint i;
 
@@ -1851,7 +3785,7 @@ wg_query *wg_make_json_query(void *db, wg_json_query_arg *arglist, gint argc) {
   /* Sort the argument list. This also checks for usable indexes, so
    * we're calling it even if we have just one argument.
    */
-  prepare_json_arglist(db, arglist, &sorted_arglist, argc,
+  prepare_json_arglist(db, arglist, &sorted_arglist, &sizes, argc,
     &index_id, &vindex_id, &kindex_id);
   /* HACK: this way, the following code does not need to care
    * whether we sorted the argument list or not.
@@ -1859,13 +3793,15 @@ wg_query *wg_make_json_query(void *db, wg_json_query_arg *arglist, gint argc) {
   if(sorted_arglist)
     arglist = sorted_arglist;
 
-  /* Iterate over the argument pairs.
-   * XXX: it is possible that getting the first set from index and
-   * doing a scan to check the remaining arguments is faster than
-   * doing the intersect operation of sets retrieved from index.
+  /* Iterate over the argument pairs. The working result is kept sorted
+   * by offset. When a row list in the index is much larger than the
+   * working result, the documents of the result are probed instead.
    */
   for(i=0; i<argc; i++) {
     query_result_set *next_set, *tmp_set;
+    gint *next_rows, next_count;
+    int probe = (curr_res && sizes &&\
+      sizes[i] > curr_res->res_count * QUERY_JSON_PROBE_RATIO);
 
     /* Initialize the set produced by this iteration */
     next_set = create_resultset(db);
@@ -1875,7 +3811,7 @@ wg_query *wg_make_json_query(void *db, wg_json_query_arg *arglist, gint argc) {
       return NULL;
     }
 
-    if(index_id > 0 &&\
+    if(index_id > 0 && !probe &&\
       wg_get_encoded_type(db, arglist[i].value) != WG_RECORDTYPE) {
       /* Fetch the matching rows from the index, then retrieve the
        * documents they belong to.
@@ -1904,7 +3840,7 @@ wg_query *wg_make_json_query(void *db, wg_json_query_arg *arglist, gint argc) {
       /* XXX: unimplemented: scan T-tree for values */
     }
 #endif
-    else if(kindex_id > 0) {
+    else if(kindex_id > 0 && !probe) {
       /* Hash index not usable, do a scan but leverage an index on the
        * key field to reduce the number of records visited.
        */
@@ -1977,34 +3913,35 @@ wg_query *wg_make_json_query(void *db, wg_json_query_arg *arglist, gint argc) {
       }
     }
 
-    /* Delete duplicate documents */
-    tmp_set = unique_resultset(db, next_set);
+    /* Sort the documents, this also deletes duplicates */
+    next_rows = sorted_resultset(db, next_set, &next_count);
     free_resultset(db, next_set);
-    if(!tmp_set) {
+    if(next_count < 0) {
       if(curr_res)
         free_resultset(db, curr_res);
       ARGLIST_CLEANUP(sorted_arglist)
       return NULL;
-    } else {
-      next_set = tmp_set;
     }
 
     /* Update the query result */
     if(curr_res) {
       /* Working resultset exists, create an intersection */
-      tmp_set = intersect_resultset(db, curr_res, next_set);
+      tmp_set = intersect_resultset(db, curr_res, next_rows, next_count);
       free_resultset(db, curr_res);
-      free_resultset(db, next_set);
-      if(!tmp_set) {
-        ARGLIST_CLEANUP(sorted_arglist)
-        return NULL;
-      } else {
-        curr_res = tmp_set;
-      }
     } else {
       /* This set becomes the working resultset */
-      curr_res = next_set;
+      tmp_set = array_resultset(db, next_rows, next_count);
+    }
+    if(next_rows)
+      free(next_rows);
+    if(!tmp_set) {
+      ARGLIST_CLEANUP(sorted_arglist)
+      return NULL;
     }
+    curr_res = tmp_set;
+
+    if(!curr_res->res_count)
+      break; /* remaining pairs can't add anything */
   }
   ARGLIST_CLEANUP(sorted_arglist)
 
@@ -2019,6 +3956,11 @@ wg_query *wg_make_json_query(void *db, wg_json_query_arg *arglist, gint argc) {
   query->arglist = NULL;
   query->argc = 0;
   query->column = -1;
+  query->cand = NULL;
+  query->arena = NULL;
+  query->last_offset = 0;
+  query->profile = 0;
+  memset(&query->stats, 0, sizeof(wg_query_stats));
 
   /* Copy the result. */
   query->curr_page = curr_res->first_page;
@@ -2030,6 +3972,390 @@ wg_query *wg_make_json_query(void *db, wg_json_query_arg *arglist, gint argc) {
   return query;
 }
 
+/* ------------------------- joins -----------------------------*/
+
+/*
+ * Join two sets of rows on equal values of one column in each.
+ *
+ * If the inner column has an index (without a template), the outer
+ * rows are streamed and each one is looked up in the index
+ * (index nested loop join). Otherwise both sides are fetched, a local
+ * hash table is built on the side with fewer rows and the other side
+ * is probed against it.
+ *
+ * NULL values and rows that are too short to have the join column
+ * never join.
+ */
+
+/** Create a join object.
+ *
+ * outer_arglist, outer_argc - conditions for the outer rows
+ * outer_column - join column of the outer rows
+ * inner_arglist, inner_argc - conditions for the inner rows
+ * inner_column - join column of the inner rows
+ *
+ * returns NULL if constructing the join fails. Otherwise returns a pointer
+ * to a wg_join object.
+ */
+wg_join *wg_make_join(void *db,
+  wg_query_arg *outer_arglist, gint outer_argc, gint outer_column,
+  wg_query_arg *inner_arglist, gint inner_argc, gint inner_column) {
+
+  wg_join *join;
+  gint ttree_id = 0, hash_id = 0;
+  db_memsegment_header* dbh = dbmemsegh(db);
+  int i;
+
+#ifdef CHECK
+  if (!dbcheck(db)) {
+#ifdef WG_NO_ERRPRINT
+#else
+    fprintf(stderr, "Invalid database pointer in wg_make_join.\n");
+#endif
+    return NULL;
+  }
+  if(outer_column < 0 || inner_column < 0) {
+    show_query_error(db, "Invalid join column");
+    return NULL;
+  }
+#endif
+
+  if(!outer_argc)
+    outer_arglist = NULL;
+  if(!inner_argc)
+    inner_arglist = NULL;
+
+  /* Find an index on the inner column. Hash index lookups are
+   * cheaper, so they are preferred over T-trees. Indexes with templates
+   * or predicates hold only a part of the rows and cannot be used.
+   */
+  if(inner_column <= MAX_INDEXED_FIELDNR) {
+    gint *ilist = &dbh->index_control_area_header.index_table[inner_column];
+    while(*ilist) {
+      gcell *ilistelem = (gcell *) offsettoptr(db, *ilist);
+      if(ilistelem->car) {
+        wg_index_header *hdr = \
+          (wg_index_header *) offsettoptr(db, ilistelem->car);
+        if(!hdr->template_offset && !hdr->predicate_offset &&\
+          hdr->rec_field_index[0] == inner_column) {
+          if(hdr->type == WG_INDEX_TYPE_HASH && hdr->fields == 1) {
+            hash_id = ilistelem->car;
+            break;
+          }
+          if(hdr->type == WG_INDEX_TYPE_TTREE && !ttree_id &&\
+            TTREE_KEY_COLUMN(hdr, 0) == inner_column) {
+            ttree_id = ilistelem->car;
+          }
+        }
+      }
+      ilist = &ilistelem->cdr;
+    }
+  }
+
+  join = (wg_join *) malloc(sizeof(wg_join));
+  if(!join) {
+    show_query_error(db, "Failed to allocate memory");
+    return NULL;
+  }
+  memset(join, 0, sizeof(wg_join));
+  join->outer_column = outer_column;
+  join->inner_column = inner_column;
+  join->curr_entry = -1;
+
+  if(hash_id || ttree_id) {
+    join->jtype = (hash_id ? WG_JTYPE_HASH : WG_JTYPE_TTREE);
+    join->index_id = (hash_id ? hash_id : ttree_id);
+
+    /* Inner conditions are checked on each row found in the index,
+     * they need a local copy. */
+    if(inner_argc) {
+      join->inner_arglist = (wg_query_arg *) malloc(
+        inner_argc * sizeof(wg_query_arg));
+      if(!join->inner_arglist) {
+        show_query_error(db, "Failed to allocate memory");
+        wg_free_join(db, join);
+        return NULL;
+      }
+      for(i=0; i<inner_argc; i++) {
+        join->inner_arglist[i].column = inner_arglist[i].column;
+        join->inner_arglist[i].cond = inner_arglist[i].cond;
+        join->inner_arglist[i].value = inner_arglist[i].value;
+      }
+      join->inner_argc = inner_argc;
+    }
+
+    /* The cursor over inner rows is set up for each outer row,
+     * it is never freed with wg_free_query().
+     */
+    join->inner.qtype = WG_QTYPE_TTREE;
+    join->inner.column = inner_column;
+    join->inner.index_id = join->index_id;
+    join->inner.arglist = join->inner_arglist;
+    join->inner.argc = join->inner_argc;
+    join->inner.direction = 1;
+
+    /* Outer rows are streamed, no need to prefetch them */
+    join->driver = internal_build_query(db, NULL, 0,
+      outer_arglist, outer_argc, 0, 0, NULL, NULL, NULL, NULL);
+    if(!join->driver) {
+      wg_free_join(db, join);
+      return NULL;
+    }
+  }
+  else {
+    wg_query *outer, *inner, *build;
+
+    join->jtype = WG_JTYPE_LOCALHASH;
+    outer = internal_build_query(db, NULL, 0,
+      outer_arglist, outer_argc, QUERY_FLAGS_PREFETCH, 0,
+      NULL, NULL, NULL, NULL);
+    if(!outer) {
+      wg_free_join(db, join);
+      return NULL;
+    }
+    inner = internal_build_query(db, NULL, 0,
+      inner_arglist, inner_argc, QUERY_FLAGS_PREFETCH, 0,
+      NULL, NULL, NULL, NULL);
+    if(!inner) {
+      wg_free_query(db, outer);
+      wg_free_join(db, join);
+      return NULL;
+    }
+
+    /* Build the table on the smaller side */
+    if(outer->res_count <= inner->res_count) {
+      join->build_outer = 1;
+      build = outer;
+      join->driver = inner;
+    } else {
+      join->build_outer = 0;
+      build = inner;
+      join->driver = outer;
+    }
+    join->table = build_join_table(db, build,
+      (join->build_outer ? outer_column : inner_column));
+    wg_free_query(db, build);
+    if(!join->table) {
+      wg_free_join(db, join);
+      return NULL;
+    }
+  }
+
+  return join;
+}
+
+/** Fetch next pair of rows from a join.
+ *
+ * returns 1 and sets *outer and *inner if a pair was found
+ * returns 0 if the join is exhausted
+ * returns -1 on error
+ */
+gint wg_fetch_join(void *db, wg_join *join, void **outer, void **inner) {
+  void *rec;
+
+#ifdef CHECK
+  if (!dbcheck(db)) {
+    /* XXX: currently show_query_error would work too */
+#ifdef WG_NO_ERRPRINT
+#else
+    fprintf(stderr, "Invalid database pointer in wg_fetch_join.\n");
+#endif
+    return -1;
+  }
+  if(!join || !join->driver) {
+    show_query_error(db, "Invalid join object");
+    return -1;
+  }
+#endif
+
+  for(;;) {
+    if(!join->curr_probe) {
+      /* Take the next row from the driving side and find the
+       * start of its matches. */
+      gint key;
+
+      rec = wg_fetch(db, join->driver);
+      if(!rec)
+        return 0;
+      key = join_value(db, rec, (join->jtype == WG_JTYPE_LOCALHASH &&\
+        join->build_outer ? join->inner_column : join->outer_column));
+      if(key == WG_ILLEGAL)
+        continue;
+
+      switch(join->jtype) {
+        case WG_JTYPE_TTREE:
+          if(find_ttree_bounds(db, join->index_id, join->inner_column,
+              key, key, 1, 1,
+              &join->inner.curr_offset, &join->inner.curr_slot,
+              &join->inner.end_offset, &join->inner.end_slot)) {
+            return -1;
+          }
+          break;
+        case WG_JTYPE_HASH:
+          join->curr_cell = wg_search_hash(db, join->index_id, &key, 1);
+          if(join->curr_cell < 0)
+            return -1;
+          break;
+        default:
+          if(join_hash_value(db, key, &join->curr_hash))
+            continue; /* not hashable, cannot match */
+          join->curr_entry = join_table_head(join->table, join->curr_hash);
+          break;
+      }
+      join->curr_probe = rec;
+      join->curr_key = key;
+    }
+
+    /* Return the next match of the current row, if any */
+    rec = NULL;
+    switch(join->jtype) {
+      case WG_JTYPE_TTREE:
+        rec = fetch_next(db, &join->inner);
+        break;
+      case WG_JTYPE_HASH:
+        while(join->curr_cell) {
+          gcell *rec_cell = (gcell *) offsettoptr(db, join->curr_cell);
+          join->curr_cell = rec_cell->cdr;
+          if(!join->inner_arglist ||\
+            check_arglist(db, offsettoptr(db, rec_cell->car),
+              join->inner_arglist, join->inner_argc, NULL)) {
+            rec = offsettoptr(db, rec_cell->car);
+            break;
+          }
+        }
+        break;
+      default:
+        rec = join_table_next(db, join);
+        break;
+    }
+
+    if(rec) {
+      if(join->jtype == WG_JTYPE_LOCALHASH && join->build_outer) {
+        *outer = rec;
+        *inner = join->curr_probe;
+      } else {
+        *outer = join->curr_probe;
+        *inner = rec;
+      }
+      return 1;
+    }
+    join->curr_probe = NULL; /* matches exhausted */
+  }
+  return 0; /* pacify the compiler */
+}
+
+/** Release the memory allocated for the join
+ */
+void wg_free_join(void *db, wg_join *join) {
+  if(join->driver)
+    wg_free_query(db, join->driver);
+  if(join->inner_arglist)
+    free(join->inner_arglist);
+  if(join->table)
+    free_join_table(join->table);
+  free(join);
+}
+
+/** Read the join value of a row
+ *  returns WG_ILLEGAL if the row has no usable value
+ */
+static gint join_value(void *db, void *rec, gint column) {
+  gint enc;
+
+  if(column >= wg_get_record_len(db, rec))
+    return WG_ILLEGAL;
+  enc = wg_get_field(db, rec, column);
+  if(wg_get_encoded_type(db, enc) == WG_NULLTYPE)
+    return WG_ILLEGAL;
+  return enc;
+}
+
+/** Hash a value for the local hash join
+ *  Equal values have equal byte representations in
+ *  wg_encode_for_hashing() regardless of how they are stored.
+ *  returns 0 on success, -1 if the value cannot be hashed.
+ */
+static gint join_hash_value(void *db, gint enc, wg_uint *hash) {
+  return wg_hash_encoded(db, enc, hash);
+}
+
+/** Build the local hash table of a join
+ *  Takes a prefetched query and hashes its rows by the join column.
+ *  returns NULL on error.
+ */
+static join_hash_table *build_join_table(void *db, wg_query *query,
+  gint column) {
+  join_hash_table *tbl;
+  gint size = 1, i;
+  void *rec;
+
+  tbl = (join_hash_table *) malloc(sizeof(join_hash_table));
+  if(!tbl) {
+    show_query_error(db, "Failed to allocate memory");
+    return NULL;
+  }
+  while(size < (gint) query->res_count)
+    size <<= 1;
+  tbl->size = size;
+  tbl->count = 0;
+  tbl->buckets = (gint *) malloc(size * sizeof(gint));
+  tbl->entries = (join_hash_entry *) malloc(
+    (query->res_count ? query->res_count : 1) * sizeof(join_hash_entry));
+  if(!tbl->buckets || !tbl->entries) {
+    show_query_error(db, "Failed to allocate memory");
+    free_join_table(tbl);
+    return NULL;
+  }
+  for(i=0; i<size; i++)
+    tbl->buckets[i] = -1;
+
+  while((rec = wg_fetch(db, query))) {
+    join_hash_entry *e = &tbl->entries[tbl->count];
+    gint key = join_value(db, rec, column);
+    if(key == WG_ILLEGAL || join_hash_value(db, key, &e->hash))
+      continue;
+    e->key = key;
+    e->rec = ptrtooffset(db, rec);
+    i = e->hash & (size - 1);
+    e->next = tbl->buckets[i];
+    tbl->buckets[i] = tbl->count++;
+  }
+  return tbl;
+}
+
+/** Free the local hash table of a join
+ */
+static void free_join_table(join_hash_table *tbl) {
+  if(tbl->buckets)
+    free(tbl->buckets);
+  if(tbl->entries)
+    free(tbl->entries);
+  free(tbl);
+}
+
+/** Find the first entry in the chain for a hash value
+ */
+static gint join_table_head(join_hash_table *tbl, wg_uint hash) {
+  return tbl->buckets[hash & (tbl->size - 1)];
+}
+
+/** Return the next row in the local hash table that matches
+ *  the current row of the join.
+ *  returns NULL if there are no more matches.
+ */
+static void *join_table_next(void *db, wg_join *join) {
+  join_hash_table *tbl = (join_hash_table *) join->table;
+
+  while(join->curr_entry >= 0) {
+    join_hash_entry *e = &tbl->entries[join->curr_entry];
+    join->curr_entry = e->next;
+    if(e->hash == join->curr_hash &&\
+      WG_COMPARE(db, e->key, join->curr_key) == WG_EQUAL)
+      return offsettoptr(db, e->rec);
+  }
+  return NULL;
+}
+
 /* ------------------ simple query functions -------------------*/
 
 void *wg_find_record(void *db, gint fieldnr, gint cond, gint data,
@@ -2037,7 +4363,7 @@ void *wg_find_record(void *db, gint fieldnr, gint cond, gint data,
   gint index_id = -1;
 
   /* find index on colum */
-  if(cond != WG_COND_NOT_EQUAL) {
+  if(cond != WG_COND_NOT_EQUAL && cond != WG_COND_CONTAINS) {
     index_id = wg_multi_column_to_index_id(db, &fieldnr, 1,
       WG_INDEX_TYPE_TTREE, NULL, 0);
   }
@@ -2114,9 +4440,15 @@ void *wg_find_record(void *db, gint fieldnr, gint cond, gint data,
     }
   }
   else {
-    /* no index (or cond == WG_COND_NOT_EQUAL), do a scan */
+    /* no index (or cond is WG_COND_NOT_EQUAL or WG_COND_CONTAINS),
+     * do a scan */
     wg_query_arg arg;
     void *rec;
+#ifdef USE_INDEX_ADVISOR
+    wg_uint start_ns = query_clock_ns();
+    wg_uint found = 1;
+    gint examined = 0;
+#endif
 
     if(lastrecord) {
       rec = wg_get_next_record(db, lastrecord);
@@ -2129,11 +4461,27 @@ void *wg_find_record(void *db, gint fieldnr, gint cond, gint data,
     arg.value = data;
 
     while(rec) {
-      if(check_arglist(db, rec, &arg, 1)) {
+#ifdef USE_INDEX_ADVISOR
+      examined++;
+#endif
+      if(check_arglist(db, rec, &arg, 1, NULL)) {
+#ifdef USE_INDEX_ADVISOR
+        wg_advise_scan(db, &arg, 1, examined, 1,
+          (gint) ((query_clock_ns() - start_ns + 500) / 1000),
+          examined, &found);
+#endif
         return rec;
       }
       rec = wg_get_next_record(db, rec);
     }
+#ifdef USE_INDEX_ADVISOR
+    if(examined) {
+      found = 0;
+      wg_advise_scan(db, &arg, 1, examined, 0,
+        (gint) ((query_clock_ns() - start_ns + 500) / 1000),
+        examined, &found);
+    }
+#endif
   }
 
   /* No records found (this can also happen if matching records were
@@ -34,7 +34,6 @@
 #endif
 
 #include "dbdata.h"
-#include "dbindex.h"
 
 /* ==== Public macros ==== */
 
@@ -44,12 +43,20 @@
 #define WG_COND_GREATER     0x0008      /** > */
 #define WG_COND_LTEQUAL     0x0010      /** <= */
 #define WG_COND_GTEQUAL     0x0020      /** >= */
+#define WG_COND_CONTAINS    0x0040      /** string contains the value */
 
 #define WG_QTYPE_TTREE      0x01
 #define WG_QTYPE_HASH       0x02
 #define WG_QTYPE_SCAN       0x04
+#define WG_QTYPE_TRIGRAM    0x08
+#define WG_QTYPE_BTREE      0x10
+#define WG_QTYPE_SPATIAL    0x20
 #define WG_QTYPE_PREFETCH   0x80
 
+#define WG_JTYPE_TTREE      0x01        /** inner rows from a T-tree index */
+#define WG_JTYPE_HASH       0x02        /** inner rows from a hash index */
+#define WG_JTYPE_LOCALHASH  0x04        /** hash table on the smaller side */
+
 /* ====== data structures ======== */
 
 /** Query argument list object */
@@ -64,6 +71,34 @@ typedef struct {
   gint value;       /** encoded value */
 } wg_json_query_arg;
 
+/** Query execution statistics. Only collected for queries
+ *  created with wg_make_query_profile().
+ */
+typedef struct {
+  wg_uint nodes_visited;      /** T-tree nodes walked */
+  wg_uint records_examined;   /** rows checked against the argument list */
+  wg_uint records_returned;   /** rows returned by wg_fetch() */
+  wg_uint compare_calls;      /** value comparisons done by the query engine */
+  wg_uint elapsed_ns;         /** time spent building and fetching */
+  wg_uint blocks_skipped;     /** full scan blocks passed over by a zone map */
+} wg_query_stats;
+
+/** Query plan, as chosen by the query builder */
+typedef struct {
+  gint qtype;               /** access path (T-tree or full scan) */
+  gint index_id;            /** index used, 0 if none */
+  gint column;              /** indexed column, -1 if none */
+  gint start_bound;         /** encoded start value, WG_ILLEGAL if unbounded */
+  gint start_inclusive;
+  gint end_bound;           /** encoded end value, WG_ILLEGAL if unbounded */
+  gint end_inclusive;
+  gint empty;               /** bounds are contradictory, no rows match */
+  gint prefix;              /** leading composite key columns fixed by
+                             * equality, the bounds apply to column */
+  wg_query_arg *arglist;    /** residual conditions checked on each row */
+  gint argc;                /** number of elements in arglist */
+} wg_query_plan;
+
 /** Query object */
 typedef struct {
   gint qtype;           /** Query type (T-tree, hash, full scan, prefetch) */
@@ -71,6 +106,7 @@ typedef struct {
   wg_query_arg *arglist;    /** check each row in result set against these */
   gint argc;                /** number of elements in arglist */
   gint column;              /** index on this column used */
+  gint index_id;            /** T-tree index used, 0 if none */
   /* Fields for T-tree query (XXX: some may be re-usable for
    * other types as well) */
   gint curr_offset;
@@ -78,15 +114,73 @@ typedef struct {
   gint curr_slot;
   gint end_slot;
   gint direction;
+  gint last_offset;         /** node of the row returned last */
+  gint last_slot;
   /* Fields for full scan */
   gint curr_record;         /** offset of the current record */
+  gint zone_index;          /** zone map used to skip blocks, 0 if none */
+  wg_uint zone_lo;          /** normalized bounds of the values that match */
+  wg_uint zone_hi;
+  gint zone_nulls;          /** NULL values can match */
+  gint zone_start;          /** block of the current record */
+  gint zone_end;
+  wg_uint scan_examined;    /** rows examined, for the index advisor */
+  wg_uint scan_returned;    /** rows returned */
+  wg_uint scan_ns;          /** time spent in the timed fetches */
+  wg_uint scan_timed;       /** rows examined by the timed fetches */
+  wg_uint scan_sampled;     /** rows checked for the selectivity of columns */
+  wg_uint scan_pass[ADVISOR_MAX_COLUMNS]; /** sampled rows passing the
+                                           *  conditions on each column */
+  /* Fields for trigram query */
+  gint *cand;               /** candidate row offsets, sorted */
+  gint cand_count;          /** number of candidates */
+  gint cand_pos;            /** next candidate to examine */
+  /* Fields for spatial query (uses curr_offset and curr_slot) */
+  wg_uint box_lo;           /** Z-order keys of the corners of the box */
+  wg_uint box_hi;
   /* Fields for prefetch */
   void *mpool;              /** storage for row offsets */
   void *curr_page;          /** current page of results */
   gint curr_pidx;           /** current index on page */
   wg_uint res_count;          /** number of rows in results */
+  void *arena;              /** caller-owned mpool the query was built in */
+  /* Fields for profiling */
+  gint profile;             /** collect execution statistics */
+  wg_query_stats stats;
 } wg_query;
 
+/** Continuation token of a keyset query. Remembers the last row
+ *  returned, so that the next page resumes right after it. */
+typedef struct {
+  gint column;              /** ordering column, needs a T-tree index */
+  gint key;                 /** value of the last row (private copy) */
+  gint offset;              /** last row returned, 0 before the first page */
+} wg_query_token;
+
+/** Join object (rows of two queries paired on equal column values) */
+typedef struct {
+  gint jtype;               /** join method */
+  gint outer_column;        /** join column of the outer rows */
+  gint inner_column;        /** join column of the inner rows */
+  wg_query *driver;         /** outer rows, or the probe side of a hash join */
+  wg_query_arg *inner_arglist; /** conditions on inner rows (index joins) */
+  gint inner_argc;
+  gint index_id;            /** index on the inner column, 0 if none */
+  void *curr_probe;         /** row currently being matched */
+  gint curr_key;            /** join value of curr_probe */
+  /* Fields for index joins */
+  wg_query inner;           /** T-tree cursor over the matching inner rows */
+  gint curr_cell;           /** next list cell of a hash index match */
+  /* Fields for local hash join */
+  void *table;              /** hash table on the build side */
+  gint build_outer;         /** the table holds the outer rows */
+  gint curr_entry;          /** next table entry to check, -1 if none */
+  wg_uint curr_hash;        /** hash of curr_key */
+} wg_join;
+
+/* Index headers use wg_query_arg, so they are included after it */
+#include "dbindex.h"
+
 /* ==== Protos ==== */
 
 wg_query *wg_make_query(void *db, void *matchrec, gint reclen,
@@ -94,9 +188,40 @@ wg_query *wg_make_query(void *db, void *matchrec, gint reclen,
 #define wg_make_prefetch_query wg_make_query
 wg_query *wg_make_query_rc(void *db, void *matchrec, gint reclen,
   wg_query_arg *arglist, gint argc, wg_uint rowlimit);
+wg_query *wg_make_query_profile(void *db, void *matchrec, gint reclen,
+  wg_query_arg *arglist, gint argc, wg_uint rowlimit);
+wg_query *wg_make_query_arena(void *db, void *matchrec, gint reclen,
+  wg_query_arg *arglist, gint argc, wg_uint rowlimit,
+  void *arena, wg_query *query);
+wg_query *wg_make_query_cursor(void *db, void *matchrec, gint reclen,
+  wg_query_arg *arglist, gint argc);
 wg_query *wg_make_json_query(void *db, wg_json_query_arg *arglist, gint argc);
+wg_query *wg_make_query_page(void *db, void *matchrec, gint reclen,
+  wg_query_arg *arglist, gint argc, wg_uint offset, wg_uint rowlimit);
+void wg_init_query_token(void *db, wg_query_token *token, gint column);
+wg_query *wg_make_query_after(void *db, void *matchrec, gint reclen,
+  wg_query_arg *arglist, gint argc, wg_query_token *token, wg_uint rowlimit);
+void wg_free_query_token(void *db, wg_query_token *token);
 void *wg_fetch(void *db, wg_query *query);
+void *wg_fetch_columns(void *db, wg_query *query, gint *columns,
+  gint count, gint *values);
+wg_uint wg_query_skip(void *db, wg_query *query, wg_uint count);
+gint wg_query_count(void *db, void *matchrec, gint reclen,
+  wg_query_arg *arglist, gint argc);
+gint wg_query_sum(void *db, void *matchrec, gint reclen,
+  wg_query_arg *arglist, gint argc, gint column, double *sum);
 void wg_free_query(void *db, wg_query *query);
+gint wg_explain_query(void *db, void *matchrec, gint reclen,
+  wg_query_arg *arglist, gint argc, wg_query_plan *plan);
+void wg_free_query_plan(void *db, wg_query_plan *plan);
+wg_join *wg_make_join(void *db,
+  wg_query_arg *outer_arglist, gint outer_argc, gint outer_column,
+  wg_query_arg *inner_arglist, gint inner_argc, gint inner_column);
+gint wg_fetch_join(void *db, wg_join *join, void **outer, void **inner);
+void wg_free_join(void *db, wg_join *join);
+
+gint wg_init_handle_querydata(void *db);
+void wg_cleanup_handle_querydata(void *db);
 
 gint wg_encode_query_param_null(void *db, char *data);
 gint wg_encode_query_param_record(void *db, void *data);
@@ -44,6 +44,7 @@ extern "C" {
 #include "dbdata.h"
 #include "dbcompare.h"
 #include "dbindex.h"
+#include "dbaggr.h"
 #include "dbschema.h"
 #include "dblog.h"
 
@@ -75,6 +76,8 @@ void *wg_create_triple(void *db, gint subj, gint prop, gint ob, gint isparam) {
       *meta |= (RECORD_META_NOTDATA|RECORD_META_MATCH);
     } else if(wg_index_add_rec(db, rec) < -1) {
       return NULL; /* index error */
+    } else if(wg_aggr_add_rec(db, rec) < -1) {
+      return NULL; /* aggregate view error */
     }
 
     if(wg_set_field(db, rec, WG_SCHEMA_TRIPLE_OFFSET, subj))
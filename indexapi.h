@@ -37,6 +37,10 @@
 #define WG_INDEX_TYPE_TTREE_JSON    51
 #define WG_INDEX_TYPE_HASH          60
 #define WG_INDEX_TYPE_HASH_JSON     61
+#define WG_INDEX_TYPE_TRIGRAM       70
+#define WG_INDEX_TYPE_BTREE         80
+#define WG_INDEX_TYPE_ZONEMAP       90
+#define WG_INDEX_TYPE_SPATIAL       100
 
 /* Public protos */
 
@@ -44,6 +48,18 @@ wg_int wg_create_index(void *db, wg_int column, wg_int type,
   wg_int *matchrec, wg_int reclen);
 wg_int wg_create_multi_index(void *db, wg_int *columns, wg_int col_count,
   wg_int type, wg_int *matchrec, wg_int reclen);
+wg_int wg_create_covering_index(void *db, wg_int *columns, wg_int col_count,
+  wg_int *include, wg_int inc_count, wg_int *matchrec, wg_int reclen);
+wg_int wg_create_partial_index(void *db, wg_int *columns, wg_int col_count,
+  wg_int type, wg_query_arg *arglist, wg_int argc);
+wg_int wg_create_unique_index(void *db, wg_int *columns, wg_int col_count);
+wg_int wg_create_multi_index_online(void *db, wg_int *columns,
+  wg_int col_count, wg_int type, wg_int *matchrec, wg_int reclen);
+wg_int wg_start_online_index(void *db, wg_int *columns, wg_int col_count,
+  wg_int type, wg_int *matchrec, wg_int reclen);
+wg_int wg_scan_online_index(void *db, wg_int index_id, wg_int rowlimit);
+wg_int wg_finish_online_index(void *db, wg_int index_id);
+wg_int wg_abort_online_index(void *db, wg_int index_id);
 wg_int wg_drop_index(void *db, wg_int index_id);
 wg_int wg_column_to_index_id(void *db, wg_int column, wg_int type,
   wg_int *matchrec, wg_int reclen);
@@ -52,5 +68,8 @@ wg_int wg_multi_column_to_index_id(void *db, wg_int *columns,
 wg_int wg_get_index_type(void *db, wg_int index_id);
 void * wg_get_index_template(void *db, wg_int index_id, wg_int *reclen);
 void * wg_get_all_indexes(void *db, wg_int *count);
+void *wg_upsert(void *db, wg_int index_id, wg_int *values, wg_int count);
+wg_int wg_begin_bulk(void *db);
+wg_int wg_end_bulk(void *db);
 
 #endif /* DEFINED_INDEXAPI_H */
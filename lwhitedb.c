@@ -39,12 +39,18 @@ extern "C"
 
 #define  WHITEDB_METATABLE          ":whitedb_meta_table:"
 #define  WHITEDB_RECORD_METATABLE   ":whitedb_record_meta_table:"
+#define  WHITEDB_TOKEN_METATABLE    ":whitedb_token_meta_table:"
+#define  WHITEDB_SUBSCRIPTION_METATABLE ":whitedb_subscription_meta_table:"
+#define  WHITEDB_JOIN_METATABLE     ":whitedb_join_meta_table:"
 #define  WHITEDB_NAME               "whitedb"
 #define  WHITEDB_MAX_FIND_STR_SIZE  64
 
 #define DWhiteDbNameSize 64
 #define DWhiteDbMaxMultiIndexSize 16
 #define DWhiteDbMaxQuerySize 20
+#define DWhiteDbQueryArenaSize (64*1024)
+#define DWhiteDbMaxChanges 256
+#define DWhiteDbMaxAdvice 32
 
 #define DWhiteDbVersion "0.1.1"
 
@@ -90,6 +96,7 @@ typedef struct whitedb_instance
 	wg_int iLockWriteTr;
 	int    iLockRead;
 	int    iLockWrite;
+	void*  pQueryArena;
 	int    whitedb_record_metatable_ref;
 } whitedb_instance;
 
@@ -107,9 +114,24 @@ typedef struct whitedb_query_iterator
 {
 	void*     pWhiteDb;
 	wg_query* pQuery;
+	wg_query_stats Stats;
 	int    whitedb_record_metatable_ref;
 } whitedb_query_iterator;
 
+//---------------------------------------------------------
+typedef struct whitedb_query_token
+{
+	void*     pWhiteDb;
+	wg_query_token Token;
+} whitedb_query_token;
+
+//---------------------------------------------------------
+typedef struct whitedb_subscription
+{
+	whitedb_instance* pInstance; // kept alive by the userdata environment
+	void*     pSubscription;
+} whitedb_subscription;
+
 //---------------------------------------------------------
 static whitedb_instance* check_instance(lua_State *l, int iIndex)
 {
@@ -133,6 +155,7 @@ static const char* STR_COND_LESSTHAN = "<";
 static const char* STR_COND_GREATER = ">";
 static const char* STR_COND_LTEQUAL = "<=";
 static const char* STR_COND_GTEQUAL = ">=";
+static const char* STR_COND_CONTAINS = "contains";
 
 //---------------------------------------------------------
 const char* cond_to_str(int iCondition)
@@ -145,6 +168,7 @@ const char* cond_to_str(int iCondition)
 		case WG_COND_GREATER: return STR_COND_GREATER;
 		case WG_COND_LTEQUAL: return STR_COND_LTEQUAL;
 		case WG_COND_GTEQUAL: return STR_COND_GTEQUAL;
+		case WG_COND_CONTAINS: return STR_COND_CONTAINS;
 		default:
 			assert(0);
 			break;
@@ -172,6 +196,9 @@ int str_to_cond(const char* sCondition)
 
 	if (strcmp(sCondition, STR_COND_GTEQUAL) == 0)
 		return WG_COND_GTEQUAL;
+
+	if (strcmp(sCondition, STR_COND_CONTAINS) == 0)
+		return WG_COND_CONTAINS;
 	
 	assert(0);
 	return 0;
@@ -625,6 +652,29 @@ static int whitedb_write_end(lua_State *l)
 	return 1;
 }
 //---------------------------------------------------------
+// db:bulk_begin() defers index updates until db:bulk_end(),
+// both are called while holding the write lock
+static int whitedb_bulk_begin(lua_State *l)
+{
+	assert(lua_gettop(l) > 0);
+	whitedb_instance* pInstance = check_instance(l, 1);
+	INSTANCE_EXIT_NIL(pInstance)
+
+	lua_pushboolean(l, wg_begin_bulk(pInstance->pWhiteDb) == 0);
+	return 1;
+}
+
+//---------------------------------------------------------
+static int whitedb_bulk_end(lua_State *l)
+{
+	assert(lua_gettop(l) > 0);
+	whitedb_instance* pInstance = check_instance(l, 1);
+	INSTANCE_EXIT_NIL(pInstance)
+
+	lua_pushboolean(l, wg_end_bulk(pInstance->pWhiteDb) == 0);
+	return 1;
+}
+//---------------------------------------------------------
 static int whitedb_log_start(lua_State *l)
 {
 	whitedb_instance* pInstance = check_instance(l, 1);
@@ -870,6 +920,70 @@ static int whitedb_record_create_t(lua_State *l)
 	return whitedb_record_to_userdata(pInstance->whitedb_record_metatable_ref, pInstance->pWhiteDb, pRecord, iSize, l);
 }
 
+//---------------------------------------------------------
+// db, { field, field, ... }, { value, value, ... } - record with the key of the
+// unique index on the fields gets the values, if there is none it is created.
+// Takes the write lock unless the script already holds it, fails if the
+// script holds a read lock.
+static int whitedb_upsert(lua_State *l)
+{
+	assert(lua_gettop(l) > 2);
+
+	whitedb_instance* pInstance = check_instance(l, 1);
+	INSTANCE_EXIT_NIL(pInstance)
+	if ( lua_type(l, 2) != LUA_TTABLE || lua_type(l, 3) != LUA_TTABLE || pInstance->iLockRead )
+	{
+		lua_pushnil(l);
+		return 1;
+	}
+	wg_int Columns[DWhiteDbMaxMultiIndexSize];
+	wg_int iColumn_count = (wg_int)lua_objlen(l, 2);
+	int    iSize = lua_objlen(l, 3);
+	if (iColumn_count < 1 || iColumn_count > DWhiteDbMaxMultiIndexSize || iSize < 1)
+	{
+		lua_pushnil(l);
+		return 1;
+	}
+	for (wg_int i = 0; i < iColumn_count; i++)
+	{
+		lua_rawgeti(l, 2, (int)i + 1);
+		Columns[i] = lua_tointeger(l, -1) - 1;
+		lua_pop(l, 1);
+	}
+	wg_int iIndex_id = wg_multi_column_to_index_id(pInstance->pWhiteDb, Columns, iColumn_count, WG_INDEX_TYPE_HASH, NULL, 0);
+	if ( iIndex_id == -1 )
+	{
+		lua_pushnil(l);
+		return 1;
+	}
+
+	wg_int* Values = (wg_int*)lua_newuserdata(l, iSize * sizeof(wg_int));
+	for (int iIndex = 1; iIndex <= iSize; iIndex++ )
+	{
+		lua_rawgeti(l, 3, iIndex );
+		Values[iIndex - 1] = lua_value_to_wg(pInstance->pWhiteDb, l, -1);
+		lua_pop(l, 1);
+	}
+	void*   pRecord = NULL;
+	wg_int  iLock = 0;
+	if ( pInstance->iLockWrite == 0 )
+		iLock = wg_start_write(pInstance->pWhiteDb);
+	if ( iLock || pInstance->iLockWrite )
+		pRecord = wg_upsert(pInstance->pWhiteDb, iIndex_id, Values, iSize);
+	if ( iLock )
+		wg_end_write(pInstance->pWhiteDb, iLock);
+	if ( pRecord == NULL )
+	{
+		// the values were not stored
+		for ( int iPos = 0; iPos < iSize; iPos++ )
+			wg_free_encoded(pInstance->pWhiteDb, Values[iPos]);
+		lua_pushnil(l);
+		return 1;
+	}
+
+	return whitedb_record_to_userdata(pInstance->whitedb_record_metatable_ref, pInstance->pWhiteDb, pRecord, 0, l);
+}
+
 //---------------------------------------------------------
 // find db, key str
 static int whitedb_find_key(lua_State *l) {
@@ -988,6 +1102,296 @@ static int whitedb_index_create(lua_State *l) {
 	return 1;
 }
 
+//---------------------------------------------------------
+// db, field - trigram index for "contains" conditions on a string field
+static int whitedb_index_trigram(lua_State *l) {
+	assert(lua_gettop(l) > 1);
+	whitedb_instance* pInstance = check_instance(l, 1);
+	INSTANCE_EXIT_NIL(pInstance)
+	int iFieldIndex = lua_tointeger(l, 2);
+	iFieldIndex--;
+	assert( iFieldIndex >= 0);
+	if (wg_column_to_index_id(pInstance->pWhiteDb, iFieldIndex, WG_INDEX_TYPE_TRIGRAM, NULL, 0) == -1)
+		lua_pushboolean(l, wg_create_index(pInstance->pWhiteDb, iFieldIndex, WG_INDEX_TYPE_TRIGRAM, NULL, 0) == 0 ? 1 : 0 );
+	else
+		lua_pushboolean(l, 0 );
+
+	return 1;
+}
+
+//---------------------------------------------------------
+// db, field - B+tree index, an alternative to the T-tree index on one field
+static int whitedb_index_btree(lua_State *l) {
+	assert(lua_gettop(l) > 1);
+	whitedb_instance* pInstance = check_instance(l, 1);
+	INSTANCE_EXIT_NIL(pInstance)
+	int iFieldIndex = lua_tointeger(l, 2);
+	iFieldIndex--;
+	assert( iFieldIndex >= 0);
+	if (wg_column_to_index_id(pInstance->pWhiteDb, iFieldIndex, WG_INDEX_TYPE_BTREE, NULL, 0) == -1)
+		lua_pushboolean(l, wg_create_index(pInstance->pWhiteDb, iFieldIndex, WG_INDEX_TYPE_BTREE, NULL, 0) == 0 ? 1 : 0 );
+	else
+		lua_pushboolean(l, 0 );
+
+	return 1;
+}
+
+//---------------------------------------------------------
+// db, field - zone map, lets queries without an index skip the blocks of
+// records whose values of the field are out of range
+static int whitedb_index_zonemap(lua_State *l) {
+	assert(lua_gettop(l) > 1);
+	whitedb_instance* pInstance = check_instance(l, 1);
+	INSTANCE_EXIT_NIL(pInstance)
+	int iFieldIndex = lua_tointeger(l, 2);
+	iFieldIndex--;
+	assert( iFieldIndex >= 0);
+	if (wg_column_to_index_id(pInstance->pWhiteDb, iFieldIndex, WG_INDEX_TYPE_ZONEMAP, NULL, 0) == -1)
+		lua_pushboolean(l, wg_create_index(pInstance->pWhiteDb, iFieldIndex, WG_INDEX_TYPE_ZONEMAP, NULL, 0) == 0 ? 1 : 0 );
+	else
+		lua_pushboolean(l, 0 );
+
+	return 1;
+}
+
+//---------------------------------------------------------
+// db, xfield, yfield - spatial index on two numeric fields, used by queries
+// with range conditions on both of them (a bounding box)
+static int whitedb_index_spatial(lua_State *l) {
+	assert(lua_gettop(l) > 2);
+	whitedb_instance* pInstance = check_instance(l, 1);
+	INSTANCE_EXIT_NIL(pInstance)
+	wg_int Columns[2];
+	Columns[0] = lua_tointeger(l, 2) - 1;
+	Columns[1] = lua_tointeger(l, 3) - 1;
+	if (Columns[0] < 0 || Columns[1] < 0)
+	{
+		lua_pushboolean(l, 0);
+		return 1;
+	}
+	if (wg_multi_column_to_index_id(pInstance->pWhiteDb, Columns, 2, WG_INDEX_TYPE_SPATIAL, NULL, 0) == -1)
+		lua_pushboolean(l, wg_create_multi_index(pInstance->pWhiteDb, Columns, 2, WG_INDEX_TYPE_SPATIAL, NULL, 0) == 0 ? 1 : 0 );
+	else
+		lua_pushboolean(l, 0 );
+
+	return 1;
+}
+
+//---------------------------------------------------------
+// db, { field, field, ... } - unique hash index, no two records may share the
+// key. Fails if the table already holds duplicates.
+static int whitedb_index_unique(lua_State *l) {
+	assert(lua_gettop(l) > 1);
+	if (lua_type(l, 2) != LUA_TTABLE )
+	{
+		lua_pushboolean(l, 0);
+		return 1;
+	}
+
+	whitedb_instance* pInstance = check_instance(l, 1);
+	INSTANCE_EXIT_NIL(pInstance)
+	wg_int Columns[DWhiteDbMaxMultiIndexSize];
+	wg_int iColumn_count = (wg_int)lua_objlen(l, 2);
+	if (iColumn_count < 1 || iColumn_count > DWhiteDbMaxMultiIndexSize)
+	{
+		lua_pushboolean(l, 0);
+		return 1;
+	}
+
+	for (wg_int i = 0; i < iColumn_count; i++)
+	{
+		lua_rawgeti(l, 2, (int)i + 1);
+		Columns[i] = lua_tointeger(l, -1) - 1;
+		lua_pop(l, 1);
+		if (Columns[i] < 0)
+		{
+			lua_pushboolean(l, 0);
+			return 1;
+		}
+	}
+
+	if (wg_multi_column_to_index_id(pInstance->pWhiteDb, Columns, iColumn_count, WG_INDEX_TYPE_HASH, NULL, 0) == -1)
+		lua_pushboolean(l, wg_create_unique_index(pInstance->pWhiteDb, Columns, iColumn_count) == 0 ? 1 : 0 );
+	else
+		lua_pushboolean(l, 0 );
+	return 1;
+}
+
+//---------------------------------------------------------
+// db, { field, field, ... } - composite T-tree, ordered by the fields as listed
+static int whitedb_index_composite(lua_State *l) {
+	assert(lua_gettop(l) > 1);
+	if (lua_type(l, 2) != LUA_TTABLE )
+	{
+		lua_pushboolean(l, 0);
+		return 1;
+	}
+
+	whitedb_instance* pInstance = check_instance(l, 1);
+	INSTANCE_EXIT_NIL(pInstance)
+	wg_int Columns[DWhiteDbMaxMultiIndexSize];
+	wg_int iColumn_count = (wg_int)lua_objlen(l, 2);
+	if (iColumn_count < 1 || iColumn_count > DWhiteDbMaxMultiIndexSize)
+	{
+		lua_pushboolean(l, 0);
+		return 1;
+	}
+
+	for (wg_int i = 0; i < iColumn_count; i++)
+	{
+		lua_rawgeti(l, 2, (int)i + 1);
+		Columns[i] = lua_tointeger(l, -1) - 1;
+		lua_pop(l, 1);
+		if (Columns[i] < 0)
+		{
+			lua_pushboolean(l, 0);
+			return 1;
+		}
+	}
+
+	if (wg_multi_column_to_index_id(pInstance->pWhiteDb, Columns, iColumn_count, WG_INDEX_TYPE_TTREE, NULL, 0) == -1)
+		lua_pushboolean(l, wg_create_multi_index(pInstance->pWhiteDb, Columns, iColumn_count, WG_INDEX_TYPE_TTREE, NULL, 0) == 0 ? 1 : 0 );
+	else
+		lua_pushboolean(l, 0 );
+	return 1;
+}
+
+//---------------------------------------------------------
+// db, { field, field, ... } - like index_c, but the table is scanned in short
+// batches so that other processes can keep writing during the build.
+// Takes the database locks itself, must not be called inside a lock.
+static int whitedb_index_online(lua_State *l) {
+	assert(lua_gettop(l) > 1);
+	if (lua_type(l, 2) != LUA_TTABLE )
+	{
+		lua_pushboolean(l, 0);
+		return 1;
+	}
+
+	whitedb_instance* pInstance = check_instance(l, 1);
+	INSTANCE_EXIT_NIL(pInstance)
+	wg_int Columns[DWhiteDbMaxMultiIndexSize];
+	wg_int iColumn_count = (wg_int)lua_objlen(l, 2);
+	if (iColumn_count < 1 || iColumn_count > DWhiteDbMaxMultiIndexSize || pInstance->iLockWriteTr || pInstance->iLockReadTr)
+	{
+		lua_pushboolean(l, 0);
+		return 1;
+	}
+
+	for (wg_int i = 0; i < iColumn_count; i++)
+	{
+		lua_rawgeti(l, 2, (int)i + 1);
+		Columns[i] = lua_tointeger(l, -1) - 1;
+		lua_pop(l, 1);
+		if (Columns[i] < 0)
+		{
+			lua_pushboolean(l, 0);
+			return 1;
+		}
+	}
+
+	lua_pushboolean(l, wg_create_multi_index_online(pInstance->pWhiteDb, Columns, iColumn_count, WG_INDEX_TYPE_TTREE, NULL, 0) == 0 ? 1 : 0 );
+	return 1;
+}
+
+//---------------------------------------------------------
+// db [, microseconds] - indexes that would have served the queries answered
+// by full scans, best first. Returns an array of { columns = { field, ... },
+// scans =, examined =, returned =, elapsed_us =, savings_us =, index_id = }
+// tables. With the second argument, T-tree indexes are created for the
+// suggestions saving at least that much (index_id is then set).
+static int whitedb_index_advice(lua_State *l) {
+	assert(lua_gettop(l) > 0);
+	whitedb_instance* pInstance = check_instance(l, 1);
+	INSTANCE_EXIT_NIL(pInstance)
+
+	wg_index_advice Advice[DWhiteDbMaxAdvice];
+	wg_int iCount = wg_get_index_advice(pInstance->pWhiteDb, Advice, DWhiteDbMaxAdvice, (wg_int)lua_tointeger(l, 2));
+	if (iCount < 0)
+		return 0;
+
+	lua_newtable(l);
+	for ( wg_int iPos = 0; iPos < iCount; iPos++ )
+	{
+		wg_index_advice* pAdvice = &Advice[iPos];
+		lua_newtable(l);
+		lua_newtable(l);
+		for ( wg_int i = 0; i < pAdvice->col_count; i++ )
+		{
+			lua_pushinteger(l, pAdvice->columns[i] + 1);
+			lua_rawseti(l, -2, (int)i + 1);
+		}
+		lua_setfield(l, -2, "columns");
+		lua_pushinteger(l, pAdvice->scans);
+		lua_setfield(l, -2, "scans");
+		lua_pushnumber(l, (lua_Number)pAdvice->examined);
+		lua_setfield(l, -2, "examined");
+		lua_pushnumber(l, (lua_Number)pAdvice->returned);
+		lua_setfield(l, -2, "returned");
+		lua_pushnumber(l, (lua_Number)pAdvice->elapsed_us);
+		lua_setfield(l, -2, "elapsed_us");
+		lua_pushnumber(l, (lua_Number)pAdvice->savings_us);
+		lua_setfield(l, -2, "savings_us");
+		lua_pushinteger(l, pAdvice->index_id);
+		lua_setfield(l, -2, "index_id");
+		lua_rawseti(l, -2, (int)iPos + 1);
+	}
+	return 1;
+}
+
+//---------------------------------------------------------
+// db, { field, field, ... }, { field, field, ... } - composite T-tree that also
+// keeps copies of the included fields (second table) for query_columns
+// and query_count_sum
+static int whitedb_index_cover(lua_State *l) {
+	assert(lua_gettop(l) > 2);
+	if (lua_type(l, 2) != LUA_TTABLE || lua_type(l, 3) != LUA_TTABLE)
+	{
+		lua_pushboolean(l, 0);
+		return 1;
+	}
+
+	whitedb_instance* pInstance = check_instance(l, 1);
+	INSTANCE_EXIT_NIL(pInstance)
+	wg_int Columns[DWhiteDbMaxMultiIndexSize];
+	wg_int Include[DWhiteDbMaxMultiIndexSize];
+	wg_int iColumn_count = (wg_int)lua_objlen(l, 2);
+	wg_int iInclude_count = (wg_int)lua_objlen(l, 3);
+	if (iColumn_count < 1 || iColumn_count > DWhiteDbMaxMultiIndexSize ||
+		iInclude_count < 1 || iInclude_count > DWhiteDbMaxMultiIndexSize)
+	{
+		lua_pushboolean(l, 0);
+		return 1;
+	}
+
+	for (wg_int i = 0; i < iColumn_count; i++)
+	{
+		lua_rawgeti(l, 2, (int)i + 1);
+		Columns[i] = lua_tointeger(l, -1) - 1;
+		lua_pop(l, 1);
+		if (Columns[i] < 0)
+		{
+			lua_pushboolean(l, 0);
+			return 1;
+		}
+	}
+
+	for (wg_int i = 0; i < iInclude_count; i++)
+	{
+		lua_rawgeti(l, 3, (int)i + 1);
+		Include[i] = lua_tointeger(l, -1) - 1;
+		lua_pop(l, 1);
+		if (Include[i] < 0)
+		{
+			lua_pushboolean(l, 0);
+			return 1;
+		}
+	}
+
+	lua_pushboolean(l, wg_create_covering_index(pInstance->pWhiteDb, Columns, iColumn_count, Include, iInclude_count, NULL, 0) == 0 ? 1 : 0 );
+	return 1;
+}
+
 //---------------------------------------------------------
 // db, index, table
 static int whitedb_index_multi(lua_State *l) {
@@ -1024,14 +1428,62 @@ static int whitedb_query_record(lua_State *l)
 	assert(lua_gettop(l) > 0);
 
 	whitedb_query_iterator* pIterator = (whitedb_query_iterator*)lua_touserdata(l, lua_upvalueindex(1));
+	if (!pIterator->pQuery)
+		return 0;
+
 	void* pRecord = wg_fetch(pIterator->pWhiteDb, pIterator->pQuery);
 	if (pRecord)
 		return whitedb_record_to_userdata(pIterator->whitedb_record_metatable_ref, pIterator->pWhiteDb, pRecord, 0, l);
 
+	pIterator->Stats = pIterator->pQuery->stats;
 	wg_free_query(pIterator->pWhiteDb, pIterator->pQuery);
+	pIterator->pQuery = NULL;
 	return 0;
 }
 
+//---------------------------------------------------------
+static void query_stats_to_lua(lua_State *l, wg_query_stats* pStats)
+{
+	lua_newtable(l);
+	lua_pushnumber(l, (lua_Number)pStats->nodes_visited);
+	lua_setfield(l, -2, "nodes_visited");
+	lua_pushnumber(l, (lua_Number)pStats->records_examined);
+	lua_setfield(l, -2, "records_examined");
+	lua_pushnumber(l, (lua_Number)pStats->records_returned);
+	lua_setfield(l, -2, "records_returned");
+	lua_pushnumber(l, (lua_Number)pStats->compare_calls);
+	lua_setfield(l, -2, "compare_calls");
+	lua_pushnumber(l, (lua_Number)pStats->elapsed_ns);
+	lua_setfield(l, -2, "elapsed_ns");
+	lua_pushnumber(l, (lua_Number)pStats->blocks_skipped);
+	lua_setfield(l, -2, "blocks_skipped");
+}
+
+//---------------------------------------------------------
+static int whitedb_query_stats(lua_State *l)
+{
+	whitedb_query_iterator* pIterator = (whitedb_query_iterator*)lua_touserdata(l, lua_upvalueindex(1));
+	query_stats_to_lua(l, pIterator->pQuery ? &pIterator->pQuery->stats : &pIterator->Stats);
+	return 1;
+}
+
+//---------------------------------------------------------
+// Queries consumed inside a single call are built in the instance arena
+static wg_query* whitedb_make_query(whitedb_instance* pInstance, wg_query_arg* pArgs, wg_int iArgc, wg_query* pStorage)
+{
+	if (pInstance->pQueryArena)
+		return wg_make_query_arena(pInstance->pWhiteDb, NULL, 0, pArgs, iArgc, 0, pInstance->pQueryArena, pStorage);
+	return wg_make_query(pInstance->pWhiteDb, NULL, 0, pArgs, iArgc);
+}
+
+//---------------------------------------------------------
+static void whitedb_free_query(whitedb_instance* pInstance, wg_query* pQuery)
+{
+	wg_free_query(pInstance->pWhiteDb, pQuery);
+	if (pInstance->pQueryArena)
+		wg_reset_mpool(pInstance->pWhiteDb, pInstance->pQueryArena);
+}
+
 //---------------------------------------------------------
 static void calc_query_param(void* db, wg_query_arg* arg, lua_State* l, int iIndex )
 {
@@ -1071,6 +1523,7 @@ static int whitedb_query_t(lua_State *l) {
 		wg_int iQuery_size = 0;
 
 	wg_query_arg Query_arg_list[DWhiteDbMaxQuerySize];
+	wg_query Query_storage;
 	wg_query* Query = NULL;
 
 	lua_pushnil(l);
@@ -1084,7 +1537,7 @@ static int whitedb_query_t(lua_State *l) {
 		lua_pop(l, 1);
 	}
 
-	Query = wg_make_query( pInstance->pWhiteDb, NULL, 0, Query_arg_list, iQuery_size);
+	Query = whitedb_make_query( pInstance, Query_arg_list, iQuery_size, &Query_storage);
 	lua_newtable(l);
 	int counter = 1;
 	if (Query)
@@ -1106,13 +1559,14 @@ static int whitedb_query_t(lua_State *l) {
 			pRecord = wg_fetch(pInstance->pWhiteDb, Query);
 		}
 
-		wg_free_query( pInstance->pWhiteDb, Query );
+		whitedb_free_query( pInstance, Query );
 	}
 	return 1;
 }
 
 //---------------------------------------------------------
-// db, table
+// db, table [, profile]
+// with profile set, a stats function is returned after the iterator
 static int whitedb_query(lua_State *l) {
 
 	assert(lua_gettop(l) > 1 );
@@ -1138,13 +1592,26 @@ static int whitedb_query(lua_State *l) {
 		lua_pop(l, 1);
 	}
 
-	Query = wg_make_query( pInstance->pWhiteDb, NULL, 0, Query_arg_list, iQuery_size);
+	int bProfile = lua_toboolean(l, 3);
+	if (bProfile)
+		Query = wg_make_query_profile( pInstance->pWhiteDb, NULL, 0, Query_arg_list, iQuery_size, 0);
+	else
+		Query = wg_make_query( pInstance->pWhiteDb, NULL, 0, Query_arg_list, iQuery_size);
 	if (Query)
 	{
 		whitedb_query_iterator* pQuery_iterator = (whitedb_query_iterator*)lua_newuserdata(l, sizeof(whitedb_query_iterator));
 		pQuery_iterator->pQuery = Query;
 		pQuery_iterator->pWhiteDb = pInstance->pWhiteDb;
 		pQuery_iterator->whitedb_record_metatable_ref = pInstance->whitedb_record_metatable_ref;
+		memset(&pQuery_iterator->Stats, 0, sizeof(wg_query_stats));
+		if (bProfile)
+		{
+			lua_pushvalue(l, -1);
+			lua_pushcclosure(l, whitedb_query_record, 1);
+			lua_insert(l, -2);
+			lua_pushcclosure(l, whitedb_query_stats, 1);
+			return 2;
+		}
 		lua_pushcclosure(l, whitedb_query_record, 1);
 		return 1;
 	}
@@ -1185,6 +1652,7 @@ static int whitedb_query_sum_t(lua_State *l)
 
 	wg_int iQuery_size = 0;
 	wg_query_arg Query_arg_list[DWhiteDbMaxQuerySize];
+	wg_query Query_storage;
 	wg_query* Query = NULL;
 
 	int iRecordCount = 0;
@@ -1209,7 +1677,7 @@ static int whitedb_query_sum_t(lua_State *l)
 	}
 
 	void* pRecord = NULL;
-	Query = wg_make_query( pInstance->pWhiteDb, NULL, 0, Query_arg_list, iQuery_size);
+	Query = whitedb_make_query( pInstance, Query_arg_list, iQuery_size, &Query_storage);
 	lua_newtable(l);
 	if (Query)
 	{
@@ -1231,7 +1699,7 @@ static int whitedb_query_sum_t(lua_State *l)
 			lua_settable(l, -3);
 			pRecord = wg_fetch(pInstance->pWhiteDb, Query );
 		}
-		wg_free_query( pInstance->pWhiteDb, Query );
+		whitedb_free_query( pInstance, Query );
 	}
 	return 1;
 }
@@ -1254,12 +1722,9 @@ static int whitedb_query_count_sum(lua_State *l) {
 
 	wg_int iQuery_size = 0;
 	wg_query_arg Query_arg_list[DWhiteDbMaxQuerySize];
-	wg_query* Query = NULL;
 
-	int iRecordCount = 0;
 	int iSumField    = lua_tointeger(l,3);
 	double dSumValue = 0;
-	double dSumLimit = 0;
 
 	assert( iSumField > 0 );
 	iSumField--;
@@ -1274,24 +1739,10 @@ static int whitedb_query_count_sum(lua_State *l) {
 		}
 		lua_pop(l, 1);
 	}
-	void* pRecord = NULL;
-	Query = wg_make_query( pInstance->pWhiteDb, NULL, 0, Query_arg_list, iQuery_size);
-	if (Query)
-	{
-		pRecord = wg_fetch(pInstance->pWhiteDb, Query );
-		while ( pRecord )
-		{
-			iRecordCount++;
-			wg_int iFieldType = wg_get_field_type(pInstance->pWhiteDb, pRecord, iSumField);
-			if ( iFieldType == WG_INTTYPE)
-				dSumValue += wg_decode_int( pInstance->pWhiteDb, wg_get_field( pInstance->pWhiteDb, pRecord, iSumField ));
-			else if ( iFieldType == WG_DOUBLETYPE)
-				dSumValue += wg_decode_double( pInstance->pWhiteDb, wg_get_field( pInstance->pWhiteDb, pRecord, iSumField ));
-			pRecord = wg_fetch(pInstance->pWhiteDb, Query );
-		}
-		wg_free_query( pInstance->pWhiteDb, Query );
-	}
-	lua_pushinteger( l , iRecordCount );
+
+	// summed from a covering index without touching the records when possible
+	wg_int iRecordCount = wg_query_sum( pInstance->pWhiteDb, NULL, 0, Query_arg_list, iQuery_size, iSumField, &dSumValue );
+	lua_pushinteger( l , iRecordCount < 0 ? 0 : iRecordCount );
 	lua_pushnumber( l , dSumValue );
 	return 2;
 }
@@ -1312,9 +1763,39 @@ static int whitedb_query_count(lua_State *l) {
 
 	wg_int iQuery_size = 0;
 	wg_query_arg Query_arg_list[DWhiteDbMaxQuerySize];
-	wg_query* Query = NULL;
 
-	int iRecordCount = 0;
+	lua_pushnil(l);
+	while (lua_next(l, 2) != 0)
+	{
+		if ( lua_type(l, -1) == LUA_TTABLE )
+		{
+			calc_query_param(pInstance->pWhiteDb, &Query_arg_list[iQuery_size], l, lua_gettop(l));
+			iQuery_size++;
+		}
+		lua_pop(l, 1);
+	}
+
+	// counted from the index without fetching when possible
+	wg_int iRecordCount = wg_query_count( pInstance->pWhiteDb, NULL, 0, Query_arg_list, iQuery_size );
+	lua_pushinteger( l , iRecordCount < 0 ? 0 : iRecordCount );
+	return 1;
+}
+
+//---------------------------------------------------------
+// db, table, offset, limit
+// returns a table of at most limit records, starting after the first
+// offset matches (0-based offset, limit 0 means no limit)
+static int whitedb_query_page(lua_State *l) {
+
+	assert(lua_gettop(l) > 1 );
+	if (lua_type(l, 2) != LUA_TTABLE)
+		return 0;
+
+	whitedb_instance* pInstance = check_instance(l, 1);
+	INSTANCE_EXIT_NIL(pInstance)
+
+	wg_int iQuery_size = 0;
+	wg_query_arg Query_arg_list[DWhiteDbMaxQuerySize];
 
 	lua_pushnil(l);
 	while (lua_next(l, 2) != 0)
@@ -1326,23 +1807,112 @@ static int whitedb_query_count(lua_State *l) {
 		}
 		lua_pop(l, 1);
 	}
-	void* pRecord = NULL;
-	Query = wg_make_query( pInstance->pWhiteDb, NULL, 0, Query_arg_list, iQuery_size);
+
+	lua_Integer iOffset = lua_tointeger(l, 3);
+	lua_Integer iLimit  = lua_tointeger(l, 4);
+	if (iOffset < 0)
+		iOffset = 0;
+	if (iLimit < 0)
+		iLimit = 0;
+
+	wg_query* Query = wg_make_query_page( pInstance->pWhiteDb, NULL, 0, Query_arg_list, iQuery_size, (wg_uint)iOffset, (wg_uint)iLimit);
+	lua_newtable(l);
+	int counter = 1;
 	if (Query)
 	{
-		pRecord = wg_fetch(pInstance->pWhiteDb, Query );
+		void* pRecord = wg_fetch(pInstance->pWhiteDb, Query);
 		while ( pRecord )
 		{
-			iRecordCount++;
-			pRecord = wg_fetch(pInstance->pWhiteDb, Query );
+			whitedb_record_to_userdata(pInstance->whitedb_record_metatable_ref, pInstance->pWhiteDb, pRecord, 0, l);
+			lua_rawseti(l, -2, counter);
+			counter++;
+			pRecord = wg_fetch(pInstance->pWhiteDb, Query);
 		}
 		wg_free_query( pInstance->pWhiteDb, Query );
 	}
-
-	lua_pushinteger( l , iRecordCount );
 	return 1;
 }
 
+//---------------------------------------------------------
+// db, table, field, limit [, token]
+// returns a table of at most limit records ordered by field (which needs
+// an index), starting after the token, and the token of this page
+static int whitedb_query_after(lua_State *l) {
+
+	assert(lua_gettop(l) > 2 );
+	if (lua_type(l, 2) != LUA_TTABLE)
+		return 0;
+
+	whitedb_instance* pInstance = check_instance(l, 1);
+	INSTANCE_EXIT_NIL(pInstance)
+
+	wg_int iQuery_size = 0;
+	wg_query_arg Query_arg_list[DWhiteDbMaxQuerySize];
+
+	lua_pushnil(l);
+	while (lua_next(l, 2) != 0)
+	{
+		if ( lua_type(l, -1) == LUA_TTABLE )
+		{
+			calc_query_param(pInstance->pWhiteDb, &Query_arg_list[iQuery_size], l, lua_gettop(l));
+			iQuery_size++;
+		}
+		lua_pop(l, 1);
+	}
+
+	lua_Integer iLimit = lua_tointeger(l, 4);
+	if (iLimit < 0)
+		iLimit = 0;
+
+	whitedb_query_token* pToken = NULL;
+	if (lua_type(l, 5) == LUA_TUSERDATA)
+	{
+		pToken = (whitedb_query_token*)luaL_checkudata(l, 5, WHITEDB_TOKEN_METATABLE);
+		lua_pushvalue(l, 5);
+	}
+	else
+	{
+		int iFieldIndex = lua_tointeger(l, 3);
+		iFieldIndex--;
+		assert( iFieldIndex >= 0);
+		pToken = (whitedb_query_token*)lua_newuserdata(l, sizeof(whitedb_query_token));
+		pToken->pWhiteDb = pInstance->pWhiteDb;
+		wg_init_query_token(pInstance->pWhiteDb, &pToken->Token, iFieldIndex);
+		luaL_getmetatable(l, WHITEDB_TOKEN_METATABLE);
+		lua_setmetatable(l, -2);
+	}
+
+	wg_query* Query = wg_make_query_after( pInstance->pWhiteDb, NULL, 0, Query_arg_list, iQuery_size, &pToken->Token, (wg_uint)iLimit);
+	if (!Query)
+		return 0;
+
+	lua_newtable(l);
+	int counter = 1;
+	void* pRecord = wg_fetch(pInstance->pWhiteDb, Query);
+	while ( pRecord )
+	{
+		whitedb_record_to_userdata(pInstance->whitedb_record_metatable_ref, pInstance->pWhiteDb, pRecord, 0, l);
+		lua_rawseti(l, -2, counter);
+		counter++;
+		pRecord = wg_fetch(pInstance->pWhiteDb, Query);
+	}
+	wg_free_query( pInstance->pWhiteDb, Query );
+	lua_insert(l, -2);
+	return 2;
+}
+
+//---------------------------------------------------------
+static int whitedb_query_token_gc(lua_State *l)
+{
+	whitedb_query_token* pToken = (whitedb_query_token*)luaL_checkudata(l, 1, WHITEDB_TOKEN_METATABLE);
+	if (pToken && pToken->pWhiteDb)
+	{
+		wg_free_query_token(pToken->pWhiteDb, &pToken->Token);
+		pToken->pWhiteDb = NULL;
+	}
+	return 0;
+}
+
 //---------------------------------------------------------
 // 
 static int whitedb_index_drop(lua_State *l) {
@@ -1362,6 +1932,12 @@ static int whitedb_gc(lua_State *l)
 
 	if (pInstance)
 	{
+		if (pInstance->pQueryArena)
+		{
+			wg_free_mpool(pInstance->pWhiteDb, pInstance->pQueryArena);
+			pInstance->pQueryArena = NULL;
+		}
+
 		if ( pInstance->iMode == 3 ) // existing
 			wg_detach_database(pInstance->pWhiteDb);
 		else if (pInstance->iMode == 2) // local db
@@ -1374,6 +1950,7 @@ static int whitedb_gc(lua_State *l)
 			wg_detach_database( pInstance->pWhiteDb);
 			wg_delete_database(pInstance->sName);
 		}
+		pInstance->pWhiteDb = NULL;
 	}
 	return 0;
 }
@@ -1440,6 +2017,7 @@ static int whitedb_attach(lua_State *l) {
 		pInstance->iLockReadTr = 0;
 		pInstance->iLockWrite = 0;
 		pInstance->iLockWriteTr;
+		pInstance->pQueryArena = wg_create_mpool(pDb, DWhiteDbQueryArenaSize);
 		strcpy_s(pInstance->sName, DWhiteDbNameSize, sName);
 
 		luaL_getmetatable(l, WHITEDB_RECORD_METATABLE);
@@ -1930,6 +2508,604 @@ static int whitedb_record_field_get(lua_State *l)
 	return wg_value_to_lua(l, iFieldType, pRecord->pWhiteDb, pField, pRecord->whitedb_record_metatable_ref);
 }
 
+//---------------------------------------------------------
+// db, table
+static int whitedb_explain(lua_State *l) {
+
+	assert(lua_gettop(l) > 1 );
+	if (lua_type(l, 2) != LUA_TTABLE || lua_objlen(l, 2) == 0)
+		return 0;
+
+	whitedb_instance* pInstance = check_instance(l, 1);
+	INSTANCE_EXIT_NIL(pInstance)
+
+	wg_int iQuery_size = 0;
+	wg_query_arg Query_arg_list[DWhiteDbMaxQuerySize];
+	wg_query_plan Plan;
+
+	lua_pushnil(l);
+	while (lua_next(l, 2) != 0)
+	{
+		if ( lua_type(l, -1) == LUA_TTABLE )
+		{
+			calc_query_param(pInstance->pWhiteDb, &Query_arg_list[iQuery_size], l, lua_gettop(l));
+			iQuery_size++;
+		}
+		lua_pop(l, 1);
+	}
+
+	if ( wg_explain_query( pInstance->pWhiteDb, NULL, 0, Query_arg_list, iQuery_size, &Plan) != 0 )
+	{
+		lua_pushnil(l);
+		return 1;
+	}
+
+	lua_newtable(l);
+	lua_pushstring(l, Plan.qtype == WG_QTYPE_TTREE ? "ttree" :
+		(Plan.qtype == WG_QTYPE_BTREE ? "btree" :
+		(Plan.qtype == WG_QTYPE_TRIGRAM ? "trigram" :
+		(Plan.qtype == WG_QTYPE_SPATIAL ? "spatial" : "scan"))));
+	lua_setfield(l, -2, "access");
+	lua_pushinteger(l, Plan.index_id);
+	lua_setfield(l, -2, "index_id");
+	if (Plan.column >= 0)
+	{
+		lua_pushinteger(l, Plan.column + 1);
+		lua_setfield(l, -2, "column");
+	}
+	if (Plan.prefix > 0)
+	{
+		lua_pushinteger(l, Plan.prefix);
+		lua_setfield(l, -2, "prefix");
+	}
+	if (Plan.start_bound != WG_ILLEGAL)
+	{
+		wg_value_to_lua(l, wg_get_encoded_type(pInstance->pWhiteDb, Plan.start_bound), pInstance->pWhiteDb, Plan.start_bound, pInstance->whitedb_record_metatable_ref);
+		lua_setfield(l, -2, "start");
+		lua_pushboolean(l, Plan.start_inclusive);
+		lua_setfield(l, -2, "start_inclusive");
+	}
+	if (Plan.end_bound != WG_ILLEGAL)
+	{
+		wg_value_to_lua(l, wg_get_encoded_type(pInstance->pWhiteDb, Plan.end_bound), pInstance->pWhiteDb, Plan.end_bound, pInstance->whitedb_record_metatable_ref);
+		lua_setfield(l, -2, "end");
+		lua_pushboolean(l, Plan.end_inclusive);
+		lua_setfield(l, -2, "end_inclusive");
+	}
+	lua_pushboolean(l, Plan.empty);
+	lua_setfield(l, -2, "empty");
+
+	lua_newtable(l);
+	for ( wg_int iIndex = 0; iIndex < Plan.argc; iIndex++ )
+	{
+		wg_query_arg* pArg = &Plan.arglist[iIndex];
+		lua_newtable(l);
+		lua_pushinteger(l, pArg->column + 1);
+		lua_setfield(l, -2, "column");
+		lua_pushstring(l, cond_to_str(pArg->cond));
+		lua_setfield(l, -2, "cond");
+		wg_value_to_lua(l, wg_get_encoded_type(pInstance->pWhiteDb, pArg->value), pInstance->pWhiteDb, pArg->value, pInstance->whitedb_record_metatable_ref);
+		lua_setfield(l, -2, "value");
+		lua_rawseti(l, -2, iIndex + 1);
+	}
+	lua_setfield(l, -2, "residual");
+
+	wg_free_query_plan(pInstance->pWhiteDb, &Plan);
+	return 1;
+}
+
+//---------------------------------------------------------
+typedef struct whitedb_join_iterator
+{
+	whitedb_instance* pInstance;
+	void*    pWhiteDb;
+	wg_join* pJoin;
+	int      iOuterColumns[DWhiteDbMaxQuerySize];
+	int      iOuterCount;
+	int      iInnerColumns[DWhiteDbMaxQuerySize];
+	int      iInnerCount;
+	int      bProject;
+	int      whitedb_record_metatable_ref;
+} whitedb_join_iterator;
+
+//---------------------------------------------------------
+static int push_projected_fields(lua_State *l, whitedb_join_iterator* pIterator, void* pRecord, int* pColumns, int iCount, int iPos)
+{
+	for ( int iIndex = 0; iIndex < iCount; iIndex++ )
+	{
+		if ( pColumns[iIndex] < wg_get_record_len(pIterator->pWhiteDb, pRecord) )
+		{
+			wg_int iField = wg_get_field(pIterator->pWhiteDb, pRecord, pColumns[iIndex]);
+			wg_value_to_lua(l, wg_get_encoded_type(pIterator->pWhiteDb, iField), pIterator->pWhiteDb, iField, pIterator->whitedb_record_metatable_ref);
+		}
+		else
+			lua_pushnil(l);
+		lua_rawseti(l, -2, iPos++);
+	}
+	return iPos;
+}
+
+//---------------------------------------------------------
+static int whitedb_join_record(lua_State *l)
+{
+	whitedb_join_iterator* pIterator = (whitedb_join_iterator*)lua_touserdata(l, lua_upvalueindex(1));
+	if (!pIterator->pJoin)
+		return 0;
+
+	void* pOuter = NULL;
+	void* pInner = NULL;
+	if ( wg_fetch_join(pIterator->pWhiteDb, pIterator->pJoin, &pOuter, &pInner) != 1 )
+	{
+		wg_free_join(pIterator->pWhiteDb, pIterator->pJoin);
+		pIterator->pJoin = NULL;
+		return 0;
+	}
+
+	if (pIterator->bProject)
+	{
+		lua_newtable(l);
+		int iPos = push_projected_fields(l, pIterator, pOuter, pIterator->iOuterColumns, pIterator->iOuterCount, 1);
+		push_projected_fields(l, pIterator, pInner, pIterator->iInnerColumns, pIterator->iInnerCount, iPos);
+		return 1;
+	}
+
+	whitedb_record_to_userdata(pIterator->whitedb_record_metatable_ref, pIterator->pWhiteDb, pOuter, 0, l);
+	whitedb_record_to_userdata(pIterator->whitedb_record_metatable_ref, pIterator->pWhiteDb, pInner, 0, l);
+	return 2;
+}
+
+//---------------------------------------------------------
+static int read_query_args(void* db, lua_State *l, int iIndex, wg_query_arg* pArgs)
+{
+	int iCount = 0;
+	if (lua_type(l, iIndex) != LUA_TTABLE)
+		return 0;
+
+	lua_pushnil(l);
+	while (lua_next(l, iIndex) != 0)
+	{
+		if ( lua_type(l, -1) == LUA_TTABLE && iCount < DWhiteDbMaxQuerySize )
+		{
+			calc_query_param(db, &pArgs[iCount], l, lua_gettop(l));
+			iCount++;
+		}
+		lua_pop(l, 1);
+	}
+	return iCount;
+}
+
+//---------------------------------------------------------
+static int read_columns(lua_State *l, int iIndex, const char* sName, int* pColumns)
+{
+	int iCount = 0;
+	lua_getfield(l, iIndex, sName);
+	if (lua_type(l, -1) == LUA_TTABLE)
+	{
+		int iSize = (int)lua_objlen(l, -1);
+		for ( int iPos = 1; iPos <= iSize && iCount < DWhiteDbMaxQuerySize; iPos++ )
+		{
+			lua_rawgeti(l, -1, iPos);
+			pColumns[iCount++] = (int)lua_tointeger(l, -1) - 1;
+			lua_pop(l, 1);
+		}
+	}
+	lua_pop(l, 1);
+	return iCount;
+}
+
+//---------------------------------------------------------
+// db, { field, field, ... }, query - T-tree that only holds the records
+// matching the query; used by queries whose conditions imply it
+static int whitedb_index_partial(lua_State *l) {
+	assert(lua_gettop(l) > 2);
+	if (lua_type(l, 2) != LUA_TTABLE || lua_type(l, 3) != LUA_TTABLE)
+	{
+		lua_pushboolean(l, 0);
+		return 1;
+	}
+
+	whitedb_instance* pInstance = check_instance(l, 1);
+	INSTANCE_EXIT_NIL(pInstance)
+	wg_int Columns[DWhiteDbMaxMultiIndexSize];
+	wg_int iColumn_count = (wg_int)lua_objlen(l, 2);
+	if (iColumn_count < 1 || iColumn_count > DWhiteDbMaxMultiIndexSize)
+	{
+		lua_pushboolean(l, 0);
+		return 1;
+	}
+
+	for (wg_int i = 0; i < iColumn_count; i++)
+	{
+		lua_rawgeti(l, 2, (int)i + 1);
+		Columns[i] = lua_tointeger(l, -1) - 1;
+		lua_pop(l, 1);
+		if (Columns[i] < 0)
+		{
+			lua_pushboolean(l, 0);
+			return 1;
+		}
+	}
+
+	wg_query_arg Predicate_arg_list[DWhiteDbMaxQuerySize];
+	int iPredicate_size = read_query_args(pInstance->pWhiteDb, l, 3, Predicate_arg_list);
+	lua_pushboolean(l, wg_create_partial_index(pInstance->pWhiteDb, Columns, iColumn_count, WG_INDEX_TYPE_TTREE, Predicate_arg_list, iPredicate_size) == 0 ? 1 : 0 );
+
+	// the index keeps its own copies of the predicate values
+	for ( int iPos = 0; iPos < iPredicate_size; iPos++ )
+		wg_free_encoded(pInstance->pWhiteDb, Predicate_arg_list[iPos].value);
+	return 1;
+}
+
+//---------------------------------------------------------
+// db, outer query, outer column, inner query, inner column [, projection]
+// returns an iterator over (outer record, inner record) pairs with equal
+// join column values; with projection { outer = { cols }, inner = { cols } }
+// each step returns one table with the outer columns followed by the inner ones
+static int whitedb_join(lua_State *l) {
+
+	assert(lua_gettop(l) > 4 );
+
+	whitedb_instance* pInstance = check_instance(l, 1);
+	INSTANCE_EXIT_NIL(pInstance)
+
+	wg_query_arg Outer_arg_list[DWhiteDbMaxQuerySize];
+	wg_query_arg Inner_arg_list[DWhiteDbMaxQuerySize];
+
+	int iOuter_size = read_query_args(pInstance->pWhiteDb, l, 2, Outer_arg_list);
+	int iOuter_column = (int)luaL_checkinteger(l, 3) - 1;
+	int iInner_size = read_query_args(pInstance->pWhiteDb, l, 4, Inner_arg_list);
+	int iInner_column = (int)luaL_checkinteger(l, 5) - 1;
+
+	wg_join* pJoin = wg_make_join(pInstance->pWhiteDb, Outer_arg_list, iOuter_size, iOuter_column, Inner_arg_list, iInner_size, iInner_column);
+	if (!pJoin)
+		return 0;
+
+	whitedb_join_iterator* pJoin_iterator = (whitedb_join_iterator*)lua_newuserdata(l, sizeof(whitedb_join_iterator));
+	pJoin_iterator->pInstance = pInstance;
+	pJoin_iterator->pWhiteDb = pInstance->pWhiteDb;
+	pJoin_iterator->pJoin = pJoin;
+	pJoin_iterator->whitedb_record_metatable_ref = pInstance->whitedb_record_metatable_ref;
+	pJoin_iterator->bProject = lua_type(l, 6) == LUA_TTABLE;
+	pJoin_iterator->iOuterCount = 0;
+	pJoin_iterator->iInnerCount = 0;
+	if (pJoin_iterator->bProject)
+	{
+		pJoin_iterator->iOuterCount = read_columns(l, 6, "outer", pJoin_iterator->iOuterColumns);
+		pJoin_iterator->iInnerCount = read_columns(l, 6, "inner", pJoin_iterator->iInnerColumns);
+	}
+	// a loop left with break leaves the join to the collector
+	luaL_getmetatable(l, WHITEDB_JOIN_METATABLE);
+	lua_setmetatable(l, -2);
+	// pin the db so it is not collected before the join
+	lua_newtable(l);
+	lua_pushvalue(l, 1);
+	lua_rawseti(l, -2, 1);
+	lua_setfenv(l, -2);
+
+	lua_pushcclosure(l, whitedb_join_record, 1);
+	return 1;
+}
+
+//---------------------------------------------------------
+static int whitedb_join_gc(lua_State *l)
+{
+	whitedb_join_iterator* pIterator = (whitedb_join_iterator*)luaL_checkudata(l, 1, WHITEDB_JOIN_METATABLE);
+	// the db is pinned, it can only be closed already if both are
+	// collected in the same cycle
+	if (pIterator && pIterator->pJoin && pIterator->pInstance->pWhiteDb)
+		wg_free_join(pIterator->pWhiteDb, pIterator->pJoin);
+	if (pIterator)
+		pIterator->pJoin = NULL;
+	return 0;
+}
+
+//---------------------------------------------------------
+// db, table, { field, field, ... }
+// returns a table of rows, each a table of the listed fields; fields
+// included in a covering index are read from the index, not the records
+static int whitedb_query_columns(lua_State *l) {
+
+	assert(lua_gettop(l) > 2 );
+	if (lua_type(l, 3) != LUA_TTABLE)
+	{
+		lua_pushnil(l);
+		return 1;
+	}
+
+	whitedb_instance* pInstance = check_instance(l, 1);
+	INSTANCE_EXIT_NIL(pInstance)
+
+	wg_query_arg Query_arg_list[DWhiteDbMaxQuerySize];
+	wg_int Columns[DWhiteDbMaxQuerySize];
+	wg_int Values[DWhiteDbMaxQuerySize];
+	wg_int iColumn_count = 0;
+
+	int iSize = (int)lua_objlen(l, 3);
+	for ( int iPos = 1; iPos <= iSize && iColumn_count < DWhiteDbMaxQuerySize; iPos++ )
+	{
+		lua_rawgeti(l, 3, iPos);
+		Columns[iColumn_count] = (wg_int)lua_tointeger(l, -1) - 1;
+		lua_pop(l, 1);
+		if (Columns[iColumn_count++] < 0)
+		{
+			lua_pushnil(l);
+			return 1;
+		}
+	}
+
+	// the query walks the index as rows are fetched, so nothing may
+	// change the database before it is freed
+	int iQuery_size = read_query_args(pInstance->pWhiteDb, l, 2, Query_arg_list);
+	wg_query* Query = wg_make_query_cursor(pInstance->pWhiteDb, NULL, 0, Query_arg_list, iQuery_size);
+	lua_newtable(l);
+	if (Query)
+	{
+		int iRow = 1;
+		while ( wg_fetch_columns(pInstance->pWhiteDb, Query, Columns, iColumn_count, Values) )
+		{
+			lua_newtable(l);
+			for ( wg_int i = 0; i < iColumn_count; i++ )
+			{
+				wg_value_to_lua(l, (int)wg_get_encoded_type(pInstance->pWhiteDb, Values[i]), pInstance->pWhiteDb, Values[i], pInstance->whitedb_record_metatable_ref);
+				lua_rawseti(l, -2, (int)i + 1);
+			}
+			lua_rawseti(l, -2, iRow++);
+		}
+		wg_free_query(pInstance->pWhiteDb, Query);
+	}
+	return 1;
+}
+
+//---------------------------------------------------------
+// db, group column, { sum columns } [, filter query]
+// creates a materialized aggregate view and returns its id; the view is
+// kept up to date as records change, so reading it costs O(groups)
+static int whitedb_aggregate_create(lua_State *l) {
+
+	assert(lua_gettop(l) > 1 );
+
+	whitedb_instance* pInstance = check_instance(l, 1);
+	INSTANCE_EXIT_NIL(pInstance)
+
+	wg_int iGroup_column = (wg_int)luaL_checkinteger(l, 2) - 1;
+	wg_int Columns[DWhiteDbMaxQuerySize];
+	wg_int iColumn_count = 0;
+	wg_query_arg Filter_arg_list[DWhiteDbMaxQuerySize];
+
+	if (lua_type(l, 3) == LUA_TTABLE)
+	{
+		int iSize = (int)lua_objlen(l, 3);
+		for ( int iPos = 1; iPos <= iSize && iColumn_count < DWhiteDbMaxQuerySize; iPos++ )
+		{
+			lua_rawgeti(l, 3, iPos);
+			Columns[iColumn_count++] = (wg_int)lua_tointeger(l, -1) - 1;
+			lua_pop(l, 1);
+		}
+	}
+
+	int iFilter_size = read_query_args(pInstance->pWhiteDb, l, 4, Filter_arg_list);
+	wg_int iView = wg_create_aggr_view(pInstance->pWhiteDb, iGroup_column, Columns, iColumn_count, Filter_arg_list, iFilter_size);
+
+	// the view keeps its own copies of the filter values
+	for ( int iPos = 0; iPos < iFilter_size; iPos++ )
+		wg_free_encoded(pInstance->pWhiteDb, Filter_arg_list[iPos].value);
+
+	if (iView < 0)
+	{
+		lua_pushnil(l);
+		return 1;
+	}
+	lua_pushinteger(l, iView);
+	return 1;
+}
+
+//---------------------------------------------------------
+static void aggregate_group_to_lua(lua_State *l, whitedb_instance* pInstance, void* pGroup, wg_int iColumn_count)
+{
+	void* pDb = pInstance->pWhiteDb;
+	wg_int iValue = wg_aggr_group_value(pDb, pGroup);
+
+	lua_newtable(l);
+	wg_value_to_lua(l, wg_get_encoded_type(pDb, iValue), pDb, iValue, pInstance->whitedb_record_metatable_ref);
+	lua_setfield(l, -2, "value");
+	lua_pushinteger(l, wg_aggr_group_count(pDb, pGroup));
+	lua_setfield(l, -2, "count");
+	lua_newtable(l);
+	for ( wg_int iPos = 0; iPos < iColumn_count; iPos++ )
+	{
+		lua_pushnumber(l, wg_aggr_group_sum(pDb, pGroup, iPos));
+		lua_rawseti(l, -2, (int)iPos + 1);
+	}
+	lua_setfield(l, -2, "sum");
+}
+
+//---------------------------------------------------------
+// db, view [, group value]
+// returns an array of { value =, count =, sum = { ... } } tables, one per
+// group, or only the table of the given group value (nil if it is empty)
+static int whitedb_aggregate(lua_State *l) {
+
+	assert(lua_gettop(l) > 1 );
+
+	whitedb_instance* pInstance = check_instance(l, 1);
+	INSTANCE_EXIT_NIL(pInstance)
+
+	wg_int iView = (wg_int)luaL_checkinteger(l, 2);
+	wg_int iColumn_count = wg_aggr_view_columns(pInstance->pWhiteDb, iView);
+
+	if (lua_gettop(l) > 2)
+	{
+		wg_int iValue = lua_value_to_wg(pInstance->pWhiteDb, l, 3);
+		void* pGroup = wg_aggr_find_group(pInstance->pWhiteDb, iView, iValue);
+		wg_free_encoded(pInstance->pWhiteDb, iValue);
+		if (!pGroup)
+		{
+			lua_pushnil(l);
+			return 1;
+		}
+		aggregate_group_to_lua(l, pInstance, pGroup, iColumn_count);
+		return 1;
+	}
+
+	int iCount = 0;
+	lua_newtable(l);
+	void* pGroup = wg_aggr_first_group(pInstance->pWhiteDb, iView);
+	while (pGroup)
+	{
+		aggregate_group_to_lua(l, pInstance, pGroup, iColumn_count);
+		lua_rawseti(l, -2, ++iCount);
+		pGroup = wg_aggr_next_group(pInstance->pWhiteDb, iView, pGroup);
+	}
+	return 1;
+}
+
+//---------------------------------------------------------
+static int whitedb_aggregate_drop(lua_State *l) {
+	assert(lua_gettop(l) > 1);
+	whitedb_instance* pInstance = check_instance(l, 1);
+	INSTANCE_EXIT_NIL(pInstance)
+	lua_pushboolean( l, wg_drop_aggr_view(pInstance->pWhiteDb, lua_tointeger(l, 2) ) == 0 ? 1 : 0 );
+	return 1;
+}
+
+//---------------------------------------------------------
+// db [, filter]
+// subscribes to the changes of the records passing the filter and returns
+// the subscription, nil on error or if the script holds a read lock
+static int whitedb_subscribe(lua_State *l) {
+
+	assert(lua_gettop(l) > 0 );
+
+	whitedb_instance* pInstance = check_instance(l, 1);
+	INSTANCE_EXIT_NIL(pInstance)
+
+	wg_query_arg Filter_arg_list[DWhiteDbMaxQuerySize];
+	int iFilter_size = read_query_args(pInstance->pWhiteDb, l, 2, Filter_arg_list);
+	void* pSubscription = NULL;
+	wg_int iLock = 0;
+	if ( pInstance->iLockWrite == 0 && pInstance->iLockRead == 0 )
+		iLock = wg_start_write(pInstance->pWhiteDb);
+	if ( iLock || pInstance->iLockWrite )
+		pSubscription = wg_subscribe_changes(pInstance->pWhiteDb, Filter_arg_list, iFilter_size);
+	if ( iLock )
+		wg_end_write(pInstance->pWhiteDb, iLock);
+
+	// the subscription keeps its own copies of the filter values
+	for ( int iPos = 0; iPos < iFilter_size; iPos++ )
+		wg_free_encoded(pInstance->pWhiteDb, Filter_arg_list[iPos].value);
+
+	if (!pSubscription)
+	{
+		lua_pushnil(l);
+		return 1;
+	}
+
+	whitedb_subscription* pSub = (whitedb_subscription*)lua_newuserdata(l, sizeof(whitedb_subscription));
+	pSub->pInstance = pInstance;
+	pSub->pSubscription = pSubscription;
+	luaL_getmetatable(l, WHITEDB_SUBSCRIPTION_METATABLE);
+	lua_setmetatable(l, -2);
+	// pin the db so it is not collected before the subscription
+	lua_newtable(l);
+	lua_pushvalue(l, 1);
+	lua_rawseti(l, -2, 1);
+	lua_setfenv(l, -2);
+	return 1;
+}
+
+//---------------------------------------------------------
+// cancels a subscription, taking the write lock unless it is held;
+// fails if the script holds a read lock
+static int subscription_cancel(whitedb_subscription* pSub)
+{
+	whitedb_instance* pInstance = pSub->pInstance;
+	wg_int iLock = 0;
+	int iResult = -1;
+
+	if ( pInstance->iLockRead )
+		return -1;
+	if ( pInstance->iLockWrite == 0 )
+	{
+		iLock = wg_start_write(pInstance->pWhiteDb);
+		if ( !iLock )
+			return -1;
+	}
+	iResult = (int)wg_unsubscribe_changes(pInstance->pWhiteDb, pSub->pSubscription);
+	pSub->pSubscription = NULL;
+	if ( iLock )
+		wg_end_write(pInstance->pWhiteDb, iLock);
+	return iResult;
+}
+
+//---------------------------------------------------------
+// db, subscription [, timeout ms (default 0, negative waits forever)]
+// returns an array of { seq =, op = 'create' | 'set' | 'delete', column =,
+// record = } tables; column is nil for whole records and record is nil
+// for deleted ones
+static int whitedb_changes(lua_State *l) {
+
+	assert(lua_gettop(l) > 1 );
+
+	whitedb_instance* pInstance = check_instance(l, 1);
+	INSTANCE_EXIT_NIL(pInstance)
+
+	whitedb_subscription* pSub = (whitedb_subscription*)luaL_checkudata(l, 2, WHITEDB_SUBSCRIPTION_METATABLE);
+	if (!pSub->pSubscription)
+		return 0;
+
+	wg_change Changes[DWhiteDbMaxChanges];
+	wg_int iCount = wg_wait_changes(pInstance->pWhiteDb, pSub->pSubscription, Changes, DWhiteDbMaxChanges, (wg_int)lua_tointeger(l, 3));
+	if (iCount < 0)
+		return 0;
+
+	lua_newtable(l);
+	for ( wg_int iPos = 0; iPos < iCount; iPos++ )
+	{
+		wg_change* pChange = &Changes[iPos];
+		lua_newtable(l);
+		lua_pushinteger(l, pChange->seq);
+		lua_setfield(l, -2, "seq");
+		lua_pushstring(l, pChange->op == WG_CHANGE_CREATE ? "create" : (pChange->op == WG_CHANGE_SET ? "set" : "delete"));
+		lua_setfield(l, -2, "op");
+		if (pChange->column >= 0)
+		{
+			lua_pushinteger(l, pChange->column + 1);
+			lua_setfield(l, -2, "column");
+		}
+		if (pChange->op != WG_CHANGE_DELETE)
+		{
+			whitedb_record_to_userdata(pInstance->whitedb_record_metatable_ref, pInstance->pWhiteDb, pChange->record, 0, l);
+			lua_setfield(l, -2, "record");
+		}
+		lua_rawseti(l, -2, (int)iPos + 1);
+	}
+	return 1;
+}
+
+//---------------------------------------------------------
+static int whitedb_unsubscribe(lua_State *l) {
+	assert(lua_gettop(l) > 1);
+	whitedb_instance* pInstance = check_instance(l, 1);
+	INSTANCE_EXIT_NIL(pInstance)
+	whitedb_subscription* pSub = (whitedb_subscription*)luaL_checkudata(l, 2, WHITEDB_SUBSCRIPTION_METATABLE);
+	int iResult = pSub->pSubscription ? subscription_cancel(pSub) : -1;
+	lua_pushboolean( l, iResult == 0 ? 1 : 0 );
+	return 1;
+}
+
+//---------------------------------------------------------
+static int whitedb_subscription_gc(lua_State *l)
+{
+	whitedb_subscription* pSub = (whitedb_subscription*)luaL_checkudata(l, 1, WHITEDB_SUBSCRIPTION_METATABLE);
+	// the db is pinned, it can only be closed already if both are
+	// collected in the same cycle. Under a read lock of the script the
+	// slot is left to be reclaimed, as waiting for the write lock would
+	// stall.
+	if (pSub && pSub->pSubscription && pSub->pInstance->pWhiteDb && !pSub->pInstance->iLockRead)
+		subscription_cancel(pSub);
+	return 0;
+}
+
 //---------------------------------------------------------
 static const struct luaL_Reg lib_whitedb_record_meta[] =
 {
@@ -1953,6 +3129,27 @@ static const struct luaL_Reg lib_whitedb_record_meta[] =
 	{ NULL, NULL }
 };
 
+//---------------------------------------------------------
+static const struct luaL_Reg lib_whitedb_token_meta[] =
+{
+	{ "__gc",		whitedb_query_token_gc },
+	{ NULL, NULL }
+};
+
+//---------------------------------------------------------
+static const struct luaL_Reg lib_whitedb_subscription_meta[] =
+{
+	{ "__gc",		whitedb_subscription_gc },
+	{ NULL, NULL }
+};
+
+//---------------------------------------------------------
+static const struct luaL_Reg lib_whitedb_join_meta[] =
+{
+	{ "__gc",		whitedb_join_gc },
+	{ NULL, NULL }
+};
+
 //---------------------------------------------------------
 static const struct luaL_Reg lib_whitedb[] =
 {
@@ -1965,6 +3162,7 @@ static const struct luaL_Reg lib_whitedb_meta[] =
 {
 	{ "record",         whitedb_record_create },
 	{ "record_t",       whitedb_record_create_t },
+	{ "upsert",         whitedb_upsert },
 	{ "delete",         whitedb_record_delete2 },
 	{ "delete_first",   whitedb_record_delete_first },
 	{ "records",	    whitedb_records },
@@ -1974,6 +3172,8 @@ static const struct luaL_Reg lib_whitedb_meta[] =
 	{ "read_end",       whitedb_read_end   },
 	{ "write_start",    whitedb_write_start },
 	{ "write_end",      whitedb_write_end },
+	{ "bulk_begin",     whitedb_bulk_begin },
+	{ "bulk_end",       whitedb_bulk_end },
 	{ "log_start",      whitedb_log_start },
 	{ "log_stop",       whitedb_log_stop},
 	{ "log_replay",     whitedb_log_replay },
@@ -1984,13 +3184,34 @@ static const struct luaL_Reg lib_whitedb_meta[] =
 	{ "free_size",      whitedb_free_size },
 	{ "index_s",        whitedb_index_create },
 	{ "index_m",        whitedb_index_multi },
+	{ "index_c",        whitedb_index_composite },
+	{ "index_trigram",  whitedb_index_trigram },
+	{ "index_btree",    whitedb_index_btree },
+	{ "index_zonemap",  whitedb_index_zonemap },
+	{ "index_spatial",  whitedb_index_spatial },
+	{ "index_unique",   whitedb_index_unique },
+	{ "index_cover",    whitedb_index_cover },
+	{ "index_partial",  whitedb_index_partial },
+	{ "index_online",   whitedb_index_online },
+	{ "index_advice",   whitedb_index_advice },
 	{ "index_drop",     whitedb_index_drop },
 	{ "query",          whitedb_query },
 	{ "query_t",        whitedb_query_t },
 	{ "query_sum_t",    whitedb_query_sum_t },
 
 	{ "query_count",    whitedb_query_count },
+	{ "query_page",     whitedb_query_page },
+	{ "query_after",    whitedb_query_after },
 	{ "query_count_sum",whitedb_query_count_sum },
+	{ "query_columns",  whitedb_query_columns },
+	{ "explain",        whitedb_explain },
+	{ "join",           whitedb_join },
+	{ "aggregate_create", whitedb_aggregate_create },
+	{ "aggregate",      whitedb_aggregate },
+	{ "aggregate_drop", whitedb_aggregate_drop },
+	{ "subscribe",      whitedb_subscribe },
+	{ "changes",        whitedb_changes },
+	{ "unsubscribe",    whitedb_unsubscribe },
 	{ "count",          whitedb_count },
 	{ "clear",          whitedb_clear },
 	{ "print",          whitedb_print },
@@ -2033,10 +3254,40 @@ static int register_whitedb_record_meta(lua_State *l)
 	return 0;
 }
 
+//---------------------------------------------------------
+static int register_whitedb_token_meta(lua_State *l)
+{
+	luaL_newmetatable(l, WHITEDB_TOKEN_METATABLE);
+	luaL_register(l, NULL, lib_whitedb_token_meta);
+
+	return 0;
+}
+
+//---------------------------------------------------------
+static int register_whitedb_subscription_meta(lua_State *l)
+{
+	luaL_newmetatable(l, WHITEDB_SUBSCRIPTION_METATABLE);
+	luaL_register(l, NULL, lib_whitedb_subscription_meta);
+
+	return 0;
+}
+
+//---------------------------------------------------------
+static int register_whitedb_join_meta(lua_State *l)
+{
+	luaL_newmetatable(l, WHITEDB_JOIN_METATABLE);
+	luaL_register(l, NULL, lib_whitedb_join_meta);
+
+	return 0;
+}
+
 //---------------------------------------------------------
 WHITE_DB_EXPORT int luaopen_whitedb(lua_State *l)
 {
 	register_whitedb_record_meta(l);
+	register_whitedb_token_meta(l);
+	register_whitedb_subscription_meta(l);
+	register_whitedb_join_meta(l);
 	register_whitedb_meta(l);
 	return 0;
 }
\ No newline at end of file
@@ -163,6 +163,200 @@ for i = 1, #qtable do
 end
 
 print('\n')
+print( 'Query explain')
+print( '--------------------------------')
+local plan = db:explain( query_data )
+print(' access : ' .. plan.access .. ' index : ' .. plan.index_id .. ' residual : ' .. #plan.residual )
+
+local qiter, qstats = db:query( query_data, true )
+for rec in qiter do
+end
+local stats = qstats()
+print(' examined : ' .. stats.records_examined .. ' returned : ' .. stats.records_returned .. ' compares : ' .. stats.compare_calls )
+
+print('\n')
+print( 'Composite index')
+print( '--------------------------------')
+success = db:index_c( { 3, 2 } )
+print(' Success : ' .. tostring( success ) )
+local query_composite = {
+    { column = 3, cond = '=', value = 3 },
+    { column = 2, cond = '>=', value = 2 },
+}
+plan = db:explain( query_composite )
+print(' access : ' .. plan.access .. ' column : ' .. tostring( plan.column ) .. ' prefix : ' .. tostring( plan.prefix ) .. ' residual : ' .. #plan.residual )
+for rec in db:query( query_composite ) do
+    rec:print()
+    print('\n')
+end
+
+print( 'Query count and page')
+print( '--------------------------------')
+local query_range = {
+    { column = 3, cond = '>=', value = 2 },
+}
+print(' count : ' .. db:query_count( query_range ) )
+local page = db:query_page( query_range, 1, 2 )
+print(' page : ' .. #page )
+for i = 1, #page do
+    page[i]:print()
+    print('\n')
+end
+
+print( 'Query after token')
+print( '--------------------------------')
+local after_page, token = db:query_after( {}, 2, 2 )
+while after_page and #after_page > 0 do
+    print(' page : ' .. #after_page )
+    after_page, token = db:query_after( {}, 2, 2, token )
+end
+
+print( 'Trigram index')
+print( '--------------------------------')
+db:index_trigram( 1 )
+local query_contains = {
+    { column = 1, cond = 'contains', value = 'x2' },
+}
+print(' access : ' .. db:explain( query_contains ).access )
+print(' count : ' .. db:query_count( query_contains ) )
+
+print( 'B+tree index')
+print( '--------------------------------')
+db:index_btree( 4 )
+local query_btree = {
+    { column = 4, cond = '<=', value = 2 },
+}
+print(' access : ' .. db:explain( query_btree ).access )
+print(' count : ' .. db:query_count( query_btree ) )
+
+print( 'Substring query on indexed columns')
+print( '--------------------------------')
+local fruits = { 'apple', 'banana', 'cherry', 'grape', 'kiwi' }
+for i = 1, 20 do
+    local fruit_rec = db:record( 14 )
+    fruit_rec:set( 12, fruits[ i % 5 + 1 ] )
+    fruit_rec:set( 13, fruits[ i % 5 + 1 ] )
+    fruit_rec:set( 14, fruits[ i % 5 + 1 ] )
+end
+db:index_s( 12 )
+db:index_btree( 13 )
+db:index_trigram( 14 )
+for _, pattern in ipairs( { 'a', 'an', 'ana', 'zz' } ) do
+    local expected = 0
+    for i = 1, 20 do
+        if string.find( fruits[ i % 5 + 1 ], pattern, 1, true ) then expected = expected + 1 end
+    end
+    for column = 12, 14 do
+        local count = db:query_count( { { column = column, cond = 'contains', value = pattern } } )
+        assert( count == expected, 'contains ' .. pattern .. ' on ' .. column .. ' : ' .. count )
+    end
+    print(' ' .. pattern .. ' count : ' .. expected )
+end
+
+print( 'Covering index')
+print( '--------------------------------')
+db:index_cover( { 3 }, { 3, 1 } )
+local columns = db:query_columns( query_range, { 3, 1 } )
+for i = 1, #columns do
+    print(' ' .. tostring( columns[i][1] ) .. ' ' .. tostring( columns[i][2] ) )
+end
+local count, sum = db:query_count_sum( query_range, 3 )
+print(' count : ' .. count .. ' sum : ' .. sum )
+
+print( 'Partial index')
+print( '--------------------------------')
+print(' created : ' .. tostring( db:index_partial( { 1 }, { { column = 3, cond = '>=', value = 2 } } ) ) )
+print(' count : ' .. db:query_count( { { column = 1, cond = '>', value = 0 }, { column = 3, cond = '>', value = 2 } } ) )
+
+print( 'Online index')
+print( '--------------------------------')
+print(' created : ' .. tostring( db:index_online( { 2, 1 } ) ) )
+
+print( 'Zone map')
+print( '--------------------------------')
+db:index_zonemap( 1 )
+local zone_iter, zone_stats = db:query( { { column = 1, cond = '>=', value = 2 } }, true )
+for rec in zone_iter do
+end
+local zone_stat = zone_stats()
+print(' examined : ' .. zone_stat.records_examined .. ' skipped blocks : ' .. zone_stat.blocks_skipped )
+
+print( 'Spatial index')
+print( '--------------------------------')
+print(' created : ' .. tostring( db:index_spatial( 1, 3 ) ) )
+local query_box = { { column = 1, cond = '>=', value = 1 }, { column = 1, cond = '<=', value = 3 },
+    { column = 3, cond = '>=', value = 2 }, { column = 3, cond = '<', value = 4 } }
+print(' access : ' .. db:explain( query_box ).access .. ' count : ' .. db:query_count( query_box ) )
+
+print( 'Upsert')
+print( '--------------------------------')
+print(' created : ' .. tostring( db:index_unique( { 8 } ) ) )
+local up1 = db:upsert( { 8 }, { 'a', 1, 0, 0, 0, 0, 0, 'key1' } )
+local up2 = db:upsert( { 8 }, { 'b', 2, 0, 0, 0, 0, 0, 'key1' } )
+up2:print()
+print(' count : ' .. db:query_count( { { column = 8, cond = '=', value = 'key1' } } ) )
+db:read_start()
+assert( db:upsert( { 8 }, { 'c', 3, 0, 0, 0, 0, 0, 'key1' } ) == nil )
+db:read_end()
+
+print( 'Bulk insert')
+print( '--------------------------------')
+db:write_start()
+print(' started : ' .. tostring( db:bulk_begin() ) )
+for i = 1, 10 do
+    local bulk_rec = db:record( 4 )
+    bulk_rec:set( 1, 'bulk' .. i )
+    bulk_rec:set( 2, 100 + i )
+end
+print(' ended : ' .. tostring( db:bulk_end() ) )
+db:write_end()
+print(' count : ' .. db:query_count( { { column = 2, cond = '>', value = 100 } } ) )
+
+print( 'Index advice')
+print( '--------------------------------')
+for _, advice in ipairs( db:index_advice() ) do
+    print(' ' .. table.concat( advice.columns, ',' ) .. ' scans : ' .. advice.scans .. ' savings us : ' .. advice.savings_us )
+end
+
+print( 'Aggregate view')
+print( '--------------------------------')
+local view = db:aggregate_create( 1, { 3 }, { { column = 3, cond = '>=', value = 2 } } )
+for _, group in ipairs( db:aggregate( view ) ) do
+    print(' ' .. tostring( group.value ) .. ' count : ' .. group.count .. ' sum : ' .. group.sum[1] )
+end
+db:aggregate_drop( view )
+
+print( 'Change feed')
+print( '--------------------------------')
+local sub = db:subscribe( { { column = 3, cond = '=', value = 3 } } )
+local feed_rec = db:record( 4 )
+feed_rec:set( 3, 3 )
+feed_rec:set( 3, 4 )
+for _, change in ipairs( db:changes( sub, 100 ) ) do
+    print(' ' .. change.seq .. ' ' .. change.op .. ' column : ' .. tostring( change.column ) )
+end
+feed_rec:delete()
+db:unsubscribe( sub )
+
+print( 'Join')
+print( '--------------------------------')
+local join_outer = {
+    { column = 3, cond = '=', value = 3 },
+}
+for outer, inner in db:join( join_outer, 2, {}, 2 ) do
+    outer:print()
+    print(' <-> ')
+    inner:print()
+    print('\n')
+end
+for row in db:join( join_outer, 2, {}, 2, { outer = { 1, 2 }, inner = { 3 } } ) do
+    print(' ' .. tostring( row[1] ) .. ' ' .. tostring( row[2] ) .. ' ' .. tostring( row[3] ) )
+end
+-- leaving the loop early, the join is freed by the collector
+for outer, inner in db:join( join_outer, 2, {}, 2 ) do
+    break
+end
+collectgarbage()
 
 
 print('\n')